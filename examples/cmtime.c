@@ -44,6 +44,7 @@
 #include <netinet/tcp.h>
 
 #include <rdma/rdma_cma.h>
+#include <rdma/rsocket.h>
 #include "common.h"
 
 static struct rdma_addrinfo hints, *rai;
@@ -53,6 +54,16 @@ static char *dst_addr;
 static char *src_addr;
 static int timeout = 2000;
 static int retries = 2;
+static int overlap;
+static int max_pending;
+
+enum mode {
+	MODE_CM,
+	MODE_RSOCKET,
+	MODE_BULK
+};
+
+static enum mode mode;
 
 enum step {
 	STEP_CREATE_ID,
@@ -79,6 +90,7 @@ static char *step_str[] = {
 
 struct node {
 	struct rdma_cm_id *id;
+	int fd;
 	struct timeval times[STEP_CNT][2];
 	int error;
 	int retries;
@@ -102,6 +114,7 @@ static struct work_list req_work;
 static struct work_list disc_work;
 static struct node *nodes;
 static struct timeval times[STEP_CNT][2];
+static long long syscalls[STEP_CNT][2];
 static int connections = 100;
 static volatile int started[STEP_CNT];
 static volatile int completed[STEP_CNT];
@@ -110,8 +123,36 @@ static struct rdma_conn_param conn_param;
 
 #define start_perf(n, s)	gettimeofday(&((n)->times[s][0]), NULL)
 #define end_perf(n, s)		gettimeofday(&((n)->times[s][1]), NULL)
-#define start_time(s)		gettimeofday(&times[s][0], NULL)
-#define end_time(s)		gettimeofday(&times[s][1], NULL)
+#define start_time(s)		do { syscalls[s][0] = get_syscalls(); \
+				     gettimeofday(&times[s][0], NULL); } while (0)
+#define end_time(s)		do { gettimeofday(&times[s][1], NULL); \
+				     syscalls[s][1] = get_syscalls(); } while (0)
+
+/*
+ * Count the read and write calls made by the whole process, which is how
+ * commands reach the rdma_cm and verbs devices and how events are read.
+ * Returns -1 if the kernel does not provide I/O accounting.
+ */
+static long long get_syscalls(void)
+{
+	char buf[256], *p;
+	long long cnt = 0;
+	int fd, len;
+
+	fd = open("/proc/self/io", O_RDONLY);
+	if (fd < 0)
+		return -1;
+
+	len = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (len <= 0)
+		return -1;
+
+	buf[len] = '\0';
+	for (p = strstr(buf, "sysc"); p; p = strstr(p + 1, "sysc"))
+		cnt += strtoll(p + 6, NULL, 10);
+	return cnt;
+}
 
 static inline void __list_delete(struct list_head *list)
 {
@@ -196,14 +237,19 @@ static void show_perf(void)
 		}
 	}
 
-	printf("step              total ms     max ms     min us  us / conn\n");
+	printf("step              total ms     max ms     min us  us / conn  sys / conn\n");
 	for (i = 0; i < STEP_CNT; i++) {
-		if (i == STEP_BIND && !src_addr)
+		if ((i == STEP_BIND && !src_addr) || zero_time(&times[i][0]))
 			continue;
 
 		us = diff_us(&times[i][1], &times[i][0]);
-		printf("%-13s: %11.2f%11.2f%11.2f%11.2f\n", step_str[i], us / 1000.,
+		printf("%-13s: %11.2f%11.2f%11.2f%11.2f", step_str[i], us / 1000.,
 			max[i] / 1000., min[i], us / connections);
+		/* the read of /proc/self/io made by start_time is counted */
+		if (syscalls[i][0] >= 0 && syscalls[i][1] >= 0)
+			printf("%12.2f", (syscalls[i][1] - syscalls[i][0] - 1) /
+			       (float) connections);
+		printf("\n");
 	}
 }
 
@@ -373,6 +419,11 @@ static int alloc_nodes(void)
 	if (!nodes)
 		return -ENOMEM;
 
+	for (i = 0; i < connections; i++)
+		nodes[i].fd = -1;
+	if (mode != MODE_CM)
+		return 0;
+
 	printf("creating id\n");
 	start_time(STEP_CREATE_ID);
 	for (i = 0; i < connections; i++) {
@@ -405,6 +456,8 @@ static void cleanup_nodes(void)
 		start_perf(&nodes[i], STEP_DESTROY);
 		if (nodes[i].id)
 			rdma_destroy_id(nodes[i].id);
+		else if (nodes[i].fd >= 0)
+			rclose(nodes[i].fd);
 		end_perf(&nodes[i], STEP_DESTROY);
 	}
 	end_time(STEP_DESTROY);
@@ -501,6 +554,27 @@ static int run_server(void)
 	return ret;
 }
 
+static void create_qps(void)
+{
+	int i, ret;
+
+	printf("creating qp\n");
+	start_time(STEP_CREATE_QP);
+	for (i = 0; i < connections; i++) {
+		if (nodes[i].error)
+			continue;
+		start_perf(&nodes[i], STEP_CREATE_QP);
+		ret = rdma_create_qp(nodes[i].id, NULL, &init_qp_attr);
+		if (ret) {
+			perror("failure creating qp");
+			nodes[i].error = 1;
+			continue;
+		}
+		end_perf(&nodes[i], STEP_CREATE_QP);
+	}
+	end_time(STEP_CREATE_QP);
+}
+
 static int run_client(void)
 {
 	pthread_t event_thread;
@@ -574,24 +648,14 @@ static int run_client(void)
 		}
 		started[STEP_RESOLVE_ROUTE]++;
 	}
+	/* QPs only need the device, which is known after address resolution */
+	if (overlap)
+		create_qps();
 	while (started[STEP_RESOLVE_ROUTE] != completed[STEP_RESOLVE_ROUTE]) sched_yield();
 	end_time(STEP_RESOLVE_ROUTE);
 
-	printf("creating qp\n");
-	start_time(STEP_CREATE_QP);
-	for (i = 0; i < connections; i++) {
-		if (nodes[i].error)
-			continue;
-		start_perf(&nodes[i], STEP_CREATE_QP);
-		ret = rdma_create_qp(nodes[i].id, NULL, &init_qp_attr);
-		if (ret) {
-			perror("failure creating qp");
-			nodes[i].error = 1;
-			continue;
-		}
-		end_perf(&nodes[i], STEP_CREATE_QP);
-	}
-	end_time(STEP_CREATE_QP);
+	if (!overlap)
+		create_qps();
 
 	printf("connecting\n");
 	start_time(STEP_CONNECT);
@@ -625,13 +689,201 @@ static int run_client(void)
 	return ret;
 }
 
+/*
+ * The rsocket modes accept on an rsocket, and only time connecting and
+ * closing.  MODE_RSOCKET connects each rsocket without blocking and waits
+ * in rpoll; MODE_BULK drives all of them through rbulk_poll.
+ */
+static int run_rs_server(void)
+{
+	int lrs, *fds;
+	int i, ret;
+
+	ret = get_rdma_addr(src_addr, dst_addr, port, &hints, &rai);
+	if (ret) {
+		printf("getrdmaaddr error: %s\n", gai_strerror(ret));
+		return ret;
+	}
+
+	fds = calloc(connections, sizeof *fds);
+	if (!fds)
+		return -ENOMEM;
+
+	lrs = rsocket(rai->ai_family, SOCK_STREAM, 0);
+	if (lrs < 0) {
+		perror("rsocket");
+		ret = lrs;
+		goto free;
+	}
+
+	ret = rbind(lrs, rai->ai_src_addr, rai->ai_src_len);
+	if (ret) {
+		perror("rbind");
+		goto close;
+	}
+
+	ret = rlisten(lrs, connections);
+	if (ret) {
+		perror("rlisten");
+		goto close;
+	}
+
+	do {
+		for (i = 0; i < connections; i++) {
+			fds[i] = raccept(lrs, NULL, NULL);
+			if (fds[i] < 0) {
+				perror("raccept");
+				ret = fds[i];
+				break;
+			}
+		}
+		while (--i >= 0)
+			rclose(fds[i]);
+	} while (!ret);
+
+close:
+	rclose(lrs);
+free:
+	free(fds);
+	return ret;
+}
+
+static void rs_connect_all(void)
+{
+	struct pollfd *fds;
+	int *idx;
+	int i, n, ret, err;
+	socklen_t len;
+
+	fds = calloc(connections, sizeof *fds);
+	idx = calloc(connections, sizeof *idx);
+	if (!fds || !idx) {
+		perror("calloc");
+		goto free;
+	}
+
+	for (i = 0; i < connections; i++) {
+		start_perf(&nodes[i], STEP_CONNECT);
+		nodes[i].fd = rsocket(rai->ai_family, SOCK_STREAM, 0);
+		if (nodes[i].fd < 0) {
+			perror("rsocket");
+			nodes[i].error = 1;
+			continue;
+		}
+
+		rfcntl(nodes[i].fd, F_SETFL, O_NONBLOCK);
+		ret = rconnect(nodes[i].fd, rai->ai_dst_addr, rai->ai_dst_len);
+		if (ret && errno != EINPROGRESS) {
+			perror("rconnect");
+			nodes[i].error = 1;
+		} else if (!ret) {
+			end_perf(&nodes[i], STEP_CONNECT);
+		} else {
+			started[STEP_CONNECT]++;
+		}
+	}
+
+	while (started[STEP_CONNECT] != completed[STEP_CONNECT]) {
+		for (i = 0, n = 0; i < connections; i++) {
+			if (nodes[i].error || !zero_time(&nodes[i].times[STEP_CONNECT][1]))
+				continue;
+			fds[n].fd = nodes[i].fd;
+			fds[n].events = POLLOUT;
+			fds[n].revents = 0;
+			idx[n++] = i;
+		}
+
+		if (rpoll(fds, n, -1) < 0) {
+			perror("rpoll");
+			break;
+		}
+
+		for (i = 0; i < n; i++) {
+			if (!fds[i].revents)
+				continue;
+			len = sizeof err;
+			if (rgetsockopt(fds[i].fd, SOL_SOCKET, SO_ERROR, &err, &len) || err) {
+				printf("connection %d failed\n", idx[i]);
+				nodes[idx[i]].error = 1;
+			}
+			end_perf(&nodes[idx[i]], STEP_CONNECT);
+			completed[STEP_CONNECT]++;
+		}
+	}
+free:
+	free(fds);
+	free(idx);
+}
+
+static void rs_bulk_connect_all(void)
+{
+	struct rsocket_bulk_comp comp[64];
+	struct rsocket_bulk *bulk;
+	struct node *n;
+	int i, cnt;
+
+	bulk = rbulk_create(-1, max_pending);
+	if (!bulk) {
+		perror("rbulk_create");
+		return;
+	}
+
+	for (i = 0; i < connections; i++) {
+		start_perf(&nodes[i], STEP_CONNECT);
+		if (rbulk_connect(bulk, rai->ai_dst_addr, rai->ai_dst_len, &nodes[i])) {
+			perror("rbulk_connect");
+			nodes[i].error = 1;
+			continue;
+		}
+		started[STEP_CONNECT]++;
+	}
+
+	while (started[STEP_CONNECT] != completed[STEP_CONNECT]) {
+		cnt = rbulk_poll(bulk, comp, 64, -1);
+		if (cnt <= 0)
+			break;
+
+		for (i = 0; i < cnt; i++) {
+			n = comp[i].context;
+			end_perf(n, STEP_CONNECT);
+			n->fd = comp[i].socket;
+			if (n->fd < 0) {
+				printf("connection failed: %s\n", strerror(comp[i].status));
+				n->error = 1;
+			}
+			completed[STEP_CONNECT]++;
+		}
+	}
+	rbulk_destroy(bulk);
+}
+
+static int run_rs_client(void)
+{
+	int ret;
+
+	ret = get_rdma_addr(src_addr, dst_addr, port, &hints, &rai);
+	if (ret) {
+		printf("getaddrinfo error: %s\n", gai_strerror(ret));
+		return ret;
+	}
+
+	printf("connecting\n");
+	start_time(STEP_CONNECT);
+	if (mode == MODE_BULK)
+		rs_bulk_connect_all();
+	else
+		rs_connect_all();
+	end_time(STEP_CONNECT);
+	return 0;
+}
+
 int main(int argc, char **argv)
 {
 	int op, ret;
 
 	hints.ai_port_space = RDMA_PS_TCP;
 	hints.ai_qp_type = IBV_QPT_RC;
-	while ((op = getopt(argc, argv, "s:b:c:p:r:t:")) != -1) {
+	while ((op = getopt(argc, argv, "s:b:c:p:r:t:Om:P:")) != -1) {
 		switch (op) {
 		case 's':
 			dst_addr = optarg;
@@ -651,6 +903,20 @@ int main(int argc, char **argv)
 		case 't':
 			timeout = atoi(optarg);
 			break;
+		case 'O':
+			overlap = 1;
+			break;
+		case 'm':
+			if (!strcasecmp(optarg, "rsocket"))
+				mode = MODE_RSOCKET;
+			else if (!strcasecmp(optarg, "bulk"))
+				mode = MODE_BULK;
+			else
+				mode = MODE_CM;
+			break;
+		case 'P':
+			max_pending = atoi(optarg);
+			break;
 		default:
 			printf("usage: %s\n", argv[0]);
 			printf("\t[-s server_address]\n");
@@ -658,6 +924,12 @@ int main(int argc, char **argv)
 			printf("\t[-c connections]\n");
 			printf("\t[-p port_number]\n");
 			printf("\t[-t timeout_ms]\n");
+			printf("\t[-O] (create qps while routes resolve)\n");
+			printf("\t[-m mode]\n");
+			printf("\t    cm - time each rdma_cm step (default)\n");
+			printf("\t    rsocket - nonblocking rconnect of each rsocket\n");
+			printf("\t    bulk - rbulk_connect all rsockets\n");
+			printf("\t[-P max_pending] (bulk mode)\n");
 			exit(1);
 		}
 	}
@@ -676,10 +948,10 @@ int main(int argc, char **argv)
 
 	if (dst_addr) {
 		alloc_nodes();
-		ret = run_client();
+		ret = mode == MODE_CM ? run_client() : run_rs_client();
 	} else {
 		hints.ai_flags |= RAI_PASSIVE;
-		ret = run_server();
+		ret = mode == MODE_CM ? run_server() : run_rs_server();
 	}
 
 	cleanup_nodes();
@@ -0,0 +1,256 @@
+/*
+ * Copyright (c) 2026 agent <agent@local>.  All rights reserved.
+ *
+ * This software is available to you under the OpenIB.org BSD license
+ * below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <getopt.h>
+#include <dirent.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+
+#include <rdma/rsocket.h>
+
+static int pid_filter;
+static int show_hist;
+static int show_all;
+
+static char *wait_str[] = {
+	"sqe",
+	"sbuf",
+	"credits",
+	"target"
+};
+
+static void addr_str(struct sockaddr_storage *addr, char *str, size_t len)
+{
+	char host[INET6_ADDRSTRLEN], serv[8];
+
+	if (!addr->ss_family ||
+	    getnameinfo((struct sockaddr *) addr, sizeof *addr, host, sizeof host,
+			serv, sizeof serv, NI_NUMERICHOST | NI_NUMERICSERV)) {
+		snprintf(str, len, "*");
+		return;
+	}
+
+	if (addr->ss_family == AF_INET6)
+		snprintf(str, len, "[%s]:%s", host, serv);
+	else
+		snprintf(str, len, "%s:%s", host, serv);
+}
+
+static void show_stalls(struct rsocket_send_counters *send, char *indent)
+{
+	int i, j, last;
+
+	for (i = 0; i < RSOCKET_SEND_WAITS; i++) {
+		if (!send->wait[i])
+			continue;
+
+		printf("%swait %s: %llu times, %llu usec\n", indent, wait_str[i],
+		       (unsigned long long) send->wait[i],
+		       (unsigned long long) send->wait_us[i]);
+		if (!show_hist)
+			continue;
+
+		for (last = RSOCKET_STALL_BUCKETS - 1; last > 0; last--) {
+			if (send->wait_hist[i][last])
+				break;
+		}
+		for (j = 0; j <= last; j++) {
+			printf("%s  < %8llu usec: %llu\n", indent,
+			       j < RSOCKET_STALL_BUCKETS - 1 ? 1ULL << j : ~0ULL,
+			       (unsigned long long) send->wait_hist[i][j]);
+		}
+	}
+}
+
+static void show_sock(struct rsocket_shm_sock *sock)
+{
+	char src[INET6_ADDRSTRLEN + 16], dst[INET6_ADDRSTRLEN + 16];
+
+	if (!sock->dst_addr.ss_family && !show_all)
+		return;
+
+	addr_str(&sock->src_addr, src, sizeof src);
+	addr_str(&sock->dst_addr, dst, sizeof dst);
+	printf("  %-6d %-*s %-*s\n", sock->index, INET6_ADDRSTRLEN, src,
+	       INET6_ADDRSTRLEN, dst);
+	printf("\t bytes_sent:%llu bytes_recv:%llu wrs:%llu msgs:%llu "
+	       "pinned:%u\n",
+	       (unsigned long long) sock->send.bytes,
+	       (unsigned long long) sock->recv.bytes,
+	       (unsigned long long) sock->send.wrs,
+	       (unsigned long long) sock->cq.msgs, sock->pinned_bytes);
+	printf("\t credits_sent:%llu credits_recv:%llu cq_events:%llu "
+	       "wc_errors:%llu rnr_errors:%llu\n",
+	       (unsigned long long) sock->cq.credits_sent,
+	       (unsigned long long) sock->cq.credits_recv,
+	       (unsigned long long) sock->cq.events,
+	       (unsigned long long) sock->cq.wc_errors,
+	       (unsigned long long) sock->cq.rnr_errors);
+	show_stalls(&sock->send, "\t ");
+}
+
+static void show_proc(struct rsocket_shm *shm, size_t size)
+{
+	uint32_t i, max_socks;
+
+	if (shm->version != RSOCKET_SHM_VERSION ||
+	    shm->sock_size != sizeof(struct rsocket_shm_sock)) {
+		printf("pid %d: unsupported statistics version %u\n",
+		       shm->pid, shm->version);
+		return;
+	}
+
+	printf("pid %d (%.16s) rsockets:%llu connections:%llu pinned:%llu\n",
+	       shm->pid, shm->comm, (unsigned long long) shm->socks_active,
+	       (unsigned long long) shm->conns_total,
+	       (unsigned long long) shm->pinned_bytes);
+	printf("  tcp_svc rsockets:%llu wakeups:%llu keepalives:%llu  "
+	       "udp_svc rsockets:%llu wakeups:%llu\n",
+	       (unsigned long long) shm->tcp_svc_socks,
+	       (unsigned long long) shm->tcp_svc_wakeups,
+	       (unsigned long long) shm->tcp_svc_keepalives,
+	       (unsigned long long) shm->udp_svc_socks,
+	       (unsigned long long) shm->udp_svc_wakeups);
+	show_stalls(&shm->send_stalls, "  ");
+
+	printf("  %-6s %-*s %-*s\n", "fd", INET6_ADDRSTRLEN, "local",
+	       INET6_ADDRSTRLEN, "peer");
+	max_socks = (size - sizeof(*shm)) / sizeof(struct rsocket_shm_sock);
+	if (shm->max_socks < max_socks)
+		max_socks = shm->max_socks;
+	for (i = 0; i < max_socks; i++) {
+		if (shm->sock[i].in_use)
+			show_sock(&shm->sock[i]);
+	}
+	printf("\n");
+}
+
+static void show_file(const char *path, int pid)
+{
+	struct rsocket_shm *shm;
+	struct stat st;
+	int fd;
+
+	/* skip segments left behind by processes that did not exit cleanly */
+	if (kill(pid, 0) && errno == ESRCH)
+		return;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return;
+
+	if (fstat(fd, &st) || st.st_size < sizeof(*shm))
+		goto out;
+
+	shm = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (shm == MAP_FAILED)
+		goto out;
+
+	show_proc(shm, st.st_size);
+	munmap(shm, st.st_size);
+out:
+	close(fd);
+}
+
+static int run(void)
+{
+	char path[PATH_MAX], *prefix, *dir;
+	const char *name;
+	struct dirent *entry;
+	DIR *d;
+	int pid;
+
+	dir = strdup(RSOCKET_SHM_PREFIX);
+	if (!dir)
+		return -ENOMEM;
+
+	prefix = strrchr(dir, '/');
+	*prefix++ = '\0';
+	d = opendir(dir);
+	if (!d) {
+		perror("opendir");
+		free(dir);
+		return -errno;
+	}
+
+	while ((entry = readdir(d))) {
+		name = entry->d_name;
+		if (strncmp(name, prefix, strlen(prefix)))
+			continue;
+
+		pid = atoi(name + strlen(prefix));
+		if (pid <= 0 || (pid_filter && pid != pid_filter))
+			continue;
+
+		snprintf(path, sizeof path, "%s/%s", dir, name);
+		show_file(path, pid);
+	}
+
+	closedir(d);
+	free(dir);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	int op;
+
+	while ((op = getopt(argc, argv, "p:ah")) != -1) {
+		switch (op) {
+		case 'p':
+			pid_filter = atoi(optarg);
+			break;
+		case 'a':
+			show_all = 1;
+			break;
+		case 'h':
+			show_hist = 1;
+			break;
+		default:
+			printf("usage: %s\n", argv[0]);
+			printf("\t[-p pid]\n");
+			printf("\t[-a] (include unconnected rsockets)\n");
+			printf("\t[-h] (show send stall histograms)\n");
+			exit(1);
+		}
+	}
+
+	return run();
+}
@@ -0,0 +1,256 @@
+/*
+ * Copyright (c) 2026 agent <agent@local>.  All rights reserved.
+ *
+ * This software is available to you under the OpenIB.org BSD license
+ * below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <rdma/rsocket.h>
+
+#define MAX_FILES 8
+
+struct event {
+	int64_t time_us;
+	int file;
+	uint32_t seq;
+	struct rsocket_rec_entry entry;
+};
+
+static int64_t offset_us;
+static int show_all;
+
+static struct event *events;
+static uint32_t event_cnt;
+
+/* rsocket protocol opcodes */
+#define OP_DATA 0
+
+static char *op_str[] = {
+	"data",
+	"rsvd",
+	"write",
+	"rsvd",
+	"sgl",
+	"rsvd",
+	"iomap_sgl",
+	"ctrl"
+};
+#define OP_CNT (sizeof op_str / sizeof op_str[0])
+
+static char *event_str[] = {
+	"send",
+	"recv",
+	"send_comp",
+	"state",
+	"error",
+	"recv_err"
+};
+#define EVENT_CNT (sizeof event_str / sizeof event_str[0])
+
+static void addr_str(struct sockaddr_storage *addr, char *str, size_t len)
+{
+	char host[INET6_ADDRSTRLEN], serv[8];
+
+	if (!addr->ss_family ||
+	    getnameinfo((struct sockaddr *) addr, sizeof *addr, host, sizeof host,
+			serv, sizeof serv, NI_NUMERICHOST | NI_NUMERICSERV)) {
+		snprintf(str, len, "*");
+		return;
+	}
+
+	snprintf(str, len, "%s:%s", host, serv);
+}
+
+static int read_file(const char *path, int file)
+{
+	struct rsocket_rec_header hdr;
+	char src[INET6_ADDRSTRLEN + 8], dst[INET6_ADDRSTRLEN + 8];
+	struct event *evt;
+	uint32_t i;
+	FILE *f;
+	int ret = 0;
+
+	f = fopen(path, "r");
+	if (!f) {
+		perror(path);
+		return -errno;
+	}
+
+	if (fread(&hdr, sizeof hdr, 1, f) != 1 ||
+	    hdr.magic != RSOCKET_REC_MAGIC) {
+		printf("%s: not an rsocket flight recorder dump\n", path);
+		ret = -EINVAL;
+		goto out;
+	}
+
+	if (hdr.version != RSOCKET_REC_VERSION ||
+	    hdr.entry_size != sizeof(struct rsocket_rec_entry)) {
+		printf("%s: unsupported version %u\n", path, hdr.version);
+		ret = -EINVAL;
+		goto out;
+	}
+
+	addr_str(&hdr.src_addr, src, sizeof src);
+	addr_str(&hdr.dst_addr, dst, sizeof dst);
+	printf("%c: %s pid %d rsocket %d %s -> %s, %u of %llu events\n",
+	       'A' + file, path, hdr.pid, hdr.index, src, dst, hdr.count,
+	       (unsigned long long) hdr.total);
+
+	evt = realloc(events, sizeof(*events) * (event_cnt + hdr.count));
+	if (!evt) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	events = evt;
+
+	for (i = 0; i < hdr.count; i++) {
+		evt = &events[event_cnt];
+		if (fread(&evt->entry, sizeof evt->entry, 1, f) != 1)
+			break;
+		if (evt->entry.event >= EVENT_CNT)
+			continue;
+
+		evt->time_us = (int64_t) evt->entry.time_us;
+		if (file)
+			evt->time_us += offset_us;
+		evt->file = file;
+		evt->seq = event_cnt++;
+	}
+out:
+	fclose(f);
+	return ret;
+}
+
+static int event_cmp(const void *a, const void *b)
+{
+	const struct event *e1 = a, *e2 = b;
+
+	if (e1->time_us != e2->time_us)
+		return e1->time_us < e2->time_us ? -1 : 1;
+	return e1->seq < e2->seq ? -1 : 1;
+}
+
+static const char *op_name(uint8_t op)
+{
+	return op < OP_CNT ? op_str[op] : "?";
+}
+
+static void show_event(struct event *evt, int64_t start, int64_t *last)
+{
+	struct rsocket_rec_entry *entry = &evt->entry;
+
+	printf("%12lld %+8lld  %*s%c %-9s ", (long long) (evt->time_us - start),
+	       (long long) (evt->time_us - *last), evt->file * 4, "",
+	       'A' + evt->file, event_str[entry->event]);
+	*last = evt->time_us;
+
+	switch (entry->event) {
+	case RSOCKET_REC_STATE:
+		printf("0x%x", entry->data);
+		break;
+	case RSOCKET_REC_ERROR:
+		printf("%-9s status %u", op_name(entry->op), entry->data);
+		break;
+	case RSOCKET_REC_RECV_ERROR:
+		printf("status %u", entry->data);
+		break;
+	default:
+		printf("%-9s %-8u", op_name(entry->op), entry->data);
+		break;
+	}
+
+	printf(" sseq %u/%u rseq %u/%u sqe %u sbuf %u rbuf %u%s\n",
+	       entry->sseq_no, entry->sseq_comp, entry->rseq_no,
+	       entry->rseq_comp, entry->sqe_avail, entry->sbuf_bytes_avail,
+	       entry->rbuf_bytes_avail,
+	       (entry->event == RSOCKET_REC_SEND && entry->op == OP_DATA &&
+		entry->sseq_no == entry->sseq_comp) ? " (no credits)" : "");
+}
+
+static void show_timeline(void)
+{
+	int64_t last;
+	uint32_t i;
+
+	if (!event_cnt)
+		return;
+
+	qsort(events, event_cnt, sizeof(*events), event_cmp);
+	printf("\n%12s %8s  event\n", "usec", "delta");
+	last = events[0].time_us;
+	for (i = 0; i < event_cnt; i++) {
+		if (!show_all && events[i].entry.event == RSOCKET_REC_SEND_COMP)
+			continue;
+		show_event(&events[i], events[0].time_us, &last);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	int op, i, ret;
+
+	while ((op = getopt(argc, argv, "o:a")) != -1) {
+		switch (op) {
+		case 'o':
+			offset_us = strtoll(optarg, NULL, 0);
+			break;
+		case 'a':
+			show_all = 1;
+			break;
+		default:
+			goto usage;
+		}
+	}
+
+	if (optind == argc || argc - optind > MAX_FILES)
+		goto usage;
+
+	for (i = 0; optind < argc; i++, optind++) {
+		ret = read_file(argv[optind], i);
+		if (ret)
+			goto out;
+	}
+
+	show_timeline();
+	ret = 0;
+out:
+	free(events);
+	return ret;
+
+usage:
+	printf("usage: %s [options] dump_file [dump_file ...]\n", argv[0]);
+	printf("\t[-o offset_usec] (added to timestamps after the first file)\n");
+	printf("\t[-a] (include send completions)\n");
+	exit(1);
+}
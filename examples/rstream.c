@@ -79,6 +79,7 @@ static int rs, lrs;  // rs client_socket_fd, lrs server_socket_fd
 static int use_async;
 static int use_rgai; // no-zero means use rdma , 0 means use tcp/ip 
 static int verify;
+static int single_thread;
 static int flags = MSG_DONTWAIT;
 static int poll_timeout = 0;
 static int custom; // 是否由user定制发送数据
@@ -93,6 +94,9 @@ static int buffer_size, inline_size = 64;
 static char test_name[10] = "custom";
 static char *port = "7471";
 static int keepalive; //开启keepalive属性, keepalive_time
+static int conn_count; // connection storm test, number of connections
+static int accept_pool; // endpoints pre-built by the listening rsocket
+static int accept_shards; // threads accepting for the listening rsocket
 static char *dst_addr; //mean to client ip . if dst_addr = NULL, then start as server , the src_addr is the server ip
 static char *src_addr; // server ip
 static struct timeval start, end;
@@ -330,6 +334,12 @@ static void set_options(int rs)
 			val = 0;
 			rs_setsockopt(rs, SOL_RDMA, RDMA_INLINE, &val, sizeof val);
 		}
+
+		if (single_thread)
+		{
+			val = 1;
+			rs_setsockopt(rs, SOL_RDMA, RDMA_SINGLE_THREAD, &val, sizeof val);
+		}
 	}
 
 	if (keepalive)
@@ -387,7 +397,27 @@ static int server_listen(void)
 		goto close;
 	}
 
-	ret = rs_listen(lrs, 1);
+	if (use_rs && accept_pool)
+	{
+		ret = rs_setsockopt(lrs, SOL_RDMA, RDMA_ACCEPT_POOL, &accept_pool, sizeof accept_pool);
+		if (ret)
+		{
+			perror("rsetsockopt RDMA_ACCEPT_POOL");
+			goto close;
+		}
+	}
+
+	if (use_rs && accept_shards)
+	{
+		ret = rs_setsockopt(lrs, SOL_RDMA, RDMA_ACCEPT_SHARDS, &accept_shards, sizeof accept_shards);
+		if (ret)
+		{
+			perror("rsetsockopt RDMA_ACCEPT_SHARDS");
+			goto close;
+		}
+	}
+
+	ret = rs_listen(lrs, conn_count ? conn_count : 1);
 	if (ret)
 	{
 		perror("rlisten");
@@ -569,6 +599,156 @@ free:
 
 
 
+static void show_conn_perf(int cnt)
+{
+	float usec;
+
+	usec = (end.tv_sec - start.tv_sec) * 1000000 + (end.tv_usec - start.tv_usec);
+	printf("%-10s%-8d%8.2fs%12.2f%11.2f\n", dst_addr ? "connect" : "accept",
+	       cnt, usec / 1000000., cnt * 1000000. / usec, usec / cnt);
+}
+
+// accept conn_count connections as fast as they arrive
+static int storm_accept(int *fds)
+{
+	struct pollfd pfd;
+	int i, ret = 0;
+
+	set_options(lrs);
+	for (i = 0; i < conn_count; i++)
+	{
+		do
+		{
+			if (use_async)
+			{
+				pfd.fd = lrs;
+				pfd.events = POLLIN;
+				ret = do_poll(&pfd, poll_timeout);
+				if (ret)
+				{
+					perror("rpoll");
+					return i;
+				}
+			}
+			fds[i] = rs_accept(lrs, NULL, 0);
+		} while (fds[i] < 0 && (errno == EAGAIN || errno == EWOULDBLOCK));
+
+		if (fds[i] < 0)
+		{
+			perror("raccept");
+			return i;
+		}
+		if (!i)
+		{
+			gettimeofday(&start, NULL);
+		}
+	}
+	gettimeofday(&end, NULL);
+	if (conn_count > 1)
+	{
+		show_conn_perf(conn_count - 1);
+	}
+	return i;
+}
+
+// start all connections before waiting for any of them to complete
+static int storm_connect(int *fds)
+{
+	struct addrinfo *ai;
+	struct pollfd pfd;
+	int i, n, ret, err;
+	socklen_t len;
+
+	ret = getaddrinfo(dst_addr, port, &ai_hints, &ai);
+	if (ret)
+	{
+		printf("getaddrinfo: %s\n", gai_strerror(ret));
+		return 0;
+	}
+
+	gettimeofday(&start, NULL);
+	for (n = 0; n < conn_count; n++)
+	{
+		fds[n] = rs_socket(ai->ai_family, SOCK_STREAM, 0);
+		if (fds[n] < 0)
+		{
+			perror("rsocket");
+			break;
+		}
+
+		set_options(fds[n]);
+		ret = rs_connect(fds[n], ai->ai_addr, ai->ai_addrlen);
+		if (ret && (errno != EINPROGRESS))
+		{
+			perror("rconnect");
+			rs_close(fds[n]);
+			break;
+		}
+	}
+
+	for (i = 0; i < n; i++)
+	{
+		pfd.fd = fds[i];
+		pfd.events = POLLOUT;
+		ret = do_poll(&pfd, poll_timeout);
+		len = sizeof err;
+		if (ret || rs_getsockopt(fds[i], SOL_SOCKET, SO_ERROR, &err, &len) || err)
+		{
+			printf("connection %d failed\n", i);
+			break;
+		}
+	}
+	gettimeofday(&end, NULL);
+	if (i == conn_count)
+	{
+		show_conn_perf(conn_count);
+	}
+
+	freeaddrinfo(ai);
+	return n;
+}
+
+static int run_conn_storm(void)
+{
+	int *fds;
+	int i, n, ret = 0;
+
+	fds = calloc(conn_count, sizeof(*fds));
+	if (!fds)
+	{
+		perror("calloc");
+		return -1;
+	}
+
+	if (!dst_addr)
+	{
+		ret = server_listen();
+		if (ret)
+		{
+			goto free;
+		}
+	}
+
+	printf("%-10s%-8s%9s%12s%11s\n", "name", "conns", "time", "conns/sec", "usec/conn");
+	n = dst_addr ? storm_connect(fds) : storm_accept(fds);
+	if (n != conn_count)
+	{
+		ret = -1;
+	}
+
+	for (i = 0; i < n; i++)
+	{
+		rs_close(fds[i]);
+	}
+	if (!dst_addr)
+	{
+		rs_close(lrs);
+	}
+free:
+	free(fds);
+	return ret;
+}
+
 static int run(void)
 {
 	int i, ret = 0;
@@ -680,6 +860,9 @@ static int set_test_opt(char *optarg)
 			case 'v'://verify - verifies data transfers
 				verify = 1;
 				break;
+			case 'l'://lockless - single threaded rsockets, skips locking
+				single_thread = 1;
+				break;
 			default:
 				return -1;
 		}
@@ -710,6 +893,10 @@ static int set_test_opt(char *optarg)
 		{
 			verify = 1;
 		} 
+		else if (!strncasecmp("lockless", optarg, 8)) 
+		{
+			single_thread = 1;
+		} 
 		else if (!strncasecmp("fork", optarg, 4)) 
 		{
 			use_fork = 1;
@@ -730,7 +917,7 @@ int main(int argc, char **argv)
 
 	ai_hints.ai_socktype = SOCK_STREAM;
 	rai_hints.ai_port_space = RDMA_PS_TCP;
-	while ((op = getopt(argc, argv, "s:b:f:B:i:I:C:S:p:k:T:")) != -1) 
+	while ((op = getopt(argc, argv, "s:b:f:B:i:I:C:S:p:k:T:c:A:Q:")) != -1) 
 	{
 		switch (op) 
 		{
@@ -787,6 +974,15 @@ int main(int argc, char **argv)
 			case 'k':
 				keepalive = atoi(optarg);
 				break;
+			case 'c':
+				conn_count = atoi(optarg);
+				break;
+			case 'A':
+				accept_pool = atoi(optarg);
+				break;
+			case 'Q':
+				accept_shards = atoi(optarg);
+				break;
 			case 'T':
 				if (!set_test_opt(optarg))
 				{
@@ -806,6 +1002,9 @@ int main(int argc, char **argv)
 				printf("\t[-S transfer_size or all]\n");
 				printf("\t[-p port_number]\n");
 				printf("\t[-k keepalive_time]\n");
+				printf("\t[-c connection_count] (connection rate test)\n");
+				printf("\t[-A accept_pool_size]\n");
+				printf("\t[-Q accept_shards]\n");
 				printf("\t[-T test_option]\n");
 				printf("\t    s|sockets - use standard tcp/ip sockets\n");
 				printf("\t    a|async - asynchronous operation (use poll)\n");
@@ -814,6 +1013,7 @@ int main(int argc, char **argv)
 				printf("\t    n|nonblocking - use nonblocking calls\n");
 				printf("\t    r|resolve - use rdma cm to resolve address\n");
 				printf("\t    v|verify - verify data\n");
+				printf("\t    l|lockless - single threaded rsockets\n");
 				exit(1);
 		}
 	}
@@ -823,6 +1023,6 @@ int main(int argc, char **argv)
 		poll_timeout = -1;
 	}
 
-	ret = run();
+	ret = conn_count ? run_conn_storm() : run();
 	return ret;
 }
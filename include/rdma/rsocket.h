@@ -79,7 +79,260 @@ enum {
 	RDMA_RQSIZE,
 	RDMA_INLINE,
 	RDMA_IOMAPSIZE,
-	RDMA_ROUTE
+	RDMA_ROUTE,
+	RDMA_EVENT_FD,
+	RDMA_LOCK_STATS,
+	RDMA_SINGLE_THREAD,
+	RDMA_STATS,
+	RDMA_STATS_RESET,
+	RDMA_SEND_STALLS,
+	RDMA_SEND_STALLS_TOTAL,
+	RDMA_RECORDER,
+	RDMA_RECORDER_DUMP,
+	RDMA_LATENCY,
+	RDMA_ACCEPT_POOL,
+	RDMA_ACCEPT_SHARDS,
+	RDMA_ACCEPT_HASH,
+	RDMA_ASYNC_CLOSE,
+	RDMA_CONN_DATA
+};
+
+struct rsocket_lock_stat {
+	uint64_t acquired;
+	uint64_t contended;
+	uint64_t sleep_us;
+};
+
+/* Returned by RDMA_STATS */
+struct rsocket_stats {
+	uint64_t bytes_sent;
+	uint64_t bytes_recv;
+	uint64_t data_wrs;		/* data transfers posted */
+	uint64_t data_msgs;		/* data transfers received */
+	uint64_t send_wait_sqe;		/* sends stalled on send queue entries */
+	uint64_t send_wait_sbuf;	/* sends stalled on send buffer space */
+	uint64_t send_wait_credits;	/* sends stalled on remote credits */
+	uint64_t send_wait_target;	/* sends stalled on remote buffer space */
+	uint64_t credits_sent;
+	uint64_t credits_recv;
+	uint64_t cq_events;
+	uint64_t wc_errors;
+	uint64_t rnr_retry_errors;
+	uint32_t sq_size;
+	uint32_t rq_size;
+	uint32_t sq_inline;
+	uint32_t sbuf_size;
+	uint32_t rbuf_size;
+	uint32_t sqe_avail;
+	uint32_t sbuf_bytes_avail;
+	uint32_t rbuf_bytes_avail;
+};
+
+/*
+ * Time that sends spent blocked on each resource.  Bucket 0 counts waits
+ * under 1 usec, bucket i waits of [2^(i-1), 2^i) usec, and the last
+ * bucket all longer waits.
+ */
+#define RSOCKET_STALL_BUCKETS 24
+
+struct rsocket_send_stall {
+	uint64_t count;
+	uint64_t time_us;
+	uint64_t hist[RSOCKET_STALL_BUCKETS];
+};
+
+/* Returned by RDMA_SEND_STALLS and RDMA_SEND_STALLS_TOTAL */
+struct rsocket_send_stalls {
+	struct rsocket_send_stall sqe;		/* send queue entries */
+	struct rsocket_send_stall sbuf;		/* local send buffer space */
+	struct rsocket_send_stall credits;	/* credits from the remote side */
+	struct rsocket_send_stall target;	/* remote receive buffer space */
+};
+
+/*
+ * Shared memory statistics.  When enabled through the shm_stats
+ * configuration file, each process maps RSOCKET_SHM_PREFIX<pid> and
+ * updates its counters in place.  Readers, such as rsstat, only map the
+ * file.  Counters are updated without locks and may be read torn.
+ */
+#define RSOCKET_SHM_PREFIX	"/dev/shm/rsocket."
+#define RSOCKET_SHM_VERSION	1
+
+/* wait[] order: send queue entries, send buffer, credits, remote buffer */
+#define RSOCKET_SEND_WAITS	4
+
+struct rsocket_send_counters {
+	uint64_t bytes;
+	uint64_t wrs;
+	uint64_t wait[RSOCKET_SEND_WAITS];
+	uint64_t wait_us[RSOCKET_SEND_WAITS];
+	uint64_t wait_hist[RSOCKET_SEND_WAITS][RSOCKET_STALL_BUCKETS];
+};
+
+struct rsocket_recv_counters {
+	uint64_t bytes;
+};
+
+struct rsocket_cq_counters {
+	uint64_t msgs;
+	uint64_t credits_sent;
+	uint64_t credits_recv;
+	uint64_t events;
+	uint64_t wc_errors;
+	uint64_t rnr_errors;
+};
+
+struct rsocket_shm_sock {
+	volatile uint32_t in_use;
+	int32_t  index;
+	int32_t  type;
+	uint32_t pinned_bytes;
+	struct sockaddr_storage src_addr;
+	struct sockaddr_storage dst_addr;
+	struct rsocket_send_counters send __attribute__((aligned(64)));
+	struct rsocket_recv_counters recv __attribute__((aligned(64)));
+	struct rsocket_cq_counters cq __attribute__((aligned(64)));
+};
+
+struct rsocket_shm {
+	uint32_t version;
+	uint32_t sock_size;		/* sizeof(struct rsocket_shm_sock) */
+	uint32_t max_socks;
+	int32_t  pid;
+	char     comm[16];
+	uint64_t socks_active;
+	uint64_t conns_total;
+	uint64_t pinned_bytes;
+	uint64_t tcp_svc_socks;		/* rsockets using keepalive */
+	uint64_t tcp_svc_wakeups;
+	uint64_t tcp_svc_keepalives;
+	uint64_t udp_svc_socks;
+	uint64_t udp_svc_wakeups;
+	struct rsocket_send_counters send_stalls __attribute__((aligned(64)));
+	struct rsocket_shm_sock sock[] __attribute__((aligned(64)));
+};
+
+/*
+ * Flight recorder.  When enabled through RDMA_RECORDER or the
+ * flight_recorder configuration file, each rsocket keeps its most recent
+ * protocol events in a ring.  RDMA_RECORDER_DUMP, or entering the error
+ * state, writes the ring to RSOCKET_REC_PREFIX<pid>.<rsocket>: a
+ * struct rsocket_rec_header, followed by count entries, oldest first.
+ */
+#define RSOCKET_REC_PREFIX	"/tmp/rsocket."
+#define RSOCKET_REC_MAGIC	0x72737263	/* "rsrc" */
+#define RSOCKET_REC_VERSION	1
+
+enum {
+	RSOCKET_REC_SEND,	/* message posted, op and data from the message */
+	RSOCKET_REC_RECV,	/* message received */
+	RSOCKET_REC_SEND_COMP,	/* send completed */
+	RSOCKET_REC_STATE,	/* data is the new rsocket state */
+	RSOCKET_REC_ERROR,	/* send failed, data is the work completion status */
+	RSOCKET_REC_RECV_ERROR	/* receive failed, data is the status, no op */
+};
+
+/* op is the rsocket protocol opcode, for example RS_OP_DATA or RS_OP_SGL */
+struct rsocket_rec_entry {
+	uint64_t time_us;		/* gettimeofday */
+	uint8_t  event;
+	uint8_t  op;
+	uint16_t sseq_no;
+	uint32_t data;
+	uint16_t sseq_comp;
+	uint16_t rseq_no;
+	uint16_t rseq_comp;
+	uint16_t sqe_avail;
+	uint32_t sbuf_bytes_avail;
+	uint32_t rbuf_bytes_avail;
+};
+
+struct rsocket_rec_header {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t entry_size;		/* sizeof(struct rsocket_rec_entry) */
+	int32_t  pid;
+	int32_t  index;
+	uint32_t count;
+	uint32_t size;			/* ring entries */
+	uint64_t total;			/* events recorded */
+	struct sockaddr_storage src_addr;
+	struct sockaddr_storage dst_addr;
+};
+
+/*
+ * Latency histograms, enabled through the latency_stats configuration
+ * file.  Each thread records into its own histograms, which are summed
+ * when read.  Buckets are log-linear: values below 8 nsec have their own
+ * bucket, and every larger power of 2 is split into 8 buckets, which
+ * bounds the error of any percentile to 12.5%.
+ */
+enum {
+	RSOCKET_LAT_SEND,		/* rsend, rsendto, rsendmsg, rwrite(v) */
+	RSOCKET_LAT_RECV,		/* rrecv, rrecvfrom, rrecvmsg, rread(v) */
+	RSOCKET_LAT_POLL,		/* rpoll, rselect */
+	RSOCKET_LAT_ACCEPT,
+	RSOCKET_LAT_CONNECT,
+	RSOCKET_LAT_IOWRITE,
+	RSOCKET_LAT_RESOLVE_ADDR,	/* rconnect setup phases */
+	RSOCKET_LAT_RESOLVE_ROUTE,
+	RSOCKET_LAT_CREATE_EP,
+	RSOCKET_LAT_ESTABLISH,
+	RSOCKET_LAT_MAX
+};
+
+#define RSOCKET_LAT_SUB_BITS	3
+#define RSOCKET_LAT_BUCKETS	304	/* up to 2^40 nsec */
+
+struct rsocket_latency {
+	uint64_t count;
+	uint64_t sum_ns;
+	uint64_t max_ns;
+	uint64_t hist[RSOCKET_LAT_BUCKETS];
+};
+
+/* Returned by RDMA_LATENCY and rget_latency_stats */
+struct rsocket_latency_stats {
+	struct rsocket_latency op[RSOCKET_LAT_MAX];
+};
+
+/* Smallest value, in nsec, counted by a histogram bucket */
+static inline uint64_t rsocket_lat_bucket_ns(int bucket)
+{
+	int sub = 1 << RSOCKET_LAT_SUB_BITS;
+
+	if (bucket < sub)
+		return bucket;
+	return (uint64_t) (sub + bucket % sub) << (bucket / sub - 1);
+}
+
+/* Upper bound, in nsec, of the given percentile (0 - 100) */
+static inline uint64_t rsocket_lat_percentile(const struct rsocket_latency *lat,
+					      double percentile)
+{
+	double rank = lat->count * percentile / 100.0;
+	uint64_t total = 0, bound;
+	int i;
+
+	for (i = 0; i < RSOCKET_LAT_BUCKETS - 1; i++) {
+		total += lat->hist[i];
+		if (total && total >= rank) {
+			bound = rsocket_lat_bucket_ns(i + 1) - 1;
+			return bound < lat->max_ns ? bound : lat->max_ns;
+		}
+	}
+	return lat->max_ns;
+}
+
+int rget_latency_stats(struct rsocket_latency_stats *stats);
+
+/* Returned by RDMA_LOCK_STATS */
+struct rsocket_lock_stats {
+	struct rsocket_lock_stat slock;
+	struct rsocket_lock_stat rlock;
+	struct rsocket_lock_stat cq_lock;
+	struct rsocket_lock_stat cq_wait_lock;
+	struct rsocket_lock_stat map_lock;
 };
 
 int rsetsockopt(int socket, int level, int optname,
@@ -92,6 +345,40 @@ off_t riomap(int socket, void *buf, size_t len, int prot, int flags, off_t offse
 int riounmap(int socket, void *buf, size_t len);
 size_t riowrite(int socket, const void *buf, size_t count, off_t offset, int flags);
 
+/*
+ * Connection pools hand out connected SOCK_STREAM rsockets, reusing idle
+ * connections to the same destination that were returned by rpool_release.
+ */
+struct rsocket_pool;
+
+struct rsocket_pool *rpool_create(int domain, int max_idle);
+int rpool_setsockopt(struct rsocket_pool *pool, int level, int optname,
+		     const void *optval, socklen_t optlen);
+int rpool_connect(struct rsocket_pool *pool, const struct sockaddr *addr,
+		  socklen_t addrlen);
+int rpool_release(struct rsocket_pool *pool, int socket);
+void rpool_destroy(struct rsocket_pool *pool);
+
+/*
+ * Bulk connects establish many SOCK_STREAM rsockets in parallel through a
+ * single rdma_cm event channel.  rbulk_poll returns each connection as it
+ * completes, or fails after its retries are exhausted.
+ */
+struct rsocket_bulk;
+
+struct rsocket_bulk_comp {
+	void	*context;
+	int	socket;		/* -1 on failure */
+	int	status;		/* errno of the last attempt */
+};
+
+struct rsocket_bulk *rbulk_create(int socket, int max_pending);
+int rbulk_connect(struct rsocket_bulk *bulk, const struct sockaddr *addr,
+		  socklen_t addrlen, void *context);
+int rbulk_poll(struct rsocket_bulk *bulk, struct rsocket_bulk_comp *comp,
+	       int nent, int timeout);
+void rbulk_destroy(struct rsocket_bulk *bulk);
+
 #ifdef __cplusplus
 }
 #endif
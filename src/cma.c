@@ -104,6 +104,7 @@ struct cma_id_private {
 	uint32_t		handle;
 	struct cma_multicast	*mc_list;
 	struct ibv_qp_init_attr	*qp_init_attr;
+	struct ibv_qp		*init_qp;
 	uint8_t			initiator_depth;
 	uint8_t			responder_resources;
 };
@@ -133,6 +134,7 @@ static int cma_init_cnt;
 static pthread_mutex_t mut = PTHREAD_MUTEX_INITIALIZER;
 static int abi_ver = RDMA_USER_CM_MAX_ABI_VERSION;
 int af_ib_support;
+int ucma_loopback;
 static struct index_map ucma_idm;
 static fastlock_t idm_lock;
 
@@ -146,8 +148,8 @@ static void ucma_cleanup(void)
 				continue;
 
 			if (cma_dev_array[cma_dev_cnt].refcnt)
-				ibv_dealloc_pd(cma_dev_array[cma_dev_cnt].pd);
-			ibv_close_device(cma_dev_array[cma_dev_cnt].verbs);
+				ucma_ibv_dealloc_pd(cma_dev_array[cma_dev_cnt].pd);
+			ucma_ibv_close_device(cma_dev_array[cma_dev_cnt].verbs);
 			free(cma_dev_array[cma_dev_cnt].port);
 			cma_init_cnt--;
 		}
@@ -210,6 +212,18 @@ static void ucma_set_af_ib_support(void)
 	rdma_destroy_id(id);
 }
 
+static int ucma_init_loopback(void)
+{
+	cma_dev_array = calloc(1, sizeof(*cma_dev_array));
+	if (!cma_dev_array)
+		return ERR(ENOMEM);
+
+	cma_dev_array[0].guid = UCMA_LB_GUID;
+	ucma_loopback = 1;
+	cma_dev_cnt = 1;
+	return 0;
+}
+
 int ucma_init(void)
 {
 	struct ibv_device **dev_list = NULL;
@@ -226,6 +240,14 @@ int ucma_init(void)
 	}
 
 	fastlock_init(&idm_lock);
+	if (ucma_lb_requested()) {
+		ret = ucma_init_loopback();
+		if (ret)
+			goto err1;
+		pthread_mutex_unlock(&mut);
+		return 0;
+	}
+
 	ret = check_abi_version();
 	if (ret)
 		goto err1;
@@ -270,6 +292,9 @@ static struct ibv_context *ucma_open_device(uint64_t guid)
 	struct ibv_context *verbs = NULL;
 	int i;
 
+	if (ucma_loopback)
+		return ucma_lb_open_device();
+
 	dev_list = ibv_get_device_list(NULL);
 	if (!dev_list) {
 		return NULL;
@@ -299,7 +324,7 @@ static int ucma_init_device(struct cma_device *cma_dev)
 	if (!cma_dev->verbs)
 		return ERR(ENODEV);
 
-	ret = ibv_query_device(cma_dev->verbs, &attr);
+	ret = ucma_ibv_query_device(cma_dev->verbs, &attr);
 	if (ret) {
 		ret = ERR(ret);
 		goto err;
@@ -312,7 +337,7 @@ static int ucma_init_device(struct cma_device *cma_dev)
 	}
 
 	for (i = 1; i <= attr.phys_port_cnt; i++) {
-		if (ibv_query_port(cma_dev->verbs, i, &port_attr))
+		if (ucma_ibv_query_port(cma_dev->verbs, i, &port_attr))
 			cma_dev->port[i - 1].link_layer = IBV_LINK_LAYER_UNSPECIFIED;
 		else
 			cma_dev->port[i - 1].link_layer = port_attr.link_layer;
@@ -326,7 +351,7 @@ static int ucma_init_device(struct cma_device *cma_dev)
 	return 0;
 
 err:
-	ibv_close_device(cma_dev->verbs);
+	ucma_ibv_close_device(cma_dev->verbs);
 	cma_dev->verbs = NULL;
 	return ret;
 }
@@ -396,7 +421,10 @@ struct rdma_event_channel *rdma_create_event_channel(void)
 	if (!channel)
 		return NULL;
 
-	channel->fd = open("/dev/infiniband/rdma_cm", O_RDWR | O_CLOEXEC);
+	if (ucma_loopback)
+		channel->fd = ucma_lb_create_channel();
+	else
+		channel->fd = open("/dev/infiniband/rdma_cm", O_RDWR | O_CLOEXEC);
 	if (channel->fd < 0) {
 		goto err;
 	}
@@ -408,7 +436,10 @@ err:
 
 void rdma_destroy_event_channel(struct rdma_event_channel *channel)
 {
-	close(channel->fd);
+	if (ucma_loopback)
+		ucma_lb_destroy_channel(channel->fd);
+	else
+		close(channel->fd);
 	free(channel);
 }
 
@@ -430,7 +461,7 @@ match:
 		goto out;
 
 	if (!cma_dev->refcnt++) {
-		cma_dev->pd = ibv_alloc_pd(cma_dev->verbs);
+		cma_dev->pd = ucma_ibv_alloc_pd(cma_dev->verbs);
 		if (!cma_dev->pd) {
 			cma_dev->refcnt--;
 			ret = ERR(ENOMEM);
@@ -449,7 +480,7 @@ static void ucma_put_device(struct cma_device *cma_dev)
 {
 	pthread_mutex_lock(&mut);
 	if (!--cma_dev->refcnt) {
-		ibv_dealloc_pd(cma_dev->pd);
+		ucma_ibv_dealloc_pd(cma_dev->pd);
 		if (cma_dev->xrcd)
 			ibv_close_xrcd(cma_dev->xrcd);
 	}
@@ -564,7 +595,7 @@ static int rdma_create_id2(struct rdma_event_channel *channel,
 	cmd.ps = ps;
 	cmd.qp_type = qp_type;
 
-	ret = write(id_priv->id.channel->fd, &cmd, sizeof cmd);
+	ret = ucma_write(id_priv->id.channel->fd, &cmd, sizeof cmd);
 	if (ret != sizeof cmd)
 		goto err;
 
@@ -599,7 +630,7 @@ static int ucma_destroy_kern_id(int fd, uint32_t handle)
 	CMA_INIT_CMD_RESP(&cmd, sizeof cmd, DESTROY_ID, &resp, sizeof resp);
 	cmd.id = handle;
 
-	ret = write(fd, &cmd, sizeof cmd);
+	ret = ucma_write(fd, &cmd, sizeof cmd);
 	if (ret != sizeof cmd)
 		return (ret >= 0) ? ERR(ENODATA) : -1;
 
@@ -659,7 +690,7 @@ static int ucma_query_addr(struct rdma_cm_id *id)
 	cmd.id = id_priv->handle;
 	cmd.option = UCMA_QUERY_ADDR;
 
-	ret = write(id->channel->fd, &cmd, sizeof cmd);
+	ret = ucma_write(id->channel->fd, &cmd, sizeof cmd);
 	if (ret != sizeof cmd)
 		return (ret >= 0) ? ERR(ENODATA) : -1;
 
@@ -692,7 +723,7 @@ static int ucma_query_gid(struct rdma_cm_id *id)
 	cmd.id = id_priv->handle;
 	cmd.option = UCMA_QUERY_GID;
 
-	ret = write(id->channel->fd, &cmd, sizeof cmd);
+	ret = ucma_write(id->channel->fd, &cmd, sizeof cmd);
 	if (ret != sizeof cmd)
 		return (ret >= 0) ? ERR(ENODATA) : -1;
 
@@ -753,7 +784,7 @@ static int ucma_query_path(struct rdma_cm_id *id)
 	cmd.id = id_priv->handle;
 	cmd.option = UCMA_QUERY_PATH;
 
-	ret = write(id->channel->fd, &cmd, sizeof cmd);
+	ret = ucma_write(id->channel->fd, &cmd, sizeof cmd);
 	if (ret != sizeof cmd)
 		return (ret >= 0) ? ERR(ENODATA) : -1;
 
@@ -773,6 +804,17 @@ static int ucma_query_path(struct rdma_cm_id *id)
 	return 0;
 }
 
+/*
+ * QUERY_ROUTE returns the addresses, GIDs, pkey, and paths in a single
+ * command, but only has room for IP addresses.  Use it in place of
+ * separate QUERY_ADDR, QUERY_GID, and QUERY_PATH commands unless the
+ * id uses AF_IB addressing.
+ */
+static int ucma_query_ip(sa_family_t family)
+{
+	return !af_ib_support || family == AF_INET || family == AF_INET6;
+}
+
 static int ucma_query_route(struct rdma_cm_id *id)
 {
 	struct ucma_abi_query_route_resp resp;
@@ -784,7 +826,7 @@ static int ucma_query_route(struct rdma_cm_id *id)
 	id_priv = container_of(id, struct cma_id_private, id);
 	cmd.id = id_priv->handle;
 
-	ret = write(id->channel->fd, &cmd, sizeof cmd);
+	ret = ucma_write(id->channel->fd, &cmd, sizeof cmd);
 	if (ret != sizeof cmd)
 		return (ret >= 0) ? ERR(ENODATA) : -1;
 
@@ -835,12 +877,16 @@ static int rdma_bind_addr2(struct rdma_cm_id *id, struct sockaddr *addr,
 	cmd.addr_size = addrlen;
 	memcpy(&cmd.addr, addr, addrlen);
 
-	ret = write(id->channel->fd, &cmd, sizeof cmd);
+	ret = ucma_write(id->channel->fd, &cmd, sizeof cmd);
 	if (ret != sizeof cmd)
 		return (ret >= 0) ? ERR(ENODATA) : -1;
 
+	if (ucma_query_ip(addr->sa_family))
+		return ucma_query_route(id);
+
 	ret = ucma_query_addr(id);
-	if (!ret)
+	if (!ret && id->verbs &&
+	    id->verbs->device->transport_type == IBV_TRANSPORT_IB)
 		ret = ucma_query_gid(id);
 	return ret;
 }
@@ -863,7 +909,7 @@ int rdma_bind_addr(struct rdma_cm_id *id, struct sockaddr *addr)
 	cmd.id = id_priv->handle;
 	memcpy(&cmd.addr, addr, addrlen);
 
-	ret = write(id->channel->fd, &cmd, sizeof cmd);
+	ret = ucma_write(id->channel->fd, &cmd, sizeof cmd);
 	if (ret != sizeof cmd)
 		return (ret >= 0) ? ERR(ENODATA) : -1;
 
@@ -916,7 +962,7 @@ static int rdma_resolve_addr2(struct rdma_cm_id *id, struct sockaddr *src_addr,
 	cmd.dst_size = dst_len;
 	cmd.timeout_ms = timeout_ms;
 
-	ret = write(id->channel->fd, &cmd, sizeof cmd);
+	ret = ucma_write(id->channel->fd, &cmd, sizeof cmd);
 	if (ret != sizeof cmd)
 		return (ret >= 0) ? ERR(ENODATA) : -1;
 
@@ -951,7 +997,7 @@ int rdma_resolve_addr(struct rdma_cm_id *id, struct sockaddr *src_addr,
 	memcpy(&cmd.dst_addr, dst_addr, dst_len);
 	cmd.timeout_ms = timeout_ms;
 
-	ret = write(id->channel->fd, &cmd, sizeof cmd);
+	ret = ucma_write(id->channel->fd, &cmd, sizeof cmd);
 	if (ret != sizeof cmd)
 		return (ret >= 0) ? ERR(ENODATA) : -1;
 
@@ -1003,7 +1049,7 @@ int rdma_resolve_route(struct rdma_cm_id *id, int timeout_ms)
 	cmd.id = id_priv->handle;
 	cmd.timeout_ms = timeout_ms;
 
-	ret = write(id->channel->fd, &cmd, sizeof cmd);
+	ret = ucma_write(id->channel->fd, &cmd, sizeof cmd);
 	if (ret != sizeof cmd)
 		return (ret >= 0) ? ERR(ENODATA) : -1;
 
@@ -1029,7 +1075,7 @@ static int rdma_init_qp_attr(struct rdma_cm_id *id, struct ibv_qp_attr *qp_attr,
 	cmd.id = id_priv->handle;
 	cmd.qp_state = qp_attr->qp_state;
 
-	ret = write(id->channel->fd, &cmd, sizeof cmd);
+	ret = ucma_write(id->channel->fd, &cmd, sizeof cmd);
 	if (ret != sizeof cmd)
 		return (ret >= 0) ? ERR(ENODATA) : -1;
 
@@ -1050,15 +1096,22 @@ static int ucma_modify_qp_rtr(struct rdma_cm_id *id, uint8_t resp_res)
 	if (!id->qp)
 		return ERR(EINVAL);
 
-	/* Need to update QP attributes from default values. */
-	qp_attr.qp_state = IBV_QPS_INIT;
-	ret = rdma_init_qp_attr(id, &qp_attr, &qp_attr_mask);
-	if (ret)
-		return ret;
+	/*
+	 * Need to update QP attributes from default values, unless the QP
+	 * was moved to INIT through this id when it was created.
+	 */
+	id_priv = container_of(id, struct cma_id_private, id);
+	if (id_priv->init_qp != id->qp) {
+		qp_attr.qp_state = IBV_QPS_INIT;
+		ret = rdma_init_qp_attr(id, &qp_attr, &qp_attr_mask);
+		if (ret)
+			return ret;
 
-	ret = ibv_modify_qp(id->qp, &qp_attr, qp_attr_mask);
-	if (ret)
-		return ERR(ret);
+		ret = ucma_ibv_modify_qp(id->qp, &qp_attr, qp_attr_mask);
+		if (ret)
+			return ERR(ret);
+		id_priv->init_qp = id->qp;
+	}
 
 	qp_attr.qp_state = IBV_QPS_RTR;
 	ret = rdma_init_qp_attr(id, &qp_attr, &qp_attr_mask);
@@ -1069,7 +1122,6 @@ static int ucma_modify_qp_rtr(struct rdma_cm_id *id, uint8_t resp_res)
 	 * Workaround for rdma_ucm kernel bug:
 	 * mask off qp_attr_mask bits 21-24 which are used for RoCE
 	 */
-	id_priv = container_of(id, struct cma_id_private, id);
 	link_layer = id_priv->cma_dev->port[id->port_num - 1].link_layer;
 
 	if (link_layer == IBV_LINK_LAYER_INFINIBAND)
@@ -1077,7 +1129,7 @@ static int ucma_modify_qp_rtr(struct rdma_cm_id *id, uint8_t resp_res)
 
 	if (resp_res != RDMA_MAX_RESP_RES)
 		qp_attr.max_dest_rd_atomic = resp_res;
-	return rdma_seterrno(ibv_modify_qp(id->qp, &qp_attr, qp_attr_mask));
+	return rdma_seterrno(ucma_ibv_modify_qp(id->qp, &qp_attr, qp_attr_mask));
 }
 
 static int ucma_modify_qp_rts(struct rdma_cm_id *id, uint8_t init_depth)
@@ -1092,7 +1144,7 @@ static int ucma_modify_qp_rts(struct rdma_cm_id *id, uint8_t init_depth)
 
 	if (init_depth != RDMA_MAX_INIT_DEPTH)
 		qp_attr.max_rd_atomic = init_depth;
-	return rdma_seterrno(ibv_modify_qp(id->qp, &qp_attr, qp_attr_mask));
+	return rdma_seterrno(ucma_ibv_modify_qp(id->qp, &qp_attr, qp_attr_mask));
 }
 
 static int ucma_modify_qp_sqd(struct rdma_cm_id *id)
@@ -1103,7 +1155,7 @@ static int ucma_modify_qp_sqd(struct rdma_cm_id *id)
 		return 0;
 
 	qp_attr.qp_state = IBV_QPS_SQD;
-	return rdma_seterrno(ibv_modify_qp(id->qp, &qp_attr, IBV_QP_STATE));
+	return rdma_seterrno(ucma_ibv_modify_qp(id->qp, &qp_attr, IBV_QP_STATE));
 }
 
 static int ucma_modify_qp_err(struct rdma_cm_id *id)
@@ -1114,7 +1166,7 @@ static int ucma_modify_qp_err(struct rdma_cm_id *id)
 		return 0;
 
 	qp_attr.qp_state = IBV_QPS_ERR;
-	return rdma_seterrno(ibv_modify_qp(id->qp, &qp_attr, IBV_QP_STATE));
+	return rdma_seterrno(ucma_ibv_modify_qp(id->qp, &qp_attr, IBV_QP_STATE));
 }
 
 static int ucma_find_pkey(struct cma_device *cma_dev, uint8_t port_num,
@@ -1124,7 +1176,7 @@ static int ucma_find_pkey(struct cma_device *cma_dev, uint8_t port_num,
 	uint16_t chk_pkey;
 
 	for (i = 0, ret = 0; !ret; i++) {
-		ret = ibv_query_pkey(cma_dev->verbs, port_num, i, &chk_pkey);
+		ret = ucma_ibv_query_pkey(cma_dev->verbs, port_num, i, &chk_pkey);
 		if (!ret && pkey == chk_pkey) {
 			*pkey_index = (uint16_t) i;
 			return 0;
@@ -1148,8 +1200,8 @@ static int ucma_init_conn_qp3(struct cma_id_private *id_priv, struct ibv_qp *qp)
 	qp_attr.qp_state = IBV_QPS_INIT;
 	qp_attr.qp_access_flags = 0;
 
-	ret = ibv_modify_qp(qp, &qp_attr, IBV_QP_STATE | IBV_QP_ACCESS_FLAGS |
-					  IBV_QP_PKEY_INDEX | IBV_QP_PORT);
+	ret = ucma_ibv_modify_qp(qp, &qp_attr, IBV_QP_STATE | IBV_QP_ACCESS_FLAGS |
+					       IBV_QP_PKEY_INDEX | IBV_QP_PORT);
 	return rdma_seterrno(ret);
 }
 
@@ -1166,7 +1218,12 @@ static int ucma_init_conn_qp(struct cma_id_private *id_priv, struct ibv_qp *qp)
 	if (ret)
 		return ret;
 
-	return rdma_seterrno(ibv_modify_qp(qp, &qp_attr, qp_attr_mask));
+	ret = ucma_ibv_modify_qp(qp, &qp_attr, qp_attr_mask);
+	if (ret)
+		return ERR(ret);
+
+	id_priv->init_qp = qp;
+	return 0;
 }
 
 static int ucma_init_ud_qp3(struct cma_id_private *id_priv, struct ibv_qp *qp)
@@ -1184,19 +1241,19 @@ static int ucma_init_ud_qp3(struct cma_id_private *id_priv, struct ibv_qp *qp)
 	qp_attr.qp_state = IBV_QPS_INIT;
 	qp_attr.qkey = RDMA_UDP_QKEY;
 
-	ret = ibv_modify_qp(qp, &qp_attr, IBV_QP_STATE | IBV_QP_QKEY |
-					  IBV_QP_PKEY_INDEX | IBV_QP_PORT);
+	ret = ucma_ibv_modify_qp(qp, &qp_attr, IBV_QP_STATE | IBV_QP_QKEY |
+					       IBV_QP_PKEY_INDEX | IBV_QP_PORT);
 	if (ret)
 		return ERR(ret);
 
 	qp_attr.qp_state = IBV_QPS_RTR;
-	ret = ibv_modify_qp(qp, &qp_attr, IBV_QP_STATE);
+	ret = ucma_ibv_modify_qp(qp, &qp_attr, IBV_QP_STATE);
 	if (ret)
 		return ERR(ret);
 
 	qp_attr.qp_state = IBV_QPS_RTS;
 	qp_attr.sq_psn = 0;
-	ret = ibv_modify_qp(qp, &qp_attr, IBV_QP_STATE | IBV_QP_SQ_PSN);
+	ret = ucma_ibv_modify_qp(qp, &qp_attr, IBV_QP_STATE | IBV_QP_SQ_PSN);
 	return rdma_seterrno(ret);
 }
 
@@ -1213,18 +1270,18 @@ static int ucma_init_ud_qp(struct cma_id_private *id_priv, struct ibv_qp *qp)
 	if (ret)
 		return ret;
 
-	ret = ibv_modify_qp(qp, &qp_attr, qp_attr_mask);
+	ret = ucma_ibv_modify_qp(qp, &qp_attr, qp_attr_mask);
 	if (ret)
 		return ERR(ret);
 
 	qp_attr.qp_state = IBV_QPS_RTR;
-	ret = ibv_modify_qp(qp, &qp_attr, IBV_QP_STATE);
+	ret = ucma_ibv_modify_qp(qp, &qp_attr, IBV_QP_STATE);
 	if (ret)
 		return ERR(ret);
 
 	qp_attr.qp_state = IBV_QPS_RTS;
 	qp_attr.sq_psn = 0;
-	ret = ibv_modify_qp(qp, &qp_attr, IBV_QP_STATE | IBV_QP_SQ_PSN);
+	ret = ucma_ibv_modify_qp(qp, &qp_attr, IBV_QP_STATE | IBV_QP_SQ_PSN);
 	return rdma_seterrno(ret);
 }
 
@@ -1234,18 +1291,18 @@ static void ucma_destroy_cqs(struct rdma_cm_id *id)
 		return;
 
 	if (id->recv_cq) {
-		ibv_destroy_cq(id->recv_cq);
+		ucma_ibv_destroy_cq(id->recv_cq);
 		if (id->send_cq && (id->send_cq != id->recv_cq)) {
-			ibv_destroy_cq(id->send_cq);
+			ucma_ibv_destroy_cq(id->send_cq);
 			id->send_cq = NULL;
 		}
 		id->recv_cq = NULL;
 	}
 
 	if (id->recv_cq_channel) {
-		ibv_destroy_comp_channel(id->recv_cq_channel);
+		ucma_ibv_destroy_comp_channel(id->recv_cq_channel);
 		if (id->send_cq_channel && (id->send_cq_channel != id->recv_cq_channel)) {
-			ibv_destroy_comp_channel(id->send_cq_channel);
+			ucma_ibv_destroy_comp_channel(id->send_cq_channel);
 			id->send_cq_channel = NULL;
 		}
 		id->recv_cq_channel = NULL;
@@ -1255,23 +1312,23 @@ static void ucma_destroy_cqs(struct rdma_cm_id *id)
 static int ucma_create_cqs(struct rdma_cm_id *id, uint32_t send_size, uint32_t recv_size)
 {
 	if (recv_size) {
-		id->recv_cq_channel = ibv_create_comp_channel(id->verbs);
+		id->recv_cq_channel = ucma_ibv_create_comp_channel(id->verbs);
 		if (!id->recv_cq_channel)
 			goto err;
 
-		id->recv_cq = ibv_create_cq(id->verbs, recv_size,
-					    id, id->recv_cq_channel, 0);
+		id->recv_cq = ucma_ibv_create_cq(id->verbs, recv_size,
+						 id, id->recv_cq_channel, 0);
 		if (!id->recv_cq)
 			goto err;
 	}
 
 	if (send_size) {
-		id->send_cq_channel = ibv_create_comp_channel(id->verbs);
+		id->send_cq_channel = ucma_ibv_create_comp_channel(id->verbs);
 		if (!id->send_cq_channel)
 			goto err;
 
-		id->send_cq = ibv_create_cq(id->verbs, send_size,
-					    id, id->send_cq_channel, 0);
+		id->send_cq = ucma_ibv_create_cq(id->verbs, send_size,
+						 id, id->send_cq_channel, 0);
 		if (!id->send_cq)
 			goto err;
 	}
@@ -1394,7 +1451,7 @@ int rdma_create_qp_ex(struct rdma_cm_id *id,
 		attr->recv_cq = id->recv_cq;
 	if (id->srq && !attr->srq)
 		attr->srq = id->srq;
-	qp = ibv_create_qp_ex(id->verbs, attr);
+	qp = ucma_ibv_create_qp_ex(id->verbs, attr);
 	if (!qp) {
 		ret = ERR(ENOMEM);
 		goto err1;
@@ -1411,7 +1468,7 @@ int rdma_create_qp_ex(struct rdma_cm_id *id,
 	id->qp = qp;
 	return 0;
 err2:
-	ibv_destroy_qp(qp);
+	ucma_ibv_destroy_qp(qp);
 err1:
 	ucma_destroy_cqs(id);
 	return ret;
@@ -1433,7 +1490,11 @@ int rdma_create_qp(struct rdma_cm_id *id, struct ibv_pd *pd,
 
 void rdma_destroy_qp(struct rdma_cm_id *id)
 {
-	ibv_destroy_qp(id->qp);
+	struct cma_id_private *id_priv;
+
+	id_priv = container_of(id, struct cma_id_private, id);
+	id_priv->init_qp = NULL;
+	ucma_ibv_destroy_qp(id->qp);
 	id->qp = NULL;
 	ucma_destroy_cqs(id);
 }
@@ -1530,7 +1591,7 @@ int rdma_connect(struct rdma_cm_id *id, struct rdma_conn_param *conn_param)
 					     conn_param, 0, 0);
 	}
 
-	ret = write(id->channel->fd, &cmd, sizeof cmd);
+	ret = ucma_write(id->channel->fd, &cmd, sizeof cmd);
 	if (ret != sizeof cmd)
 		return (ret >= 0) ? ERR(ENODATA) : -1;
 
@@ -1553,7 +1614,7 @@ int rdma_listen(struct rdma_cm_id *id, int backlog)
 	cmd.id = id_priv->handle;
 	cmd.backlog = backlog;
 
-	ret = write(id->channel->fd, &cmd, sizeof cmd);
+	ret = ucma_write(id->channel->fd, &cmd, sizeof cmd);
 	if (ret != sizeof cmd)
 		return (ret >= 0) ? ERR(ENODATA) : -1;
 
@@ -1656,7 +1717,7 @@ int rdma_accept(struct rdma_cm_id *id, struct rdma_conn_param *conn_param)
 					     conn_param, conn_param->qp_num,
 					     conn_param->srq);
 
-	ret = write(id->channel->fd, &cmd, sizeof cmd);
+	ret = ucma_write(id->channel->fd, &cmd, sizeof cmd);
 	if (ret != sizeof cmd) {
 		ucma_modify_qp_err(id);
 		return (ret >= 0) ? ERR(ENODATA) : -1;
@@ -1684,7 +1745,7 @@ int rdma_reject(struct rdma_cm_id *id, const void *private_data,
 		cmd.private_data_len = private_data_len;
 	}
 
-	ret = write(id->channel->fd, &cmd, sizeof cmd);
+	ret = ucma_write(id->channel->fd, &cmd, sizeof cmd);
 	if (ret != sizeof cmd)
 		return (ret >= 0) ? ERR(ENODATA) : -1;
 
@@ -1702,7 +1763,7 @@ int rdma_notify(struct rdma_cm_id *id, enum ibv_event_type event)
 	id_priv = container_of(id, struct cma_id_private, id);
 	cmd.id = id_priv->handle;
 	cmd.event = event;
-	ret = write(id->channel->fd, &cmd, sizeof cmd);
+	ret = ucma_write(id->channel->fd, &cmd, sizeof cmd);
 	if (ret != sizeof cmd)
 		return (ret >= 0) ? ERR(ENODATA) : -1;
 
@@ -1735,7 +1796,7 @@ int rdma_disconnect(struct rdma_cm_id *id)
 	id_priv = container_of(id, struct cma_id_private, id);
 	cmd.id = id_priv->handle;
 
-	ret = write(id->channel->fd, &cmd, sizeof cmd);
+	ret = ucma_write(id->channel->fd, &cmd, sizeof cmd);
 	if (ret != sizeof cmd)
 		return (ret >= 0) ? ERR(ENODATA) : -1;
 
@@ -1778,7 +1839,7 @@ static int rdma_join_multicast2(struct rdma_cm_id *id, struct sockaddr *addr,
 		cmd.uid = (uintptr_t) mc;
 		cmd.reserved = 0;
 
-		ret = write(id->channel->fd, &cmd, sizeof cmd);
+		ret = ucma_write(id->channel->fd, &cmd, sizeof cmd);
 		if (ret != sizeof cmd) {
 			ret = (ret >= 0) ? ERR(ENODATA) : -1;
 			goto err2;
@@ -1791,7 +1852,7 @@ static int rdma_join_multicast2(struct rdma_cm_id *id, struct sockaddr *addr,
 		memcpy(&cmd.addr, addr, addrlen);
 		cmd.uid = (uintptr_t) mc;
 
-		ret = write(id->channel->fd, &cmd, sizeof cmd);
+		ret = ucma_write(id->channel->fd, &cmd, sizeof cmd);
 		if (ret != sizeof cmd) {
 			ret = (ret >= 0) ? ERR(ENODATA) : -1;
 			goto err2;
@@ -1852,12 +1913,12 @@ int rdma_leave_multicast(struct rdma_cm_id *id, struct sockaddr *addr)
 		return ERR(EADDRNOTAVAIL);
 
 	if (id->qp)
-		ibv_detach_mcast(id->qp, &mc->mgid, mc->mlid);
+		ucma_ibv_detach_mcast(id->qp, &mc->mgid, mc->mlid);
 	
 	CMA_INIT_CMD_RESP(&cmd, sizeof cmd, LEAVE_MCAST, &resp, sizeof resp);
 	cmd.id = mc->handle;
 
-	ret = write(id->channel->fd, &cmd, sizeof cmd);
+	ret = ucma_write(id->channel->fd, &cmd, sizeof cmd);
 	if (ret != sizeof cmd) {
 		ret = (ret >= 0) ? ERR(ENODATA) : -1;
 		goto free;
@@ -1913,7 +1974,7 @@ int rdma_ack_cm_event(struct rdma_cm_event *event)
 
 static void ucma_process_addr_resolved(struct cma_event *evt)
 {
-	if (af_ib_support) {
+	if (!ucma_query_ip(evt->id_priv->id.route.addr.dst_addr.sa_family)) {
 		evt->event.status = ucma_query_addr(&evt->id_priv->id);
 		if (!evt->event.status &&
 		    evt->id_priv->id.verbs->device->transport_type == IBV_TRANSPORT_IB)
@@ -1940,11 +2001,11 @@ static void ucma_process_route_resolved(struct cma_event *evt)
 		evt->event.event = RDMA_CM_EVENT_ROUTE_ERROR;
 }
 
-static int ucma_query_req_info(struct rdma_cm_id *id)
+static int ucma_query_req_info(struct rdma_cm_id *id, sa_family_t family)
 {
 	int ret;
 
-	if (!af_ib_support)
+	if (ucma_query_ip(family))
 		return ucma_query_route(id);
 
 	ret = ucma_query_addr(id);
@@ -1990,7 +2051,8 @@ static int ucma_process_conn_req(struct cma_event *evt,
 			goto err2;
 	}
 
-	ret = ucma_query_req_info(&id_priv->id);
+	ret = ucma_query_req_info(&id_priv->id,
+				  evt->id_priv->id.route.addr.src_addr.sa_family);
 	if (ret)
 		goto err2;
 
@@ -2019,7 +2081,7 @@ static int ucma_process_conn_resp(struct cma_id_private *id_priv)
 	CMA_INIT_CMD(&cmd, sizeof cmd, ACCEPT);
 	cmd.id = id_priv->handle;
 
-	ret = write(id_priv->id.channel->fd, &cmd, sizeof cmd);
+	ret = ucma_write(id_priv->id.channel->fd, &cmd, sizeof cmd);
 	if (ret != sizeof cmd) {
 		ret = (ret >= 0) ? ERR(ENODATA) : -1;
 		goto err;
@@ -2039,8 +2101,8 @@ static int ucma_process_join(struct cma_event *evt)
 	if (!evt->id_priv->id.qp)
 		return 0;
 
-	return rdma_seterrno(ibv_attach_mcast(evt->id_priv->id.qp,
-					      &evt->mc->mgid, evt->mc->mlid));
+	return rdma_seterrno(ucma_ibv_attach_mcast(evt->id_priv->id.qp,
+						   &evt->mc->mgid, evt->mc->mlid));
 }
 
 static void ucma_copy_conn_event(struct cma_event *event,
@@ -2103,7 +2165,7 @@ int rdma_get_cm_event(struct rdma_event_channel *channel,
 retry:
 	memset(evt, 0, sizeof(*evt));
 	CMA_INIT_CMD_RESP(&cmd, sizeof cmd, GET_EVENT, &resp, sizeof resp);
-	ret = write(channel->fd, &cmd, sizeof cmd);
+	ret = ucma_write(channel->fd, &cmd, sizeof cmd);
 	if (ret != sizeof cmd) {
 		free(evt);
 		return (ret >= 0) ? ERR(ENODATA) : -1;
@@ -2215,6 +2277,8 @@ retry:
 		break;
 	}
 
+	rdma_probe3(cm_event, evt->event.id, evt->event.event,
+		    evt->event.status);
 	*event = &evt->event;
 	return 0;
 }
@@ -2274,7 +2338,7 @@ int rdma_set_option(struct rdma_cm_id *id, int level, int optname,
 	cmd.optname = optname;
 	cmd.optlen = optlen;
 
-	ret = write(id->channel->fd, &cmd, sizeof cmd);
+	ret = ucma_write(id->channel->fd, &cmd, sizeof cmd);
 	if (ret != sizeof cmd)
 		return (ret >= 0) ? ERR(ENODATA) : -1;
 
@@ -2302,7 +2366,7 @@ int rdma_migrate_id(struct rdma_cm_id *id, struct rdma_event_channel *channel)
 	cmd.id = id_priv->handle;
 	cmd.fd = id->channel->fd;
 
-	ret = write(channel->fd, &cmd, sizeof cmd);
+	ret = ucma_write(channel->fd, &cmd, sizeof cmd);
 	if (ret != sizeof cmd) {
 		if (sync)
 			rdma_destroy_event_channel(channel);
@@ -39,10 +39,13 @@
 #endif /* HAVE_CONFIG_H */
 
 #include <stdlib.h>
+#include <string.h>
 #include <errno.h>
 #include <endian.h>
 #include <byteswap.h>
 #include <semaphore.h>
+#include <unistd.h>
+#include <sys/time.h>
 
 #include <rdma/rdma_cma.h>
 #include <infiniband/ib.h>
@@ -60,6 +63,25 @@
 
 #define PFX "librdmacm: "
 
+/*
+ * Static tracepoints.  When built with systemtap SDT support, each probe
+ * compiles to a single nop under the librdmacm provider and may be enabled
+ * at run time using perf or bpftrace.  Otherwise, probes compile away.
+ */
+#ifdef HAVE_SYS_SDT_H
+#   include <sys/sdt.h>
+#   define rdma_probe1(name, a) DTRACE_PROBE1(librdmacm, name, a)
+#   define rdma_probe2(name, a, b) DTRACE_PROBE2(librdmacm, name, a, b)
+#   define rdma_probe3(name, a, b, c) DTRACE_PROBE3(librdmacm, name, a, b, c)
+#   define rdma_probe4(name, a, b, c, d) \
+	DTRACE_PROBE4(librdmacm, name, a, b, c, d)
+#else
+#   define rdma_probe1(name, a)
+#   define rdma_probe2(name, a, b)
+#   define rdma_probe3(name, a, b, c)
+#   define rdma_probe4(name, a, b, c, d)
+#endif
+
 #if __BYTE_ORDER == __LITTLE_ENDIAN
 static inline uint64_t htonll(uint64_t x) { return bswap_64(x); }
 static inline uint64_t ntohll(uint64_t x) { return bswap_64(x); }
@@ -78,14 +100,77 @@ static inline uint64_t ntohll(uint64_t x) { return x; }
 
 
 /*
- * Fast synchronization for low contention locking.
+ * Fast synchronization for low contention locking.  A contended acquire
+ * spins briefly before sleeping, since most critical sections are only a
+ * few microseconds long.  Counters are updated while holding the lock,
+ * but read without it, so that querying them neither waits behind the
+ * holder nor counts as an acquisition.
  */
+#define FASTLOCK_SPIN_COUNT 128
+
+#if defined(__i386__) || defined(__x86_64__)
+#define fastlock_pause() asm volatile("pause" ::: "memory")
+#elif defined(__aarch64__)
+#define fastlock_pause() asm volatile("yield" ::: "memory")
+#else
+#define fastlock_pause() __sync_synchronize()
+#endif
+
+struct fastlock_stats {
+	uint64_t acquired;
+	uint64_t contended;
+	uint64_t sleep_us;
+};
+
+static inline uint64_t fastlock_time_us(void)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return (uint64_t) now.tv_sec * 1000000 + now.tv_usec;
+}
+
 #if DEFINE_ATOMICS
-#define fastlock_t pthread_mutex_t
-#define fastlock_init(lock) pthread_mutex_init(lock, NULL)
-#define fastlock_destroy(lock) pthread_mutex_destroy(lock)
-#define fastlock_acquire(lock) pthread_mutex_lock(lock)
-#define fastlock_release(lock) pthread_mutex_unlock(lock)
+typedef struct {
+	pthread_mutex_t mut;
+	struct fastlock_stats stats;
+} fastlock_t;
+static inline void fastlock_init(fastlock_t *lock)
+{
+	pthread_mutex_init(&lock->mut, NULL);
+	memset(&lock->stats, 0, sizeof lock->stats);
+}
+static inline void fastlock_destroy(fastlock_t *lock)
+{
+	pthread_mutex_destroy(&lock->mut);
+}
+static inline void fastlock_acquire(fastlock_t *lock)
+{
+	uint64_t start;
+	int i;
+
+	if (!pthread_mutex_trylock(&lock->mut)) {
+		lock->stats.acquired++;
+		return;
+	}
+
+	for (i = 0; i < FASTLOCK_SPIN_COUNT; i++) {
+		fastlock_pause();
+		if (!pthread_mutex_trylock(&lock->mut))
+			goto out;
+	}
+
+	start = fastlock_time_us();
+	pthread_mutex_lock(&lock->mut);
+	lock->stats.sleep_us += fastlock_time_us() - start;
+out:
+	lock->stats.acquired++;
+	lock->stats.contended++;
+}
+static inline void fastlock_release(fastlock_t *lock)
+{
+	pthread_mutex_unlock(&lock->mut);
+}
 
 typedef struct { pthread_mutex_t mut; int val; } atomic_t;
 static inline int atomic_inc(atomic_t *atomic)
@@ -115,20 +200,47 @@ static inline void atomic_init(atomic_t *atomic)
 typedef struct {
 	sem_t sem;
 	volatile int cnt;
+	struct fastlock_stats stats;
 } fastlock_t;
 static inline void fastlock_init(fastlock_t *lock)
 {
 	sem_init(&lock->sem, 0, 0);
 	lock->cnt = 0;
+	memset(&lock->stats, 0, sizeof lock->stats);
 }
 static inline void fastlock_destroy(fastlock_t *lock)
 {
 	sem_destroy(&lock->sem);
 }
+/*
+ * The lock is free only when cnt is 0.  Spinning only takes the lock
+ * through that 0 -> 1 transition, so a thread that has already gone to
+ * sleep is always handed the lock by the releasing thread first.
+ */
 static inline void fastlock_acquire(fastlock_t *lock)
 {
-	if (__sync_add_and_fetch(&lock->cnt, 1) > 1)
+	uint64_t start;
+	int i;
+
+	if (__sync_bool_compare_and_swap(&lock->cnt, 0, 1)) {
+		lock->stats.acquired++;
+		return;
+	}
+
+	for (i = 0; i < FASTLOCK_SPIN_COUNT; i++) {
+		fastlock_pause();
+		if (!lock->cnt && __sync_bool_compare_and_swap(&lock->cnt, 0, 1))
+			goto out;
+	}
+
+	if (__sync_add_and_fetch(&lock->cnt, 1) > 1) {
+		start = fastlock_time_us();
 		sem_wait(&lock->sem);
+		lock->stats.sleep_us += fastlock_time_us() - start;
+	}
+out:
+	lock->stats.acquired++;
+	lock->stats.contended++;
 }
 static inline void fastlock_release(fastlock_t *lock)
 {
@@ -144,6 +256,16 @@ typedef struct { volatile int val; } atomic_t;
 #define atomic_get(v) ((v)->val)
 #define atomic_set(v, s) ((v)->val = s)
 
+static inline void fastlock_get_stats(fastlock_t *lock,
+				      struct fastlock_stats *stats)
+{
+	volatile struct fastlock_stats *cur = &lock->stats;
+
+	stats->acquired = cur->acquired;
+	stats->contended = cur->contended;
+	stats->sleep_us = cur->sleep_us;
+}
+
 uint16_t ucma_get_port(struct sockaddr *addr);
 int ucma_addrlen(struct sockaddr *addr);
 void ucma_set_sid(enum rdma_port_space ps, struct sockaddr *addr,
@@ -161,6 +283,82 @@ static inline int ERR(int err)
 int ucma_init(void);
 extern int af_ib_support;
 
+/*
+ * Software loopback device, selected with RDMA_LOOPBACK=1.  Commands
+ * normally written to the rdma_cm device are handled in process.
+ */
+#define UCMA_LB_GUID		0x0200000000000001ULL
+
+extern int ucma_loopback;
+
+int ucma_lb_requested(void);
+struct ibv_context *ucma_lb_open_device(void);
+int ucma_lb_create_channel(void);
+void ucma_lb_destroy_channel(int fd);
+ssize_t ucma_lb_write(int fd, const void *buf, size_t size);
+
+/*
+ * Verbs issued by librdmacm.  These service the loopback device in
+ * process and call the libibverbs entry point for any other device.
+ */
+int ucma_ibv_query_device(struct ibv_context *context,
+			  struct ibv_device_attr *device_attr);
+int ucma_ibv_query_port(struct ibv_context *context, uint8_t port_num,
+			struct ibv_port_attr *port_attr);
+int ucma_ibv_query_gid(struct ibv_context *context, uint8_t port_num,
+		       int index, union ibv_gid *gid);
+int ucma_ibv_query_pkey(struct ibv_context *context, uint8_t port_num,
+			int index, uint16_t *pkey);
+int ucma_ibv_close_device(struct ibv_context *context);
+struct ibv_pd *ucma_ibv_alloc_pd(struct ibv_context *context);
+int ucma_ibv_dealloc_pd(struct ibv_pd *pd);
+struct ibv_mr *ucma_ibv_reg_mr(struct ibv_pd *pd, void *addr,
+			       size_t length, int access);
+int ucma_ibv_dereg_mr(struct ibv_mr *mr);
+struct ibv_comp_channel *ucma_ibv_create_comp_channel(struct ibv_context *context);
+int ucma_ibv_destroy_comp_channel(struct ibv_comp_channel *channel);
+struct ibv_cq *ucma_ibv_create_cq(struct ibv_context *context, int cqe,
+				  void *cq_context,
+				  struct ibv_comp_channel *channel,
+				  int comp_vector);
+int ucma_ibv_destroy_cq(struct ibv_cq *cq);
+int ucma_ibv_get_cq_event(struct ibv_comp_channel *channel,
+			  struct ibv_cq **cq, void **cq_context);
+void ucma_ibv_ack_cq_events(struct ibv_cq *cq, unsigned int nevents);
+struct ibv_qp *ucma_ibv_create_qp(struct ibv_pd *pd,
+				  struct ibv_qp_init_attr *qp_init_attr);
+struct ibv_qp *ucma_ibv_create_qp_ex(struct ibv_context *context,
+				     struct ibv_qp_init_attr_ex *qp_init_attr_ex);
+int ucma_ibv_modify_qp(struct ibv_qp *qp, struct ibv_qp_attr *attr,
+		       int attr_mask);
+int ucma_ibv_destroy_qp(struct ibv_qp *qp);
+struct ibv_ah *ucma_ibv_create_ah(struct ibv_pd *pd, struct ibv_ah_attr *attr);
+int ucma_ibv_destroy_ah(struct ibv_ah *ah);
+int ucma_ibv_attach_mcast(struct ibv_qp *qp, const union ibv_gid *gid,
+			  uint16_t lid);
+int ucma_ibv_detach_mcast(struct ibv_qp *qp, const union ibv_gid *gid,
+			  uint16_t lid);
+
+static inline struct ibv_mr *ucma_reg_msgs(struct rdma_cm_id *id,
+					   void *addr, size_t length)
+{
+	return ucma_ibv_reg_mr(id->pd, addr, length, IBV_ACCESS_LOCAL_WRITE);
+}
+
+static inline struct ibv_mr *ucma_reg_write(struct rdma_cm_id *id,
+					    void *addr, size_t length)
+{
+	return ucma_ibv_reg_mr(id->pd, addr, length, IBV_ACCESS_LOCAL_WRITE |
+						     IBV_ACCESS_REMOTE_WRITE);
+}
+
+static inline ssize_t ucma_write(int fd, const void *buf, size_t size)
+{
+	if (ucma_loopback)
+		return ucma_lb_write(fd, buf, size);
+	return write(fd, buf, size);
+}
+
 #define RAI_ROUTEONLY		0x01000000
 
 void ucma_ib_init();
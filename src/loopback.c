@@ -0,0 +1,2575 @@
+/*
+ * Copyright (c) 2026 agent <agent@local>.  All rights reserved.
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * OpenIB.org BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Software loopback device.
+ *
+ * When RDMA_LOOPBACK is set, librdmacm does not open the rdma_cm kernel
+ * device or any verbs device.  Commands that would have been written to
+ * the kernel are processed by ucma_lb_write() instead, and a single
+ * software device is reported to the rest of the library.  Connections
+ * between processes on the same host are carried over AF_UNIX sockets
+ * in the abstract namespace: one stream socket per RC connection, and
+ * one datagram socket per UD QP.
+ *
+ * RC QPs support sends and RDMA writes, with or without immediate data.
+ * Data is copied directly into the target buffer by a per-connection
+ * thread, which waits for a posted receive when one is needed, so the
+ * device behaves as if the RNR retry count were infinite.  UD QPs
+ * support sends, and drop messages when no receive is posted.  Send
+ * completions are generated once the data has been handed to the socket.
+ *
+ * Only verbs issued from within librdmacm are redirected to the device;
+ * applications that pass it to libibverbs directly are not supported.
+ */
+
+#if HAVE_CONFIG_H
+#  include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <syslog.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/ioctl.h>
+#include <poll.h>
+#include <netinet/in.h>
+
+#include "cma.h"
+#include "indexer.h"
+#include <rdma/rdma_cma.h>
+#include <rdma/rdma_cma_abi.h>
+
+#define LB_NAME_PREFIX		"rdma-loopback"
+#define LB_MAX_SGE		16
+#define LB_MAX_WR		16384
+#define LB_MAX_CQE		(1 << 20)
+#define LB_MAX_INLINE		512
+#define LB_UD_MTU		4096
+#define LB_PORT_MIN		32768
+#define LB_PORT_MAX		61000
+
+/* IB CM reject reasons reported in RDMA_CM_EVENT_REJECTED */
+#define LB_REJ_INVALID_SID	8
+#define LB_REJ_CONSUMER		28
+
+enum {
+	LB_REQ,
+	LB_REP,
+	LB_RTU,
+	LB_REJ,
+	LB_DREQ,
+	LB_DREP,
+	LB_SEND,
+	LB_WRITE
+};
+
+/*
+ * Every message on the wire starts with this header.  CM messages carry
+ * a struct lb_cm_msg; data messages carry length bytes of payload.
+ */
+struct lb_hdr {
+	uint8_t			type;
+	uint8_t			with_imm;
+	uint16_t		reserved;
+	uint32_t		imm_data;
+	uint32_t		src_qp;
+	uint32_t		rkey;
+	uint64_t		addr;
+	uint32_t		length;
+	uint32_t		reserved2;
+};
+
+struct lb_cm_msg {
+	struct ucma_abi_conn_param conn_param;
+	struct sockaddr_in6	src_addr;
+	struct sockaddr_in6	dst_addr;
+};
+
+enum lb_state {
+	LB_IDLE,
+	LB_LISTEN,
+	LB_REQ_SENT,
+	LB_REQ_RCVD,
+	LB_REP_SENT,
+	LB_REP_RCVD,
+	LB_CONNECTED,
+	LB_DREQ_SENT,
+	LB_DISCONNECTED,
+	LB_DESTROYING
+};
+
+struct lb_conn;
+
+struct lb_channel {
+	int			fd[2];
+	dlist_entry		event_list;
+};
+
+struct lb_id {
+	struct lb_channel	*channel;
+	struct lb_id		*next;
+	uint64_t		uid;
+	int			handle;
+	uint16_t		ps;
+	uint8_t			qp_type;
+	uint8_t			ephemeral;
+	uint8_t			has_device;
+	uint8_t			route_resolved;
+	enum lb_state		state;
+	uint32_t		events_reported;
+	uint32_t		qp_num;
+	uint32_t		remote_qpn;
+	struct sockaddr_in6	src_addr;
+	struct sockaddr_in6	dst_addr;
+	struct lb_conn		*conn;
+	int			listen_fd;
+	pthread_t		thread;
+};
+
+struct lb_event {
+	dlist_entry		entry;
+	struct lb_id		*id;
+	struct lb_id		*child;
+	struct ucma_abi_event_resp resp;
+};
+
+struct lb_qp;
+
+struct lb_conn {
+	int			fd;
+	int			ref;
+	int			closing;
+	int			eof;
+	pthread_t		thread;
+	pthread_mutex_t		send_lock;
+	struct lb_id		*id;
+	struct lb_qp		*qp;
+};
+
+/*
+ * Events are CQ pointers written to a pipe.  The lock serializes writers
+ * and readers of the pipe, so that destroying a CQ can remove its queued
+ * events before the CQ is freed.
+ */
+struct lb_comp_channel {
+	struct ibv_comp_channel	channel;
+	pthread_mutex_t		lock;
+	int			notify_fd;
+};
+
+struct lb_cq {
+	struct ibv_cq		ibv_cq;
+	pthread_mutex_t		lock;
+	struct ibv_wc		*wc;
+	int			size;
+	int			head;
+	int			cnt;
+	int			armed;
+};
+
+struct lb_rwqe {
+	uint64_t		wr_id;
+	int			num_sge;
+	struct ibv_sge		sge[LB_MAX_SGE];
+};
+
+struct lb_qp {
+	struct ibv_qp		ibv_qp;
+	dlist_entry		entry;
+	pthread_mutex_t		lock;
+	pthread_cond_t		cond;
+	pthread_mutex_t		send_lock;
+	struct lb_rwqe		*rq;
+	int			rq_size;
+	int			rq_head;
+	int			rq_cnt;
+	int			sq_sig_all;
+	int			destroyed;
+	int			users;
+	struct lb_conn		*conn;
+	int			fd;
+	pthread_t		thread;
+	uint8_t			*ud_buf;
+};
+
+struct lb_mr {
+	struct ibv_mr		ibv_mr;
+	int			access;
+};
+
+/*
+ * lock protects the CM state: ids, channels, events and the binding
+ * between connections and QPs.  It is never held across a socket write.
+ */
+static struct {
+	pthread_mutex_t		lock;
+	pthread_cond_t		cond;
+	struct indexer		id_idx;
+	struct index_map	id_map;
+	struct index_map	channel_map;
+	dlist_entry		qp_list;
+	uint32_t		next_qpn;
+	uint16_t		next_port;
+	pthread_rwlock_t	mr_lock;
+	struct indexer		mr_idx;
+	struct index_map	mr_map;
+} lb = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+	.qp_list = { &lb.qp_list, &lb.qp_list },
+	.mr_lock = PTHREAD_RWLOCK_INITIALIZER
+};
+
+static int lb_poll_cq(struct ibv_cq *cq, int num_entries, struct ibv_wc *wc);
+static int lb_req_notify_cq(struct ibv_cq *cq, int solicited_only);
+static int lb_post_send(struct ibv_qp *qp, struct ibv_send_wr *wr,
+			struct ibv_send_wr **bad_wr);
+static int lb_post_recv(struct ibv_qp *qp, struct ibv_recv_wr *wr,
+			struct ibv_recv_wr **bad_wr);
+
+static struct ibv_device lb_device = {
+	.node_type = IBV_NODE_CA,
+	.transport_type = IBV_TRANSPORT_IB,
+	.name = "lb0",
+	.dev_name = "uverbs_lb0",
+};
+
+/*
+ * The data path verbs are inline functions that call through the context
+ * ops.  abi_compat is left NULL so that extended verbs report ENOSYS.
+ */
+static struct ibv_context lb_context = {
+	.device = &lb_device,
+	.ops = {
+		.poll_cq = lb_poll_cq,
+		.req_notify_cq = lb_req_notify_cq,
+		.post_send = lb_post_send,
+		.post_recv = lb_post_recv,
+	},
+	.cmd_fd = -1,
+	.async_fd = -1,
+	.num_comp_vectors = 1,
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+};
+
+#define lb_verbs(ctx) ((ctx) == &lb_context)
+
+int ucma_lb_requested(void)
+{
+	char *var;
+
+	var = getenv("RDMA_LOOPBACK");
+	return var && atoi(var);
+}
+
+struct ibv_context *ucma_lb_open_device(void)
+{
+	return &lb_context;
+}
+
+static void lb_gid(union ibv_gid *gid)
+{
+	gid->global.subnet_prefix = htonll(0xfe80000000000000ULL);
+	gid->global.interface_id = UCMA_LB_GUID;
+}
+
+/*
+ * Socket helpers
+ */
+static socklen_t lb_sock_name(struct sockaddr_un *addr, const char *name)
+{
+	memset(addr, 0, sizeof *addr);
+	addr->sun_family = AF_UNIX;
+	snprintf(&addr->sun_path[1], sizeof(addr->sun_path) - 1, "%s/%s",
+		 LB_NAME_PREFIX, name);
+	return offsetof(struct sockaddr_un, sun_path) + 1 +
+	       strlen(&addr->sun_path[1]);
+}
+
+static socklen_t lb_listen_name(struct sockaddr_un *addr, uint16_t ps,
+				uint16_t port)
+{
+	char name[16];
+
+	snprintf(name, sizeof name, "%u/%u", ps, port);
+	return lb_sock_name(addr, name);
+}
+
+static socklen_t lb_qp_name(struct sockaddr_un *addr, uint32_t qpn)
+{
+	char name[16];
+
+	snprintf(name, sizeof name, "qp/%u", qpn);
+	return lb_sock_name(addr, name);
+}
+
+static int lb_recv_all(int fd, void *buf, size_t len)
+{
+	ssize_t ret;
+
+	while (len) {
+		ret = read(fd, buf, len);
+		if (ret <= 0) {
+			if (ret < 0 && errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+static int lb_drain(int fd, size_t len)
+{
+	uint8_t buf[4096];
+
+	while (len) {
+		if (lb_recv_all(fd, buf, min(len, sizeof buf)))
+			return -1;
+		len -= min(len, sizeof buf);
+	}
+	return 0;
+}
+
+static int lb_sendv(int fd, struct iovec *iov, int iovcnt)
+{
+	struct msghdr msg;
+	ssize_t ret;
+
+	memset(&msg, 0, sizeof msg);
+	msg.msg_iov = iov;
+	msg.msg_iovlen = iovcnt;
+	while (msg.msg_iovlen) {
+		ret = sendmsg(fd, &msg, MSG_NOSIGNAL);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+
+		while (msg.msg_iovlen && ret >= msg.msg_iov->iov_len) {
+			ret -= msg.msg_iov->iov_len;
+			msg.msg_iov++;
+			msg.msg_iovlen--;
+		}
+		if (ret) {
+			msg.msg_iov->iov_base += ret;
+			msg.msg_iov->iov_len -= ret;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Connections
+ */
+static void *lb_conn_run(void *arg);
+
+static struct lb_conn *lb_alloc_conn(int fd)
+{
+	struct lb_conn *conn;
+
+	conn = calloc(1, sizeof *conn);
+	if (!conn)
+		return NULL;
+
+	conn->fd = fd;
+	conn->ref = 1;
+	pthread_mutex_init(&conn->send_lock, NULL);
+	return conn;
+}
+
+static void lb_conn_put(struct lb_conn *conn)
+{
+	int ref;
+
+	pthread_mutex_lock(&lb.lock);
+	ref = --conn->ref;
+	pthread_mutex_unlock(&lb.lock);
+	if (ref)
+		return;
+
+	close(conn->fd);
+	pthread_mutex_destroy(&conn->send_lock);
+	free(conn);
+}
+
+static int lb_conn_send(struct lb_conn *conn, int type, const void *buf,
+			uint32_t len)
+{
+	struct lb_hdr hdr;
+	struct iovec iov[2];
+	int ret;
+
+	memset(&hdr, 0, sizeof hdr);
+	hdr.type = type;
+	hdr.length = len;
+	iov[0].iov_base = &hdr;
+	iov[0].iov_len = sizeof hdr;
+	iov[1].iov_base = (void *) buf;
+	iov[1].iov_len = len;
+
+	pthread_mutex_lock(&conn->send_lock);
+	ret = lb_sendv(conn->fd, iov, len ? 2 : 1);
+	pthread_mutex_unlock(&conn->send_lock);
+	return ret;
+}
+
+/*
+ * A CM message built while holding lb.lock, sent after it is released.
+ */
+struct lb_out {
+	struct lb_conn		*conn;
+	int			type;
+	struct lb_cm_msg	msg;
+};
+
+static void lb_out_init(struct lb_out *out, struct lb_conn *conn, int type)
+{
+	conn->ref++;
+	out->conn = conn;
+	out->type = type;
+}
+
+static void lb_out_send(struct lb_out *out)
+{
+	if (!out->conn)
+		return;
+
+	lb_conn_send(out->conn, out->type, &out->msg,
+		     (out->type == LB_REQ || out->type == LB_REP ||
+		      out->type == LB_REJ) ? sizeof out->msg : 0);
+	lb_conn_put(out->conn);
+}
+
+/*
+ * Event channels
+ */
+int ucma_lb_create_channel(void)
+{
+	struct lb_channel *chan;
+	int ret;
+
+	chan = calloc(1, sizeof *chan);
+	if (!chan)
+		return ERR(ENOMEM);
+
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, chan->fd))
+		goto err1;
+
+	dlist_init(&chan->event_list);
+	pthread_mutex_lock(&lb.lock);
+	ret = idm_set(&lb.channel_map, chan->fd[0], chan);
+	pthread_mutex_unlock(&lb.lock);
+	if (ret < 0)
+		goto err2;
+
+	return chan->fd[0];
+
+err2:
+	close(chan->fd[0]);
+	close(chan->fd[1]);
+err1:
+	free(chan);
+	return -1;
+}
+
+void ucma_lb_destroy_channel(int fd)
+{
+	struct lb_channel *chan;
+	struct lb_event *evt;
+
+	pthread_mutex_lock(&lb.lock);
+	chan = idm_clear(&lb.channel_map, fd);
+	pthread_mutex_unlock(&lb.lock);
+	if (!chan)
+		return;
+
+	while (!dlist_empty(&chan->event_list)) {
+		evt = container_of(chan->event_list.next, struct lb_event, entry);
+		dlist_remove(&evt->entry);
+		free(evt);
+	}
+	close(chan->fd[0]);
+	close(chan->fd[1]);
+	free(chan);
+}
+
+/*
+ * Each queued event is matched by one byte in the channel socket, so that
+ * the user's fd polls readable and honors O_NONBLOCK on GET_EVENT.
+ */
+static void lb_queue_event(struct lb_id *id, uint32_t event, int status,
+			   struct ucma_abi_conn_param *param, struct lb_id *child)
+{
+	struct lb_event *evt;
+	char c = 0;
+
+	evt = calloc(1, sizeof *evt);
+	if (!evt) {
+		syslog(LOG_WARNING, PFX "loopback: dropping event %s\n",
+		       rdma_event_str(event));
+		return;
+	}
+
+	evt->id = id;
+	evt->child = child;
+	evt->resp.uid = id->uid;
+	evt->resp.id = child ? child->handle : id->handle;
+	evt->resp.event = event;
+	evt->resp.status = status;
+	if (param)
+		evt->resp.param.conn = *param;
+	dlist_insert_tail(&evt->entry, &id->channel->event_list);
+	send(id->channel->fd[1], &c, sizeof c, MSG_DONTWAIT);
+}
+
+static void lb_move_event(struct lb_event *evt, struct lb_channel *chan)
+{
+	char c;
+
+	dlist_remove(&evt->entry);
+	recv(evt->id->channel->fd[0], &c, sizeof c, MSG_DONTWAIT);
+	if (chan) {
+		dlist_insert_tail(&evt->entry, &chan->event_list);
+		send(chan->fd[1], &c, sizeof c, MSG_DONTWAIT);
+	}
+}
+
+static int lb_get_event(int fd, const struct ucma_abi_get_event *cmd)
+{
+	struct lb_channel *chan;
+	struct lb_event *evt;
+	ssize_t ret;
+	char c;
+
+	for (;;) {
+		ret = read(fd, &c, sizeof c);
+		if (ret != sizeof c)
+			return ret ? ret : ERR(ENODEV);
+
+		pthread_mutex_lock(&lb.lock);
+		chan = idm_lookup(&lb.channel_map, fd);
+		if (!chan) {
+			pthread_mutex_unlock(&lb.lock);
+			return ERR(EINVAL);
+		}
+		if (!dlist_empty(&chan->event_list))
+			break;
+		pthread_mutex_unlock(&lb.lock);
+	}
+
+	evt = container_of(chan->event_list.next, struct lb_event, entry);
+	dlist_remove(&evt->entry);
+	evt->id->events_reported++;
+	pthread_mutex_unlock(&lb.lock);
+
+	memcpy((void *) (uintptr_t) cmd->response, &evt->resp,
+	       min(cmd->out, sizeof evt->resp));
+	free(evt);
+	return 0;
+}
+
+/*
+ * IDs
+ */
+static struct lb_id *lb_lookup_id(uint32_t handle)
+{
+	struct lb_id *id;
+
+	id = idm_lookup(&lb.id_map, handle);
+	if (!id)
+		errno = EINVAL;
+	return id;
+}
+
+static struct lb_id *lb_alloc_id(struct lb_channel *chan, uint16_t ps,
+				 uint8_t qp_type)
+{
+	struct lb_id *id;
+
+	id = calloc(1, sizeof *id);
+	if (!id)
+		return NULL;
+
+	id->handle = idx_insert(&lb.id_idx, id);
+	if (id->handle < 0)
+		goto err;
+
+	if (idm_set(&lb.id_map, id->handle, id) < 0) {
+		idx_remove(&lb.id_idx, id->handle);
+		goto err;
+	}
+
+	id->channel = chan;
+	id->ps = ps;
+	id->qp_type = qp_type;
+	id->listen_fd = -1;
+	return id;
+err:
+	free(id);
+	return NULL;
+}
+
+static int lb_connected(struct lb_id *id)
+{
+	switch (id->state) {
+	case LB_REP_SENT:
+	case LB_REP_RCVD:
+	case LB_CONNECTED:
+	case LB_DREQ_SENT:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+static void lb_qp_wake(struct lb_qp *qp)
+{
+	pthread_mutex_lock(&qp->lock);
+	pthread_cond_broadcast(&qp->cond);
+	pthread_mutex_unlock(&qp->lock);
+}
+
+/*
+ * Called holding lb.lock.  Unqueued connection requests take their new
+ * ids with them, which are chained on id->next for lb_release_id().
+ */
+static void lb_detach_id(struct lb_id *id)
+{
+	struct lb_event *evt;
+	dlist_entry *item, *next;
+
+	idm_clear(&lb.id_map, id->handle);
+	idx_remove(&lb.id_idx, id->handle);
+
+	for (item = id->channel->event_list.next;
+	     item != &id->channel->event_list; item = next) {
+		next = item->next;
+		evt = container_of(item, struct lb_event, entry);
+		if (evt->id != id)
+			continue;
+
+		lb_move_event(evt, NULL);
+		if (evt->child) {
+			lb_detach_id(evt->child);
+			evt->child->next = id->next;
+			id->next = evt->child;
+		}
+		free(evt);
+	}
+
+	id->state = LB_DESTROYING;
+	if (id->conn) {
+		id->conn->id = NULL;
+		id->conn->closing = 1;
+		if (id->conn->qp)
+			lb_qp_wake(id->conn->qp);
+	}
+}
+
+static void lb_release_id(struct lb_id *id)
+{
+	if (id->listen_fd >= 0) {
+		shutdown(id->listen_fd, SHUT_RDWR);
+		pthread_join(id->thread, NULL);
+		close(id->listen_fd);
+	}
+
+	if (id->conn) {
+		shutdown(id->conn->fd, SHUT_RDWR);
+		pthread_join(id->conn->thread, NULL);
+		lb_conn_put(id->conn);
+	}
+	free(id);
+}
+
+static uint16_t lb_alloc_port(void)
+{
+	if (!lb.next_port)
+		lb.next_port = LB_PORT_MIN + getpid() % (LB_PORT_MAX - LB_PORT_MIN);
+	else if (++lb.next_port >= LB_PORT_MAX)
+		lb.next_port = LB_PORT_MIN;
+	return lb.next_port;
+}
+
+static int lb_addr_any(struct sockaddr_in6 *addr)
+{
+	if (addr->sin6_family == AF_INET)
+		return ((struct sockaddr_in *) addr)->sin_addr.s_addr ==
+		       htonl(INADDR_ANY);
+	return !memcmp(&addr->sin6_addr, &in6addr_any, sizeof in6addr_any);
+}
+
+/* sin_port and sin6_port share the same offset */
+static int lb_set_addr(struct sockaddr_in6 *dst, const struct sockaddr *src)
+{
+	int len;
+
+	len = ucma_addrlen((struct sockaddr *) src);
+	if (!len || src->sa_family == AF_IB)
+		return ERR(EAFNOSUPPORT);
+
+	memset(dst, 0, sizeof *dst);
+	memcpy(dst, src, len);
+	return 0;
+}
+
+static int lb_create_id(int fd, const struct ucma_abi_create_id *cmd)
+{
+	struct ucma_abi_create_id_resp resp;
+	struct lb_channel *chan;
+	struct lb_id *id;
+
+	chan = idm_lookup(&lb.channel_map, fd);
+	if (!chan)
+		return ERR(EINVAL);
+
+	id = lb_alloc_id(chan, cmd->ps, cmd->qp_type);
+	if (!id)
+		return ERR(ENOMEM);
+
+	id->uid = cmd->uid;
+	resp.id = id->handle;
+	memcpy((void *) (uintptr_t) cmd->response, &resp,
+	       min(cmd->out, sizeof resp));
+	return 0;
+}
+
+static int lb_bind_ip(const struct ucma_abi_bind_ip *cmd)
+{
+	struct lb_id *id;
+
+	if (!(id = lb_lookup_id(cmd->id)))
+		return -1;
+
+	if (lb_set_addr(&id->src_addr, (struct sockaddr *) &cmd->addr))
+		return -1;
+
+	if (!id->src_addr.sin6_port) {
+		id->src_addr.sin6_port = htons(lb_alloc_port());
+		id->ephemeral = 1;
+	}
+	id->has_device = !lb_addr_any(&id->src_addr);
+	return 0;
+}
+
+static int lb_resolve_ip(const struct ucma_abi_resolve_ip *cmd)
+{
+	struct lb_id *id;
+
+	if (!(id = lb_lookup_id(cmd->id)))
+		return -1;
+
+	if (lb_set_addr(&id->dst_addr, (struct sockaddr *) &cmd->dst_addr))
+		return -1;
+
+	/* Every destination is local, so it doubles as the source address */
+	if (cmd->src_addr.sin6_family) {
+		if (lb_set_addr(&id->src_addr, (struct sockaddr *) &cmd->src_addr))
+			return -1;
+	} else if (!id->src_addr.sin6_family || lb_addr_any(&id->src_addr)) {
+		in_port_t port = id->src_addr.sin6_port;
+
+		id->src_addr = id->dst_addr;
+		id->src_addr.sin6_port = port;
+	}
+
+	if (!id->src_addr.sin6_port) {
+		id->src_addr.sin6_port = htons(lb_alloc_port());
+		id->ephemeral = 1;
+	}
+	id->has_device = 1;
+	lb_queue_event(id, RDMA_CM_EVENT_ADDR_RESOLVED, 0, NULL, NULL);
+	return 0;
+}
+
+static int lb_resolve_route(const struct ucma_abi_resolve_route *cmd)
+{
+	struct lb_id *id;
+
+	if (!(id = lb_lookup_id(cmd->id)))
+		return -1;
+
+	if (!id->has_device || !id->dst_addr.sin6_family)
+		return ERR(EINVAL);
+
+	id->route_resolved = 1;
+	lb_queue_event(id, RDMA_CM_EVENT_ROUTE_RESOLVED, 0, NULL, NULL);
+	return 0;
+}
+
+/* Setting a path record resolves the route, as it does in the kernel */
+static int lb_set_option(const struct ucma_abi_set_option *cmd)
+{
+	struct lb_id *id;
+
+	if (cmd->level != RDMA_OPTION_IB || cmd->optname != RDMA_OPTION_IB_PATH)
+		return 0;
+
+	if (!(id = lb_lookup_id(cmd->id)))
+		return -1;
+
+	if (!id->has_device || !id->dst_addr.sin6_family ||
+	    !cmd->optlen || cmd->optlen % sizeof(struct ibv_path_data))
+		return ERR(EINVAL);
+
+	id->route_resolved = 1;
+	lb_queue_event(id, RDMA_CM_EVENT_ROUTE_RESOLVED, 0, NULL, NULL);
+	return 0;
+}
+
+static int lb_query_route(const struct ucma_abi_query *cmd)
+{
+	struct ucma_abi_query_route_resp resp;
+	struct ibv_kern_path_rec *path;
+	union ibv_gid gid;
+	struct lb_id *id;
+
+	if (!(id = lb_lookup_id(cmd->id)))
+		return -1;
+
+	memset(&resp, 0, sizeof resp);
+	resp.src_addr = id->src_addr;
+	resp.dst_addr = id->dst_addr;
+	if (id->has_device) {
+		resp.node_guid = UCMA_LB_GUID;
+		resp.port_num = 1;
+	}
+
+	lb_gid(&gid);
+	path = &resp.ib_route[0];
+	memcpy(path->sgid, gid.raw, sizeof path->sgid);
+	memcpy(path->dgid, gid.raw, sizeof path->dgid);
+	path->pkey = htons(0xffff);
+	if (id->route_resolved) {
+		resp.num_paths = 1;
+		path->dlid = htons(1);
+		path->slid = htons(1);
+		path->reversible = 1;
+		path->numb_path = 1;
+		path->mtu_selector = 2;
+		path->mtu = IBV_MTU_4096;
+		path->rate_selector = 2;
+		path->rate = IBV_RATE_40_GBPS;
+		path->packet_life_time_selector = 2;
+		path->packet_life_time = 14;
+	}
+
+	memcpy((void *) (uintptr_t) cmd->response, &resp,
+	       min(cmd->out, sizeof resp));
+	return 0;
+}
+
+static int lb_init_qp_attr(const struct ucma_abi_init_qp_attr *cmd)
+{
+	struct ibv_kern_qp_attr resp;
+	struct lb_id *id;
+
+	if (!(id = lb_lookup_id(cmd->id)))
+		return -1;
+
+	memset(&resp, 0, sizeof resp);
+	resp.qp_state = cmd->qp_state;
+	switch (cmd->qp_state) {
+	case IBV_QPS_INIT:
+		resp.qp_attr_mask = IBV_QP_STATE | IBV_QP_PKEY_INDEX | IBV_QP_PORT;
+		resp.port_num = 1;
+		if (id->qp_type == IBV_QPT_UD) {
+			resp.qp_attr_mask |= IBV_QP_QKEY;
+			resp.qkey = RDMA_UDP_QKEY;
+		} else {
+			resp.qp_attr_mask |= IBV_QP_ACCESS_FLAGS;
+			resp.qp_access_flags = IBV_ACCESS_REMOTE_WRITE |
+					       IBV_ACCESS_REMOTE_READ;
+		}
+		break;
+	case IBV_QPS_RTR:
+		resp.qp_attr_mask = IBV_QP_STATE | IBV_QP_AV | IBV_QP_PATH_MTU |
+				    IBV_QP_DEST_QPN | IBV_QP_RQ_PSN |
+				    IBV_QP_MAX_DEST_RD_ATOMIC | IBV_QP_MIN_RNR_TIMER;
+		resp.path_mtu = IBV_MTU_4096;
+		resp.dest_qp_num = id->remote_qpn;
+		resp.ah_attr.dlid = 1;
+		resp.ah_attr.port_num = 1;
+		resp.max_dest_rd_atomic = 16;
+		resp.min_rnr_timer = 12;
+		break;
+	case IBV_QPS_RTS:
+		resp.qp_attr_mask = IBV_QP_STATE | IBV_QP_TIMEOUT |
+				    IBV_QP_RETRY_CNT | IBV_QP_RNR_RETRY |
+				    IBV_QP_SQ_PSN | IBV_QP_MAX_QP_RD_ATOMIC;
+		resp.timeout = 14;
+		resp.retry_cnt = 7;
+		resp.rnr_retry = 7;
+		resp.max_rd_atomic = 16;
+		break;
+	default:
+		return ERR(EINVAL);
+	}
+
+	memcpy((void *) (uintptr_t) cmd->response, &resp,
+	       min(cmd->out, sizeof resp));
+	return 0;
+}
+
+static void *lb_listen_run(void *arg);
+
+static int lb_listen(const struct ucma_abi_listen *cmd)
+{
+	struct sockaddr_un addr;
+	socklen_t len;
+	struct lb_id *id;
+	int fd, i;
+
+	if (!(id = lb_lookup_id(cmd->id)))
+		return -1;
+
+	if (id->state != LB_IDLE || id->qp_type == IBV_QPT_UD)
+		return ERR(EINVAL);
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -1;
+
+	if (!id->src_addr.sin6_family) {
+		id->src_addr.sin6_family = AF_INET6;
+		id->ephemeral = 1;
+	}
+	if (!id->src_addr.sin6_port)
+		id->src_addr.sin6_port = htons(lb_alloc_port());
+
+	for (i = 0; ; i++) {
+		len = lb_listen_name(&addr, id->ps, ntohs(id->src_addr.sin6_port));
+		if (!bind(fd, (struct sockaddr *) &addr, len))
+			break;
+		if (errno != EADDRINUSE || !id->ephemeral ||
+		    i == LB_PORT_MAX - LB_PORT_MIN)
+			goto err;
+		id->src_addr.sin6_port = htons(lb_alloc_port());
+	}
+
+	if (listen(fd, cmd->backlog > 0 ? cmd->backlog : SOMAXCONN))
+		goto err;
+
+	id->listen_fd = fd;
+	id->state = LB_LISTEN;
+	if (pthread_create(&id->thread, NULL, lb_listen_run, id)) {
+		id->listen_fd = -1;
+		id->state = LB_IDLE;
+		goto err;
+	}
+	return 0;
+err:
+	close(fd);
+	return -1;
+}
+
+static void lb_swap_param(struct ucma_abi_conn_param *param)
+{
+	uint8_t rd;
+
+	rd = param->responder_resources;
+	param->responder_resources = param->initiator_depth;
+	param->initiator_depth = rd;
+}
+
+/*
+ * Called holding lb.lock.
+ */
+static void lb_attach_qp(struct lb_conn *conn, uint32_t qp_num)
+{
+	struct lb_qp *qp;
+	dlist_entry *item;
+
+	for (item = lb.qp_list.next; item != &lb.qp_list; item = item->next) {
+		qp = container_of(item, struct lb_qp, entry);
+		if (qp->ibv_qp.qp_num != qp_num || qp->conn)
+			continue;
+
+		qp->conn = conn;
+		conn->qp = qp;
+		conn->ref++;
+		return;
+	}
+}
+
+/*
+ * Connect does not hold lb.lock across connect(), which may block until
+ * the listener, possibly in this process, accepts.
+ */
+static int lb_connect(const struct ucma_abi_connect *cmd)
+{
+	struct sockaddr_un addr;
+	struct lb_conn *conn;
+	struct lb_out out;
+	struct lb_id *id;
+	socklen_t len;
+	int fd;
+
+	pthread_mutex_lock(&lb.lock);
+	if (!(id = lb_lookup_id(cmd->id)))
+		goto err;
+
+	if (id->qp_type == IBV_QPT_UD) {
+		errno = ENOSYS;
+		goto err;
+	}
+	if (id->state != LB_IDLE || !id->route_resolved) {
+		errno = EINVAL;
+		goto err;
+	}
+
+	len = lb_listen_name(&addr, id->ps, ntohs(id->dst_addr.sin6_port));
+	id->state = LB_REQ_SENT;
+	id->qp_num = cmd->conn_param.qp_num;
+	pthread_mutex_unlock(&lb.lock);
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		pthread_mutex_lock(&lb.lock);
+		id->state = LB_IDLE;
+		goto err;
+	}
+
+	if (connect(fd, (struct sockaddr *) &addr, len)) {
+		close(fd);
+		pthread_mutex_lock(&lb.lock);
+		id->state = LB_IDLE;
+		lb_queue_event(id, RDMA_CM_EVENT_REJECTED, LB_REJ_INVALID_SID,
+			       NULL, NULL);
+		pthread_mutex_unlock(&lb.lock);
+		return 0;
+	}
+
+	conn = lb_alloc_conn(fd);
+	pthread_mutex_lock(&lb.lock);
+	if (!conn) {
+		close(fd);
+		id->state = LB_IDLE;
+		errno = ENOMEM;
+		goto err;
+	}
+
+	id->conn = conn;
+	conn->id = id;
+	if (pthread_create(&conn->thread, NULL, lb_conn_run, conn)) {
+		id->conn = NULL;
+		id->state = LB_IDLE;
+		pthread_mutex_unlock(&lb.lock);
+		lb_conn_put(conn);
+		return ERR(ENOMEM);
+	}
+
+	lb_out_init(&out, conn, LB_REQ);
+	out.msg.conn_param = cmd->conn_param;
+	out.msg.src_addr = id->src_addr;
+	out.msg.dst_addr = id->dst_addr;
+	pthread_mutex_unlock(&lb.lock);
+	lb_out_send(&out);
+	return 0;
+err:
+	pthread_mutex_unlock(&lb.lock);
+	return -1;
+}
+
+static int lb_accept(const struct ucma_abi_accept *cmd, struct lb_out *out)
+{
+	struct lb_id *id;
+
+	if (!(id = lb_lookup_id(cmd->id)))
+		return -1;
+
+	switch (id->state) {
+	case LB_REP_RCVD:
+		/* The active side completes the handshake with an RTU */
+		id->state = LB_CONNECTED;
+		lb_out_init(out, id->conn, LB_RTU);
+		return 0;
+	case LB_REQ_RCVD:
+		id->uid = cmd->uid;
+		id->qp_num = cmd->conn_param.qp_num;
+		id->state = LB_REP_SENT;
+		lb_attach_qp(id->conn, id->qp_num);
+		lb_out_init(out, id->conn, LB_REP);
+		out->msg.conn_param = cmd->conn_param;
+		out->msg.src_addr = id->src_addr;
+		out->msg.dst_addr = id->dst_addr;
+		return 0;
+	default:
+		return ERR(EINVAL);
+	}
+}
+
+static int lb_reject(const struct ucma_abi_reject *cmd, struct lb_out *out)
+{
+	struct lb_id *id;
+
+	if (!(id = lb_lookup_id(cmd->id)))
+		return -1;
+
+	if (id->state != LB_REQ_RCVD)
+		return ERR(EINVAL);
+
+	id->state = LB_IDLE;
+	lb_out_init(out, id->conn, LB_REJ);
+	out->msg.conn_param.private_data_len = cmd->private_data_len;
+	memcpy(out->msg.conn_param.private_data, cmd->private_data,
+	       cmd->private_data_len);
+	return 0;
+}
+
+static int lb_disconnect(const struct ucma_abi_disconnect *cmd,
+			 struct lb_out *out)
+{
+	struct lb_id *id;
+
+	if (!(id = lb_lookup_id(cmd->id)))
+		return -1;
+
+	if (id->state != LB_CONNECTED && id->state != LB_REP_SENT &&
+	    id->state != LB_REP_RCVD)
+		return ERR(EINVAL);
+
+	id->state = LB_DREQ_SENT;
+	lb_out_init(out, id->conn, LB_DREQ);
+	return 0;
+}
+
+static int lb_migrate_id(int fd, const struct ucma_abi_migrate_id *cmd)
+{
+	struct ucma_abi_migrate_resp resp;
+	struct lb_channel *chan;
+	struct lb_event *evt;
+	dlist_entry *item, *next;
+	struct lb_id *id;
+
+	if (!(id = lb_lookup_id(cmd->id)))
+		return -1;
+
+	chan = idm_lookup(&lb.channel_map, fd);
+	if (!chan || id->channel != idm_lookup(&lb.channel_map, cmd->fd))
+		return ERR(EINVAL);
+
+	for (item = id->channel->event_list.next;
+	     item != &id->channel->event_list; item = next) {
+		next = item->next;
+		evt = container_of(item, struct lb_event, entry);
+		if (evt->id == id)
+			lb_move_event(evt, chan);
+	}
+
+	id->channel = chan;
+	resp.events_reported = id->events_reported;
+	memcpy((void *) (uintptr_t) cmd->response, &resp,
+	       min(cmd->out, sizeof resp));
+	return 0;
+}
+
+static int lb_destroy_id(const struct ucma_abi_destroy_id *cmd)
+{
+	struct ucma_abi_destroy_id_resp resp;
+	struct lb_id *id, *next;
+
+	pthread_mutex_lock(&lb.lock);
+	if (!(id = lb_lookup_id(cmd->id))) {
+		pthread_mutex_unlock(&lb.lock);
+		return -1;
+	}
+
+	lb_detach_id(id);
+	resp.events_reported = id->events_reported;
+	pthread_mutex_unlock(&lb.lock);
+
+	memcpy((void *) (uintptr_t) cmd->response, &resp,
+	       min(cmd->out, sizeof resp));
+	for (; id; id = next) {
+		next = id->next;
+		lb_release_id(id);
+	}
+	return 0;
+}
+
+ssize_t ucma_lb_write(int fd, const void *buf, size_t size)
+{
+	const struct ucma_abi_cmd_hdr *hdr = buf;
+	struct lb_out out;
+	int ret;
+
+	switch (hdr->cmd) {
+	case UCMA_CMD_GET_EVENT:
+		ret = lb_get_event(fd, buf);
+		return ret ? ret : size;
+	case UCMA_CMD_DESTROY_ID:
+		ret = lb_destroy_id(buf);
+		return ret ? ret : size;
+	case UCMA_CMD_CONNECT:
+		ret = lb_connect(buf);
+		return ret ? ret : size;
+	default:
+		break;
+	}
+
+	memset(&out, 0, sizeof out);
+	pthread_mutex_lock(&lb.lock);
+	switch (hdr->cmd) {
+	case UCMA_CMD_CREATE_ID:
+		ret = lb_create_id(fd, buf);
+		break;
+	case UCMA_CMD_BIND_IP:
+		ret = lb_bind_ip(buf);
+		break;
+	case UCMA_CMD_RESOLVE_IP:
+		ret = lb_resolve_ip(buf);
+		break;
+	case UCMA_CMD_RESOLVE_ROUTE:
+		ret = lb_resolve_route(buf);
+		break;
+	case UCMA_CMD_QUERY_ROUTE:
+		ret = lb_query_route(buf);
+		break;
+	case UCMA_CMD_INIT_QP_ATTR:
+		ret = lb_init_qp_attr(buf);
+		break;
+	case UCMA_CMD_LISTEN:
+		ret = lb_listen(buf);
+		break;
+	case UCMA_CMD_ACCEPT:
+		ret = lb_accept(buf, &out);
+		break;
+	case UCMA_CMD_REJECT:
+		ret = lb_reject(buf, &out);
+		break;
+	case UCMA_CMD_DISCONNECT:
+		ret = lb_disconnect(buf, &out);
+		break;
+	case UCMA_CMD_MIGRATE_ID:
+		ret = lb_migrate_id(fd, buf);
+		break;
+	case UCMA_CMD_SET_OPTION:
+		ret = lb_set_option(buf);
+		break;
+	case UCMA_CMD_NOTIFY:
+		ret = 0;
+		break;
+	default:
+		ret = ERR(ENOSYS);
+		break;
+	}
+	pthread_mutex_unlock(&lb.lock);
+
+	lb_out_send(&out);
+	return ret ? ret : size;
+}
+
+/*
+ * Listener thread: accepts connections and reads the REQ from each.
+ */
+static void *lb_listen_run(void *arg)
+{
+	struct lb_id *listen_id = arg, *id;
+	struct lb_cm_msg msg;
+	struct lb_conn *conn;
+	struct lb_hdr hdr;
+	int fd;
+
+	for (;;) {
+		fd = accept4(listen_id->listen_fd, NULL, NULL, SOCK_CLOEXEC);
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			break;
+		}
+
+		memset(&msg, 0, sizeof msg);
+		if (lb_recv_all(fd, &hdr, sizeof hdr) || hdr.type != LB_REQ ||
+		    hdr.length != sizeof msg || lb_recv_all(fd, &msg, sizeof msg))
+			goto close;
+
+		conn = lb_alloc_conn(fd);
+		if (!conn)
+			goto close;
+
+		pthread_mutex_lock(&lb.lock);
+		if (listen_id->state != LB_LISTEN)
+			goto unlock;
+
+		id = lb_alloc_id(listen_id->channel, listen_id->ps,
+				 listen_id->qp_type);
+		if (!id)
+			goto unlock;
+
+		id->state = LB_REQ_RCVD;
+		id->has_device = 1;
+		id->route_resolved = 1;
+		id->src_addr = msg.dst_addr;
+		id->dst_addr = msg.src_addr;
+		id->remote_qpn = msg.conn_param.qp_num;
+		id->conn = conn;
+		conn->id = id;
+		if (pthread_create(&conn->thread, NULL, lb_conn_run, conn)) {
+			idm_clear(&lb.id_map, id->handle);
+			idx_remove(&lb.id_idx, id->handle);
+			free(id);
+			goto unlock;
+		}
+
+		lb_swap_param(&msg.conn_param);
+		lb_queue_event(listen_id, RDMA_CM_EVENT_CONNECT_REQUEST, 0,
+			       &msg.conn_param, id);
+		pthread_mutex_unlock(&lb.lock);
+		continue;
+unlock:
+		pthread_mutex_unlock(&lb.lock);
+		lb_conn_put(conn);
+		continue;
+close:
+		close(fd);
+	}
+	return NULL;
+}
+
+/*
+ * QPs
+ */
+static struct lb_qp *lb_get_qp(struct lb_conn *conn)
+{
+	struct lb_qp *qp;
+
+	pthread_mutex_lock(&lb.lock);
+	qp = conn->qp;
+	if (qp)
+		qp->users++;
+	pthread_mutex_unlock(&lb.lock);
+	return qp;
+}
+
+static void lb_put_qp(struct lb_qp *qp)
+{
+	pthread_mutex_lock(&lb.lock);
+	if (!--qp->users)
+		pthread_cond_broadcast(&lb.cond);
+	pthread_mutex_unlock(&lb.lock);
+}
+
+static void lb_cq_add(struct lb_cq *cq, struct ibv_wc *wc)
+{
+	struct lb_comp_channel *chan;
+	int notify;
+
+	pthread_mutex_lock(&cq->lock);
+	if (cq->cnt == cq->size) {
+		pthread_mutex_unlock(&cq->lock);
+		syslog(LOG_WARNING, PFX "loopback: CQ overrun\n");
+		return;
+	}
+
+	cq->wc[(cq->head + cq->cnt) % cq->size] = *wc;
+	cq->cnt++;
+	notify = cq->armed;
+	cq->armed = 0;
+	pthread_mutex_unlock(&cq->lock);
+
+	if (notify && cq->ibv_cq.channel) {
+		chan = container_of(cq->ibv_cq.channel, struct lb_comp_channel,
+				    channel);
+		pthread_mutex_lock(&chan->lock);
+		write(chan->notify_fd, &cq, sizeof cq);
+		pthread_mutex_unlock(&chan->lock);
+	}
+}
+
+static struct lb_cq *lb_cq(struct ibv_cq *cq)
+{
+	return container_of(cq, struct lb_cq, ibv_cq);
+}
+
+static struct lb_qp *lb_qp(struct ibv_qp *qp)
+{
+	return container_of(qp, struct lb_qp, ibv_qp);
+}
+
+static void lb_complete_recv(struct lb_qp *qp, struct lb_rwqe *wqe,
+			     struct lb_hdr *hdr, enum ibv_wc_status status,
+			     uint32_t byte_len)
+{
+	struct ibv_wc wc;
+
+	memset(&wc, 0, sizeof wc);
+	wc.wr_id = wqe->wr_id;
+	wc.status = status;
+	wc.qp_num = qp->ibv_qp.qp_num;
+	wc.byte_len = byte_len;
+	wc.slid = 1;
+	if (hdr) {
+		wc.opcode = (hdr->type == LB_WRITE) ?
+			    IBV_WC_RECV_RDMA_WITH_IMM : IBV_WC_RECV;
+		wc.src_qp = hdr->src_qp;
+		if (hdr->with_imm) {
+			wc.wc_flags = IBV_WC_WITH_IMM;
+			wc.imm_data = hdr->imm_data;
+		}
+		if (qp->ibv_qp.qp_type == IBV_QPT_UD)
+			wc.wc_flags |= IBV_WC_GRH;
+	} else {
+		wc.opcode = IBV_WC_RECV;
+	}
+	lb_cq_add(lb_cq(qp->ibv_qp.recv_cq), &wc);
+}
+
+/*
+ * Called holding qp->lock.  Posted receives are flushed once the QP
+ * enters the error state.
+ */
+static void lb_flush_rq(struct lb_qp *qp)
+{
+	for (; qp->rq_cnt; qp->rq_cnt--) {
+		lb_complete_recv(qp, &qp->rq[qp->rq_head], NULL,
+				 IBV_WC_WR_FLUSH_ERR, 0);
+		qp->rq_head = (qp->rq_head + 1) % qp->rq_size;
+	}
+	pthread_cond_broadcast(&qp->cond);
+}
+
+static void lb_qp_error(struct lb_qp *qp)
+{
+	pthread_mutex_lock(&qp->lock);
+	qp->ibv_qp.state = IBV_QPS_ERR;
+	lb_flush_rq(qp);
+	pthread_mutex_unlock(&qp->lock);
+}
+
+static int lb_qp_ready(struct lb_qp *qp)
+{
+	return qp->ibv_qp.state == IBV_QPS_RTR || qp->ibv_qp.state == IBV_QPS_RTS;
+}
+
+/*
+ * RC receives wait for a posted WQE.  UD receives pass a NULL conn and
+ * are dropped when the receive queue is empty.
+ */
+static int lb_take_rwqe(struct lb_qp *qp, struct lb_conn *conn,
+			struct lb_rwqe *wqe)
+{
+	pthread_mutex_lock(&qp->lock);
+	while (conn && !qp->rq_cnt && lb_qp_ready(qp) && !qp->destroyed &&
+	       !conn->closing)
+		pthread_cond_wait(&qp->cond, &qp->lock);
+
+	if (!qp->rq_cnt || !lb_qp_ready(qp)) {
+		pthread_mutex_unlock(&qp->lock);
+		return -1;
+	}
+
+	*wqe = qp->rq[qp->rq_head];
+	qp->rq_head = (qp->rq_head + 1) % qp->rq_size;
+	qp->rq_cnt--;
+	pthread_mutex_unlock(&qp->lock);
+	return 0;
+}
+
+static int lb_recv_write(struct lb_qp *qp, struct lb_conn *conn,
+			 struct lb_hdr *hdr)
+{
+	struct lb_rwqe wqe;
+	struct lb_mr *mr;
+	int ret;
+
+	if (hdr->length) {
+		pthread_rwlock_rdlock(&lb.mr_lock);
+		mr = idm_lookup(&lb.mr_map, hdr->rkey);
+		if (!mr || !(mr->access & IBV_ACCESS_REMOTE_WRITE) ||
+		    hdr->addr < (uintptr_t) mr->ibv_mr.addr ||
+		    hdr->addr + hdr->length >
+		    (uintptr_t) mr->ibv_mr.addr + mr->ibv_mr.length) {
+			pthread_rwlock_unlock(&lb.mr_lock);
+			syslog(LOG_WARNING, PFX "loopback: remote access error "
+			       "on QP %u\n", qp->ibv_qp.qp_num);
+			lb_qp_error(qp);
+			return lb_drain(conn->fd, hdr->length);
+		}
+
+		ret = lb_recv_all(conn->fd, (void *) (uintptr_t) hdr->addr,
+				  hdr->length);
+		pthread_rwlock_unlock(&lb.mr_lock);
+		if (ret)
+			return ret;
+	}
+
+	if (hdr->with_imm && !lb_take_rwqe(qp, conn, &wqe))
+		lb_complete_recv(qp, &wqe, hdr, IBV_WC_SUCCESS, hdr->length);
+	return 0;
+}
+
+static int lb_recv_send(struct lb_qp *qp, struct lb_conn *conn,
+			struct lb_hdr *hdr)
+{
+	struct lb_rwqe wqe;
+	uint32_t len, n;
+	int i;
+
+	if (lb_take_rwqe(qp, conn, &wqe))
+		return lb_drain(conn->fd, hdr->length);
+
+	for (i = 0, len = hdr->length; i < wqe.num_sge && len; i++) {
+		n = min(len, wqe.sge[i].length);
+		if (lb_recv_all(conn->fd, (void *) (uintptr_t) wqe.sge[i].addr, n))
+			return -1;
+		len -= n;
+	}
+
+	if (len) {
+		if (lb_drain(conn->fd, len))
+			return -1;
+		lb_complete_recv(qp, &wqe, hdr, IBV_WC_LOC_LEN_ERR, 0);
+		lb_qp_error(qp);
+		return 0;
+	}
+
+	lb_complete_recv(qp, &wqe, hdr, IBV_WC_SUCCESS, hdr->length);
+	return 0;
+}
+
+static int lb_recv_data(struct lb_conn *conn, struct lb_hdr *hdr)
+{
+	struct lb_qp *qp;
+	int ret;
+
+	qp = lb_get_qp(conn);
+	if (!qp || !lb_qp_ready(qp))
+		ret = lb_drain(conn->fd, hdr->length);
+	else if (hdr->type == LB_WRITE)
+		ret = lb_recv_write(qp, conn, hdr);
+	else
+		ret = lb_recv_send(qp, conn, hdr);
+
+	if (qp)
+		lb_put_qp(qp);
+	return ret;
+}
+
+static int lb_recv_cm(struct lb_conn *conn, struct lb_hdr *hdr)
+{
+	struct lb_cm_msg msg;
+	struct lb_out out;
+	struct lb_id *id;
+
+	memset(&msg, 0, sizeof msg);
+	if (hdr->length > sizeof msg || lb_recv_all(conn->fd, &msg, hdr->length))
+		return -1;
+
+	memset(&out, 0, sizeof out);
+	pthread_mutex_lock(&lb.lock);
+	if (!(id = conn->id))
+		goto unlock;
+
+	switch (hdr->type) {
+	case LB_REP:
+		if (id->state != LB_REQ_SENT)
+			break;
+		id->state = LB_REP_RCVD;
+		id->remote_qpn = msg.conn_param.qp_num;
+		lb_attach_qp(conn, id->qp_num);
+		lb_swap_param(&msg.conn_param);
+		lb_queue_event(id, RDMA_CM_EVENT_CONNECT_RESPONSE, 0,
+			       &msg.conn_param, NULL);
+		break;
+	case LB_REJ:
+		if (id->state != LB_REQ_SENT)
+			break;
+		id->state = LB_IDLE;
+		lb_queue_event(id, RDMA_CM_EVENT_REJECTED, LB_REJ_CONSUMER,
+			       &msg.conn_param, NULL);
+		break;
+	case LB_RTU:
+		if (id->state != LB_REP_SENT)
+			break;
+		id->state = LB_CONNECTED;
+		lb_queue_event(id, RDMA_CM_EVENT_ESTABLISHED, 0, NULL, NULL);
+		break;
+	case LB_DREQ:
+		if (!lb_connected(id))
+			break;
+		id->state = LB_DISCONNECTED;
+		lb_queue_event(id, RDMA_CM_EVENT_DISCONNECTED, 0, NULL, NULL);
+		lb_out_init(&out, conn, LB_DREP);
+		break;
+	case LB_DREP:
+		if (id->state != LB_DREQ_SENT)
+			break;
+		id->state = LB_DISCONNECTED;
+		lb_queue_event(id, RDMA_CM_EVENT_DISCONNECTED, 0, NULL, NULL);
+		break;
+	default:
+		break;
+	}
+unlock:
+	pthread_mutex_unlock(&lb.lock);
+	lb_out_send(&out);
+	return 0;
+}
+
+/*
+ * Connection thread: receives CM messages and data for one connection.
+ */
+static void *lb_conn_run(void *arg)
+{
+	struct lb_conn *conn = arg;
+	struct lb_hdr hdr;
+	struct lb_id *id;
+	int ret;
+
+	while (!lb_recv_all(conn->fd, &hdr, sizeof hdr)) {
+		if (hdr.type == LB_SEND || hdr.type == LB_WRITE)
+			ret = lb_recv_data(conn, &hdr);
+		else
+			ret = lb_recv_cm(conn, &hdr);
+		if (ret)
+			break;
+	}
+
+	pthread_mutex_lock(&lb.lock);
+	conn->eof = 1;
+	pthread_cond_broadcast(&lb.cond);
+	if ((id = conn->id)) {
+		if (lb_connected(id)) {
+			id->state = LB_DISCONNECTED;
+			lb_queue_event(id, RDMA_CM_EVENT_DISCONNECTED, 0,
+				       NULL, NULL);
+		} else if (id->state == LB_REQ_SENT) {
+			id->state = LB_IDLE;
+			lb_queue_event(id, RDMA_CM_EVENT_REJECTED,
+				       LB_REJ_INVALID_SID, NULL, NULL);
+		}
+	}
+	pthread_mutex_unlock(&lb.lock);
+	return NULL;
+}
+
+/*
+ * UD QP thread: receives datagrams addressed to the QP.  A zeroed GRH is
+ * placed ahead of the payload, as on a real device.
+ */
+static void *lb_ud_run(void *arg)
+{
+	struct lb_qp *qp = arg;
+	struct lb_rwqe wqe;
+	struct lb_hdr hdr;
+	uint8_t *buf;
+	uint32_t len, n;
+	ssize_t ret;
+	int i;
+
+	buf = qp->ud_buf + sizeof(struct ibv_grh) - sizeof hdr;
+	for (;;) {
+		ret = recv(qp->fd, buf, sizeof hdr + LB_UD_MTU, 0);
+		if (ret < (ssize_t) sizeof hdr) {
+			if (qp->destroyed)
+				break;
+			continue;
+		}
+
+		memcpy(&hdr, buf, sizeof hdr);
+		if (hdr.length != ret - sizeof hdr || lb_take_rwqe(qp, NULL, &wqe))
+			continue;
+
+		memset(qp->ud_buf, 0, sizeof(struct ibv_grh));
+		buf = qp->ud_buf;
+		len = sizeof(struct ibv_grh) + hdr.length;
+		for (i = 0; i < wqe.num_sge && len; i++) {
+			n = min(len, wqe.sge[i].length);
+			memcpy((void *) (uintptr_t) wqe.sge[i].addr, buf, n);
+			buf += n;
+			len -= n;
+		}
+
+		lb_complete_recv(qp, &wqe, &hdr,
+				 len ? IBV_WC_LOC_LEN_ERR : IBV_WC_SUCCESS,
+				 sizeof(struct ibv_grh) + hdr.length);
+		buf = qp->ud_buf + sizeof(struct ibv_grh) - sizeof hdr;
+	}
+	return NULL;
+}
+
+/*
+ * Called holding lb.lock.
+ */
+static int lb_bind_ud(struct lb_qp *qp)
+{
+	struct sockaddr_un addr;
+	socklen_t len;
+	int i;
+
+	qp->fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (qp->fd < 0)
+		return -1;
+
+	for (i = 0; i < 1024; i++) {
+		qp->ibv_qp.qp_num = lb.next_qpn++ & 0xFFFFFF;
+		if (qp->ibv_qp.qp_num < 2)
+			continue;
+
+		len = lb_qp_name(&addr, qp->ibv_qp.qp_num);
+		if (!bind(qp->fd, (struct sockaddr *) &addr, len))
+			return 0;
+		if (errno != EADDRINUSE)
+			break;
+	}
+
+	close(qp->fd);
+	qp->fd = -1;
+	return -1;
+}
+
+static struct ibv_qp *lb_create_qp(struct ibv_pd *pd,
+				   struct ibv_qp_init_attr *attr)
+{
+	struct lb_qp *qp;
+
+	if (attr->qp_type != IBV_QPT_RC && attr->qp_type != IBV_QPT_UD) {
+		errno = ENOSYS;
+		return NULL;
+	}
+
+	if (attr->srq || !attr->send_cq || !attr->recv_cq ||
+	    !lb_verbs(attr->send_cq->context) ||
+	    !lb_verbs(attr->recv_cq->context) ||
+	    attr->cap.max_send_sge > LB_MAX_SGE ||
+	    attr->cap.max_recv_sge > LB_MAX_SGE ||
+	    attr->cap.max_send_wr > LB_MAX_WR ||
+	    attr->cap.max_recv_wr > LB_MAX_WR ||
+	    attr->cap.max_inline_data > LB_MAX_INLINE) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	qp = calloc(1, sizeof *qp);
+	if (!qp)
+		return NULL;
+
+	qp->rq_size = max(attr->cap.max_recv_wr, 1);
+	qp->rq = calloc(qp->rq_size, sizeof *qp->rq);
+	if (!qp->rq)
+		goto err1;
+
+	if (attr->qp_type == IBV_QPT_UD) {
+		qp->ud_buf = malloc(sizeof(struct ibv_grh) + LB_UD_MTU);
+		if (!qp->ud_buf)
+			goto err2;
+	}
+
+	qp->ibv_qp.context = pd->context;
+	qp->ibv_qp.qp_context = attr->qp_context;
+	qp->ibv_qp.pd = pd;
+	qp->ibv_qp.send_cq = attr->send_cq;
+	qp->ibv_qp.recv_cq = attr->recv_cq;
+	qp->ibv_qp.qp_type = attr->qp_type;
+	qp->ibv_qp.state = IBV_QPS_RESET;
+	qp->sq_sig_all = attr->sq_sig_all;
+	qp->fd = -1;
+	pthread_mutex_init(&qp->lock, NULL);
+	pthread_cond_init(&qp->cond, NULL);
+	pthread_mutex_init(&qp->send_lock, NULL);
+
+	pthread_mutex_lock(&lb.lock);
+	if (!lb.next_qpn)
+		lb.next_qpn = (getpid() & 0xFFFF) << 8;
+	if (attr->qp_type == IBV_QPT_UD) {
+		if (lb_bind_ud(qp))
+			goto err3;
+	} else {
+		qp->ibv_qp.qp_num = lb.next_qpn++ & 0xFFFFFF;
+	}
+	dlist_insert_tail(&qp->entry, &lb.qp_list);
+	pthread_mutex_unlock(&lb.lock);
+
+	if (qp->fd >= 0 && pthread_create(&qp->thread, NULL, lb_ud_run, qp))
+		goto err4;
+
+	return &qp->ibv_qp;
+
+err4:
+	pthread_mutex_lock(&lb.lock);
+	dlist_remove(&qp->entry);
+	close(qp->fd);
+err3:
+	pthread_mutex_unlock(&lb.lock);
+	pthread_mutex_destroy(&qp->send_lock);
+	pthread_cond_destroy(&qp->cond);
+	pthread_mutex_destroy(&qp->lock);
+	free(qp->ud_buf);
+err2:
+	free(qp->rq);
+err1:
+	free(qp);
+	errno = ENOMEM;
+	return NULL;
+}
+
+static int lb_destroy_qp(struct ibv_qp *ibqp)
+{
+	struct lb_qp *qp = lb_qp(ibqp);
+	struct lb_conn *conn;
+
+	pthread_mutex_lock(&lb.lock);
+	if ((conn = qp->conn)) {
+		conn->qp = NULL;
+		qp->conn = NULL;
+	}
+	dlist_remove(&qp->entry);
+	pthread_mutex_unlock(&lb.lock);
+
+	pthread_mutex_lock(&qp->lock);
+	qp->destroyed = 1;
+	pthread_cond_broadcast(&qp->cond);
+	pthread_mutex_unlock(&qp->lock);
+
+	if (qp->fd >= 0) {
+		shutdown(qp->fd, SHUT_RDWR);
+		pthread_join(qp->thread, NULL);
+		close(qp->fd);
+	}
+
+	pthread_mutex_lock(&lb.lock);
+	while (qp->users)
+		pthread_cond_wait(&lb.cond, &lb.lock);
+	pthread_mutex_unlock(&lb.lock);
+
+	if (conn)
+		lb_conn_put(conn);
+	pthread_mutex_destroy(&qp->send_lock);
+	pthread_cond_destroy(&qp->cond);
+	pthread_mutex_destroy(&qp->lock);
+	free(qp->ud_buf);
+	free(qp->rq);
+	free(qp);
+	return 0;
+}
+
+static int lb_modify_qp(struct ibv_qp *ibqp, struct ibv_qp_attr *attr,
+			int attr_mask)
+{
+	struct lb_qp *qp = lb_qp(ibqp);
+
+	if (!(attr_mask & IBV_QP_STATE))
+		return 0;
+
+	if (attr->qp_state == IBV_QPS_ERR) {
+		lb_qp_error(qp);
+		return 0;
+	}
+
+	pthread_mutex_lock(&qp->lock);
+	if (attr->qp_state == IBV_QPS_RESET) {
+		qp->rq_head = 0;
+		qp->rq_cnt = 0;
+	}
+	qp->ibv_qp.state = attr->qp_state;
+	pthread_cond_broadcast(&qp->cond);
+	pthread_mutex_unlock(&qp->lock);
+	return 0;
+}
+
+static void lb_complete_send(struct lb_qp *qp, struct ibv_send_wr *wr,
+			     enum ibv_wc_status status)
+{
+	struct ibv_wc wc;
+
+	if (status == IBV_WC_SUCCESS && !qp->sq_sig_all &&
+	    !(wr->send_flags & IBV_SEND_SIGNALED))
+		return;
+
+	memset(&wc, 0, sizeof wc);
+	wc.wr_id = wr->wr_id;
+	wc.status = status;
+	wc.opcode = (wr->opcode == IBV_WR_RDMA_WRITE ||
+		     wr->opcode == IBV_WR_RDMA_WRITE_WITH_IMM) ?
+		    IBV_WC_RDMA_WRITE : IBV_WC_SEND;
+	wc.qp_num = qp->ibv_qp.qp_num;
+	lb_cq_add(lb_cq(qp->ibv_qp.send_cq), &wc);
+}
+
+/*
+ * A peer that sends and then closes leaves its last messages queued on
+ * the connection.  A device would have received them before its send
+ * retries ran out, so let the connection thread deliver them before the
+ * failed send moves the QP into the error state.  Stop early if the
+ * thread would have to wait for a receive to be posted.
+ */
+static void lb_conn_drain(struct lb_qp *qp, struct lb_conn *conn)
+{
+	struct timespec ts;
+	int rq_cnt;
+
+	pthread_mutex_lock(&lb.lock);
+	while (!conn->eof && !conn->closing) {
+		pthread_mutex_lock(&qp->lock);
+		rq_cnt = qp->rq_cnt;
+		pthread_mutex_unlock(&qp->lock);
+		if (!rq_cnt)
+			break;
+
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += 10000000;
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+		pthread_cond_timedwait(&lb.cond, &lb.lock, &ts);
+	}
+	pthread_mutex_unlock(&lb.lock);
+}
+
+static enum ibv_wc_status lb_send_wr(struct lb_qp *qp, struct ibv_send_wr *wr)
+{
+	struct iovec iov[LB_MAX_SGE + 1];
+	struct sockaddr_un addr;
+	struct msghdr msg;
+	struct lb_hdr hdr;
+	int i, ret;
+
+	memset(&hdr, 0, sizeof hdr);
+	hdr.type = (wr->opcode == IBV_WR_SEND ||
+		    wr->opcode == IBV_WR_SEND_WITH_IMM) ? LB_SEND : LB_WRITE;
+	hdr.with_imm = (wr->opcode == IBV_WR_SEND_WITH_IMM ||
+			wr->opcode == IBV_WR_RDMA_WRITE_WITH_IMM);
+	hdr.imm_data = wr->imm_data;
+	hdr.src_qp = qp->ibv_qp.qp_num;
+	if (hdr.type == LB_WRITE) {
+		hdr.addr = wr->wr.rdma.remote_addr;
+		hdr.rkey = wr->wr.rdma.rkey;
+	}
+
+	iov[0].iov_base = &hdr;
+	iov[0].iov_len = sizeof hdr;
+	for (i = 0; i < wr->num_sge; i++) {
+		iov[i + 1].iov_base = (void *) (uintptr_t) wr->sg_list[i].addr;
+		iov[i + 1].iov_len = wr->sg_list[i].length;
+		hdr.length += wr->sg_list[i].length;
+	}
+
+	if (qp->ibv_qp.qp_type == IBV_QPT_UD) {
+		/* Datagrams that cannot be delivered are silently dropped */
+		if (hdr.length <= LB_UD_MTU) {
+			memset(&msg, 0, sizeof msg);
+			msg.msg_name = &addr;
+			msg.msg_namelen = lb_qp_name(&addr, wr->wr.ud.remote_qpn);
+			msg.msg_iov = iov;
+			msg.msg_iovlen = wr->num_sge + 1;
+			sendmsg(qp->fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+		}
+		return IBV_WC_SUCCESS;
+	}
+
+	if (!qp->conn)
+		return IBV_WC_RETRY_EXC_ERR;
+
+	pthread_mutex_lock(&qp->conn->send_lock);
+	ret = lb_sendv(qp->conn->fd, iov, wr->num_sge + 1);
+	pthread_mutex_unlock(&qp->conn->send_lock);
+	if (ret) {
+		lb_conn_drain(qp, qp->conn);
+		return IBV_WC_RETRY_EXC_ERR;
+	}
+	return IBV_WC_SUCCESS;
+}
+
+static int lb_post_send(struct ibv_qp *ibqp, struct ibv_send_wr *wr,
+			struct ibv_send_wr **bad_wr)
+{
+	struct lb_qp *qp = lb_qp(ibqp);
+	enum ibv_wc_status status;
+	int ret = 0;
+
+	pthread_mutex_lock(&qp->send_lock);
+	for (; wr; wr = wr->next) {
+		if (wr->num_sge > LB_MAX_SGE ||
+		    (wr->opcode != IBV_WR_SEND &&
+		     wr->opcode != IBV_WR_SEND_WITH_IMM &&
+		     (ibqp->qp_type == IBV_QPT_UD ||
+		      (wr->opcode != IBV_WR_RDMA_WRITE &&
+		       wr->opcode != IBV_WR_RDMA_WRITE_WITH_IMM)))) {
+			ret = EINVAL;
+			break;
+		}
+
+		if (ibqp->state == IBV_QPS_ERR) {
+			status = IBV_WC_WR_FLUSH_ERR;
+		} else if (ibqp->state != IBV_QPS_RTS) {
+			ret = EINVAL;
+			break;
+		} else {
+			status = lb_send_wr(qp, wr);
+			if (status != IBV_WC_SUCCESS)
+				lb_qp_error(qp);
+		}
+		lb_complete_send(qp, wr, status);
+	}
+	pthread_mutex_unlock(&qp->send_lock);
+
+	if (ret)
+		*bad_wr = wr;
+	return ret;
+}
+
+static int lb_post_recv(struct ibv_qp *ibqp, struct ibv_recv_wr *wr,
+			struct ibv_recv_wr **bad_wr)
+{
+	struct lb_qp *qp = lb_qp(ibqp);
+	struct lb_rwqe *wqe;
+	int ret = 0;
+
+	pthread_mutex_lock(&qp->lock);
+	for (; wr; wr = wr->next) {
+		if (wr->num_sge > LB_MAX_SGE || qp->rq_cnt == qp->rq_size) {
+			ret = wr->num_sge > LB_MAX_SGE ? EINVAL : ENOMEM;
+			break;
+		}
+
+		wqe = &qp->rq[(qp->rq_head + qp->rq_cnt) % qp->rq_size];
+		wqe->wr_id = wr->wr_id;
+		wqe->num_sge = wr->num_sge;
+		memcpy(wqe->sge, wr->sg_list, sizeof(*wr->sg_list) * wr->num_sge);
+		qp->rq_cnt++;
+	}
+
+	if (ibqp->state == IBV_QPS_ERR)
+		lb_flush_rq(qp);
+	else
+		pthread_cond_signal(&qp->cond);
+	pthread_mutex_unlock(&qp->lock);
+
+	if (ret)
+		*bad_wr = wr;
+	return ret;
+}
+
+/*
+ * CQs
+ */
+static int lb_poll_cq(struct ibv_cq *ibcq, int num_entries, struct ibv_wc *wc)
+{
+	struct lb_cq *cq = lb_cq(ibcq);
+	int n;
+
+	pthread_mutex_lock(&cq->lock);
+	for (n = 0; n < num_entries && cq->cnt; n++) {
+		wc[n] = cq->wc[cq->head];
+		cq->head = (cq->head + 1) % cq->size;
+		cq->cnt--;
+	}
+	pthread_mutex_unlock(&cq->lock);
+	return n;
+}
+
+static int lb_req_notify_cq(struct ibv_cq *ibcq, int solicited_only)
+{
+	struct lb_cq *cq = lb_cq(ibcq);
+
+	pthread_mutex_lock(&cq->lock);
+	cq->armed = 1;
+	pthread_mutex_unlock(&cq->lock);
+	return 0;
+}
+
+static struct ibv_cq *lb_create_cq(int cqe, void *cq_context,
+				   struct ibv_comp_channel *channel)
+{
+	struct lb_cq *cq;
+
+	if (cqe <= 0 || cqe > LB_MAX_CQE ||
+	    (channel && !lb_verbs(channel->context))) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	cq = calloc(1, sizeof *cq);
+	if (!cq)
+		return NULL;
+
+	cq->wc = calloc(cqe, sizeof *cq->wc);
+	if (!cq->wc) {
+		free(cq);
+		return NULL;
+	}
+
+	cq->size = cqe;
+	pthread_mutex_init(&cq->lock, NULL);
+	cq->ibv_cq.context = &lb_context;
+	cq->ibv_cq.channel = channel;
+	cq->ibv_cq.cq_context = cq_context;
+	cq->ibv_cq.cqe = cqe;
+	if (channel)
+		channel->refcnt++;
+	return &cq->ibv_cq;
+}
+
+/* Removes any events for cq still queued on its channel */
+static void lb_purge_cq_events(struct lb_cq *cq)
+{
+	struct lb_comp_channel *chan;
+	struct lb_cq **events;
+	int avail, cnt, i, keep;
+
+	chan = container_of(cq->ibv_cq.channel, struct lb_comp_channel, channel);
+	pthread_mutex_lock(&chan->lock);
+	if (ioctl(chan->channel.fd, FIONREAD, &avail) || avail <= 0)
+		goto out;
+
+	events = malloc(avail);
+	if (!events)
+		goto out;
+
+	cnt = read(chan->channel.fd, events, avail);
+	cnt = cnt > 0 ? cnt / (int) sizeof *events : 0;
+	for (i = keep = 0; i < cnt; i++) {
+		if (events[i] != cq)
+			events[keep++] = events[i];
+	}
+	if (keep)
+		write(chan->notify_fd, events, keep * sizeof *events);
+	free(events);
+out:
+	pthread_mutex_unlock(&chan->lock);
+}
+
+static int lb_destroy_cq(struct ibv_cq *ibcq)
+{
+	struct lb_cq *cq = lb_cq(ibcq);
+
+	if (ibcq->channel) {
+		lb_purge_cq_events(cq);
+		ibcq->channel->refcnt--;
+	}
+	pthread_mutex_destroy(&cq->lock);
+	free(cq->wc);
+	free(cq);
+	return 0;
+}
+
+static struct ibv_comp_channel *lb_create_comp_channel(void)
+{
+	struct lb_comp_channel *chan;
+	int fd[2];
+
+	chan = calloc(1, sizeof *chan);
+	if (!chan)
+		return NULL;
+
+	if (pipe2(fd, O_CLOEXEC)) {
+		free(chan);
+		return NULL;
+	}
+
+	/* A full pipe already guarantees the reader will wake up */
+	fcntl(fd[1], F_SETFL, O_NONBLOCK);
+	pthread_mutex_init(&chan->lock, NULL);
+	chan->channel.context = &lb_context;
+	chan->channel.fd = fd[0];
+	chan->notify_fd = fd[1];
+	return &chan->channel;
+}
+
+static int lb_destroy_comp_channel(struct ibv_comp_channel *channel)
+{
+	struct lb_comp_channel *chan;
+
+	if (channel->refcnt)
+		return EBUSY;
+
+	chan = container_of(channel, struct lb_comp_channel, channel);
+	close(chan->channel.fd);
+	close(chan->notify_fd);
+	pthread_mutex_destroy(&chan->lock);
+	free(chan);
+	return 0;
+}
+
+/*
+ * Reads happen under the channel lock, so we wait for the pipe to become
+ * readable without it.  The fd may be set nonblocking by the caller.
+ */
+static int lb_get_cq_event(struct ibv_comp_channel *channel,
+			   struct ibv_cq **cq, void **cq_context)
+{
+	struct lb_comp_channel *chan;
+	struct lb_cq *lcq;
+	struct pollfd fds;
+	int avail, ret;
+
+	chan = container_of(channel, struct lb_comp_channel, channel);
+	fds.fd = channel->fd;
+	fds.events = POLLIN;
+	for (;;) {
+		pthread_mutex_lock(&chan->lock);
+		if (!ioctl(channel->fd, FIONREAD, &avail) &&
+		    avail >= (int) sizeof lcq) {
+			ret = read(channel->fd, &lcq, sizeof lcq);
+			pthread_mutex_unlock(&chan->lock);
+			if (ret != sizeof lcq)
+				return -1;
+			break;
+		}
+		pthread_mutex_unlock(&chan->lock);
+
+		if (fcntl(channel->fd, F_GETFL) & O_NONBLOCK) {
+			errno = EAGAIN;
+			return -1;
+		}
+		if (poll(&fds, 1, -1) < 0)
+			return -1;
+	}
+
+	*cq = &lcq->ibv_cq;
+	*cq_context = lcq->ibv_cq.cq_context;
+	return 0;
+}
+
+/*
+ * Memory regions, PDs and AHs
+ */
+static struct ibv_mr *lb_reg_mr(struct ibv_pd *pd, void *addr, size_t length,
+				int access)
+{
+	struct lb_mr *mr;
+	int key;
+
+	mr = calloc(1, sizeof *mr);
+	if (!mr)
+		return NULL;
+
+	pthread_rwlock_wrlock(&lb.mr_lock);
+	key = idx_insert(&lb.mr_idx, mr);
+	if (key >= 0 && idm_set(&lb.mr_map, key, mr) < 0) {
+		idx_remove(&lb.mr_idx, key);
+		key = -1;
+	}
+	pthread_rwlock_unlock(&lb.mr_lock);
+	if (key < 0) {
+		free(mr);
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	mr->ibv_mr.context = pd->context;
+	mr->ibv_mr.pd = pd;
+	mr->ibv_mr.addr = addr;
+	mr->ibv_mr.length = length;
+	mr->ibv_mr.lkey = key;
+	mr->ibv_mr.rkey = key;
+	mr->access = access;
+	return &mr->ibv_mr;
+}
+
+static int lb_dereg_mr(struct ibv_mr *ibmr)
+{
+	struct lb_mr *mr = container_of(ibmr, struct lb_mr, ibv_mr);
+
+	pthread_rwlock_wrlock(&lb.mr_lock);
+	idm_clear(&lb.mr_map, ibmr->rkey);
+	idx_remove(&lb.mr_idx, ibmr->rkey);
+	pthread_rwlock_unlock(&lb.mr_lock);
+	free(mr);
+	return 0;
+}
+
+static int lb_query_device(struct ibv_device_attr *attr)
+{
+	memset(attr, 0, sizeof *attr);
+	strcpy(attr->fw_ver, "0.0.0");
+	attr->node_guid = UCMA_LB_GUID;
+	attr->sys_image_guid = UCMA_LB_GUID;
+	attr->max_mr_size = ~0ULL;
+	attr->page_size_cap = 0xFFFFF000;
+	attr->max_qp = IDX_MAX_INDEX;
+	attr->max_qp_wr = LB_MAX_WR;
+	attr->max_sge = LB_MAX_SGE;
+	attr->max_cq = IDX_MAX_INDEX;
+	attr->max_cqe = LB_MAX_CQE;
+	attr->max_mr = IDX_MAX_INDEX;
+	attr->max_pd = IDX_MAX_INDEX;
+	attr->max_qp_rd_atom = 16;
+	attr->max_qp_init_rd_atom = 16;
+	attr->max_res_rd_atom = 16 * IDX_MAX_INDEX;
+	attr->max_ah = IDX_MAX_INDEX;
+	attr->max_pkeys = 1;
+	attr->phys_port_cnt = 1;
+	return 0;
+}
+
+static int lb_query_port(uint8_t port_num, struct ibv_port_attr *attr)
+{
+	if (port_num != 1)
+		return EINVAL;
+
+	memset(attr, 0, sizeof *attr);
+	attr->state = IBV_PORT_ACTIVE;
+	attr->max_mtu = IBV_MTU_4096;
+	attr->active_mtu = IBV_MTU_4096;
+	attr->gid_tbl_len = 1;
+	attr->max_msg_sz = 1 << 31;
+	attr->pkey_tbl_len = 1;
+	attr->lid = 1;
+	attr->sm_lid = 1;
+	attr->max_vl_num = 1;
+	attr->active_width = 2;
+	attr->active_speed = 1;
+	attr->phys_state = 5;
+	attr->link_layer = IBV_LINK_LAYER_INFINIBAND;
+	return 0;
+}
+
+/*
+ * Verbs issued by librdmacm go through these helpers.  Calls on the
+ * loopback device are handled above; everything else is passed to
+ * libibverbs.  libibverbs symbols are never overridden, so applications
+ * and real devices always see the library's own entry points.
+ */
+int ucma_ibv_query_device(struct ibv_context *context,
+			  struct ibv_device_attr *device_attr)
+{
+	if (lb_verbs(context))
+		return lb_query_device(device_attr);
+	return ibv_query_device(context, device_attr);
+}
+
+int ucma_ibv_query_port(struct ibv_context *context, uint8_t port_num,
+			struct ibv_port_attr *port_attr)
+{
+	if (lb_verbs(context))
+		return lb_query_port(port_num, port_attr);
+	return ibv_query_port(context, port_num, port_attr);
+}
+
+int ucma_ibv_query_gid(struct ibv_context *context, uint8_t port_num,
+		       int index, union ibv_gid *gid)
+{
+	if (!lb_verbs(context))
+		return ibv_query_gid(context, port_num, index, gid);
+
+	if (port_num != 1 || index)
+		return -1;
+	lb_gid(gid);
+	return 0;
+}
+
+int ucma_ibv_query_pkey(struct ibv_context *context, uint8_t port_num,
+			int index, uint16_t *pkey)
+{
+	if (!lb_verbs(context))
+		return ibv_query_pkey(context, port_num, index, pkey);
+
+	if (port_num != 1 || index)
+		return -1;
+	*pkey = htons(0xffff);
+	return 0;
+}
+
+int ucma_ibv_close_device(struct ibv_context *context)
+{
+	if (lb_verbs(context))
+		return 0;
+	return ibv_close_device(context);
+}
+
+struct ibv_pd *ucma_ibv_alloc_pd(struct ibv_context *context)
+{
+	struct ibv_pd *pd;
+
+	if (!lb_verbs(context))
+		return ibv_alloc_pd(context);
+
+	pd = calloc(1, sizeof *pd);
+	if (pd)
+		pd->context = context;
+	return pd;
+}
+
+int ucma_ibv_dealloc_pd(struct ibv_pd *pd)
+{
+	if (!lb_verbs(pd->context))
+		return ibv_dealloc_pd(pd);
+
+	free(pd);
+	return 0;
+}
+
+struct ibv_mr *ucma_ibv_reg_mr(struct ibv_pd *pd, void *addr,
+			       size_t length, int access)
+{
+	if (lb_verbs(pd->context))
+		return lb_reg_mr(pd, addr, length, access);
+	return ibv_reg_mr(pd, addr, length, access);
+}
+
+int ucma_ibv_dereg_mr(struct ibv_mr *mr)
+{
+	if (lb_verbs(mr->context))
+		return lb_dereg_mr(mr);
+	return ibv_dereg_mr(mr);
+}
+
+struct ibv_comp_channel *ucma_ibv_create_comp_channel(struct ibv_context *context)
+{
+	if (lb_verbs(context))
+		return lb_create_comp_channel();
+	return ibv_create_comp_channel(context);
+}
+
+int ucma_ibv_destroy_comp_channel(struct ibv_comp_channel *channel)
+{
+	if (lb_verbs(channel->context))
+		return lb_destroy_comp_channel(channel);
+	return ibv_destroy_comp_channel(channel);
+}
+
+struct ibv_cq *ucma_ibv_create_cq(struct ibv_context *context, int cqe,
+				  void *cq_context,
+				  struct ibv_comp_channel *channel,
+				  int comp_vector)
+{
+	if (lb_verbs(context))
+		return lb_create_cq(cqe, cq_context, channel);
+	return ibv_create_cq(context, cqe, cq_context, channel, comp_vector);
+}
+
+int ucma_ibv_destroy_cq(struct ibv_cq *cq)
+{
+	if (lb_verbs(cq->context))
+		return lb_destroy_cq(cq);
+	return ibv_destroy_cq(cq);
+}
+
+int ucma_ibv_get_cq_event(struct ibv_comp_channel *channel,
+			  struct ibv_cq **cq, void **cq_context)
+{
+	if (lb_verbs(channel->context))
+		return lb_get_cq_event(channel, cq, cq_context);
+	return ibv_get_cq_event(channel, cq, cq_context);
+}
+
+void ucma_ibv_ack_cq_events(struct ibv_cq *cq, unsigned int nevents)
+{
+	if (!lb_verbs(cq->context))
+		ibv_ack_cq_events(cq, nevents);
+}
+
+struct ibv_qp *ucma_ibv_create_qp(struct ibv_pd *pd,
+				  struct ibv_qp_init_attr *qp_init_attr)
+{
+	if (lb_verbs(pd->context))
+		return lb_create_qp(pd, qp_init_attr);
+	return ibv_create_qp(pd, qp_init_attr);
+}
+
+struct ibv_qp *ucma_ibv_create_qp_ex(struct ibv_context *context,
+				     struct ibv_qp_init_attr_ex *qp_init_attr_ex)
+{
+	if (!lb_verbs(context))
+		return ibv_create_qp_ex(context, qp_init_attr_ex);
+
+	if (qp_init_attr_ex->comp_mask != IBV_QP_INIT_ATTR_PD) {
+		errno = ENOSYS;
+		return NULL;
+	}
+	return lb_create_qp(qp_init_attr_ex->pd,
+			    (struct ibv_qp_init_attr *) qp_init_attr_ex);
+}
+
+int ucma_ibv_modify_qp(struct ibv_qp *qp, struct ibv_qp_attr *attr,
+		       int attr_mask)
+{
+	if (lb_verbs(qp->context))
+		return lb_modify_qp(qp, attr, attr_mask);
+	return ibv_modify_qp(qp, attr, attr_mask);
+}
+
+int ucma_ibv_destroy_qp(struct ibv_qp *qp)
+{
+	if (lb_verbs(qp->context))
+		return lb_destroy_qp(qp);
+	return ibv_destroy_qp(qp);
+}
+
+struct ibv_ah *ucma_ibv_create_ah(struct ibv_pd *pd,
+				  struct ibv_ah_attr *attr)
+{
+	struct ibv_ah *ah;
+
+	if (!lb_verbs(pd->context))
+		return ibv_create_ah(pd, attr);
+
+	ah = calloc(1, sizeof *ah);
+	if (ah) {
+		ah->context = pd->context;
+		ah->pd = pd;
+	}
+	return ah;
+}
+
+int ucma_ibv_destroy_ah(struct ibv_ah *ah)
+{
+	if (!lb_verbs(ah->context))
+		return ibv_destroy_ah(ah);
+
+	free(ah);
+	return 0;
+}
+
+int ucma_ibv_attach_mcast(struct ibv_qp *qp, const union ibv_gid *gid,
+			  uint16_t lid)
+{
+	if (lb_verbs(qp->context))
+		return ENOSYS;
+	return ibv_attach_mcast(qp, gid, lid);
+}
+
+int ucma_ibv_detach_mcast(struct ibv_qp *qp, const union ibv_gid *gid,
+			  uint16_t lid)
+{
+	if (lb_verbs(qp->context))
+		return ENOSYS;
+	return ibv_detach_mcast(qp, gid, lid);
+}
@@ -48,6 +48,13 @@
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/random.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/uio.h>
 #include <search.h>
 
 #include <rdma/rdma_cma.h>
@@ -64,6 +71,12 @@
 #define RS_QP_CTRL_SIZE 4	/* must be power of 2 */
 #define RS_CONN_RETRIES 6
 #define RS_SGL_SIZE 2
+#define RS_REC_MAX_SIZE (1 << 20)
+#define RS_ACCEPT_POOL_MAX 1024
+#define RS_ACCEPT_SHARDS_MAX 64
+#define RS_REAPER_IDLE 1	/* seconds before an idle reaper thread exits */
+#define RS_REAPER_WAIT 5	/* seconds to wait for the reaper at unload */
+#define RS_BULK_PENDING 64
 static struct index_map idm;
 static pthread_mutex_t mut = PTHREAD_MUTEX_INITIALIZER;
 
@@ -75,7 +88,10 @@ enum {
 	RS_SVC_REM_DGRAM,
 	RS_SVC_ADD_KEEPALIVE,
 	RS_SVC_REM_KEEPALIVE,
-	RS_SVC_MOD_KEEPALIVE
+	RS_SVC_MOD_KEEPALIVE,
+	RS_SVC_WAKE_KEEPALIVE,
+	RS_SVC_ADD_ACCEPT,
+	RS_SVC_REM_ACCEPT
 };
 
 struct rs_svc_msg {
@@ -91,6 +107,10 @@ struct rs_svc {
 	int size;
 	int context_size;
 	void *(*run)(void *svc);
+	/* handles cmd without the service thread, or returns -1 */
+	int (*notify)(struct rs_svc *svc, struct rsocket *rs, int cmd);
+	/* protects cnt, if notify changes it outside the service thread */
+	pthread_mutex_t *cnt_lock;
 	struct rsocket **rss;
 	void *contexts;
 };
@@ -101,11 +121,19 @@ static struct rs_svc udp_svc = {
 	.context_size = sizeof(*udp_svc_fds),
 	.run = udp_svc_run
 };
-static uint32_t *tcp_svc_timeouts;
 static void *tcp_svc_run(void *arg);
+static int tcp_svc_notify(struct rs_svc *svc, struct rsocket *rs, int cmd);
+static pthread_mutex_t keepalive_lock = PTHREAD_MUTEX_INITIALIZER;
 static struct rs_svc tcp_svc = {
-	.context_size = sizeof(*tcp_svc_timeouts),
-	.run = tcp_svc_run
+	.run = tcp_svc_run,
+	.notify = tcp_svc_notify,
+	.cnt_lock = &keepalive_lock
+};
+static struct pollfd *accept_svc_fds;
+static void *accept_svc_run(void *arg);
+static struct rs_svc accept_svc = {
+	.context_size = sizeof(*accept_svc_fds),
+	.run = accept_svc_run
 };
 
 static uint16_t def_iomap_size = 0;
@@ -114,7 +142,15 @@ static uint16_t def_sqsize = 384;
 static uint16_t def_rqsize = 384;
 static uint32_t def_mem = (1 << 17);
 static uint32_t def_wmem = (1 << 17);
+static uint32_t def_rec_size = 0;
+static int def_accept_pool = 0;
+static int def_accept_shards = 0;
+static int def_async_close = 0;
+static uint32_t route_cache_ttl = 0;
+static int latency_stats = 0;
 static uint32_t polling_time = 10;
+static int shared_comp_channel = 0;
+static int local_fastpath = 1;
 
 /*
  * Immediate data format is determined by the upper bits
@@ -200,17 +236,29 @@ struct rs_iomap_mr {
 #define rs_host_is_net()   (1 == htonl(1))
 #define RS_CONN_FLAG_NET   (1 << 0)
 #define RS_CONN_FLAG_IOMAP (1 << 1)
+#define RS_CONN_FLAG_LOCAL (1 << 2)
+#define RS_CONN_FLAG_DATA  (1 << 3)
 
 struct rs_conn_data {
 	uint8_t		  version;
 	uint8_t		  flags;
 	uint16_t	  credits;
-	uint8_t		  reserved[3];
+	uint8_t		  data_len;	/* valid with RS_CONN_FLAG_DATA */
+	uint8_t		  reserved[2];
 	uint8_t		  target_iomap_size;
 	struct rs_sge	  target_sgl;
 	struct rs_sge	  data_buf;
+	uint64_t	  local_nonce;	/* valid with RS_CONN_FLAG_LOCAL */
 };
 
+/*
+ * Private data left to rsockets in an IB CM REQ and REP.  Other
+ * transports allow more.
+ */
+#define RS_CONN_REQ_SIZE   56
+#define RS_CONN_REP_SIZE   196
+#define RS_CONN_DATA_MAX   148
+
 struct rs_conn_private_data {
 	union {
 		struct rs_conn_data		conn_data;
@@ -219,6 +267,7 @@ struct rs_conn_private_data {
 			struct rs_conn_data	conn_data;
 		} af_ib;
 	};
+	uint8_t		  data[RS_CONN_DATA_MAX];
 };
 
 /*
@@ -249,6 +298,29 @@ enum rs_state {
  */
 #define RS_OPT_MSG_SEND   (1 << 1)
 #define RS_OPT_SVC_ACTIVE (1 << 2)
+/*
+ * The application only accesses the rsocket from a single thread, so the
+ * stream data path skips the slock, rlock, cq_lock and cq_wait_lock.
+ * This excludes keepalive, which is driven from the service thread.
+ */
+#define RS_OPT_SINGLE_THREAD (1 << 3)
+/* A sharded listener picks the shard by peer address, not round-robin */
+#define RS_OPT_ACCEPT_HASH (1 << 4)
+/* rclose leaves the disconnect and teardown to the reaper thread */
+#define RS_OPT_ASYNC_CLOSE (1 << 5)
+/* SO_LINGER was enabled by the application */
+#define RS_OPT_LINGER	  (1 << 6)
+/* The path came from RDMA_ROUTE or the route cache, see rs_route_lookup */
+#define RS_OPT_ROUTE_SET  (1 << 7)
+
+/*
+ * State of the user visible event fd.  See rs_update_evfd.
+ */
+#define RS_EV_CM_CHANNEL  (1 << 0)
+#define RS_EV_CQ_CHANNEL  (1 << 1)
+#define RS_EV_WANT_SEND   (1 << 2)
+#define RS_EV_SIGNALED    (1 << 3)
+#define RS_EV_LOCAL       (1 << 4)
 
 union socket_addr {
 	struct sockaddr		sa;
@@ -293,97 +365,564 @@ struct ds_qp {
 	int		  cq_armed;
 };
 
+/*
+ * Completion channel shared by all stream rsockets on a device.  See
+ * rs_get_shared_cq_event.
+ */
+struct rs_comp_channel {
+	struct rs_comp_channel	*next;
+	struct ibv_context	*verbs;
+	struct ibv_comp_channel	*channel;
+	pthread_mutex_t		mut;
+	pthread_cond_t		cond;
+	int			kick;
+	int			polling;
+	int			refcnt;
+};
+
+static struct rs_comp_channel *comp_channel_list;
+
+/*
+ * Transport specific data path operations.  IB and RoCE transfer rsocket
+ * messages as RDMA write with immediate data, while iWarp uses a write
+ * followed by an inline send (RS_OPT_MSG_SEND).  The credit updates also
+ * depend on whether the peer uses a different byte order (RS_OPT_SWAP_SGL).
+ * The operations are selected by rs_set_ops whenever those options change,
+ * so that the data path does not need to test them.
+ */
+struct rsocket;
+struct rs_ops {
+	int	(*post_recv)(struct rsocket *rs);
+	int	(*post_msg)(struct rsocket *rs, uint32_t msg);
+	int	(*post_write_msg)(struct rsocket *rs, struct ibv_sge *sgl,
+				  int nsge, uint32_t msg, int flags,
+				  uint64_t addr, uint32_t rkey);
+	int	(*can_send)(struct rsocket *rs);
+	void	(*update_credits)(struct rsocket *rs);
+	int	msg_sqe;	/* send queue entries used per message */
+};
+
+/*
+ * Counters reported through RDMA_STATS, RDMA_SEND_STALLS and the shared
+ * memory statistics.  Each group is updated under the lock of the rsocket
+ * section that it describes.  It is kept in that section, or in the
+ * rsocket's shared memory slot when shm_stats is enabled.
+ */
+enum rs_send_wait {
+	RS_WAIT_SQE,		/* no send queue entries */
+	RS_WAIT_SBUF,		/* send buffer full */
+	RS_WAIT_CREDITS,	/* no receive credits from the peer */
+	RS_WAIT_TARGET,		/* no space in the peer's receive buffer */
+	RS_WAIT_MAX = RSOCKET_SEND_WAITS
+};
+
+/* Send stalls of all rsockets in the process, protected by mut */
+static struct rsocket_send_counters send_stalls_local;
+static struct rsocket_send_counters *send_stalls = &send_stalls_local;
+
+/* Shared memory statistics segment, see rs_shm_init */
+static struct rsocket_shm *rs_shm;
+static uint32_t shm_stats;
+
+/*
+ * The rsocket is split into cache line aligned sections, so that threads
+ * sending and receiving on the same rsocket do not false share.  Fields
+ * that are only set during connection setup are kept with the hot fields
+ * that read them, and configuration and bookkeeping data is kept last.
+ */
+#define RS_CACHE_LINE	64
+#define rs_cache_aligned __attribute__((aligned(RS_CACHE_LINE)))
+
+/*
+ * When both ends of a connection are on the same host, data is carried
+ * through a shared memory segment instead of the QP.  The connecting side
+ * offers a random nonce in its private data and listens on an abstract
+ * unix socket named by the nonce's upper half, its local_id.  The
+ * accepting side connects to that socket, passes it the whole nonce and a
+ * memory segment holding one byte ring per direction, and accepts the
+ * RDMA connection with RS_CONN_FLAG_LOCAL set.  Deriving the name from
+ * the nonce keeps both in the 8 bytes that an IB connection request has
+ * left for RDMA_CONN_DATA.  The socket name can be seen, but the lower 32
+ * bits of the nonce only travel in the private data, and each side also
+ * requires the other to run as the same user.  The unix socket then
+ * serves as a doorbell: a side arms it before sleeping, and the peer only
+ * writes to it after updating a ring while it is armed.  The QP stays
+ * connected but idle.
+ */
+#define RS_LOCAL_MAGIC	  0x72736c63
+#define RS_LOCAL_VERSION  1
+#define RS_LOCAL_BACKLOG  4
+
+struct rs_local_ring {
+	/* written by the sender */
+	volatile uint32_t head rs_cache_aligned;
+	volatile uint32_t ctrl;
+	/* written by the receiver */
+	volatile uint32_t tail rs_cache_aligned;
+};
+
+/* ring[0] carries data from the connecting side to the accepting side */
+struct rs_local_seg {
+	uint32_t	  magic;
+	uint32_t	  version;
+	uint64_t	  local_id;
+	uint32_t	  size;
+	volatile uint32_t armed[2] rs_cache_aligned;
+	struct rs_local_ring ring[2];
+};
+
+struct rs_local {
+	struct rs_local_seg *seg;
+	size_t		  seg_size;
+	struct rs_local_ring *sring;
+	struct rs_local_ring *rring;
+	uint8_t		  *sdata;
+	uint8_t		  *rdata;
+	uint32_t	  size;
+	int		  side;
+	int		  fd;
+	int		  peer_gone;
+	uint32_t	  ctrl;		/* last control message processed */
+};
+
 struct rsocket {
+	/* read mostly */
 	int		  type;
 	int		  index;
-	fastlock_t	  slock;
-	fastlock_t	  rlock;
-	fastlock_t	  cq_lock;
-	fastlock_t	  cq_wait_lock;
-	fastlock_t	  map_lock; /* acquire slock first if needed */
-
+	int		  opts;
+	int		  fd_flags;
+	int		  state;
+	int		  err;
+	int		  evfd;
+	uint32_t	  sbuf_size;
+	uint16_t	  sq_size;
+	uint16_t	  sq_inline;
+	uint32_t	  rbuf_size;
+	uint16_t	  rq_size;
+	const struct rs_ops *ops;
+	struct rs_local	  *local;
+	struct rsocket_rec_entry *rec;
+	uint32_t	  rec_mask;
 	union {
 		/* data stream */
 		struct {
 			struct rdma_cm_id *cm_id;
-			uint64_t	  tcp_opts;
-			unsigned int	  keepalive_time;
+			struct ibv_mr	  *rmr;
+			uint8_t		  *rbuf;
+			struct ibv_mr	  *smr;
+		};
+		/* datagram */
+		struct {
+			struct ds_qp	  *qp_list;
+			int		  udp_sock;
+			int		  epfd;
+		};
+	};
+	uint8_t		  *sbuf;
+	union {
+		struct rs_msg	  *rmsg;
+		struct ds_rmsg	  *dmsg;
+	};
 
-			unsigned int	  ctrl_seqno;
-			unsigned int	  ctrl_max_seqno;
+	/* completion processing, protected by cq_lock */
+	fastlock_t	  cq_lock rs_cache_aligned;
+	fastlock_t	  cq_wait_lock;
+	int		  cq_armed;
+	int		  unack_cqe;
+	int		  rmsg_tail;
+	unsigned int	  ctrl_seqno;
+	unsigned int	  ctrl_max_seqno;
+	uint16_t	  sseq_comp;
+	uint16_t	  rseq_comp;
+	int		  rbuf_msg_index;
+	int		  rbuf_free_offset;
+	int		  remote_sge;
+	struct rs_sge	  remote_sgl;
+	struct rsocket_cq_counters *cq_stats;
+	struct rsocket_cq_counters cq_counters;
+
+	/* send side, protected by slock */
+	fastlock_t	  slock rs_cache_aligned;
+	fastlock_t	  map_lock; /* acquire slock first if needed */
+	int		  sqe_avail;
+	int		  iomap_pending;
+	int		  ev_want_send;
+	union {
+		/* data stream */
+		struct {
 			uint16_t	  sseq_no;
-			uint16_t	  sseq_comp;
-			uint16_t	  rseq_no;
-			uint16_t	  rseq_comp;
-
-			int		  remote_sge;
-			struct rs_sge	  remote_sgl;
-			struct rs_sge	  remote_iomap;
-
-			struct ibv_mr	  *target_mr;
+			int		  sbuf_bytes_avail;
 			int		  target_sge;
-			int		  target_iomap_size;
-			void		  *target_buffer_list;
 			volatile struct rs_sge	  *target_sgl;
 			struct rs_iomap   *target_iomap;
-
-			int		  rbuf_msg_index;
-			int		  rbuf_bytes_avail;
-			int		  rbuf_free_offset;
-			int		  rbuf_offset;
-			struct ibv_mr	  *rmr;
-			uint8_t		  *rbuf;
-
-			int		  sbuf_bytes_avail;
-			struct ibv_mr	  *smr;
 			struct ibv_sge	  ssgl[2];
 		};
 		/* datagram */
 		struct {
-			struct ds_qp	  *qp_list;
 			void		  *dest_map;
 			struct ds_dest    *conn_dest;
+			struct ds_smsg	  *smsg_free;
+		};
+	};
+	struct rsocket_send_counters *send_stats;
+	struct rsocket_send_counters send_counters;
 
-			int		  udp_sock;
-			int		  epfd;
+	/* receive side, protected by rlock */
+	fastlock_t	  rlock rs_cache_aligned;
+	int		  rmsg_head;
+	struct rsocket_recv_counters *recv_stats;
+	struct rsocket_recv_counters recv_counters;
+	union {
+		/* data stream */
+		struct {
+			uint16_t	  rseq_no;
+			int		  rbuf_bytes_avail;
+			int		  rbuf_offset;
+		};
+		/* datagram */
+		struct {
 			int		  rqe_avail;
-			struct ds_smsg	  *smsg_free;
 		};
 	};
 
-	int		  opts;
-	int		  fd_flags;
+	/* configuration and setup */
+	uint64_t	  tcp_opts rs_cache_aligned;
 	uint64_t	  so_opts;
 	uint64_t	  ipv6_opts;
+	unsigned int	  keepalive_time;
+	uint32_t	  keepalive_due;	/* keepalive_lock protects these */
+	uint16_t	  keepalive_slot;
+	dlist_entry	  keepalive_entry;
+	int		  target_iomap_size;
+	struct rs_sge	  remote_iomap;
+	struct ibv_mr	  *target_mr;
+	void		  *target_buffer_list;
 	void		  *optval;
 	size_t		  optlen;
-	int		  state;
-	int		  cq_armed;
 	int		  retries;
-	int		  err;
-
-	int		  sqe_avail;
-	uint32_t	  sbuf_size;
-	uint16_t	  sq_size;
-	uint16_t	  sq_inline;
-
-	uint32_t	  rbuf_size;
-	uint16_t	  rq_size;
-	int		  rmsg_head;
-	int		  rmsg_tail;
-	union {
-		struct rs_msg	  *rmsg;
-		struct ds_rmsg	  *dmsg;
-	};
-
-	uint8_t		  *sbuf;
 	struct rs_iomap_mr *remote_iomappings;
 	dlist_entry	  iomap_list;
 	dlist_entry	  iomap_queue;
-	int		  iomap_pending;
-	int		  unack_cqe;
+	struct rs_comp_channel *shared_chan;
+	struct rsocket_shm_sock *shm_sock;
+	atomic_t	  rec_head;
+	uint32_t	  rec_size;
+	int		  rec_dump;	/* error dump waiting, see rs_set_state */
+	uint64_t	  conn_start;	/* start of current connect phase */
+	int		  local_fd;	/* listening for the local data path */
+	uint64_t	  local_id;
+	uint64_t	  local_nonce;
+	int		  accept_pool_size;
+	struct rs_accept_pool *accept_pool;
+	struct rsocket_pool *pool;	/* set by rpool_connect */
+	int		  accept_shard_cnt;
+	struct rs_accept_shards *accept_shards;
+	dlist_entry	  accept_entry;	/* on a shard or the ready queue */
+	dlist_entry	  close_entry;	/* on the reaper's queue */
+	void		  *conn_sdata;	/* RDMA_CONN_DATA, sent when connecting */
+	uint8_t		  conn_slen;
+	uint8_t		  conn_sent;	/* conn_sdata went with the request */
+	int		  conn_sflush;	/* a thread is sending conn_sdata */
+	uint8_t		  conn_rlen;	/* conn_rlen and conn_roff use rlock */
+	uint8_t		  conn_roff;
+	void		  *conn_rdata;	/* peer's connection data, not yet read */
+	/* counter values at the last RDMA_STATS_RESET */
+	struct rsocket_send_counters send_base;
+	struct rsocket_recv_counters recv_base;
+	struct rsocket_cq_counters cq_base;
+
+	int		  ev_notify;
+	int		  ev_flags;
+};
+
+static void rs_update_evfd(struct rsocket *rs);
+static void rs_set_ops(struct rsocket *rs);
+static int rs_conn_data_flush(struct rsocket *rs, int flags);
+
+static inline void rs_lock(struct rsocket *rs, fastlock_t *lock)
+{
+	if (!(rs->opts & RS_OPT_SINGLE_THREAD))
+		fastlock_acquire(lock);
+}
+
+static inline void rs_unlock(struct rsocket *rs, fastlock_t *lock)
+{
+	if (!(rs->opts & RS_OPT_SINGLE_THREAD))
+		fastlock_release(lock);
+}
+
+/*
+ * Latency histograms are kept per thread, so recording never contends.
+ * Threads register their histograms on first use, and the histograms of
+ * exited threads are folded into lat_exited.  The list and lat_exited
+ * are protected by mut.
+ */
+struct rs_lat_thread {
+	dlist_entry		entry;
+	struct rsocket_latency	op[RSOCKET_LAT_MAX];
 };
 
+static __thread struct rs_lat_thread *rs_lat;
+static pthread_key_t lat_key;
+static dlist_entry lat_list = { &lat_list, &lat_list };
+static struct rsocket_latency_stats lat_exited;
+
+static uint64_t rs_time_ns(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static void rs_lat_add(struct rsocket_latency *dst, struct rsocket_latency *src)
+{
+	int i;
+
+	dst->count += src->count;
+	dst->sum_ns += src->sum_ns;
+	if (src->max_ns > dst->max_ns)
+		dst->max_ns = src->max_ns;
+	for (i = 0; i < RSOCKET_LAT_BUCKETS; i++)
+		dst->hist[i] += src->hist[i];
+}
+
+static void rs_lat_exit(void *arg)
+{
+	struct rs_lat_thread *lat = arg;
+	int i;
+
+	pthread_mutex_lock(&mut);
+	for (i = 0; i < RSOCKET_LAT_MAX; i++)
+		rs_lat_add(&lat_exited.op[i], &lat->op[i]);
+	dlist_remove(&lat->entry);
+	pthread_mutex_unlock(&mut);
+	free(lat);
+}
+
+static struct rs_lat_thread *rs_lat_alloc(void)
+{
+	struct rs_lat_thread *lat;
+
+	lat = calloc(1, sizeof *lat);
+	if (!lat)
+		return NULL;
+
+	pthread_mutex_lock(&mut);
+	dlist_insert_tail(&lat->entry, &lat_list);
+	pthread_mutex_unlock(&mut);
+	pthread_setspecific(lat_key, lat);
+	rs_lat = lat;
+	return lat;
+}
+
+static inline int rs_lat_bucket(uint64_t ns)
+{
+	int msb, bucket;
+
+	if (ns < (1 << RSOCKET_LAT_SUB_BITS))
+		return (int) ns;
+
+	msb = 63 - __builtin_clzll(ns);
+	bucket = ((msb - RSOCKET_LAT_SUB_BITS + 1) << RSOCKET_LAT_SUB_BITS) +
+		 (int) ((ns >> (msb - RSOCKET_LAT_SUB_BITS)) &
+			((1 << RSOCKET_LAT_SUB_BITS) - 1));
+	return min(bucket, RSOCKET_LAT_BUCKETS - 1);
+}
+
+/* Returns 0 if latency statistics are disabled */
+static inline uint64_t rs_lat_start(void)
+{
+	return latency_stats ? rs_time_ns() : 0;
+}
+
+static inline void rs_lat_end(int op, uint64_t start)
+{
+	struct rs_lat_thread *lat;
+	struct rsocket_latency *l;
+	uint64_t ns;
+
+	if (!start)
+		return;
+
+	lat = rs_lat ? rs_lat : rs_lat_alloc();
+	if (!lat)
+		return;
+
+	ns = rs_time_ns() - start;
+	l = &lat->op[op];
+	l->count++;
+	l->sum_ns += ns;
+	if (ns > l->max_ns)
+		l->max_ns = ns;
+	l->hist[rs_lat_bucket(ns)]++;
+}
+
+int rget_latency_stats(struct rsocket_latency_stats *stats)
+{
+	struct rs_lat_thread *lat;
+	dlist_entry *entry;
+	int i;
+
+	if (!latency_stats)
+		return ERR(ENOTSUP);
+
+	pthread_mutex_lock(&mut);
+	*stats = lat_exited;
+	for (entry = lat_list.next; entry != &lat_list; entry = entry->next) {
+		lat = container_of(entry, struct rs_lat_thread, entry);
+		for (i = 0; i < RSOCKET_LAT_MAX; i++)
+			rs_lat_add(&stats->op[i], &lat->op[i]);
+	}
+	pthread_mutex_unlock(&mut);
+	return 0;
+}
+
+static uint32_t rs_rec_entries(uint32_t entries)
+{
+	uint32_t size;
+
+	if (!entries)
+		return 0;
+
+	entries = min(entries, RS_REC_MAX_SIZE);
+	for (size = 1; size < entries; size <<= 1)
+		;
+	return size;
+}
+
+/*
+ * Events are recorded from both the send and completion paths, which run
+ * under different locks.  Each writer claims an entry by advancing
+ * rec_head, so recording never blocks.  Fields read from other sections
+ * are a best effort snapshot.
+ */
+static inline void rs_record(struct rsocket *rs, int event, uint32_t msg)
+{
+	struct rsocket_rec_entry *entry;
+
+	if (!rs->rec)
+		return;
+
+	entry = &rs->rec[((uint32_t) atomic_inc(&rs->rec_head) - 1) & rs->rec_mask];
+	entry->time_us = fastlock_time_us();
+	entry->event = event;
+	entry->op = rs_msg_op(msg);
+	entry->data = rs_msg_data(msg);
+	entry->sseq_no = rs->sseq_no;
+	entry->sseq_comp = rs->sseq_comp;
+	entry->rseq_no = rs->rseq_no;
+	entry->rseq_comp = rs->rseq_comp;
+	entry->sqe_avail = rs->sqe_avail;
+	entry->sbuf_bytes_avail = rs->sbuf_bytes_avail;
+	entry->rbuf_bytes_avail = rs->rbuf_bytes_avail;
+}
+
+/*
+ * Files under /tmp and /dev/shm have predictable names, so they are only
+ * created new, never through a link, and are private to the user.  An
+ * earlier file with the same name, from this rsocket or a process that
+ * had our pid, is replaced.  The sticky bit keeps us from removing
+ * another user's file.
+ */
+static int rs_create_file(const char *path)
+{
+	int fd;
+
+	fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC,
+		  0600);
+	if (fd < 0 && errno == EEXIST) {
+		unlink(path);
+		fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW |
+			  O_CLOEXEC, 0600);
+	}
+	return fd;
+}
+
+static int rs_rec_dump(struct rsocket *rs)
+{
+	struct rsocket_rec_header hdr;
+	struct sockaddr *addr;
+	struct iovec iov[3];
+	uint32_t head, first;
+	char path[64];
+	ssize_t len;
+	int fd;
+
+	if (!rs->rec)
+		return ERR(EINVAL);
+
+	memset(&hdr, 0, sizeof hdr);
+	hdr.magic = RSOCKET_REC_MAGIC;
+	hdr.version = RSOCKET_REC_VERSION;
+	hdr.entry_size = sizeof(struct rsocket_rec_entry);
+	hdr.pid = getpid();
+	hdr.index = rs->index;
+	hdr.size = rs->rec_mask + 1;
+	head = (uint32_t) atomic_get(&rs->rec_head);
+	hdr.total = head;
+	hdr.count = min(head, hdr.size);
+	if (rs->cm_id) {
+		addr = rdma_get_local_addr(rs->cm_id);
+		memcpy(&hdr.src_addr, addr, ucma_addrlen(addr));
+		addr = rdma_get_peer_addr(rs->cm_id);
+		memcpy(&hdr.dst_addr, addr, ucma_addrlen(addr));
+	}
+
+	first = (head - hdr.count) & rs->rec_mask;
+	iov[0].iov_base = &hdr;
+	iov[0].iov_len = sizeof hdr;
+	iov[1].iov_base = &rs->rec[first];
+	iov[1].iov_len = min(hdr.count, hdr.size - first) * sizeof(*rs->rec);
+	iov[2].iov_base = rs->rec;
+	iov[2].iov_len = hdr.count * sizeof(*rs->rec) - iov[1].iov_len;
+
+	snprintf(path, sizeof path, RSOCKET_REC_PREFIX "%d.%d", hdr.pid, rs->index);
+	fd = rs_create_file(path);
+	if (fd < 0)
+		return fd;
+
+	len = writev(fd, iov, 3);
+	close(fd);
+	if (len < 0)
+		return -1;
+
+	return (len == iov[0].iov_len + iov[1].iov_len + iov[2].iov_len) ?
+		0 : ERR(EIO);
+}
+
+static inline void rs_set_state(struct rsocket *rs, int state)
+{
+	int old_state = rs->state;
+
+	rdma_probe3(rs_state, rs->index, old_state, state);
+	rs->state = state;
+	rs_record(rs, RSOCKET_REC_STATE, state);
+	if (rs->rec && state == rs_error && old_state != rs_error)
+		rs->rec_dump = 1;
+}
+
+/*
+ * Errors are found while processing completions under cq_lock, so the
+ * dump is written by rs_process_cq once it drops the lock.
+ */
+static void rs_rec_dump_pending(struct rsocket *rs)
+{
+	if (__sync_bool_compare_and_swap(&rs->rec_dump, 1, 0))
+		rs_rec_dump(rs);
+}
+
+/* Forgets the recorded events, when a pooled rsocket changes users */
+static void rs_rec_reset(struct rsocket *rs)
+{
+	if (!rs->rec)
+		return;
+
+	rs->rec_dump = 0;
+	atomic_set(&rs->rec_head, 0);
+	memset(rs->rec, 0, sizeof(*rs->rec) * (rs->rec_mask + 1));
+}
+
 #define DS_UDP_TAG 0x55555555
 
 struct ds_udp_header {
@@ -423,13 +962,32 @@ static void ds_remove_qp(struct rsocket *rs, struct ds_qp *qp)
 	}
 }
 
+static int rs_svc_cnt(struct rs_svc *svc)
+{
+	int cnt;
+
+	if (!svc->cnt_lock)
+		return svc->cnt;
+
+	pthread_mutex_lock(svc->cnt_lock);
+	cnt = svc->cnt;
+	pthread_mutex_unlock(svc->cnt_lock);
+	return cnt;
+}
+
 static int rs_notify_svc(struct rs_svc *svc, struct rsocket *rs, int cmd)
 {
 	struct rs_svc_msg msg;
 	int ret;
 
+	if (svc->notify) {
+		ret = svc->notify(svc, rs, cmd);
+		if (ret >= 0)
+			return rdma_seterrno(ret);
+	}
+
 	pthread_mutex_lock(&mut);
-	if (!svc->cnt) {
+	if (!rs_svc_cnt(svc)) {
 		ret = socketpair(AF_UNIX, SOCK_STREAM, 0, svc->sock);
 		if (ret)
 			goto unlock;
@@ -447,7 +1005,7 @@ static int rs_notify_svc(struct rs_svc *svc, struct rsocket *rs, int cmd)
 	write(svc->sock[0], &msg, sizeof msg);
 	read(svc->sock[0], &msg, sizeof msg);
 	ret = rdma_seterrno(msg.status);
-	if (svc->cnt)
+	if (rs_svc_cnt(svc))
 		goto unlock;
 
 	pthread_join(svc->id, NULL);
@@ -484,19 +1042,169 @@ static int rs_scale_to_value(int value, int bits)
 	       value : (value & ~(1 << (bits - 1))) << bits;
 }
 
-void rs_configure(void)
+static void rs_shm_path(char *path, size_t len)
 {
-	FILE *f;
-	static int init;
+	snprintf(path, len, RSOCKET_SHM_PREFIX "%d", getpid());
+}
 
-	if (init)
-		return;
+/* Only the process that created the segment removes it */
+static pid_t rs_shm_owner;
 
-	pthread_mutex_lock(&mut);
-	if (init)
-		goto out;
+static void __attribute__((destructor)) rs_shm_cleanup(void)
+{
+	char path[64];
 
-	if (ucma_init())
+	if (!rs_shm || getpid() != rs_shm_owner)
+		return;
+
+	rs_shm_path(path, sizeof path);
+	unlink(path);
+}
+
+/*
+ * A forked child would otherwise keep updating its parent's segment.
+ * Replace the shared mapping with a private copy of it, so the child's
+ * rsockets keep valid counters that nobody else sees.
+ */
+static void rs_shm_fork_child(void)
+{
+	char path[64];
+	size_t size;
+	void *shm;
+	int fd;
+
+	if (!rs_shm)
+		return;
+
+	size = sizeof(*rs_shm) + rs_shm->max_socks * sizeof(struct rsocket_shm_sock);
+	snprintf(path, sizeof path, RSOCKET_SHM_PREFIX "%d", rs_shm_owner);
+	fd = open(path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd >= 0) {
+		shm = mmap(rs_shm, size, PROT_READ | PROT_WRITE,
+			   MAP_PRIVATE | MAP_FIXED, fd, 0);
+		close(fd);
+	} else {
+		shm = MAP_FAILED;
+	}
+
+	/* Without the file, lose the counters rather than share them */
+	if (shm == MAP_FAILED)
+		mmap(rs_shm, size, PROT_READ | PROT_WRITE,
+		     MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+}
+
+/*
+ * Map the shared memory statistics segment.  The file is sized for
+ * shm_stats rsockets, but pages are only allocated as slots are used.
+ * Counters of rsockets beyond that limit are kept private.
+ */
+static void rs_shm_init(void)
+{
+	struct rsocket_shm *shm;
+	char path[64];
+	size_t size;
+	int fd;
+
+	size = sizeof(*shm) + shm_stats * sizeof(struct rsocket_shm_sock);
+	rs_shm_path(path, sizeof path);
+	fd = rs_create_file(path);
+	if (fd < 0)
+		return;
+
+	if (ftruncate(fd, size))
+		goto err;
+
+	shm = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (shm == MAP_FAILED)
+		goto err;
+
+	close(fd);
+	shm->sock_size = sizeof(struct rsocket_shm_sock);
+	shm->max_socks = shm_stats;
+	shm->pid = getpid();
+	prctl(PR_GET_NAME, shm->comm, 0, 0, 0);
+	shm->send_stalls = *send_stalls;
+	send_stalls = &shm->send_stalls;
+	shm->version = RSOCKET_SHM_VERSION;
+	rs_shm_owner = shm->pid;
+	rs_shm = shm;
+	pthread_atfork(NULL, NULL, rs_shm_fork_child);
+	return;
+err:
+	close(fd);
+	unlink(path);
+}
+
+static void rs_shm_alloc(struct rsocket *rs)
+{
+	struct rsocket_shm_sock *sock;
+	uint32_t i;
+
+	pthread_mutex_lock(&mut);
+	for (i = 0; i < rs_shm->max_socks; i++) {
+		sock = &rs_shm->sock[i];
+		if (sock->in_use)
+			continue;
+
+		memset(sock, 0, sizeof *sock);
+		sock->index = rs->index;
+		sock->type = rs->type;
+		sock->in_use = 1;
+		rs_shm->socks_active++;
+
+		rs->shm_sock = sock;
+		rs->send_stats = &sock->send;
+		rs->recv_stats = &sock->recv;
+		rs->cq_stats = &sock->cq;
+		break;
+	}
+	pthread_mutex_unlock(&mut);
+}
+
+static void rs_shm_free(struct rsocket *rs)
+{
+	pthread_mutex_lock(&mut);
+	rs_shm->pinned_bytes -= rs->shm_sock->pinned_bytes;
+	rs_shm->socks_active--;
+	rs->shm_sock->in_use = 0;
+	pthread_mutex_unlock(&mut);
+}
+
+static void rs_shm_set_pinned(struct rsocket *rs, uint32_t len)
+{
+	pthread_mutex_lock(&mut);
+	rs_shm->pinned_bytes += len;
+	rs->shm_sock->pinned_bytes += len;
+	pthread_mutex_unlock(&mut);
+}
+
+static void rs_shm_set_conn(struct rsocket *rs)
+{
+	struct sockaddr *addr;
+
+	addr = rdma_get_local_addr(rs->cm_id);
+	memcpy(&rs->shm_sock->src_addr, addr, ucma_addrlen(addr));
+	addr = rdma_get_peer_addr(rs->cm_id);
+	memcpy(&rs->shm_sock->dst_addr, addr, ucma_addrlen(addr));
+
+	pthread_mutex_lock(&mut);
+	rs_shm->conns_total++;
+	pthread_mutex_unlock(&mut);
+}
+
+void rs_configure(void)
+{
+	FILE *f;
+	static int init;
+
+	if (init)
+		return;
+
+	pthread_mutex_lock(&mut);
+	if (init)
+		goto out;
+
+	if (ucma_init())
 		goto out;
 	ucma_ib_init();
 
@@ -535,6 +1243,57 @@ void rs_configure(void)
 			def_wmem = RS_SNDLOWAT << 1;
 	}
 
+	if ((f = fopen(RS_CONF_DIR "/shared_comp_channel", "r"))) {
+		(void) fscanf(f, "%d", &shared_comp_channel);
+		fclose(f);
+	}
+
+	if ((f = fopen(RS_CONF_DIR "/latency_stats", "r"))) {
+		(void) fscanf(f, "%d", &latency_stats);
+		fclose(f);
+		if (latency_stats && pthread_key_create(&lat_key, rs_lat_exit))
+			latency_stats = 0;
+	}
+
+	if ((f = fopen(RS_CONF_DIR "/flight_recorder", "r"))) {
+		(void) fscanf(f, "%u", &def_rec_size);
+		fclose(f);
+		def_rec_size = rs_rec_entries(def_rec_size);
+	}
+
+	if ((f = fopen(RS_CONF_DIR "/shm_stats", "r"))) {
+		(void) fscanf(f, "%u", &shm_stats);
+		fclose(f);
+	}
+
+	if ((f = fopen(RS_CONF_DIR "/accept_pool", "r"))) {
+		(void) fscanf(f, "%d", &def_accept_pool);
+		fclose(f);
+		def_accept_pool = min(max(def_accept_pool, 0), RS_ACCEPT_POOL_MAX);
+	}
+
+	if ((f = fopen(RS_CONF_DIR "/accept_shards", "r"))) {
+		(void) fscanf(f, "%d", &def_accept_shards);
+		fclose(f);
+		def_accept_shards = min(max(def_accept_shards, 0),
+					RS_ACCEPT_SHARDS_MAX);
+	}
+
+	if ((f = fopen(RS_CONF_DIR "/async_close", "r"))) {
+		(void) fscanf(f, "%d", &def_async_close);
+		fclose(f);
+	}
+
+	if ((f = fopen(RS_CONF_DIR "/route_cache_ttl", "r"))) {
+		(void) fscanf(f, "%u", &route_cache_ttl);
+		fclose(f);
+	}
+
+	if ((f = fopen(RS_CONF_DIR "/local_fastpath", "r"))) {
+		(void) fscanf(f, "%d", &local_fastpath);
+		fclose(f);
+	}
+
 	if ((f = fopen(RS_CONF_DIR "/iomap_size", "r"))) {
 		(void) fscanf(f, "%hu", &def_iomap_size);
 		fclose(f);
@@ -543,6 +1302,9 @@ void rs_configure(void)
 		def_iomap_size = (uint8_t) rs_value_to_scale(
 			(uint16_t) rs_scale_to_value(def_iomap_size, 8), 8);
 	}
+
+	if (shm_stats)
+		rs_shm_init();
 	init = 1;
 out:
 	pthread_mutex_unlock(&mut);
@@ -552,6 +1314,8 @@ static int rs_insert(struct rsocket *rs, int index)
 {
 	pthread_mutex_lock(&mut);
 	rs->index = idm_set(&idm, index, rs);
+	if (rs->shm_sock)
+		rs->shm_sock->index = rs->index;
 	pthread_mutex_unlock(&mut);
 	return rs->index;
 }
@@ -568,15 +1332,26 @@ static struct rsocket *rs_alloc(struct rsocket *inherited_rs, int type)
 {
 	struct rsocket *rs;
 
-	rs = calloc(1, sizeof(*rs));
-	if (!rs)
+	if (posix_memalign((void **) &rs, RS_CACHE_LINE, sizeof(*rs)))
 		return NULL;
 
+	memset(rs, 0, sizeof(*rs));
 	rs->type = type;
 	rs->index = -1;
+	rs->evfd = -1;
+	rs->ev_notify = -1;
+	rs->local_fd = -1;
+	rs->send_stats = &rs->send_counters;
+	rs->recv_stats = &rs->recv_counters;
+	rs->cq_stats = &rs->cq_counters;
+	atomic_init(&rs->rec_head);
 	if (type == SOCK_DGRAM) {
 		rs->udp_sock = -1;
 		rs->epfd = -1;
+	} else {
+		rs_set_ops(rs);
+		if (rs_shm)
+			rs_shm_alloc(rs);
 	}
 
 	if (inherited_rs) {
@@ -588,6 +1363,9 @@ static struct rsocket *rs_alloc(struct rsocket *inherited_rs, int type)
 		if (type == SOCK_STREAM) {
 			rs->ctrl_max_seqno = inherited_rs->ctrl_max_seqno;
 			rs->target_iomap_size = inherited_rs->target_iomap_size;
+			rs->opts = inherited_rs->opts &
+				   (RS_OPT_SINGLE_THREAD | RS_OPT_ASYNC_CLOSE);
+			rs->rec_size = inherited_rs->rec_size;
 		}
 	} else {
 		rs->sbuf_size = def_wmem;
@@ -598,6 +1376,11 @@ static struct rsocket *rs_alloc(struct rsocket *inherited_rs, int type)
 		if (type == SOCK_STREAM) {
 			rs->ctrl_max_seqno = RS_QP_CTRL_SIZE;
 			rs->target_iomap_size = def_iomap_size;
+			rs->rec_size = def_rec_size;
+			rs->accept_pool_size = def_accept_pool;
+			rs->accept_shard_cnt = def_accept_shards;
+			if (def_async_close)
+				rs->opts |= RS_OPT_ASYNC_CLOSE;
 		}
 	}
 	fastlock_init(&rs->slock);
@@ -616,7 +1399,7 @@ static int rs_set_nonblocking(struct rsocket *rs, int arg)
 	int ret = 0;
 
 	if (rs->type == SOCK_STREAM) {
-		if (rs->cm_id->recv_cq_channel)
+		if (rs->cm_id->recv_cq_channel && !rs->shared_chan)
 			ret = fcntl(rs->cm_id->recv_cq_channel->fd, F_SETFL, arg);
 
 		if (!ret && rs->state < rs_connected)
@@ -691,7 +1474,7 @@ static int rs_init_bufs(struct rsocket *rs)
 	if (!rs->sbuf)
 		return ERR(ENOMEM);
 
-	rs->smr = rdma_reg_msgs(rs->cm_id, rs->sbuf, total_sbuf_size);
+	rs->smr = ucma_reg_msgs(rs->cm_id, rs->sbuf, total_sbuf_size);
 	if (!rs->smr)
 		return -1;
 
@@ -701,7 +1484,7 @@ static int rs_init_bufs(struct rsocket *rs)
 	if (!rs->target_buffer_list)
 		return ERR(ENOMEM);
 
-	rs->target_mr = rdma_reg_write(rs->cm_id, rs->target_buffer_list, len);
+	rs->target_mr = ucma_reg_write(rs->cm_id, rs->target_buffer_list, len);
 	if (!rs->target_mr)
 		return -1;
 
@@ -717,7 +1500,7 @@ static int rs_init_bufs(struct rsocket *rs)
 	if (!rs->rbuf)
 		return ERR(ENOMEM);
 
-	rs->rmr = rdma_reg_write(rs->cm_id, rs->rbuf, total_rbuf_size);
+	rs->rmr = ucma_reg_write(rs->cm_id, rs->rbuf, total_rbuf_size);
 	if (!rs->rmr)
 		return -1;
 
@@ -725,10 +1508,20 @@ static int rs_init_bufs(struct rsocket *rs)
 	rs->sbuf_bytes_avail = rs->sbuf_size;
 	rs->ssgl[0].lkey = rs->ssgl[1].lkey = rs->smr->lkey;
 
+	if (rs->rec_size) {
+		rs->rec = calloc(rs->rec_size, sizeof(*rs->rec));
+		if (!rs->rec)
+			return ERR(ENOMEM);
+		rs->rec_mask = rs->rec_size - 1;
+	}
+
 	rs->rbuf_free_offset = rs->rbuf_size >> 1;
 	rs->rbuf_bytes_avail = rs->rbuf_size >> 1;
 	rs->sqe_avail = rs->sq_size - rs->ctrl_max_seqno;
 	rs->rseq_comp = rs->rq_size >> 1;
+
+	if (rs->shm_sock)
+		rs_shm_set_pinned(rs, total_sbuf_size + len + total_rbuf_size);
 	return 0;
 }
 
@@ -738,11 +1531,11 @@ static int ds_init_bufs(struct ds_qp *qp)
 	if (!qp->rbuf)
 		return ERR(ENOMEM);
 
-	qp->smr = rdma_reg_msgs(qp->cm_id, qp->rs->sbuf, qp->rs->sbuf_size);
+	qp->smr = ucma_reg_msgs(qp->cm_id, qp->rs->sbuf, qp->rs->sbuf_size);
 	if (!qp->smr)
 		return -1;
 
-	qp->rmr = rdma_reg_msgs(qp->cm_id, qp->rbuf, qp->rs->rbuf_size +
+	qp->rmr = ucma_reg_msgs(qp->cm_id, qp->rbuf, qp->rs->rbuf_size +
 						     sizeof(struct ibv_grh));
 	if (!qp->rmr)
 		return -1;
@@ -750,6 +1543,109 @@ static int ds_init_bufs(struct ds_qp *qp)
 	return 0;
 }
 
+static struct rs_comp_channel *rs_get_comp_channel(struct ibv_context *verbs)
+{
+	struct rs_comp_channel *chan;
+
+	pthread_mutex_lock(&mut);
+	for (chan = comp_channel_list; chan; chan = chan->next) {
+		if (chan->verbs == verbs)
+			goto found;
+	}
+
+	chan = calloc(1, sizeof(*chan));
+	if (!chan)
+		goto out;
+
+	chan->channel = ucma_ibv_create_comp_channel(verbs);
+	if (!chan->channel)
+		goto err1;
+
+	if (fcntl(chan->channel->fd, F_SETFL, O_NONBLOCK))
+		goto err2;
+
+	chan->kick = eventfd(0, EFD_NONBLOCK);
+	if (chan->kick < 0)
+		goto err2;
+
+	chan->verbs = verbs;
+	pthread_mutex_init(&chan->mut, NULL);
+	pthread_cond_init(&chan->cond, NULL);
+	chan->next = comp_channel_list;
+	comp_channel_list = chan;
+found:
+	chan->refcnt++;
+out:
+	pthread_mutex_unlock(&mut);
+	return chan;
+
+err2:
+	ucma_ibv_destroy_comp_channel(chan->channel);
+err1:
+	free(chan);
+	chan = NULL;
+	goto out;
+}
+
+static void rs_put_comp_channel(struct rs_comp_channel *chan)
+{
+	struct rs_comp_channel **prev;
+
+	pthread_mutex_lock(&mut);
+	if (--chan->refcnt)
+		goto out;
+
+	for (prev = &comp_channel_list; *prev != chan; prev = &(*prev)->next)
+		;
+	*prev = chan->next;
+
+	ucma_ibv_destroy_comp_channel(chan->channel);
+	close(chan->kick);
+	pthread_cond_destroy(&chan->cond);
+	pthread_mutex_destroy(&chan->mut);
+	free(chan);
+out:
+	pthread_mutex_unlock(&mut);
+}
+
+static int rs_create_shared_cq(struct rsocket *rs)
+{
+	struct rdma_cm_id *cm_id = rs->cm_id;
+
+	rs->shared_chan = rs_get_comp_channel(cm_id->verbs);
+	if (!rs->shared_chan)
+		return ERR(ENOMEM);
+
+	/* The CQ context identifies the rsocket when demultiplexing events */
+	cm_id->recv_cq = ucma_ibv_create_cq(cm_id->verbs, rs->sq_size + rs->rq_size,
+					    rs, rs->shared_chan->channel, 0);
+	if (!cm_id->recv_cq) {
+		rs_put_comp_channel(rs->shared_chan);
+		rs->shared_chan = NULL;
+		return -1;
+	}
+
+	ibv_req_notify_cq(cm_id->recv_cq, 0);
+	cm_id->recv_cq_channel = rs->shared_chan->channel;
+	cm_id->send_cq_channel = cm_id->recv_cq_channel;
+	cm_id->send_cq = cm_id->recv_cq;
+	return 0;
+}
+
+/*
+ * The shared channel must not be destroyed with the QP.
+ */
+static void rs_destroy_shared_cq(struct rsocket *rs)
+{
+	rs->cm_id->recv_cq_channel = NULL;
+	rs->cm_id->send_cq_channel = NULL;
+	if (!rs->cm_id->qp && rs->cm_id->recv_cq) {
+		ucma_ibv_destroy_cq(rs->cm_id->recv_cq);
+		rs->cm_id->recv_cq = NULL;
+		rs->cm_id->send_cq = NULL;
+	}
+}
+
 /*
  * If a user is waiting on a datagram rsocket through poll or select, then
  * we need the first completion to generate an event on the related epoll fd
@@ -757,12 +1653,12 @@ static int ds_init_bufs(struct ds_qp *qp)
  */
 static int rs_create_cq(struct rsocket *rs, struct rdma_cm_id *cm_id)
 {
-	cm_id->recv_cq_channel = ibv_create_comp_channel(cm_id->verbs);
+	cm_id->recv_cq_channel = ucma_ibv_create_comp_channel(cm_id->verbs);
 	if (!cm_id->recv_cq_channel)
 		return -1;
 
-	cm_id->recv_cq = ibv_create_cq(cm_id->verbs, rs->sq_size + rs->rq_size,
-				       cm_id, cm_id->recv_cq_channel, 0);
+	cm_id->recv_cq = ucma_ibv_create_cq(cm_id->verbs, rs->sq_size + rs->rq_size,
+					    cm_id, cm_id->recv_cq_channel, 0);
 	if (!cm_id->recv_cq)
 		goto err1;
 
@@ -777,40 +1673,51 @@ static int rs_create_cq(struct rsocket *rs, struct rdma_cm_id *cm_id)
 	return 0;
 
 err2:
-	ibv_destroy_cq(cm_id->recv_cq);
+	ucma_ibv_destroy_cq(cm_id->recv_cq);
 	cm_id->recv_cq = NULL;
 err1:
-	ibv_destroy_comp_channel(cm_id->recv_cq_channel);
+	ucma_ibv_destroy_comp_channel(cm_id->recv_cq_channel);
 	cm_id->recv_cq_channel = NULL;
 	return -1;
 }
 
-static inline int rs_post_recv(struct rsocket *rs)
+static int rs_post_recv_imm(struct rsocket *rs)
+{
+	struct ibv_recv_wr wr, *bad;
+
+	wr.next = NULL;
+	wr.wr_id = rs_recv_wr_id(0);
+	wr.sg_list = NULL;
+	wr.num_sge = 0;
+
+	return rdma_seterrno(ibv_post_recv(rs->cm_id->qp, &wr, &bad));
+}
+
+static int rs_post_recv_msg(struct rsocket *rs)
 {
 	struct ibv_recv_wr wr, *bad;
 	struct ibv_sge sge;
 
 	wr.next = NULL;
-	if (!(rs->opts & RS_OPT_MSG_SEND)) {
-		wr.wr_id = rs_recv_wr_id(0);
-		wr.sg_list = NULL;
-		wr.num_sge = 0;
-	} else {
-		wr.wr_id = rs_recv_wr_id(rs->rbuf_msg_index);
-		sge.addr = (uintptr_t) rs->rbuf + rs->rbuf_size +
-			   (rs->rbuf_msg_index * RS_MSG_SIZE);
-		sge.length = RS_MSG_SIZE;
-		sge.lkey = rs->rmr->lkey;
+	wr.wr_id = rs_recv_wr_id(rs->rbuf_msg_index);
+	sge.addr = (uintptr_t) rs->rbuf + rs->rbuf_size +
+		   (rs->rbuf_msg_index * RS_MSG_SIZE);
+	sge.length = RS_MSG_SIZE;
+	sge.lkey = rs->rmr->lkey;
 
-		wr.sg_list = &sge;
-		wr.num_sge = 1;
-		if(++rs->rbuf_msg_index == rs->rq_size)
-			rs->rbuf_msg_index = 0;
-	}
+	wr.sg_list = &sge;
+	wr.num_sge = 1;
+	if(++rs->rbuf_msg_index == rs->rq_size)
+		rs->rbuf_msg_index = 0;
 
 	return rdma_seterrno(ibv_post_recv(rs->cm_id->qp, &wr, &bad));
 }
 
+static inline int rs_post_recv(struct rsocket *rs)
+{
+	return rs->ops->post_recv(rs);
+}
+
 static inline int ds_post_recv(struct rsocket *rs, struct ds_qp *qp, uint32_t offset)
 {
 	struct ibv_recv_wr wr, *bad;
@@ -831,6 +1738,19 @@ static inline int ds_post_recv(struct rsocket *rs, struct ds_qp *qp, uint32_t of
 	return rdma_seterrno(ibv_post_recv(qp->cm_id->qp, &wr, &bad));
 }
 
+static int rs_evfd_add(struct rsocket *rs, int fd, int flag)
+{
+	struct epoll_event event;
+	int ret;
+
+	event.events = EPOLLIN;
+	event.data.u32 = flag;
+	ret = epoll_ctl(rs->evfd, EPOLL_CTL_ADD, fd, &event);
+	if (!ret)
+		rs->ev_flags |= flag;
+	return ret;
+}
+
 static int rs_create_ep(struct rsocket *rs)
 {
 	struct ibv_qp_init_attr qp_attr;
@@ -839,10 +1759,21 @@ static int rs_create_ep(struct rsocket *rs)
 	rs_set_qp_size(rs);
 	if (rs->cm_id->verbs->device->transport_type == IBV_TRANSPORT_IWARP)
 		rs->opts |= RS_OPT_MSG_SEND;
-	ret = rs_create_cq(rs, rs->cm_id);
+	rs_set_ops(rs);
+	if (shared_comp_channel && rs->evfd < 0)
+		ret = rs_create_shared_cq(rs);
+	else
+		ret = rs_create_cq(rs, rs->cm_id);
 	if (ret)
 		return ret;
 
+	if (rs->evfd >= 0) {
+		ret = rs_evfd_add(rs, rs->cm_id->recv_cq_channel->fd,
+				  RS_EV_CQ_CHANNEL);
+		if (ret)
+			return ret;
+	}
+
 	memset(&qp_attr, 0, sizeof qp_attr);
 	qp_attr.qp_context = rs;
 	qp_attr.send_cq = rs->cm_id->send_cq;
@@ -881,7 +1812,7 @@ static void rs_release_iomap_mr(struct rs_iomap_mr *iomr)
 		return;
 
 	dlist_remove(&iomr->entry);
-	ibv_dereg_mr(iomr->mr);
+	ucma_ibv_dereg_mr(iomr->mr);
 	if (iomr->index >= 0)
 		iomr->mr = NULL;
 	else
@@ -907,11 +1838,11 @@ static void rs_free_iomappings(struct rsocket *rs)
 static void ds_free_qp(struct ds_qp *qp)
 {
 	if (qp->smr)
-		rdma_dereg_mr(qp->smr);
+		ucma_ibv_dereg_mr(qp->smr);
 
 	if (qp->rbuf) {
 		if (qp->rmr)
-			rdma_dereg_mr(qp->rmr);
+			ucma_ibv_dereg_mr(qp->rmr);
 		free(qp->rbuf);
 	}
 
@@ -961,87 +1892,391 @@ static void ds_free(struct rsocket *rs)
 	free(rs);
 }
 
-static void rs_free(struct rsocket *rs)
+static void rs_local_name(uint64_t id, struct sockaddr_un *addr, socklen_t *len)
 {
-	if (rs->type == SOCK_DGRAM) {
-		ds_free(rs);
-		return;
-	}
-
-	if (rs->rmsg)
-		free(rs->rmsg);
+	memset(addr, 0, sizeof *addr);
+	addr->sun_family = AF_UNIX;
+	*len = offsetof(struct sockaddr_un, sun_path) + 1 +
+	       snprintf(addr->sun_path + 1, sizeof(addr->sun_path) - 1,
+			"rsocket-local/%016llx", (unsigned long long) id);
+}
 
-	if (rs->sbuf) {
-		if (rs->smr)
-			rdma_dereg_mr(rs->smr);
-		free(rs->sbuf);
-	}
+/* The local data path is only shared with processes of the same user */
+static int rs_local_peer_ok(int fd)
+{
+	struct ucred cred;
+	socklen_t len = sizeof cred;
 
-	if (rs->rbuf) {
-		if (rs->rmr)
-			rdma_dereg_mr(rs->rmr);
-		free(rs->rbuf);
-	}
+	return !getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) &&
+	       cred.uid == geteuid();
+}
 
-	if (rs->target_buffer_list) {
-		if (rs->target_mr)
-			rdma_dereg_mr(rs->target_mr);
-		free(rs->target_buffer_list);
-	}
+static void rs_local_free(struct rs_local *lc)
+{
+	if (lc->seg)
+		munmap(lc->seg, lc->seg_size);
+	if (lc->fd >= 0)
+		close(lc->fd);
+	free(lc);
+}
 
-	if (rs->cm_id) {
-		rs_free_iomappings(rs);
-		if (rs->cm_id->qp) {
-			ibv_ack_cq_events(rs->cm_id->recv_cq, rs->unack_cqe);
-			rdma_destroy_qp(rs->cm_id);
-		}
-		rdma_destroy_id(rs->cm_id);
+static int rs_local_map(struct rs_local *lc, int fd, size_t size, int side)
+{
+	lc->seg = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (lc->seg == MAP_FAILED) {
+		lc->seg = NULL;
+		return -1;
 	}
 
-	if (rs->index >= 0)
-		rs_remove(rs);
-
-	fastlock_destroy(&rs->map_lock);
-	fastlock_destroy(&rs->cq_wait_lock);
-	fastlock_destroy(&rs->cq_lock);
-	fastlock_destroy(&rs->rlock);
-	fastlock_destroy(&rs->slock);
-	free(rs);
+	lc->seg_size = size;
+	lc->side = side;
+	return 0;
 }
 
-static size_t rs_conn_data_offset(struct rsocket *rs)
+static int rs_local_set(struct rsocket *rs, struct rs_local *lc)
 {
-	return (rs->cm_id->route.addr.src_addr.sa_family == AF_IB) ?
-		sizeof(struct ib_connect_hdr) : 0;
+	lc->size = lc->seg->size;
+	lc->sring = &lc->seg->ring[lc->side];
+	lc->rring = &lc->seg->ring[!lc->side];
+	lc->sdata = (uint8_t *) (lc->seg + 1) + lc->size * lc->side;
+	lc->rdata = (uint8_t *) (lc->seg + 1) + lc->size * !lc->side;
+	rs->local = lc;
+
+	if (rs->evfd >= 0)
+		return rs_evfd_add(rs, lc->fd, RS_EV_LOCAL);
+	return 0;
 }
 
-static void rs_format_conn_data(struct rsocket *rs, struct rs_conn_data *conn)
+/*
+ * The connecting side offers the local data path by listening on a unix
+ * socket.  If the peer is on another host, nobody connects to it.
+ */
+static void rs_local_offer(struct rsocket *rs, struct rs_conn_data *creq)
 {
-	conn->version = 1;
-	conn->flags = RS_CONN_FLAG_IOMAP |
-		      (rs_host_is_net() ? RS_CONN_FLAG_NET : 0);
-	conn->credits = htons(rs->rq_size);
-	memset(conn->reserved, 0, sizeof conn->reserved);
-	conn->target_iomap_size = (uint8_t) rs_value_to_scale(rs->target_iomap_size, 8);
+	struct sockaddr_un addr;
+	socklen_t len;
 
-	conn->target_sgl.addr = htonll((uintptr_t) rs->target_sgl);
-	conn->target_sgl.length = htonl(RS_SGL_SIZE);
-	conn->target_sgl.key = htonl(rs->target_mr->rkey);
+	if (!local_fastpath || rs->target_iomap_size)
+		return;
 
-	conn->data_buf.addr = htonll((uintptr_t) rs->rbuf);
-	conn->data_buf.length = htonl(rs->rbuf_size >> 1);
-	conn->data_buf.key = htonl(rs->rmr->rkey);
+	if (getrandom(&rs->local_nonce, sizeof rs->local_nonce, 0) !=
+	    sizeof rs->local_nonce)
+		return;
+	rs->local_id = rs->local_nonce >> 32;
+
+	rs->local_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK |
+				       SOCK_CLOEXEC, 0);
+	if (rs->local_fd < 0)
+		return;
+
+	rs_local_name(rs->local_id, &addr, &len);
+	if (bind(rs->local_fd, (struct sockaddr *) &addr, len) ||
+	    listen(rs->local_fd, RS_LOCAL_BACKLOG)) {
+		close(rs->local_fd);
+		rs->local_fd = -1;
+		return;
+	}
+
+	creq->flags |= RS_CONN_FLAG_LOCAL;
+	creq->local_nonce = htonll(rs->local_nonce);
 }
 
-static void rs_save_conn_data(struct rsocket *rs, struct rs_conn_data *conn)
-{
+/*
+ * Create the shared segment and hand it to the connecting side.  Returns
+ * 1 if the local data path is used.  The accept proceeds over RDMA on
+ * any failure.  Other local processes can see the socket's name and fill
+ * its backlog, so the connect does not wait: a full backlog also falls
+ * back to RDMA.  All later I/O on the socket is nonblocking.
+ */
+static int rs_local_accept(struct rsocket *rs, struct rs_conn_data *creq,
+			   size_t len)
+{
+	struct sockaddr_un addr;
+	struct rs_local *lc;
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct iovec iov[2];
+	char cbuf[CMSG_SPACE(sizeof(int))];
+	socklen_t alen;
+	size_t size;
+	uint32_t rsize;
+	uint8_t ver = RS_LOCAL_VERSION;
+	uint64_t nonce = ntohll(creq->local_nonce);
+	int fd;
+
+	if (!local_fastpath || len < sizeof(*creq) ||
+	    !(creq->flags & RS_CONN_FLAG_LOCAL) ||
+	    creq->target_iomap_size || rs->target_iomap_size)
+		return 0;
+
+	lc = calloc(1, sizeof *lc);
+	if (!lc)
+		return 0;
+
+	lc->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (lc->fd < 0)
+		goto err1;
+
+	rs_local_name(nonce >> 32, &addr, &alen);
+	if (connect(lc->fd, (struct sockaddr *) &addr, alen) ||
+	    !rs_local_peer_ok(lc->fd))
+		goto err1;
+
+	fd = memfd_create("rsocket-local", MFD_CLOEXEC);
+	if (fd < 0)
+		goto err1;
+
+	for (rsize = RS_SNDLOWAT; rsize < max(rs->sbuf_size, rs->rbuf_size); rsize <<= 1)
+		;
+	size = sizeof(*lc->seg) + ((size_t) rsize << 1);
+	if (ftruncate(fd, size) || rs_local_map(lc, fd, size, 1))
+		goto err2;
+
+	lc->seg->magic = RS_LOCAL_MAGIC;
+	lc->seg->version = RS_LOCAL_VERSION;
+	lc->seg->local_id = nonce >> 32;
+	lc->seg->size = rsize;
+
+	iov[0].iov_base = &ver;
+	iov[0].iov_len = sizeof ver;
+	iov[1].iov_base = &nonce;
+	iov[1].iov_len = sizeof nonce;
+	memset(&msg, 0, sizeof msg);
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 2;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof cbuf;
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &fd, sizeof fd);
+	if (sendmsg(lc->fd, &msg, MSG_NOSIGNAL) != sizeof ver + sizeof nonce)
+		goto err2;
+
+	close(fd);
+	if (rs_local_set(rs, lc)) {
+		rs->local = NULL;
+		goto err1;
+	}
+	return 1;
+
+err2:
+	close(fd);
+err1:
+	rs_local_free(lc);
+	return 0;
+}
+
+/*
+ * Returns the segment sent on fd, after checking that the sender knows
+ * the nonce offered in the private data.
+ */
+static int rs_local_recv_seg(struct rsocket *rs, int fd)
+{
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct iovec iov[2];
+	char cbuf[CMSG_SPACE(sizeof(int))];
+	uint8_t ver;
+	uint64_t nonce;
+	int seg_fd = -1;
+
+	iov[0].iov_base = &ver;
+	iov[0].iov_len = sizeof ver;
+	iov[1].iov_base = &nonce;
+	iov[1].iov_len = sizeof nonce;
+	memset(&msg, 0, sizeof msg);
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 2;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof cbuf;
+	if (recvmsg(fd, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC) !=
+	    sizeof ver + sizeof nonce)
+		goto out;
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (!cmsg || cmsg->cmsg_type != SCM_RIGHTS ||
+	    cmsg->cmsg_len != CMSG_LEN(sizeof(int)))
+		goto out;
+
+	memcpy(&seg_fd, CMSG_DATA(cmsg), sizeof seg_fd);
+	if (ver != RS_LOCAL_VERSION || nonce != rs->local_nonce) {
+		close(seg_fd);
+		seg_fd = -1;
+	}
+out:
+	return seg_fd;
+}
+
+/*
+ * The accepting side sent the segment before accepting the connection,
+ * so it is queued by now.  Anyone may connect to the socket, so
+ * connections from other users, or that do not carry the nonce, are
+ * discarded.  Nothing here blocks.
+ */
+static int rs_local_connect(struct rsocket *rs, struct rs_conn_data *cresp)
+{
+	struct rs_local *lc;
+	struct stat st;
+	int fd = -1;
+
+	if (!(cresp->flags & RS_CONN_FLAG_LOCAL)) {
+		close(rs->local_fd);
+		rs->local_fd = -1;
+		return 0;
+	}
+
+	lc = calloc(1, sizeof *lc);
+	if (!lc)
+		return ERR(ENOMEM);
+
+	lc->fd = -1;
+	do {
+		if (lc->fd >= 0)
+			close(lc->fd);
+		lc->fd = accept4(rs->local_fd, NULL, NULL, SOCK_CLOEXEC);
+		if (lc->fd < 0)
+			break;
+		if (rs_local_peer_ok(lc->fd))
+			fd = rs_local_recv_seg(rs, lc->fd);
+	} while (fd < 0);
+	close(rs->local_fd);
+	rs->local_fd = -1;
+	if (fd < 0)
+		goto err;
+
+	if (fstat(fd, &st) || st.st_size < sizeof(*lc->seg) ||
+	    rs_local_map(lc, fd, st.st_size, 0))
+		goto err;
+
+	if (lc->seg->magic != RS_LOCAL_MAGIC ||
+	    lc->seg->local_id != rs->local_id ||
+	    lc->seg->size & (lc->seg->size - 1) ||
+	    sizeof(*lc->seg) + ((size_t) lc->seg->size << 1) != lc->seg_size)
+		goto err;
+
+	close(fd);
+	fd = -1;
+	if (!rs_local_set(rs, lc))
+		return 0;
+	rs->local = NULL;
+err:
+	if (fd >= 0)
+		close(fd);
+	rs_local_free(lc);
+	return ERR(ECONNREFUSED);
+}
+
+static void rs_free(struct rsocket *rs)
+{
+	if (rs->type == SOCK_DGRAM) {
+		ds_free(rs);
+		return;
+	}
+
+	if (rs->rmsg)
+		free(rs->rmsg);
+
+	if (rs->rec) {
+		rs_rec_dump_pending(rs);
+		free(rs->rec);
+	}
+
+	if (rs->sbuf) {
+		if (rs->smr)
+			ucma_ibv_dereg_mr(rs->smr);
+		free(rs->sbuf);
+	}
+
+	if (rs->rbuf) {
+		if (rs->rmr)
+			ucma_ibv_dereg_mr(rs->rmr);
+		free(rs->rbuf);
+	}
+
+	if (rs->target_buffer_list) {
+		if (rs->target_mr)
+			ucma_ibv_dereg_mr(rs->target_mr);
+		free(rs->target_buffer_list);
+	}
+
+	if (rs->cm_id) {
+		rs_free_iomappings(rs);
+		if (rs->shared_chan)
+			rs_destroy_shared_cq(rs);
+		if (rs->cm_id->qp) {
+			ucma_ibv_ack_cq_events(rs->cm_id->recv_cq, rs->unack_cqe);
+			rdma_destroy_qp(rs->cm_id);
+		}
+		rdma_destroy_id(rs->cm_id);
+	}
+
+	if (rs->shared_chan)
+		rs_put_comp_channel(rs->shared_chan);
+
+	if (rs->index >= 0)
+		rs_remove(rs);
+
+	if (rs->evfd >= 0)
+		close(rs->evfd);
+	if (rs->ev_notify >= 0)
+		close(rs->ev_notify);
+	if (rs->shm_sock)
+		rs_shm_free(rs);
+	if (rs->local)
+		rs_local_free(rs->local);
+	if (rs->local_fd >= 0)
+		close(rs->local_fd);
+	free(rs->conn_sdata);
+	free(rs->conn_rdata);
+
+	fastlock_destroy(&rs->map_lock);
+	fastlock_destroy(&rs->cq_wait_lock);
+	fastlock_destroy(&rs->cq_lock);
+	fastlock_destroy(&rs->rlock);
+	fastlock_destroy(&rs->slock);
+	free(rs);
+}
+
+static size_t rs_conn_data_offset(struct rsocket *rs)
+{
+	return (rs->cm_id->route.addr.src_addr.sa_family == AF_IB) ?
+		sizeof(struct ib_connect_hdr) : 0;
+}
+
+static void rs_format_conn_data(struct rsocket *rs, struct rs_conn_data *conn)
+{
+	conn->version = 1;
+	conn->flags = RS_CONN_FLAG_IOMAP | RS_CONN_FLAG_DATA |
+		      (rs_host_is_net() ? RS_CONN_FLAG_NET : 0);
+	conn->credits = htons(rs->rq_size);
+	conn->data_len = 0;
+	memset(conn->reserved, 0, sizeof conn->reserved);
+	conn->target_iomap_size = (uint8_t) rs_value_to_scale(rs->target_iomap_size, 8);
+
+	conn->target_sgl.addr = htonll((uintptr_t) rs->target_sgl);
+	conn->target_sgl.length = htonl(RS_SGL_SIZE);
+	conn->target_sgl.key = htonl(rs->target_mr->rkey);
+
+	conn->data_buf.addr = htonll((uintptr_t) rs->rbuf);
+	conn->data_buf.length = htonl(rs->rbuf_size >> 1);
+	conn->data_buf.key = htonl(rs->rmr->rkey);
+	conn->local_nonce = 0;
+}
+
+static void rs_save_conn_data(struct rsocket *rs, struct rs_conn_data *conn)
+{
 	rs->remote_sgl.addr = ntohll(conn->target_sgl.addr);
 	rs->remote_sgl.length = ntohl(conn->target_sgl.length);
 	rs->remote_sgl.key = ntohl(conn->target_sgl.key);
 	rs->remote_sge = 1;
 	if ((rs_host_is_net() && !(conn->flags & RS_CONN_FLAG_NET)) ||
 	    (!rs_host_is_net() && (conn->flags & RS_CONN_FLAG_NET)))
-		rs->opts = RS_OPT_SWAP_SGL;
+		rs->opts |= RS_OPT_SWAP_SGL;
+	rs_set_ops(rs);
+	if (rs->shm_sock)
+		rs_shm_set_conn(rs);
 
 	if (conn->flags & RS_CONN_FLAG_IOMAP) {
 		rs->remote_iomap.addr = rs->remote_sgl.addr +
@@ -1057,6 +2292,60 @@ static void rs_save_conn_data(struct rsocket *rs, struct rs_conn_data *conn)
 	rs->sseq_comp = ntohs(conn->credits);
 }
 
+/*
+ * Connection data, set through RDMA_CONN_DATA, follows rs_conn_data in
+ * the private data, taking the place of local_nonce when that is unused.
+ * Peers that understand it set RS_CONN_FLAG_DATA, even without data to
+ * send, and the accepting side only replies with data to such peers.
+ * Data that does not fit, or that the peer would not understand, is
+ * sent as the first bytes of the stream once the connection is
+ * established.  Either way, the peer reads it from the stream.  A
+ * request whose data was cut short by the transport is answered as if
+ * the peer did not understand it, so that it is resent in the stream.
+ */
+static size_t rs_conn_data_size(struct rs_conn_data *conn)
+{
+	return (conn->flags & RS_CONN_FLAG_LOCAL) ? sizeof(*conn) :
+	       offsetof(struct rs_conn_data, local_nonce);
+}
+
+/* Returns the length of the private data, from conn */
+static size_t rs_conn_data_add(struct rs_conn_data *conn, const void *data,
+			       size_t len, size_t limit)
+{
+	size_t size = rs_conn_data_size(conn);
+
+	if (!data || !len || size + len > limit)
+		return sizeof(*conn);
+
+	memcpy((void *) conn + size, data, len);
+	conn->data_len = (uint8_t) len;
+	return max(size + len, sizeof(*conn));
+}
+
+static int rs_conn_data_save(struct rsocket *rs, struct rs_conn_data *conn,
+			     size_t len)
+{
+	size_t size = rs_conn_data_size(conn);
+
+	if (!(conn->flags & RS_CONN_FLAG_DATA) || !conn->data_len)
+		return 0;
+
+	if (size + conn->data_len > len) {
+		conn->flags &= ~RS_CONN_FLAG_DATA;
+		return 0;
+	}
+
+	rs->conn_rdata = malloc(conn->data_len);
+	if (!rs->conn_rdata)
+		return ERR(ENOMEM);
+
+	memcpy(rs->conn_rdata, (void *) conn + size, conn->data_len);
+	rs->conn_rlen = conn->data_len;
+	rs->conn_roff = 0;
+	return 0;
+}
+
 static int ds_init(struct rsocket *rs, int domain)
 {
 	rs->udp_sock = socket(domain, SOCK_DGRAM, 0);
@@ -1100,73 +2389,617 @@ static int ds_init_ep(struct rsocket *rs)
 	if (ret)
 		return ret;
 
-	rs->state = rs_readable | rs_writable;
-	return 0;
+	rs_set_state(rs, rs_readable | rs_writable);
+	return 0;
+}
+
+int rsocket(int domain, int type, int protocol)
+{
+	struct rsocket *rs;
+	int index, ret;
+
+	if ((domain != AF_INET && domain != AF_INET6 && domain != AF_IB) ||
+	    ((type != SOCK_STREAM) && (type != SOCK_DGRAM)) ||
+	    (type == SOCK_STREAM && protocol && protocol != IPPROTO_TCP) ||
+	    (type == SOCK_DGRAM && protocol && protocol != IPPROTO_UDP))
+		return ERR(ENOTSUP);
+
+	rs_configure();
+	rs = rs_alloc(NULL, type);
+	if (!rs)
+		return ERR(ENOMEM);
+
+	if (type == SOCK_STREAM) {
+		ret = rdma_create_id(NULL, &rs->cm_id, rs, RDMA_PS_TCP);
+		if (ret)
+			goto err;
+
+		rs->cm_id->route.addr.src_addr.sa_family = domain;
+		index = rs->cm_id->channel->fd;
+	} else {
+		ret = ds_init(rs, domain);
+		if (ret)
+			goto err;
+
+		index = rs->udp_sock;
+	}
+
+	ret = rs_insert(rs, index);
+	if (ret < 0)
+		goto err;
+
+	return rs->index;
+
+err:
+	rs_free(rs);
+	return ret;
+}
+
+int rbind(int socket, const struct sockaddr *addr, socklen_t addrlen)
+{
+	struct rsocket *rs;
+	int ret;
+
+	rs = idm_lookup(&idm, socket);
+	if (!rs)
+		return ERR(EBADF);
+	if (rs->type == SOCK_STREAM) {
+		ret = rdma_bind_addr(rs->cm_id, (struct sockaddr *) addr);
+		if (!ret)
+			rs_set_state(rs, rs_bound);
+	} else {
+		if (rs->state == rs_init) {
+			ret = ds_init_ep(rs);
+			if (ret)
+				return ret;
+		}
+		ret = bind(rs->udp_sock, addr, addrlen);
+	}
+	return ret;
+}
+
+/*
+ * A listening rsocket may keep a pool of endpoints built ahead of time, so
+ * that raccept does not create a CQ, QP and buffers while the peer waits.
+ * Each pooled endpoint is a complete rsocket whose resources hang off a
+ * placeholder cm_id bound to the listen address.  When a request arrives
+ * on the same device, raccept moves the QP and CQ onto the request's cm_id;
+ * rdma_accept reloads the QP's port and pkey from that id.  accept_svc
+ * destroys the placeholders and refills the pool.
+ */
+struct rs_accept_pool {
+	pthread_mutex_t	  lock;
+	int		  kick;		/* eventfd, wakes accept_svc */
+	int		  size;
+	int		  cnt;
+	int		  idle_cnt;
+	union socket_addr addr;		/* port 0, unset until known */
+	struct rsocket	  **eps;
+	struct rdma_cm_id **idle_ids;
+};
+
+static void rs_accept_pool_kick(struct rs_accept_pool *pool)
+{
+	uint64_t cnt = 1;
+
+	write(pool->kick, &cnt, sizeof cnt);
+}
+
+static void rs_accept_pool_set_addr(struct rs_accept_pool *pool,
+				    struct sockaddr *addr)
+{
+	if (addr->sa_family == AF_INET) {
+		memcpy(&pool->addr.sin, addr, sizeof pool->addr.sin);
+		pool->addr.sin.sin_port = 0;
+	} else if (addr->sa_family == AF_INET6) {
+		memcpy(&pool->addr.sin6, addr, sizeof pool->addr.sin6);
+		pool->addr.sin6.sin6_port = 0;
+	}
+}
+
+static void rs_accept_pool_free(struct rs_accept_pool *pool)
+{
+	while (pool->cnt)
+		rs_free(pool->eps[--pool->cnt]);
+	while (pool->idle_cnt)
+		rdma_destroy_id(pool->idle_ids[--pool->idle_cnt]);
+	close(pool->kick);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool);
+}
+
+/*
+ * A wildcard listen does not identify a device, so the pool learns its
+ * address from the first connection request.
+ */
+static int rs_accept_pool_start(struct rsocket *rs)
+{
+	struct rs_accept_pool *pool;
+	int ret;
+
+	pool = calloc(1, sizeof(*pool) +
+			 sizeof(void *) * 2 * rs->accept_pool_size);
+	if (!pool)
+		return ERR(ENOMEM);
+
+	pool->kick = eventfd(0, EFD_NONBLOCK);
+	if (pool->kick < 0) {
+		free(pool);
+		return -1;
+	}
+
+	pthread_mutex_init(&pool->lock, NULL);
+	pool->size = rs->accept_pool_size;
+	pool->eps = (struct rsocket **) (pool + 1);
+	pool->idle_ids = (struct rdma_cm_id **) (pool->eps + pool->size);
+	if (rs->cm_id->verbs)
+		rs_accept_pool_set_addr(pool, &rs->cm_id->route.addr.src_addr);
+
+	rs->accept_pool = pool;
+	ret = rs_notify_svc(&accept_svc, rs, RS_SVC_ADD_ACCEPT);
+	if (ret) {
+		rs->accept_pool = NULL;
+		rs_accept_pool_free(pool);
+		return ret;
+	}
+
+	if (pool->addr.sa.sa_family)
+		rs_accept_pool_kick(pool);
+	return 0;
+}
+
+static void rs_accept_pool_stop(struct rsocket *rs)
+{
+	rs_notify_svc(&accept_svc, rs, RS_SVC_REM_ACCEPT);
+	rs_accept_pool_free(rs->accept_pool);
+	rs->accept_pool = NULL;
+}
+
+/*
+ * Returns a pooled endpoint that now owns the QP and CQ of cm_id, or NULL
+ * if none was built on the request's device.
+ */
+static struct rsocket *rs_accept_pool_get(struct rsocket *rs,
+					  struct rdma_cm_id *cm_id)
+{
+	struct rs_accept_pool *pool = rs->accept_pool;
+	struct rsocket *ep = NULL;
+	struct rdma_cm_id *id;
+	int i, kick = 0;
+
+	pthread_mutex_lock(&pool->lock);
+	if (!pool->addr.sa.sa_family) {
+		rs_accept_pool_set_addr(pool, &cm_id->route.addr.src_addr);
+		kick = pool->addr.sa.sa_family;
+	}
+
+	for (i = pool->cnt - 1; i >= 0; i--) {
+		if (pool->eps[i]->cm_id->verbs != cm_id->verbs)
+			continue;
+
+		ep = pool->eps[i];
+		pool->eps[i] = pool->eps[--pool->cnt];
+		id = ep->cm_id;
+		/* take over what rs_create_ep set up on the placeholder id */
+		cm_id->pd = id->pd;
+		cm_id->qp = id->qp;
+		cm_id->send_cq = id->send_cq;
+		cm_id->recv_cq = id->recv_cq;
+		cm_id->send_cq_channel = id->send_cq_channel;
+		cm_id->recv_cq_channel = id->recv_cq_channel;
+		if (cm_id->recv_cq->cq_context == id)
+			cm_id->recv_cq->cq_context = cm_id;
+		id->qp = NULL;
+		id->send_cq = id->recv_cq = NULL;
+		id->send_cq_channel = id->recv_cq_channel = NULL;
+		ep->cm_id = cm_id;
+		pool->idle_ids[pool->idle_cnt++] = id;
+		kick = 1;
+		break;
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	if (kick)
+		rs_accept_pool_kick(pool);
+	return ep;
+}
+
+/*
+ * Returns the rsocket that will own cm_id.  On failure the request is
+ * rejected and cm_id destroyed.
+ */
+static struct rsocket *rs_accept_alloc(struct rsocket *rs,
+				       struct rdma_cm_id *cm_id)
+{
+	struct rsocket *new_rs;
+
+	new_rs = rs->accept_pool ? rs_accept_pool_get(rs, cm_id) : NULL;
+	if (!new_rs) {
+		new_rs = rs_alloc(rs, rs->type);
+		if (!new_rs) {
+			rdma_reject(cm_id, NULL, 0);
+			rdma_destroy_id(cm_id);
+			errno = ENOMEM;
+			return NULL;
+		}
+		new_rs->cm_id = cm_id;
+	}
+	return new_rs;
+}
+
+/*
+ * Builds the endpoint for a connection request and the parameters to
+ * accept it with.  The request's private data is released with its event,
+ * so everything that is needed from it is taken here.
+ */
+static int rs_accept_prep(struct rsocket *rs, struct rsocket *new_rs,
+			  struct rdma_conn_param *param,
+			  struct rs_conn_data *cresp)
+{
+	struct rs_conn_data *creq;
+	size_t len;
+	int ret;
+
+	creq = (struct rs_conn_data *)
+	       (new_rs->cm_id->event->param.conn.private_data + rs_conn_data_offset(rs));
+	if (creq->version != 1)
+		return ERR(ENOTSUP);
+
+	if (!new_rs->cm_id->qp) {
+		ret = rs_create_ep(new_rs);
+		if (ret)
+			return ret;
+	}
+
+	*param = new_rs->cm_id->event->param.conn;
+	len = param->private_data_len - rs_conn_data_offset(rs);
+	ret = rs_conn_data_save(new_rs, creq, len);
+	if (ret)
+		return ret;
+
+	rs_save_conn_data(new_rs, creq);
+	rs_format_conn_data(new_rs, cresp);
+	if (!(creq->flags & RS_CONN_FLAG_DATA))
+		cresp->flags &= ~RS_CONN_FLAG_DATA;
+	if (rs_local_accept(new_rs, creq, len))
+		cresp->flags |= RS_CONN_FLAG_LOCAL;
+	param->private_data = cresp;
+	param->private_data_len = rs_conn_data_add(cresp,
+		(creq->flags & RS_CONN_FLAG_DATA) ? rs->conn_sdata : NULL,
+		rs->conn_slen, RS_CONN_REP_SIZE);
+
+	if (rs->conn_sdata && !cresp->data_len) {
+		new_rs->conn_sdata = malloc(rs->conn_slen);
+		if (!new_rs->conn_sdata)
+			return ERR(ENOMEM);
+		memcpy(new_rs->conn_sdata, rs->conn_sdata, rs->conn_slen);
+		new_rs->conn_slen = rs->conn_slen;
+	}
+	return 0;
+}
+
+/*
+ * A sharded listener spreads connection setup across threads, in the way
+ * SO_REUSEPORT spreads it across processes.  A dispatcher thread takes
+ * each request off the listen channel and passes it to a shard, either
+ * round-robin or by peer address.  The shard builds the endpoint, moves
+ * the request onto the shard's own event channel and accepts it without
+ * blocking, so each shard has many connections in flight.  Once a
+ * connection is established, its cm_id moves to a channel of its own, as
+ * raccept would leave it, and the rsocket is queued on the listener.
+ * raccept then only dequeues it.
+ */
+struct rs_accept_shard {
+	pthread_t	  thread;
+	int		  pipe[2];	/* cm_id's from the dispatcher */
+	struct rdma_event_channel *channel;
+	dlist_entry	  accepting;
+	struct rs_accept_shards *shards;
+};
+
+struct rs_accept_shards {
+	struct rsocket	  *rs;
+	pthread_t	  dispatcher;
+	pthread_mutex_t	  lock;
+	int		  stop;		/* eventfd, stops the dispatcher */
+	int		  ready;	/* semaphore eventfd, counts ready_list */
+	int		  closing;
+	int		  cnt;
+	unsigned int	  next;
+	dlist_entry	  ready_list;
+	struct rs_accept_shard *shard;
+};
+
+static void rs_accept_shard_start(struct rs_accept_shard *shard,
+				  struct rdma_cm_id *cm_id)
+{
+	struct rsocket *rs = shard->shards->rs, *new_rs;
+	struct rdma_conn_param param;
+	struct rs_conn_private_data cresp;
+
+	if (shard->shards->closing) {
+		rdma_reject(cm_id, NULL, 0);
+		rdma_destroy_id(cm_id);
+		return;
+	}
+
+	new_rs = rs_accept_alloc(rs, cm_id);
+	if (!new_rs)
+		return;
+
+	if (rs_accept_prep(rs, new_rs, &param, &cresp.conn_data) ||
+	    rdma_migrate_id(new_rs->cm_id, shard->channel))
+		goto err;
+
+	new_rs->cm_id->context = new_rs;
+	rs_set_state(new_rs, rs_accepting);
+	if (rdma_accept(new_rs->cm_id, &param))
+		goto err;
+
+	dlist_insert_tail(&new_rs->accept_entry, &shard->accepting);
+	return;
+err:
+	rs_free(new_rs);
+}
+
+static void rs_accept_shard_ready(struct rs_accept_shards *shards,
+				  struct rsocket *new_rs)
+{
+	uint64_t cnt = 1;
+
+	if (rdma_migrate_id(new_rs->cm_id, NULL) ||
+	    rs_insert(new_rs, new_rs->cm_id->channel->fd) < 0) {
+		rs_free(new_rs);
+		return;
+	}
+
+	rs_set_state(new_rs, rs_connect_rdwr);
+	rs_conn_data_flush(new_rs, 0);
+	pthread_mutex_lock(&shards->lock);
+	dlist_insert_tail(&new_rs->accept_entry, &shards->ready_list);
+	pthread_mutex_unlock(&shards->lock);
+	write(shards->ready, &cnt, sizeof cnt);
+}
+
+static void rs_accept_shard_events(struct rs_accept_shard *shard)
+{
+	struct rdma_cm_event *event;
+	struct rsocket *new_rs;
+	int established;
+
+	while (!rdma_get_cm_event(shard->channel, &event)) {
+		new_rs = event->id->context;
+		established = (event->event == RDMA_CM_EVENT_ESTABLISHED);
+		rdma_ack_cm_event(event);
+
+		dlist_remove(&new_rs->accept_entry);
+		if (established)
+			rs_accept_shard_ready(shard->shards, new_rs);
+		else
+			rs_free(new_rs);
+	}
+}
+
+static void *rs_accept_shard_run(void *arg)
+{
+	struct rs_accept_shard *shard = arg;
+	struct rdma_cm_id *cm_id;
+	struct rsocket *new_rs;
+	struct pollfd fds[2];
+
+	fds[0].fd = shard->pipe[0];
+	fds[0].events = POLLIN;
+	fds[1].fd = shard->channel->fd;
+	fds[1].events = POLLIN;
+	for (;;) {
+		if (poll(fds, 2, -1) < 0)
+			continue;
+
+		if (fds[1].revents)
+			rs_accept_shard_events(shard);
+
+		if (fds[0].revents) {
+			if (read(shard->pipe[0], &cm_id, sizeof cm_id) != sizeof cm_id)
+				break;
+			rs_accept_shard_start(shard, cm_id);
+		}
+	}
+
+	while (!dlist_empty(&shard->accepting)) {
+		new_rs = container_of(shard->accepting.next, struct rsocket,
+				      accept_entry);
+		dlist_remove(&new_rs->accept_entry);
+		rs_free(new_rs);
+	}
+	return NULL;
+}
+
+static unsigned int rs_addr_hash(struct sockaddr *addr)
+{
+	uint32_t *a;
+
+	if (addr->sa_family == AF_INET)
+		return ntohl(((struct sockaddr_in *) addr)->sin_addr.s_addr);
+
+	a = (uint32_t *) &((struct sockaddr_in6 *) addr)->sin6_addr;
+	return ntohl(a[0] ^ a[1] ^ a[2] ^ a[3]);
+}
+
+static void *rs_accept_dispatch(void *arg)
+{
+	struct rs_accept_shards *shards = arg;
+	struct rsocket *rs = shards->rs;
+	struct rdma_cm_id *cm_id;
+	struct pollfd fds[2];
+	unsigned int i;
+
+	fds[0].fd = rs->cm_id->channel->fd;
+	fds[0].events = POLLIN;
+	fds[1].fd = shards->stop;
+	fds[1].events = POLLIN;
+	for (;;) {
+		if (poll(fds, 2, -1) < 0)
+			continue;
+
+		if (fds[1].revents)
+			break;
+
+		if (!fds[0].revents || rdma_get_request(rs->cm_id, &cm_id))
+			continue;
+
+		if (rs->opts & RS_OPT_ACCEPT_HASH)
+			i = rs_addr_hash(rdma_get_peer_addr(cm_id)) % shards->cnt;
+		else
+			i = shards->next++ % shards->cnt;
+
+		if (write(shards->shard[i].pipe[1], &cm_id, sizeof cm_id) !=
+		    sizeof cm_id) {
+			rdma_reject(cm_id, NULL, 0);
+			rdma_destroy_id(cm_id);
+		}
+	}
+	return NULL;
+}
+
+/* Closing the pipes tells the shards to exit after their last request */
+static void rs_accept_shards_join(struct rs_accept_shards *shards, int cnt)
+{
+	int i;
+
+	for (i = 0; i < cnt; i++) {
+		close(shards->shard[i].pipe[1]);
+		shards->shard[i].pipe[1] = -1;
+	}
+	for (i = 0; i < cnt; i++)
+		pthread_join(shards->shard[i].thread, NULL);
+}
+
+static void rs_accept_shards_free(struct rs_accept_shards *shards)
+{
+	struct rs_accept_shard *shard;
+	int i;
+
+	for (i = 0; i < shards->cnt; i++) {
+		shard = &shards->shard[i];
+		if (shard->pipe[0] >= 0)
+			close(shard->pipe[0]);
+		if (shard->pipe[1] >= 0)
+			close(shard->pipe[1]);
+		if (shard->channel)
+			rdma_destroy_event_channel(shard->channel);
+	}
+	if (shards->stop >= 0)
+		close(shards->stop);
+	if (shards->ready >= 0)
+		close(shards->ready);
+	pthread_mutex_destroy(&shards->lock);
+	free(shards);
 }
 
-int rsocket(int domain, int type, int protocol)
+/*
+ * The fd that signals progress before an rsocket connects.  Sharded
+ * listeners signal ready connections instead of requests.
+ */
+static int rs_cm_fd(struct rsocket *rs)
 {
-	struct rsocket *rs;
-	int index, ret;
+	return rs->accept_shards ? rs->accept_shards->ready :
+				   rs->cm_id->channel->fd;
+}
 
-	if ((domain != AF_INET && domain != AF_INET6 && domain != AF_IB) ||
-	    ((type != SOCK_STREAM) && (type != SOCK_DGRAM)) ||
-	    (type == SOCK_STREAM && protocol && protocol != IPPROTO_TCP) ||
-	    (type == SOCK_DGRAM && protocol && protocol != IPPROTO_UDP))
-		return ERR(ENOTSUP);
+static int rs_accept_shards_start(struct rsocket *rs)
+{
+	struct rs_accept_shards *shards;
+	struct rs_accept_shard *shard;
+	int i, ret;
 
-	rs_configure();
-	rs = rs_alloc(NULL, type);
-	if (!rs)
+	shards = calloc(1, sizeof(*shards) +
+			   sizeof(*shards->shard) * rs->accept_shard_cnt);
+	if (!shards)
 		return ERR(ENOMEM);
 
-	if (type == SOCK_STREAM) {
-		ret = rdma_create_id(NULL, &rs->cm_id, rs, RDMA_PS_TCP);
-		if (ret)
+	shards->rs = rs;
+	pthread_mutex_init(&shards->lock, NULL);
+	dlist_init(&shards->ready_list);
+	shards->cnt = rs->accept_shard_cnt;
+	shards->shard = (struct rs_accept_shard *) (shards + 1);
+	for (i = 0; i < shards->cnt; i++) {
+		shard = &shards->shard[i];
+		shard->pipe[0] = shard->pipe[1] = -1;
+		shard->shards = shards;
+		dlist_init(&shard->accepting);
+	}
+
+	shards->stop = eventfd(0, EFD_NONBLOCK);
+	shards->ready = eventfd(0, EFD_NONBLOCK | EFD_SEMAPHORE);
+	if (shards->stop < 0 || shards->ready < 0)
+		goto err;
+
+	for (i = 0; i < shards->cnt; i++) {
+		shard = &shards->shard[i];
+		if (pipe(shard->pipe))
 			goto err;
 
-		rs->cm_id->route.addr.src_addr.sa_family = domain;
-		index = rs->cm_id->channel->fd;
-	} else {
-		ret = ds_init(rs, domain);
-		if (ret)
+		shard->channel = rdma_create_event_channel();
+		if (!shard->channel ||
+		    fcntl(shard->channel->fd, F_SETFL, O_NONBLOCK))
 			goto err;
+	}
 
-		index = rs->udp_sock;
+	for (i = 0; i < shards->cnt; i++) {
+		ret = pthread_create(&shards->shard[i].thread, NULL,
+				     rs_accept_shard_run, &shards->shard[i]);
+		if (ret)
+			goto join;
 	}
 
-	ret = rs_insert(rs, index);
-	if (ret < 0)
-		goto err;
+	ret = pthread_create(&shards->dispatcher, NULL, rs_accept_dispatch,
+			     shards);
+	if (ret)
+		goto join;
 
-	return rs->index;
+	rs->accept_shards = shards;
+	if (rs->ev_flags & RS_EV_CM_CHANNEL) {
+		epoll_ctl(rs->evfd, EPOLL_CTL_DEL, rs->cm_id->channel->fd, NULL);
+		rs->ev_flags &= ~RS_EV_CM_CHANNEL;
+		rs_evfd_add(rs, shards->ready, RS_EV_CM_CHANNEL);
+	}
+	return 0;
 
+join:
+	rs_accept_shards_join(shards, i);
+	rs_accept_shards_free(shards);
+	return ERR(ret);
 err:
-	rs_free(rs);
-	return ret;
+	ret = errno;
+	rs_accept_shards_free(shards);
+	return ERR(ret);
 }
 
-int rbind(int socket, const struct sockaddr *addr, socklen_t addrlen)
+static void rs_accept_shards_stop(struct rsocket *rs)
 {
-	struct rsocket *rs;
-	int ret;
+	struct rs_accept_shards *shards = rs->accept_shards;
+	struct rsocket *new_rs;
+	uint64_t cnt = 1;
 
-	rs = idm_lookup(&idm, socket);
-	if (!rs)
-		return ERR(EBADF);
-	if (rs->type == SOCK_STREAM) {
-		ret = rdma_bind_addr(rs->cm_id, (struct sockaddr *) addr);
-		if (!ret)
-			rs->state = rs_bound;
-	} else {
-		if (rs->state == rs_init) {
-			ret = ds_init_ep(rs);
-			if (ret)
-				return ret;
-		}
-		ret = bind(rs->udp_sock, addr, addrlen);
+	shards->closing = 1;
+	write(shards->stop, &cnt, sizeof cnt);
+	pthread_join(shards->dispatcher, NULL);
+	rs_accept_shards_join(shards, shards->cnt);
+
+	while (!dlist_empty(&shards->ready_list)) {
+		new_rs = container_of(shards->ready_list.next, struct rsocket,
+				      accept_entry);
+		dlist_remove(&new_rs->accept_entry);
+		rclose(new_rs->index);
 	}
-	return ret;
+
+	rs->accept_shards = NULL;
+	if (rs->ev_flags & RS_EV_CM_CHANNEL) {
+		epoll_ctl(rs->evfd, EPOLL_CTL_DEL, shards->ready, NULL);
+		rs->ev_flags &= ~RS_EV_CM_CHANNEL;
+		rs_evfd_add(rs, rs->cm_id->channel->fd, RS_EV_CM_CHANNEL);
+	}
+	rs_accept_shards_free(shards);
 }
 
 int rlisten(int socket, int backlog)
@@ -1178,14 +3011,72 @@ int rlisten(int socket, int backlog)
 	if (!rs)
 		return ERR(EBADF);
 
-	if (rs->state != rs_listening) {
-		ret = rdma_listen(rs->cm_id, backlog);
-		if (!ret)
-			rs->state = rs_listening;
-	} else {
-		ret = 0;
+	if (rs->state == rs_listening)
+		return 0;
+
+	/*
+	 * A cm_id cannot stop listening, so the pool and shards are started
+	 * first, and stopped again if anything fails.
+	 */
+	if (rs->accept_pool_size) {
+		ret = rs_accept_pool_start(rs);
+		if (ret)
+			return ret;
 	}
-	return ret;
+
+	if (rs->accept_shard_cnt) {
+		ret = rs_accept_shards_start(rs);
+		if (ret)
+			goto err;
+	}
+
+	ret = rdma_listen(rs->cm_id, backlog);
+	if (ret)
+		goto err;
+
+	rs_set_state(rs, rs_listening);
+	return 0;
+
+err:
+	ret = errno;
+	if (rs->accept_shards)
+		rs_accept_shards_stop(rs);
+	if (rs->accept_pool)
+		rs_accept_pool_stop(rs);
+	return ERR(ret);
+}
+
+/*
+ * Takes the next connection established by the shards of a listener.
+ */
+static int rs_accept_ready(struct rsocket *rs, struct sockaddr *addr,
+			   socklen_t *addrlen)
+{
+	struct rs_accept_shards *shards = rs->accept_shards;
+	struct rsocket *new_rs;
+	struct pollfd fds;
+	uint64_t cnt;
+
+	while (read(shards->ready, &cnt, sizeof cnt) != sizeof cnt) {
+		if ((errno != EAGAIN && errno != EWOULDBLOCK) ||
+		    (rs->fd_flags & O_NONBLOCK))
+			return -1;
+
+		fds.fd = shards->ready;
+		fds.events = POLLIN;
+		fds.revents = 0;
+		poll(&fds, 1, -1);
+	}
+
+	pthread_mutex_lock(&shards->lock);
+	new_rs = container_of(shards->ready_list.next, struct rsocket,
+			      accept_entry);
+	dlist_remove(&new_rs->accept_entry);
+	pthread_mutex_unlock(&shards->lock);
+
+	if (addr && addrlen)
+		rgetpeername(new_rs->index, addr, addrlen);
+	return new_rs->index;
 }
 
 /*
@@ -1200,52 +3091,46 @@ int rlisten(int socket, int backlog)
  * Data transfers on the new socket remain blocking unless the user
  * specifies otherwise through rfcntl.
  */
-int raccept(int socket, struct sockaddr *addr, socklen_t *addrlen)
+static int rs_accept(int socket, struct sockaddr *addr, socklen_t *addrlen)
 {
 	struct rsocket *rs, *new_rs;
 	struct rdma_conn_param param;
-	struct rs_conn_data *creq, cresp;
+	struct rs_conn_private_data cresp;
+	struct rdma_cm_id *cm_id;
 	int ret;
 
 	rs = idm_lookup(&idm, socket);
 	if (!rs)
 		return ERR(EBADF);
-	new_rs = rs_alloc(rs, rs->type);
-	if (!new_rs)
-		return ERR(ENOMEM);
 
-	ret = rdma_get_request(rs->cm_id, &new_rs->cm_id);
+	if (rs->accept_shards)
+		return rs_accept_ready(rs, addr, addrlen);
+
+	ret = rdma_get_request(rs->cm_id, &cm_id);
 	if (ret)
-		goto err;
+		return ret;
+
+	new_rs = rs_accept_alloc(rs, cm_id);
+	if (!new_rs)
+		return -1;
 
 	ret = rs_insert(new_rs, new_rs->cm_id->channel->fd);
 	if (ret < 0)
 		goto err;
 
-	creq = (struct rs_conn_data *)
-	       (new_rs->cm_id->event->param.conn.private_data + rs_conn_data_offset(rs));
-	if (creq->version != 1) {
-		ret = ERR(ENOTSUP);
-		goto err;
-	}
-
 	if (rs->fd_flags & O_NONBLOCK)
 		fcntl(new_rs->cm_id->channel->fd, F_SETFL, O_NONBLOCK);
 
-	ret = rs_create_ep(new_rs);
+	ret = rs_accept_prep(rs, new_rs, &param, &cresp.conn_data);
 	if (ret)
 		goto err;
 
-	rs_save_conn_data(new_rs, creq);
-	param = new_rs->cm_id->event->param.conn;
-	rs_format_conn_data(new_rs, &cresp);
-	param.private_data = &cresp;
-	param.private_data_len = sizeof cresp;
 	ret = rdma_accept(new_rs->cm_id, &param);
-	if (!ret)
-		new_rs->state = rs_connect_rdwr;
-	else if (errno == EAGAIN || errno == EWOULDBLOCK)
-		new_rs->state = rs_accepting;
+	if (!ret) {
+		rs_set_state(new_rs, rs_connect_rdwr);
+		rs_conn_data_flush(new_rs, 0);
+	} else if (errno == EAGAIN || errno == EWOULDBLOCK)
+		rs_set_state(new_rs, rs_accepting);
 	else
 		goto err;
 
@@ -1258,24 +3143,352 @@ err:
 	return ret;
 }
 
+int raccept(int socket, struct sockaddr *addr, socklen_t *addrlen)
+{
+	uint64_t start = rs_lat_start();
+	int ret;
+
+	ret = rs_accept(socket, addr, addrlen);
+	rs_lat_end(RSOCKET_LAT_ACCEPT, start);
+	return ret;
+}
+
+/* Record the time spent in the connect phase that just completed */
+static void rs_conn_phase(struct rsocket *rs, int op)
+{
+	uint64_t start = rs->conn_start;
+
+	if (start) {
+		rs->conn_start = rs_time_ns();
+		rs_lat_end(op, start);
+	}
+}
+
+/*
+ * Create the QP and buffers, unless that was already done while the
+ * route resolved.  Blocking rsockets switch their rdma_cm channel
+ * back to blocking afterwards.
+ */
+static int rs_connect_ep(struct rsocket *rs)
+{
+	int ret;
+
+	if (rs->cm_id->qp)
+		return 0;
+
+	ret = rs_create_ep(rs);
+	if (ret)
+		return ret;
+
+	rs_conn_phase(rs, RSOCKET_LAT_CREATE_EP);
+	if (!(rs->fd_flags & O_NONBLOCK))
+		fcntl(rs->cm_id->channel->fd, F_SETFL, 0);
+	return 0;
+}
+
+static void rs_format_conn_param(struct rsocket *rs,
+				 struct rdma_conn_param *param,
+				 struct rs_conn_private_data *cdata)
+{
+	struct rs_conn_data *creq;
+
+	memset(param, 0, sizeof *param);
+	creq = (void *) cdata + rs_conn_data_offset(rs);
+	rs_format_conn_data(rs, creq);
+	rs_local_offer(rs, creq);
+	param->private_data = (void *) creq - rs_conn_data_offset(rs);
+	param->private_data_len = rs_conn_data_offset(rs) +
+		rs_conn_data_add(creq, rs->conn_sdata, rs->conn_slen,
+				 RS_CONN_REQ_SIZE);
+	rs->conn_sent = (creq->data_len != 0);
+	param->flow_control = 1;
+	param->retry_count = 7;
+	param->rnr_retry_count = 7;
+	/* work-around: iWarp issues RDMA read during connection */
+	if (rs->opts & RS_OPT_MSG_SEND)
+		param->initiator_depth = 1;
+}
+
+/* Completes the active side once the connection is established */
+static int rs_connect_done(struct rsocket *rs, struct rdma_conn_param *param)
+{
+	struct rs_conn_data *cresp = (struct rs_conn_data *) param->private_data;
+	int data_ack, ret;
+
+	if (cresp->version != 1)
+		return ERR(ENOTSUP);
+
+	data_ack = rs->conn_sent && (cresp->flags & RS_CONN_FLAG_DATA);
+	ret = rs_conn_data_save(rs, cresp, param->private_data_len);
+	if (ret)
+		return ret;
+
+	rs_save_conn_data(rs, cresp);
+	if (rs->local_fd >= 0) {
+		ret = rs_local_connect(rs, cresp);
+		if (ret)
+			return ret;
+	}
+	if (data_ack) {
+		free(rs->conn_sdata);
+		rs->conn_sdata = NULL;
+		rs->conn_slen = 0;
+	}
+	rs_set_state(rs, rs_connect_rdwr);
+	rs_conn_data_flush(rs, 0);
+	return 0;
+}
+
+/*
+ * Process-wide cache of IB path records, so that repeated connections to
+ * the same destination do not query the SA or ACM again.  Entries are
+ * keyed by device, port and address pair, and expire after
+ * route_cache_ttl seconds.  An entry is only used while the local port
+ * is active with the LID and SM LID it had when the path was resolved,
+ * which catches port events without consuming the device's async events.
+ * A connection that fails with a cached path drops the entry, so the
+ * next attempt resolves the route again.  Other transports resolve routes
+ * locally, and are not cached.
+ *
+ * Entries are also listed in the order they were added.  All entries
+ * have the same lifetime, so that is also the order they expire in.
+ * Adding an entry drops expired entries from the head of the list, and
+ * the oldest entries beyond RS_ROUTE_CACHE_MAX, so the cache stays
+ * bounded when destinations are not connected to again.
+ */
+struct rs_route {
+	struct ibv_context *verbs;	/* key */
+	union socket_addr src;
+	union socket_addr dst;
+	uint8_t		  port_num;
+	uint16_t	  lid;		/* port state when resolved */
+	uint16_t	  sm_lid;
+	uint64_t	  expires;
+	struct ibv_path_data path;
+	dlist_entry	  entry;	/* on route_list, oldest first */
+};
+
+#define RS_ROUTE_KEY_SIZE offsetof(struct rs_route, lid)
+#define RS_ROUTE_CACHE_MAX 4096
+
+static void *route_cache;
+static dlist_entry route_list = { &route_list, &route_list };
+static int route_cnt;
+static pthread_mutex_t route_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int rs_route_compare(const void *r1, const void *r2)
+{
+	return memcmp(r1, r2, RS_ROUTE_KEY_SIZE);
+}
+
+static void rs_route_key_addr(union socket_addr *key, struct sockaddr *addr)
+{
+	if (addr->sa_family == AF_INET) {
+		key->sin.sin_family = AF_INET;
+		key->sin.sin_addr = ((struct sockaddr_in *) addr)->sin_addr;
+	} else {
+		key->sin6.sin6_family = AF_INET6;
+		key->sin6.sin6_addr = ((struct sockaddr_in6 *) addr)->sin6_addr;
+		key->sin6.sin6_scope_id = ((struct sockaddr_in6 *) addr)->sin6_scope_id;
+	}
+}
+
+/* Returns 0 if the connection's route can be cached, with key filled in */
+static int rs_route_key(struct rsocket *rs, struct rs_route *key)
+{
+	struct rdma_addr *addr = &rs->cm_id->route.addr;
+
+	if (!route_cache_ttl || !rs->cm_id->verbs ||
+	    rs->cm_id->verbs->device->transport_type != IBV_TRANSPORT_IB ||
+	    addr->src_addr.sa_family != addr->dst_addr.sa_family ||
+	    (addr->src_addr.sa_family != AF_INET &&
+	     addr->src_addr.sa_family != AF_INET6))
+		return -1;
+
+	memset(key, 0, sizeof *key);
+	key->verbs = rs->cm_id->verbs;
+	key->port_num = rs->cm_id->port_num;
+	rs_route_key_addr(&key->src, &addr->src_addr);
+	rs_route_key_addr(&key->dst, &addr->dst_addr);
+	return 0;
+}
+
+static int rs_route_port(struct rs_route *route, uint16_t *lid, uint16_t *sm_lid)
+{
+	struct ibv_port_attr attr;
+
+	if (ucma_ibv_query_port(route->verbs, route->port_num, &attr) ||
+	    attr.state != IBV_PORT_ACTIVE)
+		return -1;
+
+	*lid = attr.lid;
+	*sm_lid = attr.sm_lid;
+	return 0;
+}
+
+static void rs_route_remove(struct rs_route *route)
+{
+	tdelete(route, &route_cache, rs_route_compare);
+	dlist_remove(&route->entry);
+	route_cnt--;
+	free(route);
+}
+
+/* Makes room for one entry */
+static void rs_route_trim(void)
+{
+	struct rs_route *route;
+	uint64_t now = fastlock_time_us();
+
+	while (!dlist_empty(&route_list)) {
+		route = container_of(route_list.next, struct rs_route, entry);
+		if (route->expires > now && route_cnt < RS_ROUTE_CACHE_MAX)
+			break;
+		rs_route_remove(route);
+	}
+}
+
+/*
+ * Sets a cached path on the connection, in place of rdma_resolve_route.
+ * The path is set without blocking, and completes with a route resolved
+ * event.
+ */
+static int rs_route_lookup(struct rsocket *rs)
+{
+	struct rs_route key, **tdata, *route;
+	struct ibv_path_data path;
+	uint16_t lid, sm_lid;
+
+	if (rs_route_key(rs, &key))
+		return -1;
+
+	pthread_mutex_lock(&route_lock);
+	tdata = tfind(&key, &route_cache, rs_route_compare);
+	route = tdata ? *tdata : NULL;
+	if (route && (route->expires <= fastlock_time_us() ||
+		      rs_route_port(route, &lid, &sm_lid) ||
+		      lid != route->lid || sm_lid != route->sm_lid)) {
+		rs_route_remove(route);
+		route = NULL;
+	}
+	if (route)
+		path = route->path;
+	pthread_mutex_unlock(&route_lock);
+
+	if (!route || rdma_set_option(rs->cm_id, RDMA_OPTION_IB,
+				      RDMA_OPTION_IB_PATH, &path, sizeof path))
+		return -1;
+
+	rs->opts |= RS_OPT_ROUTE_SET;
+	return 0;
+}
+
+/* Adds the primary path of a resolved route to the cache */
+static void rs_route_save(struct rsocket *rs)
+{
+	struct ibv_sa_path_rec *rec = rs->cm_id->route.path_rec;
+	struct rs_route *route, **tdata;
+	struct ibv_path_record *path;
+
+	if ((rs->opts & RS_OPT_ROUTE_SET) || !rs->cm_id->route.num_paths ||
+	    !rec->reversible || !(route = malloc(sizeof *route)))
+		return;
+
+	if (rs_route_key(rs, route) ||
+	    rs_route_port(route, &route->lid, &route->sm_lid)) {
+		free(route);
+		return;
+	}
+
+	route->expires = fastlock_time_us() + (uint64_t) route_cache_ttl * 1000000;
+	route->path.flags = IBV_PATH_FLAG_GMP | IBV_PATH_FLAG_PRIMARY |
+			    IBV_PATH_FLAG_BIDIRECTIONAL;
+	route->path.reserved = 0;
+	path = &route->path.path;
+	memset(path, 0, sizeof *path);
+	path->dgid = rec->dgid;
+	path->sgid = rec->sgid;
+	path->dlid = rec->dlid;
+	path->slid = rec->slid;
+	path->flowlabel_hoplimit = htonl((ntohl(rec->flow_label) << 8) |
+					 rec->hop_limit);
+	path->tclass = rec->traffic_class;
+	path->reversible_numpath = (1 << 7) | 1;
+	path->pkey = rec->pkey;
+	path->qosclass_sl = htons(rec->sl & 0xF);
+	path->mtu = (2 << 6) | rec->mtu;		/* exactly */
+	path->rate = (2 << 6) | rec->rate;
+	path->packetlifetime = (2 << 6) | rec->packet_life_time;
+
+	pthread_mutex_lock(&route_lock);
+	rs_route_trim();
+	tdata = tsearch(route, &route_cache, rs_route_compare);
+	if (!tdata) {
+		free(route);
+		goto out;
+	}
+	if (*tdata != route) {
+		dlist_remove(&(*tdata)->entry);
+		free(*tdata);
+		*tdata = route;
+	} else {
+		route_cnt++;
+	}
+	dlist_insert_tail(&route->entry, &route_list);
+out:
+	pthread_mutex_unlock(&route_lock);
+}
+
+/*
+ * Called when a connection fails with err, in case its cached path is
+ * stale.  Only errors that point at the path drop it.  A reject means the
+ * path worked, and dropping it would send every reconnect to a restarting
+ * server back to the SA.
+ */
+static void rs_route_drop(struct rsocket *rs, int err)
+{
+	struct rs_route key, **tdata;
+
+	switch (err) {
+	case ETIMEDOUT:
+	case EHOSTUNREACH:
+	case ENETUNREACH:
+	case EADDRNOTAVAIL:
+		break;
+	default:
+		return;
+	}
+
+	if (!(rs->opts & RS_OPT_ROUTE_SET) || rs_route_key(rs, &key))
+		return;
+
+	pthread_mutex_lock(&route_lock);
+	tdata = tfind(&key, &route_cache, rs_route_compare);
+	if (tdata)
+		rs_route_remove(*tdata);
+	pthread_mutex_unlock(&route_lock);
+}
+
 static int rs_do_connect(struct rsocket *rs)
 {
 	struct rdma_conn_param param;
 	struct rs_conn_private_data cdata;
-	struct rs_conn_data *creq, *cresp;
 	int to, ret;
 
 	switch (rs->state) {
 	case rs_init:
 	case rs_bound:
+		rs->conn_start = rs_lat_start();
 resolve_addr:
 		to = 1000 << rs->retries++;
 		ret = rdma_resolve_addr(rs->cm_id, NULL,
 					&rs->cm_id->route.addr.dst_addr, to);
-		if (!ret)
+		if (!ret) {
+			rs_conn_phase(rs, RSOCKET_LAT_RESOLVE_ADDR);
 			goto resolve_route;
+		}
 		if (errno == EAGAIN || errno == EWOULDBLOCK)
-			rs->state = rs_resolving_addr;
+			rs_set_state(rs, rs_resolving_addr);
 		break;
 	case rs_resolving_addr:
 		ret = ucma_complete(rs->cm_id);
@@ -1285,9 +3498,17 @@ resolve_addr:
 			break;
 		}
 
+		rs_conn_phase(rs, RSOCKET_LAT_RESOLVE_ADDR);
 		rs->retries = 0;
 resolve_route:
 		to = 1000 << rs->retries++;
+		/*
+		 * The QP and buffers only depend on the device, which is known
+		 * once the address resolves.  Issue the route request without
+		 * blocking, and create them while the route resolves.
+		 */
+		if (!rs->cm_id->qp && !(rs->fd_flags & O_NONBLOCK))
+			fcntl(rs->cm_id->channel->fd, F_SETFL, O_NONBLOCK);
 		if (rs->optval) {
 			ret = rdma_set_option(rs->cm_id,  RDMA_OPTION_IB,
 					      RDMA_OPTION_IB_PATH, rs->optval,
@@ -1295,19 +3516,29 @@ resolve_route:
 			free(rs->optval);
 			rs->optval = NULL;
 			if (!ret) {
-				rs->state = rs_resolving_route;
+				rs->opts |= RS_OPT_ROUTE_SET;
+				rs_set_state(rs, rs_resolving_route);
 				goto resolving_route;
 			}
+		} else if (!rs_route_lookup(rs)) {
+			rs_set_state(rs, rs_resolving_route);
+			goto resolving_route;
 		} else {
 			ret = rdma_resolve_route(rs->cm_id, to);
 			if (!ret)
 				goto do_connect;
 		}
-		if (errno == EAGAIN || errno == EWOULDBLOCK)
-			rs->state = rs_resolving_route;
+		if (errno == EAGAIN || errno == EWOULDBLOCK) {
+			rs_set_state(rs, rs_resolving_route);
+			goto resolving_route;
+		}
 		break;
 	case rs_resolving_route:
 resolving_route:
+		ret = rs_connect_ep(rs);
+		if (ret)
+			break;
+
 		ret = ucma_complete(rs->cm_id);
 		if (ret) {
 			if (errno == ETIMEDOUT && rs->retries <= RS_CONN_RETRIES)
@@ -1315,42 +3546,28 @@ resolving_route:
 			break;
 		}
 do_connect:
-		ret = rs_create_ep(rs);
+		rs_conn_phase(rs, RSOCKET_LAT_RESOLVE_ROUTE);
+		rs_route_save(rs);
+		ret = rs_connect_ep(rs);
 		if (ret)
 			break;
 
-		memset(&param, 0, sizeof param);
-		creq = (void *) &cdata + rs_conn_data_offset(rs);
-		rs_format_conn_data(rs, creq);
-		param.private_data = (void *) creq - rs_conn_data_offset(rs);
-		param.private_data_len = sizeof(*creq) + rs_conn_data_offset(rs);
-		param.flow_control = 1;
-		param.retry_count = 7;
-		param.rnr_retry_count = 7;
-		/* work-around: iWarp issues RDMA read during connection */
-		if (rs->opts & RS_OPT_MSG_SEND)
-			param.initiator_depth = 1;
+		rs_format_conn_param(rs, &param, &cdata);
 		rs->retries = 0;
 
 		ret = rdma_connect(rs->cm_id, &param);
 		if (!ret)
 			goto connected;
 		if (errno == EAGAIN || errno == EWOULDBLOCK)
-			rs->state = rs_connecting;
+			rs_set_state(rs, rs_connecting);
 		break;
 	case rs_connecting:
 		ret = ucma_complete(rs->cm_id);
 		if (ret)
 			break;
 connected:
-		cresp = (struct rs_conn_data *) rs->cm_id->event->param.conn.private_data;
-		if (cresp->version != 1) {
-			ret = ERR(ENOTSUP);
-			break;
-		}
-
-		rs_save_conn_data(rs, cresp);
-		rs->state = rs_connect_rdwr;
+		rs_conn_phase(rs, RSOCKET_LAT_ESTABLISH);
+		ret = rs_connect_done(rs, &rs->cm_id->event->param.conn);
 		break;
 	case rs_accepting:
 		if (!(rs->fd_flags & O_NONBLOCK))
@@ -1360,7 +3577,8 @@ connected:
 		if (ret)
 			break;
 
-		rs->state = rs_connect_rdwr;
+		rs_set_state(rs, rs_connect_rdwr);
+		rs_conn_data_flush(rs, 0);
 		break;
 	default:
 		ret = ERR(EINVAL);
@@ -1371,8 +3589,13 @@ connected:
 		if (errno == EAGAIN || errno == EWOULDBLOCK) {
 			errno = EINPROGRESS;
 		} else {
-			rs->state = rs_connect_error;
+			rs_set_state(rs, rs_connect_error);
 			rs->err = errno;
+			rs_route_drop(rs, rs->err);
+			/* the route may have been requested without blocking */
+			if (!(rs->fd_flags & O_NONBLOCK))
+				fcntl(rs->cm_id->channel->fd, F_SETFL, 0);
+			errno = rs->err;
 		}
 	}
 	return ret;
@@ -1445,14 +3668,14 @@ static int ds_add_qp_dest(struct ds_qp *qp, union socket_addr *addr,
 	qp->dest.qp = qp;
 	qp->dest.qpn = qp->cm_id->qp->qp_num;
 
-	ret = ibv_query_port(qp->cm_id->verbs, qp->cm_id->port_num, &port_attr);
+	ret = ucma_ibv_query_port(qp->cm_id->verbs, qp->cm_id->port_num, &port_attr);
 	if (ret)
 		return ret;
 
 	memset(&attr, 0, sizeof attr);
 	attr.dlid = port_attr.lid;
 	attr.port_num = qp->cm_id->port_num;
-	qp->dest.ah = ibv_create_ah(qp->cm_id->pd, &attr);
+	qp->dest.ah = ucma_ibv_create_ah(qp->cm_id->pd, &attr);
 	if (!qp->dest.ah)
 		return ERR(ENOMEM);
 
@@ -1590,7 +3813,7 @@ out:
 	return ret;
 }
 
-int rconnect(int socket, const struct sockaddr *addr, socklen_t addrlen)
+static int rs_connect(int socket, const struct sockaddr *addr, socklen_t addrlen)
 {
 	struct rsocket *rs;
 	int ret;
@@ -1601,6 +3824,10 @@ int rconnect(int socket, const struct sockaddr *addr, socklen_t addrlen)
 	if (rs->type == SOCK_STREAM) {
 		memcpy(&rs->cm_id->route.addr.dst_addr, addr, addrlen);
 		ret = rs_do_connect(rs);
+		if (rs->evfd >= 0) {
+			rs->ev_want_send = (ret && errno == EINPROGRESS);
+			rs_update_evfd(rs);
+		}
 	} else {
 		if (rs->state == rs_init) {
 			ret = ds_init_ep(rs);
@@ -1617,38 +3844,64 @@ int rconnect(int socket, const struct sockaddr *addr, socklen_t addrlen)
 	return ret;
 }
 
+int rconnect(int socket, const struct sockaddr *addr, socklen_t addrlen)
+{
+	uint64_t start = rs_lat_start();
+	int ret;
+
+	ret = rs_connect(socket, addr, addrlen);
+	rs_lat_end(RSOCKET_LAT_CONNECT, start);
+	return ret;
+}
+
 static void *rs_get_ctrl_buf(struct rsocket *rs)
 {
 	return rs->sbuf + rs->sbuf_size +
 		RS_MAX_CTRL_MSG * (rs->ctrl_seqno & (RS_QP_CTRL_SIZE - 1));
 }
 
-static int rs_post_msg(struct rsocket *rs, uint32_t msg)
+static int rs_post_msg_imm(struct rsocket *rs, uint32_t msg)
+{
+	struct ibv_send_wr wr, *bad;
+
+	rs_record(rs, RSOCKET_REC_SEND, msg);
+
+	wr.wr_id = rs_send_wr_id(msg);
+	wr.next = NULL;
+	wr.sg_list = NULL;
+	wr.num_sge = 0;
+	wr.opcode = IBV_WR_RDMA_WRITE_WITH_IMM;
+	wr.send_flags = 0;
+	wr.imm_data = htonl(msg);
+
+	return rdma_seterrno(ibv_post_send(rs->cm_id->qp, &wr, &bad));
+}
+
+static int rs_post_msg_msg(struct rsocket *rs, uint32_t msg)
 {
 	struct ibv_send_wr wr, *bad;
 	struct ibv_sge sge;
 
+	rs_record(rs, RSOCKET_REC_SEND, msg);
+
 	wr.wr_id = rs_send_wr_id(msg);
 	wr.next = NULL;
-	if (!(rs->opts & RS_OPT_MSG_SEND)) {
-		wr.sg_list = NULL;
-		wr.num_sge = 0;
-		wr.opcode = IBV_WR_RDMA_WRITE_WITH_IMM;
-		wr.send_flags = 0;
-		wr.imm_data = htonl(msg);
-	} else {
-		sge.addr = (uintptr_t) &msg;
-		sge.lkey = 0;
-		sge.length = sizeof msg;
-		wr.sg_list = &sge;
-		wr.num_sge = 1;
-		wr.opcode = IBV_WR_SEND;
-		wr.send_flags = IBV_SEND_INLINE;
-	}
+	sge.addr = (uintptr_t) &msg;
+	sge.lkey = 0;
+	sge.length = sizeof msg;
+	wr.sg_list = &sge;
+	wr.num_sge = 1;
+	wr.opcode = IBV_WR_SEND;
+	wr.send_flags = IBV_SEND_INLINE;
 
 	return rdma_seterrno(ibv_post_send(rs->cm_id->qp, &wr, &bad));
 }
 
+static inline int rs_post_msg(struct rsocket *rs, uint32_t msg)
+{
+	return rs->ops->post_msg(rs, msg);
+}
+
 static int rs_post_write(struct rsocket *rs,
 			 struct ibv_sge *sgl, int nsge,
 			 uint32_t wr_data, int flags,
@@ -1668,7 +3921,28 @@ static int rs_post_write(struct rsocket *rs,
 	return rdma_seterrno(ibv_post_send(rs->cm_id->qp, &wr, &bad));
 }
 
-static int rs_post_write_msg(struct rsocket *rs,
+static int rs_post_write_msg_imm(struct rsocket *rs,
+			 struct ibv_sge *sgl, int nsge,
+			 uint32_t msg, int flags,
+			 uint64_t addr, uint32_t rkey)
+{
+	struct ibv_send_wr wr, *bad;
+
+	rs_record(rs, RSOCKET_REC_SEND, msg);
+	wr.next = NULL;
+	wr.wr_id = rs_send_wr_id(msg);
+	wr.sg_list = sgl;
+	wr.num_sge = nsge;
+	wr.opcode = IBV_WR_RDMA_WRITE_WITH_IMM;
+	wr.send_flags = flags;
+	wr.imm_data = htonl(msg);
+	wr.wr.rdma.remote_addr = addr;
+	wr.wr.rdma.rkey = rkey;
+
+	return rdma_seterrno(ibv_post_send(rs->cm_id->qp, &wr, &bad));
+}
+
+static int rs_post_write_msg_msg(struct rsocket *rs,
 			 struct ibv_sge *sgl, int nsge,
 			 uint32_t msg, int flags,
 			 uint64_t addr, uint32_t rkey)
@@ -1677,35 +3951,31 @@ static int rs_post_write_msg(struct rsocket *rs,
 	struct ibv_sge sge;
 	int ret;
 
-	wr.next = NULL;
-	if (!(rs->opts & RS_OPT_MSG_SEND)) {
-		wr.wr_id = rs_send_wr_id(msg);
-		wr.sg_list = sgl;
-		wr.num_sge = nsge;
-		wr.opcode = IBV_WR_RDMA_WRITE_WITH_IMM;
-		wr.send_flags = flags;
-		wr.imm_data = htonl(msg);
-		wr.wr.rdma.remote_addr = addr;
-		wr.wr.rdma.rkey = rkey;
-
-		return rdma_seterrno(ibv_post_send(rs->cm_id->qp, &wr, &bad));
-	} else {
-		ret = rs_post_write(rs, sgl, nsge, msg, flags, addr, rkey);
-		if (!ret) {
-			wr.wr_id = rs_send_wr_id(rs_msg_set(rs_msg_op(msg), 0)) |
-				   RS_WR_ID_FLAG_MSG_SEND;
-			sge.addr = (uintptr_t) &msg;
-			sge.lkey = 0;
-			sge.length = sizeof msg;
-			wr.sg_list = &sge;
-			wr.num_sge = 1;
-			wr.opcode = IBV_WR_SEND;
-			wr.send_flags = IBV_SEND_INLINE;
+	rs_record(rs, RSOCKET_REC_SEND, msg);
+	ret = rs_post_write(rs, sgl, nsge, msg, flags, addr, rkey);
+	if (!ret) {
+		wr.next = NULL;
+		wr.wr_id = rs_send_wr_id(rs_msg_set(rs_msg_op(msg), 0)) |
+			   RS_WR_ID_FLAG_MSG_SEND;
+		sge.addr = (uintptr_t) &msg;
+		sge.lkey = 0;
+		sge.length = sizeof msg;
+		wr.sg_list = &sge;
+		wr.num_sge = 1;
+		wr.opcode = IBV_WR_SEND;
+		wr.send_flags = IBV_SEND_INLINE;
 
-			ret = rdma_seterrno(ibv_post_send(rs->cm_id->qp, &wr, &bad));
-		}
-		return ret;
+		ret = rdma_seterrno(ibv_post_send(rs->cm_id->qp, &wr, &bad));
 	}
+	return ret;
+}
+
+static inline int rs_post_write_msg(struct rsocket *rs,
+			 struct ibv_sge *sgl, int nsge,
+			 uint32_t msg, int flags,
+			 uint64_t addr, uint32_t rkey)
+{
+	return rs->ops->post_write_msg(rs, sgl, nsge, msg, flags, addr, rkey);
 }
 
 static int ds_post_send(struct rsocket *rs, struct ibv_sge *sge,
@@ -1738,10 +4008,12 @@ static int rs_write_data(struct rsocket *rs,
 	uint32_t rkey;
 
 	rs->sseq_no++;
-	rs->sqe_avail--;
-	if (rs->opts & RS_OPT_MSG_SEND)
-		rs->sqe_avail--;
+	rs->sqe_avail -= rs->ops->msg_sqe;
 	rs->sbuf_bytes_avail -= length;
+	rs->send_stats->bytes += length;
+	rs->send_stats->wrs++;
+	rdma_probe4(rs_post_data, rs->index, rs->sseq_no, length,
+		    rs->sbuf_bytes_avail);
 
 	addr = rs->target_sgl[rs->target_sge].addr;
 	rkey = rs->target_sgl[rs->target_sge].key;
@@ -1765,8 +4037,12 @@ static int rs_write_direct(struct rsocket *rs, struct rs_iomap *iom, uint64_t of
 
 	rs->sqe_avail--;
 	rs->sbuf_bytes_avail -= length;
+	rs->send_stats->bytes += length;
+	rs->send_stats->wrs++;
 
 	addr = iom->sge.addr + offset - iom->offset;
+	rdma_probe3(rs_post_direct, rs->index, addr, length);
+	rs_record(rs, RSOCKET_REC_SEND, rs_msg_set(RS_OP_WRITE, length));
 	return rs_post_write(rs, sgl, nsge, rs_msg_set(RS_OP_WRITE, length),
 			     flags, addr, iom->sge.key);
 }
@@ -1777,9 +4053,7 @@ static int rs_write_iomap(struct rsocket *rs, struct rs_iomap_mr *iomr,
 	uint64_t addr;
 
 	rs->sseq_no++;
-	rs->sqe_avail--;
-	if (rs->opts & RS_OPT_MSG_SEND)
-		rs->sqe_avail--;
+	rs->sqe_avail -= rs->ops->msg_sqe;
 	rs->sbuf_bytes_avail -= sizeof(struct rs_iomap);
 
 	addr = rs->remote_iomap.addr + iomr->index * sizeof(struct rs_iomap);
@@ -1793,7 +4067,22 @@ static uint32_t rs_sbuf_left(struct rsocket *rs)
 			   rs->ssgl[0].addr);
 }
 
-static void rs_send_credits(struct rsocket *rs)
+static inline int rs_ctrl_avail(struct rsocket *rs)
+{
+	return rs->ctrl_seqno != rs->ctrl_max_seqno;
+}
+
+/* Protocols that do not support RDMA write with immediate may require 2 msgs */
+static inline int rs_2ctrl_avail(struct rsocket *rs)
+{
+	return (int)((rs->ctrl_seqno + 1) - rs->ctrl_max_seqno) < 0;
+}
+
+/*
+ * msg_send and swap are constants in each caller, so the compiler
+ * generates a branch free version for every rs_ops variant.
+ */
+static inline void rs_send_credits(struct rsocket *rs, int msg_send, int swap)
 {
 	struct ibv_sge ibsge;
 	struct rs_sge sge, *sge_buf;
@@ -1801,11 +4090,14 @@ static void rs_send_credits(struct rsocket *rs)
 
 	rs->ctrl_seqno++;
 	rs->rseq_comp = rs->rseq_no + (rs->rq_size >> 1);
+	rs->cq_stats->credits_sent++;
+	rdma_probe3(rs_credits_send, rs->index, rs->rseq_no,
+		    rs->rbuf_bytes_avail);
 	if (rs->rbuf_bytes_avail >= (rs->rbuf_size >> 1)) {
-		if (rs->opts & RS_OPT_MSG_SEND)
+		if (msg_send)
 			rs->ctrl_seqno++;
 
-		if (!(rs->opts & RS_OPT_SWAP_SGL)) {
+		if (!swap) {
 			sge.addr = (uintptr_t) &rs->rbuf[rs->rbuf_free_offset];
 			sge.key = rs->rmr->rkey;
 			sge.length = rs->rbuf_size >> 1;
@@ -1828,7 +4120,8 @@ static void rs_send_credits(struct rsocket *rs)
 		}
 		ibsge.length = sizeof(sge);
 
-		rs_post_write_msg(rs, &ibsge, 1,
+		(msg_send ? rs_post_write_msg_msg : rs_post_write_msg_imm)(rs,
+			&ibsge, 1,
 			rs_msg_set(RS_OP_SGL, rs->rseq_no + rs->rq_size), flags,
 			rs->remote_sgl.addr + rs->remote_sge * sizeof(struct rs_sge),
 			rs->remote_sgl.key);
@@ -1840,38 +4133,46 @@ static void rs_send_credits(struct rsocket *rs)
 		if (++rs->remote_sge == rs->remote_sgl.length)
 			rs->remote_sge = 0;
 	} else {
-		rs_post_msg(rs, rs_msg_set(RS_OP_SGL, rs->rseq_no + rs->rq_size));
+		(msg_send ? rs_post_msg_msg : rs_post_msg_imm)(rs,
+			rs_msg_set(RS_OP_SGL, rs->rseq_no + rs->rq_size));
 	}
 }
 
-static inline int rs_ctrl_avail(struct rsocket *rs)
+static inline int rs_give_credits(struct rsocket *rs, int msg_send)
 {
-	return rs->ctrl_seqno != rs->ctrl_max_seqno;
+	return ((rs->rbuf_bytes_avail >= (rs->rbuf_size >> 1)) ||
+		((short) ((short) rs->rseq_no - (short) rs->rseq_comp) >= 0)) &&
+	       (msg_send ? rs_2ctrl_avail(rs) : rs_ctrl_avail(rs)) &&
+	       (rs->state & rs_connected);
 }
 
-/* Protocols that do not support RDMA write with immediate may require 2 msgs */
-static inline int rs_2ctrl_avail(struct rsocket *rs)
+static void rs_update_credits_imm(struct rsocket *rs)
 {
-	return (int)((rs->ctrl_seqno + 1) - rs->ctrl_max_seqno) < 0;
+	if (rs_give_credits(rs, 0))
+		rs_send_credits(rs, 0, 0);
 }
 
-static int rs_give_credits(struct rsocket *rs)
+static void rs_update_credits_imm_swap(struct rsocket *rs)
 {
-	if (!(rs->opts & RS_OPT_MSG_SEND)) {
-		return ((rs->rbuf_bytes_avail >= (rs->rbuf_size >> 1)) ||
-			((short) ((short) rs->rseq_no - (short) rs->rseq_comp) >= 0)) &&
-		       rs_ctrl_avail(rs) && (rs->state & rs_connected);
-	} else {
-		return ((rs->rbuf_bytes_avail >= (rs->rbuf_size >> 1)) ||
-			((short) ((short) rs->rseq_no - (short) rs->rseq_comp) >= 0)) &&
-		       rs_2ctrl_avail(rs) && (rs->state & rs_connected);
-	}
+	if (rs_give_credits(rs, 0))
+		rs_send_credits(rs, 0, 1);
+}
+
+static void rs_update_credits_msg(struct rsocket *rs)
+{
+	if (rs_give_credits(rs, 1))
+		rs_send_credits(rs, 1, 0);
+}
+
+static void rs_update_credits_msg_swap(struct rsocket *rs)
+{
+	if (rs_give_credits(rs, 1))
+		rs_send_credits(rs, 1, 1);
 }
 
-static void rs_update_credits(struct rsocket *rs)
+static inline void rs_update_credits(struct rsocket *rs)
 {
-	if (rs_give_credits(rs))
-		rs_send_credits(rs);
+	rs->ops->update_credits(rs);
 }
 
 static int rs_poll_cq(struct rsocket *rs)
@@ -1882,8 +4183,12 @@ static int rs_poll_cq(struct rsocket *rs)
 
 	while ((ret = ibv_poll_cq(rs->cm_id->recv_cq, 1, &wc)) > 0) {
 		if (rs_wr_is_recv(wc.wr_id)) {
-			if (wc.status != IBV_WC_SUCCESS)
+			if (wc.status != IBV_WC_SUCCESS) {
+				rdma_probe3(rs_recv_wc, rs->index, 0, wc.status);
+				rs_record(rs, RSOCKET_REC_RECV_ERROR, wc.status);
+				rs->cq_stats->wc_errors++;
 				continue;
+			}
 			rcnt++;
 
 			if (wc.wc_flags & IBV_WC_WITH_IMM) {
@@ -1893,22 +4198,26 @@ static int rs_poll_cq(struct rsocket *rs)
 					[rs_wr_data(wc.wr_id)];
 
 			}
+			rdma_probe3(rs_recv_wc, rs->index, msg, wc.status);
+			rs_record(rs, RSOCKET_REC_RECV, msg);
 			switch (rs_msg_op(msg)) {
 			case RS_OP_SGL:
 				rs->sseq_comp = (uint16_t) rs_msg_data(msg);
+				rs->cq_stats->credits_recv++;
+				rdma_probe2(rs_credits_recv, rs->index, rs->sseq_comp);
 				break;
 			case RS_OP_IOMAP_SGL:
 				/* The iomap was updated, that's nice to know. */
 				break;
 			case RS_OP_CTRL:
 				if (rs_msg_data(msg) == RS_CTRL_DISCONNECT) {
-					rs->state = rs_disconnected;
+					rs_set_state(rs, rs_disconnected);
 					return 0;
 				} else if (rs_msg_data(msg) == RS_CTRL_SHUTDOWN) {
 					if (rs->state & rs_writable) {
-						rs->state &= ~rs_readable;
+						rs_set_state(rs, rs->state & ~rs_readable);
 					} else {
-						rs->state = rs_disconnected;
+						rs_set_state(rs, rs_disconnected);
 						return 0;
 					}
 				}
@@ -1917,6 +4226,7 @@ static int rs_poll_cq(struct rsocket *rs)
 				/* We really shouldn't be here. */
 				break;
 			default:
+				rs->cq_stats->msgs++;
 				rs->rmsg[rs->rmsg_tail].op = rs_msg_op(msg);
 				rs->rmsg[rs->rmsg_tail].data = rs_msg_data(msg);
 				if (++rs->rmsg_tail == rs->rq_size + 1)
@@ -1924,6 +4234,9 @@ static int rs_poll_cq(struct rsocket *rs)
 				break;
 			}
 		} else {
+			rdma_probe3(rs_send_wc, rs->index, rs_wr_data(wc.wr_id),
+				    wc.status);
+			rs_record(rs, RSOCKET_REC_SEND_COMP, rs_wr_data(wc.wr_id));
 			switch  (rs_msg_op(rs_wr_data(wc.wr_id))) {
 			case RS_OP_SGL:
 				rs->ctrl_max_seqno++;
@@ -1931,7 +4244,7 @@ static int rs_poll_cq(struct rsocket *rs)
 			case RS_OP_CTRL:
 				rs->ctrl_max_seqno++;
 				if (rs_msg_data(rs_wr_data(wc.wr_id)) == RS_CTRL_DISCONNECT)
-					rs->state = rs_disconnected;
+					rs_set_state(rs, rs_disconnected);
 				break;
 			case RS_OP_IOMAP_SGL:
 				rs->sqe_avail++;
@@ -1943,9 +4256,17 @@ static int rs_poll_cq(struct rsocket *rs)
 				rs->sbuf_bytes_avail += rs_msg_data(rs_wr_data(wc.wr_id));
 				break;
 			}
-			if (wc.status != IBV_WC_SUCCESS && (rs->state & rs_connected)) {
-				rs->state = rs_error;
-				rs->err = EIO;
+			if (wc.status != IBV_WC_SUCCESS) {
+				rs_record(rs, RSOCKET_REC_ERROR,
+					  rs_msg_set(rs_msg_op(rs_wr_data(wc.wr_id)),
+						     wc.status));
+				rs->cq_stats->wc_errors++;
+				if (wc.status == IBV_WC_RNR_RETRY_EXC_ERR)
+					rs->cq_stats->rnr_errors++;
+				if (rs->state & rs_connected) {
+					rs_set_state(rs, rs_error);
+					rs->err = EIO;
+				}
 			}
 		}
 	}
@@ -1955,14 +4276,93 @@ static int rs_poll_cq(struct rsocket *rs)
 			ret = rs_post_recv(rs);
 
 		if (ret) {
-			rs->state = rs_error;
+			rs_set_state(rs, rs_error);
 			rs->err = errno;
 		}
 	}
 	return ret;
 }
 
-static int rs_get_cq_event(struct rsocket *rs)
+/*
+ * Retrieve all pending events from a shared completion channel.  The
+ * event may belong to any rsocket using the channel, so we clear the armed
+ * state of the owning rsocket and wake up anyone waiting on the channel.
+ * Events are acknowledged immediately, which ensures that the owning
+ * rsocket cannot be freed while we reference it.  Called with the channel
+ * lock held, but not the owner's cq_lock, so the armed state is cleared
+ * atomically; rs_process_cq sets it before arming the CQ.
+ */
+static void rs_drain_comp_channel(struct rs_comp_channel *chan)
+{
+	struct rsocket *rs;
+	struct ibv_cq *cq;
+	void *context;
+	uint64_t val = 1;
+	int cnt = 0;
+
+	while (!ucma_ibv_get_cq_event(chan->channel, &cq, &context)) {
+		rs = context;
+		__sync_fetch_and_and(&rs->cq_armed, 0);
+		rs->cq_stats->events++;
+		ucma_ibv_ack_cq_events(cq, 1);
+		cnt++;
+	}
+
+	if (cnt) {
+		pthread_cond_broadcast(&chan->cond);
+		if (chan->polling)
+			write(chan->kick, &val, sizeof val);
+	}
+}
+
+/*
+ * Only one thread at a time blocks on a shared completion channel.  Other
+ * waiters sleep on the channel's condition and recheck whether the event
+ * for their rsocket was retrieved by someone else.  Nonblocking callers
+ * drain the channel and kick the blocked thread if they consumed an
+ * event that it may be waiting for.
+ */
+static int rs_get_shared_cq_event(struct rsocket *rs, int nonblock)
+{
+	struct rs_comp_channel *chan = rs->shared_chan;
+	struct pollfd fds[2];
+	uint64_t val;
+	int ret = 0;
+
+	pthread_mutex_lock(&chan->mut);
+	rs_drain_comp_channel(chan);
+	while (!nonblock && rs->cq_armed) {
+		if (chan->polling) {
+			pthread_cond_wait(&chan->cond, &chan->mut);
+			continue;
+		}
+
+		chan->polling = 1;
+		pthread_mutex_unlock(&chan->mut);
+
+		fds[0].fd = chan->channel->fd;
+		fds[0].events = POLLIN;
+		fds[0].revents = 0;
+		fds[1].fd = chan->kick;
+		fds[1].events = POLLIN;
+		fds[1].revents = 0;
+		ret = poll(fds, 2, -1);
+		if (fds[1].revents)
+			read(chan->kick, &val, sizeof val);
+
+		pthread_mutex_lock(&chan->mut);
+		chan->polling = 0;
+		rs_drain_comp_channel(chan);
+		pthread_cond_broadcast(&chan->cond);
+		if (ret < 0)
+			break;
+		ret = 0;
+	}
+	pthread_mutex_unlock(&chan->mut);
+	return ret;
+}
+
+static int rs_get_cq_event(struct rsocket *rs, int nonblock)
 {
 	struct ibv_cq *cq;
 	void *context;
@@ -1971,15 +4371,19 @@ static int rs_get_cq_event(struct rsocket *rs)
 	if (!rs->cq_armed)
 		return 0;
 
-	ret = ibv_get_cq_event(rs->cm_id->recv_cq_channel, &cq, &context);
+	if (rs->shared_chan)
+		return rs_get_shared_cq_event(rs, nonblock);
+
+	ret = ucma_ibv_get_cq_event(rs->cm_id->recv_cq_channel, &cq, &context);
 	if (!ret) {
 		if (++rs->unack_cqe >= rs->sq_size + rs->rq_size) {
-			ibv_ack_cq_events(rs->cm_id->recv_cq, rs->unack_cqe);
+			ucma_ibv_ack_cq_events(rs->cm_id->recv_cq, rs->unack_cqe);
 			rs->unack_cqe = 0;
 		}
 		rs->cq_armed = 0;
+		rs->cq_stats->events++;
 	} else if (!(errno == EAGAIN || errno == EINTR)) {
-		rs->state = rs_error;
+		rs_set_state(rs, rs_error);
 	}
 
 	return ret;
@@ -2003,7 +4407,7 @@ static int rs_process_cq(struct rsocket *rs, int nonblock, int (*test)(struct rs
 {
 	int ret;
 
-	fastlock_acquire(&rs->cq_lock);
+	rs_lock(rs, &rs->cq_lock);
 	do {
 		rs_update_credits(rs);
 		ret = rs_poll_cq(rs);
@@ -2015,21 +4419,30 @@ static int rs_process_cq(struct rsocket *rs, int nonblock, int (*test)(struct rs
 		} else if (nonblock) {
 			ret = ERR(EWOULDBLOCK);
 		} else if (!rs->cq_armed) {
+			/*
+			 * A shared channel may retrieve the event as soon as
+			 * the CQ is armed, so mark it armed first.
+			 */
+			rdma_probe1(rs_cq_arm, rs->index);
+			__sync_fetch_and_or(&rs->cq_armed, 1);
 			ibv_req_notify_cq(rs->cm_id->recv_cq, 0);
-			rs->cq_armed = 1;
 		} else {
 			rs_update_credits(rs);
-			fastlock_acquire(&rs->cq_wait_lock);
-			fastlock_release(&rs->cq_lock);
-
-			ret = rs_get_cq_event(rs);
-			fastlock_release(&rs->cq_wait_lock);
-			fastlock_acquire(&rs->cq_lock);
+			rs_lock(rs, &rs->cq_wait_lock);
+			rs_unlock(rs, &rs->cq_lock);
+
+			rdma_probe1(rs_cq_sleep, rs->index);
+			ret = rs_get_cq_event(rs, 0);
+			rdma_probe2(rs_cq_wake, rs->index, ret);
+			rs_unlock(rs, &rs->cq_wait_lock);
+			rs_lock(rs, &rs->cq_lock);
 		}
 	} while (!ret);
 
 	rs_update_credits(rs);
-	fastlock_release(&rs->cq_lock);
+	rs_unlock(rs, &rs->cq_lock);
+	if (rs->rec_dump)
+		rs_rec_dump_pending(rs);
 	return ret;
 }
 
@@ -2155,9 +4568,9 @@ static int ds_get_cq_event(struct rsocket *rs)
 		return ret;
 
 	qp = event.data.ptr;
-	ret = ibv_get_cq_event(qp->cm_id->recv_cq_channel, &cq, &context);
+	ret = ucma_ibv_get_cq_event(qp->cm_id->recv_cq_channel, &cq, &context);
 	if (!ret) {
-		ibv_ack_cq_events(qp->cm_id->recv_cq, 1);
+		ucma_ibv_ack_cq_events(qp->cm_id->recv_cq, 1);
 		qp->cq_armed = 0;
 		rs->cq_armed = 0;
 	}
@@ -2184,26 +4597,277 @@ static int ds_process_cqs(struct rsocket *rs, int nonblock, int (*test)(struct r
 			fastlock_acquire(&rs->cq_wait_lock);
 			fastlock_release(&rs->cq_lock);
 
-			ret = ds_get_cq_event(rs);
-			fastlock_release(&rs->cq_wait_lock);
-			fastlock_acquire(&rs->cq_lock);
-		}
-	} while (!ret);
+			ret = ds_get_cq_event(rs);
+			fastlock_release(&rs->cq_wait_lock);
+			fastlock_acquire(&rs->cq_lock);
+		}
+	} while (!ret);
+
+	fastlock_release(&rs->cq_lock);
+	return ret;
+}
+
+static int ds_get_comp(struct rsocket *rs, int nonblock, int (*test)(struct rsocket *rs))
+{
+	struct timeval s, e;
+	uint32_t poll_time = 0;
+	int ret;
+
+	do {
+		ret = ds_process_cqs(rs, 1, test);
+		if (!ret || nonblock || errno != EWOULDBLOCK)
+			return ret;
+
+		if (!poll_time)
+			gettimeofday(&s, NULL);
+
+		gettimeofday(&e, NULL);
+		poll_time = (e.tv_sec - s.tv_sec) * 1000000 +
+			    (e.tv_usec - s.tv_usec) + 1;
+	} while (poll_time <= polling_time);
+
+	ret = ds_process_cqs(rs, 0, test);
+	return ret;
+}
+
+static int rs_nonblocking(struct rsocket *rs, int flags)
+{
+	return (rs->fd_flags & O_NONBLOCK) || (flags & MSG_DONTWAIT);
+}
+
+static int rs_is_cq_armed(struct rsocket *rs)
+{
+	return rs->cq_armed;
+}
+
+static int rs_poll_all(struct rsocket *rs)
+{
+	return 1;
+}
+
+/*
+ * We use hardware flow control to prevent over running the remote
+ * receive queue.  However, data transfers still require space in
+ * the remote rmsg queue, or we risk losing notification that data
+ * has been transfered.
+ *
+ * Be careful with race conditions in the check below.  The target SGL
+ * may be updated by a remote RDMA write.
+ */
+static int rs_can_send_imm(struct rsocket *rs)
+{
+	return rs->sqe_avail && (rs->sbuf_bytes_avail >= RS_SNDLOWAT) &&
+	       (rs->sseq_no != rs->sseq_comp) &&
+	       (rs->target_sgl[rs->target_sge].length != 0);
+}
+
+static int rs_can_send_msg(struct rsocket *rs)
+{
+	return (rs->sqe_avail >= 2) && (rs->sbuf_bytes_avail >= RS_SNDLOWAT) &&
+	       (rs->sseq_no != rs->sseq_comp) &&
+	       (rs->target_sgl[rs->target_sge].length != 0);
+}
+
+static inline int rs_can_send(struct rsocket *rs)
+{
+	return rs->ops->can_send(rs);
+}
+
+/* Return the first condition that prevents rs_can_send from succeeding. */
+static int rs_send_wait_reason(struct rsocket *rs)
+{
+	if (rs->sqe_avail < rs->ops->msg_sqe)
+		return RS_WAIT_SQE;
+	else if (rs->sbuf_bytes_avail < RS_SNDLOWAT)
+		return RS_WAIT_SBUF;
+	else if (rs->sseq_no == rs->sseq_comp)
+		return RS_WAIT_CREDITS;
+	else
+		return RS_WAIT_TARGET;
+}
+
+/* A bucket < 0 counts a stall that did not wait, so it has no time */
+static void rs_add_send_wait(struct rsocket_send_counters *stats, int reason,
+			     uint64_t usec, int bucket)
+{
+	stats->wait[reason]++;
+	if (bucket < 0)
+		return;
+	stats->wait_us[reason] += usec;
+	stats->wait_hist[reason][bucket]++;
+}
+
+/* Process wide totals are shared by all rsockets, so add atomically */
+static void rs_add_send_wait_total(struct rsocket_send_counters *stats,
+				   int reason, uint64_t usec, int bucket)
+{
+	__sync_fetch_and_add(&stats->wait[reason], 1);
+	if (bucket < 0)
+		return;
+	__sync_fetch_and_add(&stats->wait_us[reason], usec);
+	__sync_fetch_and_add(&stats->wait_hist[reason][bucket], 1);
+}
+
+static const struct rs_ops rs_imm_ops = {
+	.post_recv = rs_post_recv_imm,
+	.post_msg = rs_post_msg_imm,
+	.post_write_msg = rs_post_write_msg_imm,
+	.can_send = rs_can_send_imm,
+	.update_credits = rs_update_credits_imm,
+	.msg_sqe = 1,
+};
+
+static const struct rs_ops rs_imm_swap_ops = {
+	.post_recv = rs_post_recv_imm,
+	.post_msg = rs_post_msg_imm,
+	.post_write_msg = rs_post_write_msg_imm,
+	.can_send = rs_can_send_imm,
+	.update_credits = rs_update_credits_imm_swap,
+	.msg_sqe = 1,
+};
+
+static const struct rs_ops rs_msg_ops = {
+	.post_recv = rs_post_recv_msg,
+	.post_msg = rs_post_msg_msg,
+	.post_write_msg = rs_post_write_msg_msg,
+	.can_send = rs_can_send_msg,
+	.update_credits = rs_update_credits_msg,
+	.msg_sqe = 2,
+};
+
+static const struct rs_ops rs_msg_swap_ops = {
+	.post_recv = rs_post_recv_msg,
+	.post_msg = rs_post_msg_msg,
+	.post_write_msg = rs_post_write_msg_msg,
+	.can_send = rs_can_send_msg,
+	.update_credits = rs_update_credits_msg_swap,
+	.msg_sqe = 2,
+};
+
+static void rs_set_ops(struct rsocket *rs)
+{
+	if (!(rs->opts & RS_OPT_MSG_SEND))
+		rs->ops = (rs->opts & RS_OPT_SWAP_SGL) ? &rs_imm_swap_ops : &rs_imm_ops;
+	else
+		rs->ops = (rs->opts & RS_OPT_SWAP_SGL) ? &rs_msg_swap_ops : &rs_msg_ops;
+}
+
+static int ds_can_send(struct rsocket *rs)
+{
+	return rs->sqe_avail;
+}
+
+static int ds_all_sends_done(struct rsocket *rs)
+{
+	return rs->sqe_avail == rs->sq_size;
+}
+
+static uint32_t rs_local_rdata(struct rs_local *lc)
+{
+	return lc->rring->head - lc->rring->tail;
+}
+
+static uint32_t rs_local_sspace(struct rs_local *lc)
+{
+	return lc->size - (lc->sring->head - lc->sring->tail);
+}
+
+static void rs_local_arm(struct rs_local *lc)
+{
+	lc->seg->armed[lc->side] = 1;
+	__sync_synchronize();
+}
+
+/* Wake up the peer if it armed the doorbell before sleeping. */
+static void rs_local_signal(struct rs_local *lc)
+{
+	uint8_t val = 0;
+
+	__sync_synchronize();
+	if (lc->seg->armed[!lc->side] &&
+	    __sync_bool_compare_and_swap(&lc->seg->armed[!lc->side], 1, 0))
+		send(lc->fd, &val, sizeof val, MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+
+/* Called with cq_wait_lock held */
+static void rs_local_drain(struct rs_local *lc)
+{
+	uint8_t buf[64];
+	ssize_t ret;
+
+	do {
+		ret = recv(lc->fd, buf, sizeof buf, MSG_DONTWAIT);
+	} while (ret == sizeof buf);
+
+	if (!ret || (ret < 0 && errno != EAGAIN && errno != EWOULDBLOCK))
+		lc->peer_gone = 1;
+}
+
+/*
+ * Control messages are written to the sender's ring and handled the same
+ * way as those received over the QP.  A closed doorbell means the peer
+ * exited without disconnecting.
+ */
+static void rs_local_process(struct rsocket *rs)
+{
+	struct rs_local *lc = rs->local;
+	uint32_t ctrl;
+
+	ctrl = lc->peer_gone ? rs_msg_set(RS_OP_CTRL, RS_CTRL_DISCONNECT) :
+	       lc->rring->ctrl;
+	if (ctrl == lc->ctrl)
+		return;
 
-	fastlock_release(&rs->cq_lock);
-	return ret;
+	lc->ctrl = ctrl;
+	rs_record(rs, RSOCKET_REC_RECV, ctrl);
+	if (rs_msg_data(ctrl) == RS_CTRL_SHUTDOWN && (rs->state & rs_writable))
+		rs_set_state(rs, rs->state & ~rs_readable);
+	else
+		rs_set_state(rs, rs_disconnected);
 }
 
-static int ds_get_comp(struct rsocket *rs, int nonblock, int (*test)(struct rsocket *rs))
+static void rs_local_shutdown(struct rsocket *rs, int ctrl)
+{
+	struct rs_local *lc = rs->local;
+	uint8_t val = 0;
+
+	rs_record(rs, RSOCKET_REC_SEND, rs_msg_set(RS_OP_CTRL, ctrl));
+	__sync_synchronize();
+	lc->sring->ctrl = rs_msg_set(RS_OP_CTRL, ctrl);
+	__sync_synchronize();
+	send(lc->fd, &val, sizeof val, MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+
+static int rs_local_have_rdata(struct rsocket *rs)
 {
+	return rs_local_rdata(rs->local) || !(rs->state & rs_readable);
+}
+
+static int rs_local_can_send(struct rsocket *rs)
+{
+	return rs_local_sspace(rs->local) || !(rs->state & rs_writable);
+}
+
+/*
+ * Spin for polling_time, then sleep on the doorbell.  Only the holder of
+ * cq_wait_lock sleeps and drains the doorbell, and it arms and rechecks
+ * after taking the lock, so draining a wakeup meant for another thread
+ * cannot cause that thread to miss it.
+ */
+static int rs_local_wait(struct rsocket *rs, int nonblock,
+			 int (*test)(struct rsocket *rs))
+{
+	struct rs_local *lc = rs->local;
 	struct timeval s, e;
+	struct pollfd fds;
 	uint32_t poll_time = 0;
-	int ret;
 
 	do {
-		ret = ds_process_cqs(rs, 1, test);
-		if (!ret || nonblock || errno != EWOULDBLOCK)
-			return ret;
+		rs_local_process(rs);
+		if (test(rs))
+			return 0;
+		if (nonblock)
+			return ERR(EWOULDBLOCK);
 
 		if (!poll_time)
 			gettimeofday(&s, NULL);
@@ -2213,60 +4877,59 @@ static int ds_get_comp(struct rsocket *rs, int nonblock, int (*test)(struct rsoc
 			    (e.tv_usec - s.tv_usec) + 1;
 	} while (poll_time <= polling_time);
 
-	ret = ds_process_cqs(rs, 0, test);
-	return ret;
-}
-
-static int rs_nonblocking(struct rsocket *rs, int flags)
-{
-	return (rs->fd_flags & O_NONBLOCK) || (flags & MSG_DONTWAIT);
-}
-
-static int rs_is_cq_armed(struct rsocket *rs)
-{
-	return rs->cq_armed;
+	fds.fd = lc->fd;
+	fds.events = POLLIN;
+	do {
+		rs_lock(rs, &rs->cq_wait_lock);
+		rs_local_arm(lc);
+		rs_local_process(rs);
+		if (!test(rs)) {
+			fds.revents = 0;
+			poll(&fds, 1, -1);
+			rs_local_drain(lc);
+		}
+		rs_unlock(rs, &rs->cq_wait_lock);
+		rs_local_process(rs);
+	} while (!test(rs));
+	return 0;
 }
 
-static int rs_poll_all(struct rsocket *rs)
+static int rs_conn_can_send(struct rsocket *rs)
 {
-	return 1;
+	if (rs->local)
+		return rs_local_can_send(rs);
+	return rs_can_send(rs) || !(rs->state & rs_writable);
 }
 
 /*
- * We use hardware flow control to prevent over running the remote
- * receive queue.  However, data transfers still require space in
- * the remote rmsg queue, or we risk losing notification that data
- * has been transfered.
- *
- * Be careful with race conditions in the check below.  The target SGL
- * may be updated by a remote RDMA write.
+ * Wait for the rsocket to be able to send, charging the time spent to the
+ * resource that blocked the send.  Nonblocking calls never wait, so they
+ * only count the stall.  Called with slock held, which protects the
+ * rsocket's counters.
  */
-static int rs_can_send(struct rsocket *rs)
+static int rs_wait_send(struct rsocket *rs, int nonblock)
 {
-	if (!(rs->opts & RS_OPT_MSG_SEND)) {
-		return rs->sqe_avail && (rs->sbuf_bytes_avail >= RS_SNDLOWAT) &&
-		       (rs->sseq_no != rs->sseq_comp) &&
-		       (rs->target_sgl[rs->target_sge].length != 0);
-	} else {
-		return (rs->sqe_avail >= 2) && (rs->sbuf_bytes_avail >= RS_SNDLOWAT) &&
-		       (rs->sseq_no != rs->sseq_comp) &&
-		       (rs->target_sgl[rs->target_sge].length != 0);
+	uint64_t start, usec;
+	int reason, bucket, ret;
+
+	reason = rs_send_wait_reason(rs);
+	if (nonblock) {
+		rs_add_send_wait(rs->send_stats, reason, 0, -1);
+		rs_add_send_wait_total(send_stalls, reason, 0, -1);
+		return rs_get_comp(rs, nonblock, rs_conn_can_send);
 	}
-}
 
-static int ds_can_send(struct rsocket *rs)
-{
-	return rs->sqe_avail;
-}
+	start = fastlock_time_us();
+	ret = rs_get_comp(rs, nonblock, rs_conn_can_send);
+	usec = fastlock_time_us() - start;
 
-static int ds_all_sends_done(struct rsocket *rs)
-{
-	return rs->sqe_avail == rs->sq_size;
-}
+	bucket = usec ? 64 - __builtin_clzll(usec) : 0;
+	if (bucket >= RSOCKET_STALL_BUCKETS)
+		bucket = RSOCKET_STALL_BUCKETS - 1;
 
-static int rs_conn_can_send(struct rsocket *rs)
-{
-	return rs_can_send(rs) || !(rs->state & rs_writable);
+	rs_add_send_wait(rs->send_stats, reason, usec, bucket);
+	rs_add_send_wait_total(send_stalls, reason, usec, bucket);
+	return ret;
 }
 
 static int rs_conn_can_send_ctrl(struct rsocket *rs)
@@ -2281,6 +4944,10 @@ static int rs_have_rdata(struct rsocket *rs)
 
 static int rs_conn_have_rdata(struct rsocket *rs)
 {
+	if (rs->conn_rdata)
+		return 1;
+	if (rs->local)
+		return rs_local_have_rdata(rs);
 	return rs_have_rdata(rs) || !(rs->state & rs_readable);
 }
 
@@ -2291,6 +4958,136 @@ static int rs_conn_all_sends_done(struct rsocket *rs)
 	       !(rs->state & rs_connected);
 }
 
+static int rs_evfd_revents(struct rsocket *rs)
+{
+	int revents = 0;
+
+	if (rs->state & rs_connected) {
+		if (rs_conn_have_rdata(rs))
+			revents |= POLLIN;
+		if (rs->ev_want_send && rs_conn_can_send(rs))
+			revents |= POLLOUT;
+	} else if (rs->state == rs_disconnected) {
+		revents |= POLLHUP;
+	} else if (rs->state & (rs_error | rs_connect_error)) {
+		revents |= POLLERR;
+	}
+	return revents;
+}
+
+/*
+ * The user visible event fd is an epoll set containing an eventfd, the
+ * CQ channel, and the rdma_cm channel until the connection is established.
+ * We signal the eventfd while the rsocket has data to read, can send after
+ * a send would have blocked, or has been disconnected.  Before returning
+ * to the user, we consume any pending CQ event and rearm the CQ, so that
+ * the CQ channel only wakes up the user for new completions.  This runs
+ * after failed calls too, so errno is preserved for the caller.
+ */
+static void rs_update_evfd(struct rsocket *rs)
+{
+	struct pollfd fds;
+	uint64_t val;
+	int revents, save_errno = errno;
+
+	if (rs->local && rs->state >= rs_connected) {
+		rs_lock(rs, &rs->cq_wait_lock);
+		rs_local_drain(rs->local);
+		rs_local_arm(rs->local);
+		rs_unlock(rs, &rs->cq_wait_lock);
+		rs_local_process(rs);
+	} else if (rs->cm_id->recv_cq_channel) {
+		rs_lock(rs, &rs->cq_wait_lock);
+		if (rs->cq_armed) {
+			fds.fd = rs->cm_id->recv_cq_channel->fd;
+			fds.events = POLLIN;
+			fds.revents = 0;
+			if (poll(&fds, 1, 0) > 0)
+				rs_get_cq_event(rs, 1);
+		}
+		rs_unlock(rs, &rs->cq_wait_lock);
+
+		if ((rs->state & rs_connected) || (rs->state == rs_disconnected) ||
+		    (rs->state & rs_error))
+			rs_process_cq(rs, 0, rs_is_cq_armed);
+	}
+
+	revents = rs_evfd_revents(rs);
+
+	rs_lock(rs, &rs->cq_lock);
+	if ((rs->ev_flags & RS_EV_CM_CHANNEL) && rs->state >= rs_connected) {
+		epoll_ctl(rs->evfd, EPOLL_CTL_DEL, rs->cm_id->channel->fd, NULL);
+		rs->ev_flags &= ~RS_EV_CM_CHANNEL;
+	}
+
+	if (revents && !(rs->ev_flags & RS_EV_SIGNALED)) {
+		val = 1;
+		if (write(rs->ev_notify, &val, sizeof val) == sizeof val)
+			rs->ev_flags |= RS_EV_SIGNALED;
+	} else if (!revents && (rs->ev_flags & RS_EV_SIGNALED)) {
+		/* EAGAIN means the count is already zero */
+		if (read(rs->ev_notify, &val, sizeof val) == sizeof val ||
+		    errno == EAGAIN)
+			rs->ev_flags &= ~RS_EV_SIGNALED;
+	}
+	rs_unlock(rs, &rs->cq_lock);
+	errno = save_errno;
+}
+
+static int rs_init_evfd(struct rsocket *rs)
+{
+	struct epoll_event event;
+	int ret;
+
+	rs->evfd = epoll_create(3);
+	if (rs->evfd < 0)
+		return rs->evfd;
+
+	rs->ev_notify = eventfd(0, EFD_NONBLOCK);
+	if (rs->ev_notify < 0) {
+		ret = rs->ev_notify;
+		goto err;
+	}
+
+	event.events = EPOLLIN;
+	event.data.u32 = 0;
+	ret = epoll_ctl(rs->evfd, EPOLL_CTL_ADD, rs->ev_notify, &event);
+	if (ret)
+		goto err;
+
+	if (rs->state < rs_connected) {
+		ret = rs_evfd_add(rs, rs_cm_fd(rs), RS_EV_CM_CHANNEL);
+		if (ret)
+			goto err;
+	}
+
+	if (rs->cm_id->recv_cq_channel) {
+		ret = rs_evfd_add(rs, rs->cm_id->recv_cq_channel->fd,
+				  RS_EV_CQ_CHANNEL);
+		if (ret)
+			goto err;
+	}
+
+	if (rs->local) {
+		ret = rs_evfd_add(rs, rs->local->fd, RS_EV_LOCAL);
+		if (ret)
+			goto err;
+	}
+
+	rs_update_evfd(rs);
+	return 0;
+
+err:
+	if (rs->ev_notify >= 0) {
+		close(rs->ev_notify);
+		rs->ev_notify = -1;
+	}
+	close(rs->evfd);
+	rs->evfd = -1;
+	rs->ev_flags = 0;
+	return ret;
+}
+
 static void ds_set_src(struct sockaddr *addr, socklen_t *addrlen,
 		       struct ds_header *hdr)
 {
@@ -2386,10 +5183,154 @@ static ssize_t rs_peek(struct rsocket *rs, void *buf, size_t len)
 	return len - left;
 }
 
+static void rs_local_read(struct rs_local *lc, uint32_t pos, void *buf,
+			  uint32_t len)
+{
+	uint32_t offset = pos & (lc->size - 1), end_size = lc->size - offset;
+
+	if (len > end_size) {
+		memcpy(buf, &lc->rdata[offset], end_size);
+		buf += end_size;
+		len -= end_size;
+		offset = 0;
+	}
+	memcpy(buf, &lc->rdata[offset], len);
+}
+
+static void rs_local_write(struct rs_local *lc, uint32_t pos, const void *buf,
+			   uint32_t len)
+{
+	uint32_t offset = pos & (lc->size - 1), end_size = lc->size - offset;
+
+	if (len > end_size) {
+		memcpy(&lc->sdata[offset], buf, end_size);
+		buf += end_size;
+		len -= end_size;
+		offset = 0;
+	}
+	memcpy(&lc->sdata[offset], buf, len);
+}
+
+static ssize_t rs_local_recv(struct rsocket *rs, void *buf, size_t len, int flags)
+{
+	struct rs_local *lc = rs->local;
+	size_t left = len;
+	uint32_t tail, rsize;
+	int ret = 0;
+
+	rs_lock(rs, &rs->rlock);
+	do {
+		if (!rs_local_rdata(lc)) {
+			ret = rs_local_wait(rs, rs_nonblocking(rs, flags),
+					    rs_local_have_rdata);
+			if (ret)
+				break;
+		}
+
+		rsize = rs_local_rdata(lc);
+		if (rsize > left)
+			rsize = left;
+		tail = lc->rring->tail;
+		__sync_synchronize();
+		rs_local_read(lc, tail, buf, rsize);
+		left -= rsize;
+		if (flags & MSG_PEEK)
+			break;
+
+		buf += rsize;
+		__sync_synchronize();
+		lc->rring->tail = tail + rsize;
+		rs_local_signal(lc);
+	} while (left && (flags & MSG_WAITALL) && (rs->state & rs_readable));
+
+	if (!(flags & MSG_PEEK))
+		rs->recv_stats->bytes += len - left;
+	rs_unlock(rs, &rs->rlock);
+	if (rs->evfd >= 0)
+		rs_update_evfd(rs);
+	return (ret && left == len) ? ret : len - left;
+}
+
+static ssize_t rs_local_sendv(struct rsocket *rs, const struct iovec *iov,
+			      int iovcnt, int flags)
+{
+	struct rs_local *lc = rs->local;
+	size_t left, len = 0, offset = 0;
+	uint32_t head, end, xfer_size;
+	int i, ret = 0;
+
+	for (i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+	left = len;
+
+	rs_lock(rs, &rs->slock);
+	while (left) {
+		if (!rs_local_sspace(lc)) {
+			ret = rs_local_wait(rs, rs_nonblocking(rs, flags),
+					    rs_local_can_send);
+			if (ret)
+				break;
+		}
+		if (!(rs->state & rs_writable)) {
+			ret = ERR(ECONNRESET);
+			break;
+		}
+
+		head = lc->sring->head;
+		end = head + min(left, rs_local_sspace(lc));
+		for (; head != end; head += xfer_size) {
+			xfer_size = min(iov->iov_len - offset, end - head);
+			rs_local_write(lc, head, iov->iov_base + offset, xfer_size);
+			offset += xfer_size;
+			if (offset == iov->iov_len) {
+				iov++;
+				offset = 0;
+			}
+		}
+		left -= end - lc->sring->head;
+		__sync_synchronize();
+		lc->sring->head = end;
+		rs_local_signal(lc);
+	}
+
+	rs->send_stats->bytes += len - left;
+	rs_unlock(rs, &rs->slock);
+	if (rs->evfd >= 0) {
+		rs->ev_want_send = (left != 0);
+		rs_update_evfd(rs);
+	}
+	return (ret && left == len) ? ret : len - left;
+}
+
+/* The peer's connection data is read ahead of the rest of the stream */
+static size_t rs_conn_data_recv(struct rsocket *rs, void *buf, size_t len,
+				int flags)
+{
+	size_t rsize = 0;
+
+	rs_lock(rs, &rs->rlock);
+	if (rs->conn_rdata) {
+		rsize = min(len, (size_t) (rs->conn_rlen - rs->conn_roff));
+		memcpy(buf, rs->conn_rdata + rs->conn_roff, rsize);
+		if (!(flags & MSG_PEEK)) {
+			rs->conn_roff += rsize;
+			if (rs->conn_roff == rs->conn_rlen) {
+				free(rs->conn_rdata);
+				rs->conn_rdata = NULL;
+			}
+			rs->recv_stats->bytes += rsize;
+		}
+	}
+	rs_unlock(rs, &rs->rlock);
+	if (rs->evfd >= 0)
+		rs_update_evfd(rs);
+	return rsize;
+}
+
 /*
  * Continue to receive any queued data even if the remote side has disconnected.
  */
-ssize_t rrecv(int socket, void *buf, size_t len, int flags)
+static ssize_t rs_recv(int socket, void *buf, size_t len, int flags)
 {
 	struct rsocket *rs;
 	size_t left = len;
@@ -2412,7 +5353,20 @@ ssize_t rrecv(int socket, void *buf, size_t len, int flags)
 			return ret;
 		}
 	}
-	fastlock_acquire(&rs->rlock);
+	if (rs->conn_rdata) {
+		rsize = rs_conn_data_recv(rs, buf, len, flags);
+		if (rsize) {
+			if (rsize == len || (flags & MSG_PEEK) ||
+			    !(flags & MSG_WAITALL))
+				return rsize;
+			ret = rs_recv(socket, buf + rsize, len - rsize, flags);
+			return (ret < 0) ? rsize : rsize + ret;
+		}
+	}
+	if (rs->local)
+		return rs_local_recv(rs, buf, len, flags);
+
+	rs_lock(rs, &rs->rlock);
 	do {
 		if (!rs_have_rdata(rs)) {
 			ret = rs_get_comp(rs, rs_nonblocking(rs, flags),
@@ -2454,10 +5408,24 @@ ssize_t rrecv(int socket, void *buf, size_t len, int flags)
 
 	} while (left && (flags & MSG_WAITALL) && (rs->state & rs_readable));
 
-	fastlock_release(&rs->rlock);
+	if (!(flags & MSG_PEEK))
+		rs->recv_stats->bytes += len - left;
+	rs_unlock(rs, &rs->rlock);
+	if (rs->evfd >= 0)
+		rs_update_evfd(rs);
 	return (ret && left == len) ? ret : len - left;
 }
 
+ssize_t rrecv(int socket, void *buf, size_t len, int flags)
+{
+	uint64_t start = rs_lat_start();
+	ssize_t ret;
+
+	ret = rs_recv(socket, buf, len, flags);
+	rs_lat_end(RSOCKET_LAT_RECV, start);
+	return ret;
+}
+
 ssize_t rrecvfrom(int socket, void *buf, size_t len, int flags,
 		  struct sockaddr *src_addr, socklen_t *addrlen)
 {
@@ -2516,8 +5484,7 @@ static int rs_send_iomaps(struct rsocket *rs, int flags)
 	fastlock_acquire(&rs->map_lock);
 	while (!dlist_empty(&rs->iomap_queue)) {
 		if (!rs_can_send(rs)) {
-			ret = rs_get_comp(rs, rs_nonblocking(rs, flags),
-					  rs_conn_can_send);
+			ret = rs_wait_send(rs, rs_nonblocking(rs, flags));
 			if (ret)
 				break;
 			if (!(rs->state & rs_writable)) {
@@ -2659,32 +5626,22 @@ static ssize_t dsend(struct rsocket *rs, const void *buf, size_t len, int flags)
  * We overlap sending the data, by posting a small work request immediately,
  * then increasing the size of the send on each iteration.
  */
-ssize_t rsend(int socket, const void *buf, size_t len, int flags)
+static ssize_t rs_conn_send(struct rsocket *rs, const void *buf, size_t len,
+			    int flags)
 {
-	struct rsocket *rs;
+	struct iovec iov;
 	struct ibv_sge sge;
 	size_t left = len;
 	uint32_t xfer_size, olen = RS_OLAP_START_SIZE;
 	int ret = 0;
 
-	rs = idm_at(&idm, socket);
-	if (rs->type == SOCK_DGRAM) {
-		fastlock_acquire(&rs->slock);
-		ret = dsend(rs, buf, len, flags);
-		fastlock_release(&rs->slock);
-		return ret;
-	}
-
-	if (rs->state & rs_opening) {
-		ret = rs_do_connect(rs);
-		if (ret) {
-			if (errno == EINPROGRESS)
-				errno = EAGAIN;
-			return ret;
-		}
+	if (rs->local) {
+		iov.iov_base = (void *) buf;
+		iov.iov_len = len;
+		return rs_local_sendv(rs, &iov, 1, flags);
 	}
 
-	fastlock_acquire(&rs->slock);
+	rs_lock(rs, &rs->slock);
 	if (rs->iomap_pending) {
 		ret = rs_send_iomaps(rs, flags);
 		if (ret)
@@ -2692,8 +5649,7 @@ ssize_t rsend(int socket, const void *buf, size_t len, int flags)
 	}
 	for (; left; left -= xfer_size, buf += xfer_size) {
 		if (!rs_can_send(rs)) {
-			ret = rs_get_comp(rs, rs_nonblocking(rs, flags),
-					  rs_conn_can_send);
+			ret = rs_wait_send(rs, rs_nonblocking(rs, flags));
 			if (ret)
 				break;
 			if (!(rs->state & rs_writable)) {
@@ -2737,13 +5693,93 @@ ssize_t rsend(int socket, const void *buf, size_t len, int flags)
 			ret = rs_write_data(rs, rs->ssgl, 2, xfer_size, 0);
 			rs->ssgl[0].addr = (uintptr_t) rs->sbuf + rs->ssgl[1].length;
 		}
-		if (ret)
-			break;
+		if (ret)
+			break;
+	}
+out:
+	rs_unlock(rs, &rs->slock);
+	if (rs->evfd >= 0) {
+		rs->ev_want_send = (left != 0);
+		rs_update_evfd(rs);
+	}
+
+	return (ret && left == len) ? ret : len - left;
+}
+
+static ssize_t rs_send(int socket, const void *buf, size_t len, int flags)
+{
+	struct rsocket *rs;
+	int ret;
+
+	rs = idm_at(&idm, socket);
+	if (rs->type == SOCK_DGRAM) {
+		fastlock_acquire(&rs->slock);
+		ret = dsend(rs, buf, len, flags);
+		fastlock_release(&rs->slock);
+		return ret;
+	}
+
+	if (rs->state & rs_opening) {
+		ret = rs_do_connect(rs);
+		if (ret) {
+			if (errno == EINPROGRESS)
+				errno = EAGAIN;
+			return ret;
+		}
+	}
+	ret = rs_conn_data_flush(rs, flags);
+	if (ret)
+		return ret;
+	return rs_conn_send(rs, buf, len, flags);
+}
+
+/*
+ * Sends connection data that did not go with the connection request or
+ * reply, ahead of anything the user sends.  Whatever a nonblocking
+ * socket cannot send yet stays queued and is retried by the next send
+ * or poll.  Returns 0 once all of it has gone out.
+ */
+static int rs_conn_data_flush(struct rsocket *rs, int flags)
+{
+	ssize_t ret;
+
+	if (!rs->conn_sdata)
+		return 0;
+
+	while (__sync_lock_test_and_set(&rs->conn_sflush, 1)) {
+		if (rs_nonblocking(rs, flags))
+			return ERR(EAGAIN);
+		sched_yield();
+	}
+
+	ret = 0;
+	if (rs->conn_sdata) {
+		ret = rs_conn_send(rs, rs->conn_sdata, rs->conn_slen, flags);
+		if (ret == rs->conn_slen || (ret < 0 && errno != EAGAIN)) {
+			free(rs->conn_sdata);
+			rs->conn_sdata = NULL;
+			rs->conn_slen = 0;
+		} else if (ret > 0) {
+			rs->conn_slen -= ret;
+			memmove(rs->conn_sdata, rs->conn_sdata + ret,
+				rs->conn_slen);
+			ret = ERR(EAGAIN);
+		}
+		if (ret > 0)
+			ret = 0;
 	}
-out:
-	fastlock_release(&rs->slock);
+	__sync_lock_release(&rs->conn_sflush);
+	return (int) ret;
+}
 
-	return (ret && left == len) ? ret : len - left;
+ssize_t rsend(int socket, const void *buf, size_t len, int flags)
+{
+	uint64_t start = rs_lat_start();
+	ssize_t ret;
+
+	ret = rs_send(socket, buf, len, flags);
+	rs_lat_end(RSOCKET_LAT_SEND, start);
+	return ret;
 }
 
 ssize_t rsendto(int socket, const void *buf, size_t len, int flags,
@@ -2799,7 +5835,7 @@ static void rs_copy_iov(void *dst, const struct iovec **iov, size_t *offset, siz
 	}
 }
 
-static ssize_t rsendv(int socket, const struct iovec *iov, int iovcnt, int flags)
+static ssize_t rs_sendv(int socket, const struct iovec *iov, int iovcnt, int flags)
 {
 	struct rsocket *rs;
 	const struct iovec *cur_iov;
@@ -2816,6 +5852,11 @@ static ssize_t rsendv(int socket, const struct iovec *iov, int iovcnt, int flags
 			return ret;
 		}
 	}
+	ret = rs_conn_data_flush(rs, flags);
+	if (ret)
+		return ret;
+	if (rs->local)
+		return rs_local_sendv(rs, iov, iovcnt, flags);
 
 	cur_iov = iov;
 	len = iov[0].iov_len;
@@ -2823,7 +5864,7 @@ static ssize_t rsendv(int socket, const struct iovec *iov, int iovcnt, int flags
 		len += iov[i].iov_len;
 	left = len;
 
-	fastlock_acquire(&rs->slock);
+	rs_lock(rs, &rs->slock);
 	if (rs->iomap_pending) {
 		ret = rs_send_iomaps(rs, flags);
 		if (ret)
@@ -2831,8 +5872,7 @@ static ssize_t rsendv(int socket, const struct iovec *iov, int iovcnt, int flags
 	}
 	for (; left; left -= xfer_size) {
 		if (!rs_can_send(rs)) {
-			ret = rs_get_comp(rs, rs_nonblocking(rs, flags),
-					  rs_conn_can_send);
+			ret = rs_wait_send(rs, rs_nonblocking(rs, flags));
 			if (ret)
 				break;
 			if (!(rs->state & rs_writable)) {
@@ -2878,11 +5918,25 @@ static ssize_t rsendv(int socket, const struct iovec *iov, int iovcnt, int flags
 			break;
 	}
 out:
-	fastlock_release(&rs->slock);
+	rs_unlock(rs, &rs->slock);
+	if (rs->evfd >= 0) {
+		rs->ev_want_send = (left != 0);
+		rs_update_evfd(rs);
+	}
 
 	return (ret && left == len) ? ret : len - left;
 }
 
+static ssize_t rsendv(int socket, const struct iovec *iov, int iovcnt, int flags)
+{
+	uint64_t start = rs_lat_start();
+	ssize_t ret;
+
+	ret = rs_sendv(socket, iov, iovcnt, flags);
+	rs_lat_end(RSOCKET_LAT_SEND, start);
+	return ret;
+}
+
 ssize_t rsendmsg(int socket, const struct msghdr *msg, int flags)
 {
 	if (msg->msg_control && msg->msg_controllen)
@@ -2927,12 +5981,20 @@ static int rs_poll_rs(struct rsocket *rs, int events,
 check_cq:
 	if ((rs->type == SOCK_STREAM) && ((rs->state & rs_connected) ||
 	     (rs->state == rs_disconnected) || (rs->state & rs_error))) {
-		rs_process_cq(rs, nonblock, test);
+		if (rs->local)
+			rs_local_process(rs);
+		else
+			rs_process_cq(rs, nonblock, test);
+		if (rs->conn_sdata && (rs->state & rs_writable))
+			rs_conn_data_flush(rs, MSG_DONTWAIT);
+		if (rs->evfd >= 0)
+			rs_update_evfd(rs);
 
 		revents = 0;
 		if ((events & POLLIN) && rs_conn_have_rdata(rs))
 			revents |= POLLIN;
-		if ((events & POLLOUT) && rs_can_send(rs))
+		if ((events & POLLOUT) && !rs->conn_sdata &&
+		    (rs->local ? rs_local_sspace(rs->local) : rs_can_send(rs)))
 			revents |= POLLOUT;
 		if (!(rs->state & rs_connected)) {
 			if (rs->state == rs_disconnected)
@@ -2955,7 +6017,7 @@ check_cq:
 	}
 
 	if (rs->state == rs_listening) {
-		fds.fd = rs->cm_id->channel->fd;
+		fds.fd = rs_cm_fd(rs);
 		fds.events = events;
 		fds.revents = 0;
 		poll(&fds, 1, 0);
@@ -2984,20 +6046,38 @@ check_cq:
 	return 0;
 }
 
-static int rs_poll_check(struct pollfd *fds, nfds_t nfds)
+/*
+ * Rsockets are checked directly.  All other fd's are gathered into rfds
+ * and checked using a single call to poll.
+ */
+static int rs_poll_check(struct pollfd *rfds, struct pollfd *fds, nfds_t nfds)
 {
 	struct rsocket *rs;
-	int i, cnt = 0;
+	int i, n = 0, cnt = 0;
 
 	for (i = 0; i < nfds; i++) {
 		rs = idm_lookup(&idm, fds[i].fd);
-		if (rs)
+		if (rs) {
 			fds[i].revents = rs_poll_rs(rs, fds[i].events, 1, rs_poll_all);
-		else
-			poll(&fds[i], 1, 0);
+			if (fds[i].revents)
+				cnt++;
+		} else {
+			rfds[n].fd = fds[i].fd;
+			rfds[n].events = fds[i].events;
+			rfds[n++].revents = 0;
+		}
+	}
 
-		if (fds[i].revents)
-			cnt++;
+	if (!n)
+		return cnt;
+
+	poll(rfds, n, 0);
+	for (i = 0, n = 0; i < nfds; i++) {
+		if (!idm_lookup(&idm, fds[i].fd)) {
+			fds[i].revents = rfds[n++].revents;
+			if (fds[i].revents)
+				cnt++;
+		}
 	}
 	return cnt;
 }
@@ -3010,15 +6090,19 @@ static int rs_poll_arm(struct pollfd *rfds, struct pollfd *fds, nfds_t nfds)
 	for (i = 0; i < nfds; i++) {
 		rs = idm_lookup(&idm, fds[i].fd);
 		if (rs) {
+			if (rs->local && rs->state >= rs_connected)
+				rs_local_arm(rs->local);
 			fds[i].revents = rs_poll_rs(rs, fds[i].events, 0, rs_is_cq_armed);
 			if (fds[i].revents)
 				return 1;
 
 			if (rs->type == SOCK_STREAM) {
-				if (rs->state >= rs_connected)
+				if (rs->local && rs->state >= rs_connected)
+					rfds[i].fd = rs->local->fd;
+				else if (rs->state >= rs_connected)
 					rfds[i].fd = rs->cm_id->recv_cq_channel->fd;
 				else
-					rfds[i].fd = rs->cm_id->channel->fd;
+					rfds[i].fd = rs_cm_fd(rs);
 			} else {
 				rfds[i].fd = rs->epfd;
 			}
@@ -3043,12 +6127,14 @@ static int rs_poll_events(struct pollfd *rfds, struct pollfd *fds, nfds_t nfds)
 
 		rs = idm_lookup(&idm, fds[i].fd);
 		if (rs) {
-			fastlock_acquire(&rs->cq_wait_lock);
-			if (rs->type == SOCK_STREAM)
-				rs_get_cq_event(rs);
+			rs_lock(rs, &rs->cq_wait_lock);
+			if (rs->local && rs->state >= rs_connected)
+				rs_local_drain(rs->local);
+			else if (rs->type == SOCK_STREAM)
+				rs_get_cq_event(rs, 1);
 			else
 				ds_get_cq_event(rs);
-			fastlock_release(&rs->cq_wait_lock);
+			rs_unlock(rs, &rs->cq_wait_lock);
 			fds[i].revents = rs_poll_rs(rs, fds[i].events, 1, rs_poll_all);
 		} else {
 			fds[i].revents = rfds[i].revents;
@@ -3065,15 +6151,19 @@ static int rs_poll_events(struct pollfd *rfds, struct pollfd *fds, nfds_t nfds)
  * to the user (e.g. connection events or credit updates).  Process those
  * events, then return to polling until we find ones of interest.
  */
-int rpoll(struct pollfd *fds, nfds_t nfds, int timeout)
+static int rs_poll(struct pollfd *fds, nfds_t nfds, int timeout)
 {
 	struct timeval s, e;
 	struct pollfd *rfds;
 	uint32_t poll_time = 0;
 	int ret;
 
+	rfds = rs_fds_alloc(nfds);
+	if (!rfds)
+		return ERR(ENOMEM);
+
 	do {
-		ret = rs_poll_check(fds, nfds);
+		ret = rs_poll_check(rfds, fds, nfds);
 		if (ret || !timeout)
 			return ret;
 
@@ -3085,10 +6175,6 @@ int rpoll(struct pollfd *fds, nfds_t nfds, int timeout)
 			    (e.tv_usec - s.tv_usec) + 1;
 	} while (poll_time <= polling_time);
 
-	rfds = rs_fds_alloc(nfds);
-	if (!rfds)
-		return ERR(ENOMEM);
-
 	do {
 		ret = rs_poll_arm(rfds, fds, nfds);
 		if (ret)
@@ -3104,6 +6190,16 @@ int rpoll(struct pollfd *fds, nfds_t nfds, int timeout)
 	return ret;
 }
 
+int rpoll(struct pollfd *fds, nfds_t nfds, int timeout)
+{
+	uint64_t start = rs_lat_start();
+	int ret;
+
+	ret = rs_poll(fds, nfds, timeout);
+	rs_lat_end(RSOCKET_LAT_POLL, start);
+	return ret;
+}
+
 static struct pollfd *
 rs_select_to_poll(int *nfds, fd_set *readfds, fd_set *writefds, fd_set *exceptfds)
 {
@@ -3198,14 +6294,10 @@ int rselect(int nfds, fd_set *readfds, fd_set *writefds,
  * disconnecting and wait until all outstanding sends complete, provided
  * that the remote side has not sent a disconnect message.
  */
-int rshutdown(int socket, int how)
+static int rs_shutdown(struct rsocket *rs, int how)
 {
-	struct rsocket *rs;
 	int ctrl, ret = 0;
 
-	rs = idm_lookup(&idm, socket);
-	if (!rs)
-		return ERR(EBADF);
 	if (rs->opts & RS_OPT_SVC_ACTIVE)
 		rs_notify_svc(&tcp_svc, rs, RS_SVC_REM_KEEPALIVE);
 
@@ -3215,17 +6307,21 @@ int rshutdown(int socket, int how)
 	if (rs->state & rs_connected) {
 		if (how == SHUT_RDWR) {
 			ctrl = RS_CTRL_DISCONNECT;
-			rs->state &= ~(rs_readable | rs_writable);
+			rs_set_state(rs, rs->state & ~(rs_readable | rs_writable));
 		} else if (how == SHUT_WR) {
-			rs->state &= ~rs_writable;
+			rs_set_state(rs, rs->state & ~rs_writable);
 			ctrl = (rs->state & rs_readable) ?
 				RS_CTRL_SHUTDOWN : RS_CTRL_DISCONNECT;
 		} else {
-			rs->state &= ~rs_readable;
+			rs_set_state(rs, rs->state & ~rs_readable);
 			if (rs->state & rs_writable)
 				goto out;
 			ctrl = RS_CTRL_DISCONNECT;
 		}
+		if (rs->local) {
+			rs_local_shutdown(rs, ctrl);
+			goto out;
+		}
 		if (!rs_ctrl_avail(rs)) {
 			ret = rs_process_cq(rs, 0, rs_conn_can_send_ctrl);
 			if (ret)
@@ -3251,9 +6347,21 @@ out:
 		ucma_shutdown(rs->cm_id);
 	}
 
+	if (rs->evfd >= 0)
+		rs_update_evfd(rs);
 	return ret;
 }
 
+int rshutdown(int socket, int how)
+{
+	struct rsocket *rs;
+
+	rs = idm_lookup(&idm, socket);
+	if (!rs)
+		return ERR(EBADF);
+	return rs_shutdown(rs, how);
+}
+
 static void ds_shutdown(struct rsocket *rs)
 {
 	if (rs->opts & RS_OPT_SVC_ACTIVE)
@@ -3262,13 +6370,179 @@ static void ds_shutdown(struct rsocket *rs)
 	if (rs->fd_flags & O_NONBLOCK)
 		rs_set_nonblocking(rs, 0);
 
-	rs->state &= ~(rs_readable | rs_writable);
+	rs_set_state(rs, rs->state & ~(rs_readable | rs_writable));
 	ds_process_cqs(rs, 0, ds_all_sends_done);
 
 	if (rs->fd_flags & O_NONBLOCK)
 		rs_set_nonblocking(rs, rs->fd_flags);
 }
 
+static void rs_close_stream(struct rsocket *rs)
+{
+	if (rs->state & rs_connected)
+		rs_shutdown(rs, SHUT_RDWR);
+	else if (rs->opts & RS_OPT_SVC_ACTIVE)
+		rs_notify_svc(&tcp_svc, rs, RS_SVC_REM_KEEPALIVE);
+}
+
+/*
+ * Stream rsockets closed with RDMA_ASYNC_CLOSE are queued to a reaper
+ * thread, which sends the disconnect, waits for outstanding sends, and
+ * destroys the QP, CQ, buffers and their registrations.  The thread is
+ * started on demand and exits after it has been idle for a while.  When
+ * the library is unloaded, at exit or by dlclose, the thread is stopped
+ * once its queue is empty, so that it is not left running in unmapped
+ * code, and the rdma_cm destructor does not close devices still in use.
+ * The wait is bounded by RS_REAPER_WAIT.  A forked child has no reaper
+ * thread, so it starts over with an empty queue.
+ */
+struct rs_reaper {
+	pthread_mutex_t	  lock;
+	pthread_cond_t	  cond;
+	dlist_entry	  list;
+	int		  running;
+	int		  joinable;	/* thread has not been joined */
+	int		  stop;
+	int		  atfork;
+	pthread_t	  thread;
+};
+
+static struct rs_reaper reaper = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+	.list = { &reaper.list, &reaper.list }
+};
+
+static void *rs_reaper_run(void *arg)
+{
+	struct rsocket *rs;
+	struct timespec ts;
+
+	pthread_mutex_lock(&reaper.lock);
+	for (;;) {
+		if (dlist_empty(&reaper.list)) {
+			if (reaper.stop)
+				break;
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_sec += RS_REAPER_IDLE;
+			if (pthread_cond_timedwait(&reaper.cond, &reaper.lock, &ts) &&
+			    dlist_empty(&reaper.list))
+				break;
+			continue;
+		}
+
+		rs = container_of(reaper.list.next, struct rsocket, close_entry);
+		dlist_remove(&rs->close_entry);
+		pthread_mutex_unlock(&reaper.lock);
+
+		rs_close_stream(rs);
+		rs_free(rs);
+
+		pthread_mutex_lock(&reaper.lock);
+	}
+	reaper.running = 0;
+	pthread_mutex_unlock(&reaper.lock);
+	return NULL;
+}
+
+static void rs_reaper_fork_prepare(void)
+{
+	pthread_mutex_lock(&reaper.lock);
+}
+
+static void rs_reaper_fork_parent(void)
+{
+	pthread_mutex_unlock(&reaper.lock);
+}
+
+/* The queued rsockets belong to the parent's reaper */
+static void rs_reaper_fork_child(void)
+{
+	pthread_mutex_init(&reaper.lock, NULL);
+	pthread_cond_init(&reaper.cond, NULL);
+	dlist_init(&reaper.list);
+	reaper.running = 0;
+	reaper.joinable = 0;
+}
+
+static void __attribute__((destructor)) rs_reaper_fini(void)
+{
+	struct timespec ts;
+
+	pthread_mutex_lock(&reaper.lock);
+	if (!reaper.joinable) {
+		pthread_mutex_unlock(&reaper.lock);
+		return;
+	}
+	reaper.stop = 1;
+	pthread_cond_broadcast(&reaper.cond);
+	pthread_mutex_unlock(&reaper.lock);
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += RS_REAPER_WAIT;
+	if (!pthread_timedjoin_np(reaper.thread, NULL, &ts))
+		reaper.joinable = 0;
+}
+
+/*
+ * Detaches the rsocket from the application and queues it to the reaper.
+ * If the application enabled SO_LINGER, queued data is still sent before
+ * rclose returns; only the teardown is deferred.
+ */
+static int rs_close_async(struct rsocket *rs)
+{
+	int ret;
+
+	pthread_mutex_lock(&reaper.lock);
+	if (!reaper.atfork) {
+		ret = pthread_atfork(rs_reaper_fork_prepare,
+				     rs_reaper_fork_parent,
+				     rs_reaper_fork_child);
+		if (ret) {
+			pthread_mutex_unlock(&reaper.lock);
+			return ERR(ret);
+		}
+		reaper.atfork = 1;
+	}
+	pthread_mutex_unlock(&reaper.lock);
+
+	if ((rs->opts & RS_OPT_LINGER) && (rs->state & rs_connected))
+		rs_shutdown(rs, SHUT_RDWR);
+
+	if (rs->evfd >= 0) {
+		close(rs->evfd);
+		close(rs->ev_notify);
+		rs->evfd = rs->ev_notify = -1;
+		rs->ev_flags = 0;
+	}
+	rs_remove(rs);
+	rs->index = -1;
+
+	/*
+	 * An idle thread may exit at any time until the rsocket is queued,
+	 * so it is only replaced here.  One that exited is joined first.
+	 */
+	pthread_mutex_lock(&reaper.lock);
+	if (!reaper.running) {
+		if (reaper.joinable)
+			pthread_join(reaper.thread, NULL);
+		reaper.joinable = 0;
+		ret = pthread_create(&reaper.thread, NULL, rs_reaper_run, NULL);
+		if (ret) {
+			pthread_mutex_unlock(&reaper.lock);
+			rs_close_stream(rs);
+			rs_free(rs);
+			return 0;
+		}
+		reaper.running = 1;
+		reaper.joinable = 1;
+	}
+	dlist_insert_tail(&rs->close_entry, &reaper.list);
+	pthread_cond_broadcast(&reaper.cond);
+	pthread_mutex_unlock(&reaper.lock);
+	return 0;
+}
+
 int rclose(int socket)
 {
 	struct rsocket *rs;
@@ -3277,10 +6551,15 @@ int rclose(int socket)
 	if (!rs)
 		return EBADF;
 	if (rs->type == SOCK_STREAM) {
-		if (rs->state & rs_connected)
-			rshutdown(socket, SHUT_RDWR);
-		else if (rs->opts & RS_OPT_SVC_ACTIVE)
-			rs_notify_svc(&tcp_svc, rs, RS_SVC_REM_KEEPALIVE);
+		if ((rs->opts & RS_OPT_ASYNC_CLOSE) &&
+		    !(rs->state & rs_listening) && !rs_close_async(rs))
+			return 0;
+
+		rs_close_stream(rs);
+		if (rs->accept_shards)
+			rs_accept_shards_stop(rs);
+		if (rs->accept_pool)
+			rs_accept_pool_stop(rs);
 	} else {
 		ds_shutdown(rs);
 	}
@@ -3359,6 +6638,91 @@ static int rs_set_keepalive(struct rsocket *rs, int on)
 	return ret;
 }
 
+/*
+ * The data path updates counters under its own locks, which may be held
+ * while a thread blocks.  Statistics are instead read one word at a time
+ * without locking, and a reset only records the current values, which
+ * later reads subtract.  The counters themselves keep running, so the
+ * shared memory statistics are unaffected by a reset.
+ */
+static void rs_read_counters(void *dst, const void *cur, const void *base,
+			     size_t size)
+{
+	const volatile uint64_t *src = cur;
+	const uint64_t *sub = base;
+	uint64_t *val = dst;
+	size_t i;
+
+	for (i = 0; i < size / sizeof(uint64_t); i++)
+		val[i] = src[i] - (sub ? sub[i] : 0);
+}
+
+static void rs_read_send_counters(struct rsocket *rs,
+				  struct rsocket_send_counters *send)
+{
+	rs_read_counters(send, rs->send_stats, &rs->send_base, sizeof *send);
+}
+
+static void rs_get_stats(struct rsocket *rs, struct rsocket_stats *stats)
+{
+	struct rsocket_send_counters send;
+	struct rsocket_recv_counters recv;
+	struct rsocket_cq_counters cq;
+
+	rs_read_send_counters(rs, &send);
+	rs_read_counters(&recv, rs->recv_stats, &rs->recv_base, sizeof recv);
+	rs_read_counters(&cq, rs->cq_stats, &rs->cq_base, sizeof cq);
+
+	memset(stats, 0, sizeof *stats);
+	stats->bytes_sent = send.bytes;
+	stats->bytes_recv = recv.bytes;
+	stats->data_wrs = send.wrs;
+	stats->data_msgs = cq.msgs;
+	stats->send_wait_sqe = send.wait[RS_WAIT_SQE];
+	stats->send_wait_sbuf = send.wait[RS_WAIT_SBUF];
+	stats->send_wait_credits = send.wait[RS_WAIT_CREDITS];
+	stats->send_wait_target = send.wait[RS_WAIT_TARGET];
+	stats->credits_sent = cq.credits_sent;
+	stats->credits_recv = cq.credits_recv;
+	stats->cq_events = cq.events;
+	stats->wc_errors = cq.wc_errors;
+	stats->rnr_retry_errors = cq.rnr_errors;
+	stats->sq_size = rs->sq_size;
+	stats->rq_size = rs->rq_size;
+	stats->sq_inline = rs->sq_inline;
+	stats->sbuf_size = rs->sbuf_size;
+	stats->rbuf_size = rs->rbuf_size;
+	stats->sqe_avail = rs->sqe_avail;
+	stats->sbuf_bytes_avail = rs->sbuf_bytes_avail;
+	stats->rbuf_bytes_avail = rs->rbuf_bytes_avail;
+}
+
+static void rs_get_send_stall(struct rsocket_send_counters *stats, int reason,
+			      struct rsocket_send_stall *stall)
+{
+	stall->count = stats->wait[reason];
+	stall->time_us = stats->wait_us[reason];
+	memcpy(stall->hist, stats->wait_hist[reason], sizeof stall->hist);
+}
+
+static void rs_get_send_stalls(struct rsocket_send_counters *stats,
+			       struct rsocket_send_stalls *stalls)
+{
+	rs_get_send_stall(stats, RS_WAIT_SQE, &stalls->sqe);
+	rs_get_send_stall(stats, RS_WAIT_SBUF, &stalls->sbuf);
+	rs_get_send_stall(stats, RS_WAIT_CREDITS, &stalls->credits);
+	rs_get_send_stall(stats, RS_WAIT_TARGET, &stalls->target);
+}
+
+static void rs_reset_stats(struct rsocket *rs)
+{
+	rs_read_counters(&rs->send_base, rs->send_stats, NULL,
+			 sizeof rs->send_base);
+	rs_read_counters(&rs->recv_base, rs->recv_stats, NULL,
+			 sizeof rs->recv_base);
+	rs_read_counters(&rs->cq_base, rs->cq_stats, NULL, sizeof rs->cq_base);
+}
+
 int rsetsockopt(int socket, int level, int optname,
 		const void *optval, socklen_t optlen)
 {
@@ -3408,9 +6772,17 @@ int rsetsockopt(int socket, int level, int optname,
 		case SO_LINGER:
 			/* Invert value so default so_opt = 0 is on */
 			opt_on =  !((struct linger *) optval)->l_onoff;
+			if (opt_on)
+				rs->opts &= ~RS_OPT_LINGER;
+			else
+				rs->opts |= RS_OPT_LINGER;
 			ret = 0;
 			break;
 		case SO_KEEPALIVE:
+			if (*(int *) optval && (rs->opts & RS_OPT_SINGLE_THREAD)) {
+				ret = ERR(EINVAL);
+				break;
+			}
 			ret = rs_set_keepalive(rs, *(int *) optval);
 			opt_on = rs->opts & RS_OPT_SVC_ACTIVE;
 			break;
@@ -3465,6 +6837,20 @@ int rsetsockopt(int socket, int level, int optname,
 		}
 		break;
 	case SOL_RDMA:
+		if (optname == RDMA_STATS_RESET) {
+			if (rs->type != SOCK_STREAM) {
+				ret = ERR(ENOTSUP);
+				break;
+			}
+			rs_reset_stats(rs);
+			ret = 0;
+			break;
+		} else if (optname == RDMA_RECORDER_DUMP) {
+			ret = (rs->type == SOCK_STREAM) ?
+			      rs_rec_dump(rs) : ERR(ENOTSUP);
+			break;
+		}
+
 		if (rs->state >= rs_opening) {
 			ret = ERR(EINVAL);
 			break;
@@ -3488,6 +6874,94 @@ int rsetsockopt(int socket, int level, int optname,
 				(uint8_t) rs_value_to_scale(*(int *) optval, 8), 8);
 			ret = 0;
 			break;
+		case RDMA_SINGLE_THREAD:
+			/*
+			 * Other threads may already be inside a listening
+			 * rsocket, and accepted rsockets copy the flag.
+			 */
+			if (rs->type != SOCK_STREAM || rs->state >= rs_listening ||
+			    (rs->opts & RS_OPT_SVC_ACTIVE)) {
+				ret = ERR(EINVAL);
+				break;
+			}
+			if (*(int *) optval)
+				rs->opts |= RS_OPT_SINGLE_THREAD;
+			else
+				rs->opts &= ~RS_OPT_SINGLE_THREAD;
+			ret = 0;
+			break;
+		case RDMA_RECORDER:
+			if (rs->type != SOCK_STREAM) {
+				ret = ERR(EINVAL);
+				break;
+			}
+			rs->rec_size = rs_rec_entries(*(uint32_t *) optval);
+			ret = 0;
+			break;
+		case RDMA_ACCEPT_POOL:
+			if (rs->type != SOCK_STREAM ||
+			    (rs->state & rs_listening)) {
+				ret = ERR(EINVAL);
+				break;
+			}
+			rs->accept_pool_size = min(max(*(int *) optval, 0),
+						   RS_ACCEPT_POOL_MAX);
+			ret = 0;
+			break;
+		case RDMA_ACCEPT_SHARDS:
+			if (rs->type != SOCK_STREAM ||
+			    (rs->state & rs_listening)) {
+				ret = ERR(EINVAL);
+				break;
+			}
+			rs->accept_shard_cnt = min(max(*(int *) optval, 0),
+						   RS_ACCEPT_SHARDS_MAX);
+			ret = 0;
+			break;
+		case RDMA_ACCEPT_HASH:
+			if (rs->type != SOCK_STREAM ||
+			    (rs->state & rs_listening)) {
+				ret = ERR(EINVAL);
+				break;
+			}
+			if (*(int *) optval)
+				rs->opts |= RS_OPT_ACCEPT_HASH;
+			else
+				rs->opts &= ~RS_OPT_ACCEPT_HASH;
+			ret = 0;
+			break;
+		case RDMA_ASYNC_CLOSE:
+			if (rs->type != SOCK_STREAM) {
+				ret = ERR(EINVAL);
+				break;
+			}
+			if (*(int *) optval)
+				rs->opts |= RS_OPT_ASYNC_CLOSE;
+			else
+				rs->opts &= ~RS_OPT_ASYNC_CLOSE;
+			ret = 0;
+			break;
+		case RDMA_CONN_DATA:
+			if (rs->type != SOCK_STREAM ||
+			    rs->state >= rs_listening ||
+			    optlen > RS_CONN_DATA_MAX) {
+				ret = ERR(EINVAL);
+				break;
+			}
+			free(rs->conn_sdata);
+			rs->conn_sdata = NULL;
+			rs->conn_slen = 0;
+			if (optlen) {
+				rs->conn_sdata = malloc(optlen);
+				if (!rs->conn_sdata) {
+					ret = ERR(ENOMEM);
+					break;
+				}
+				memcpy(rs->conn_sdata, optval, optlen);
+				rs->conn_slen = (uint8_t) optlen;
+			}
+			ret = 0;
+			break;
 		case RDMA_ROUTE:
 			if ((rs->optval = malloc(optlen))) {
 				memcpy(rs->optval, optval, optlen);
@@ -3537,6 +7011,25 @@ static void rs_convert_sa_path(struct ibv_sa_path_rec *sa_path,
 	path_data->flags= sa_path->preference;
 }
 
+static void rs_get_lock_stat(fastlock_t *lock, struct rsocket_lock_stat *stat)
+{
+	struct fastlock_stats stats;
+
+	fastlock_get_stats(lock, &stats);
+	stat->acquired = stats.acquired;
+	stat->contended = stats.contended;
+	stat->sleep_us = stats.sleep_us;
+}
+
+static void rs_get_lock_stats(struct rsocket *rs, struct rsocket_lock_stats *stats)
+{
+	rs_get_lock_stat(&rs->slock, &stats->slock);
+	rs_get_lock_stat(&rs->rlock, &stats->rlock);
+	rs_get_lock_stat(&rs->cq_lock, &stats->cq_lock);
+	rs_get_lock_stat(&rs->cq_wait_lock, &stats->cq_wait_lock);
+	rs_get_lock_stat(&rs->map_lock, &stats->map_lock);
+}
+
 int rgetsockopt(int socket, int level, int optname,
 		void *optval, socklen_t *optlen)
 {
@@ -3544,6 +7037,7 @@ int rgetsockopt(int socket, int level, int optname,
 	void *opt;
 	struct ibv_sa_path_rec *path_rec;
 	struct ibv_path_data path_data;
+	struct rsocket_send_counters send;
 	socklen_t len;
 	int ret = 0;
 	int num_paths;
@@ -3635,9 +7129,103 @@ int rgetsockopt(int socket, int level, int optname,
 			*((int *) optval) = rs->sq_inline;
 			*optlen = sizeof(int);
 			break;
-		case RDMA_IOMAPSIZE:
-			*((int *) optval) = rs->target_iomap_size;
-			*optlen = sizeof(int);
+		case RDMA_IOMAPSIZE:
+			*((int *) optval) = rs->target_iomap_size;
+			*optlen = sizeof(int);
+			break;
+		case RDMA_EVENT_FD:
+			if (rs->type != SOCK_STREAM || rs->shared_chan) {
+				ret = ENOTSUP;
+				break;
+			}
+			if (rs->evfd < 0 && rs_init_evfd(rs)) {
+				ret = errno;
+				break;
+			}
+			*((int *) optval) = rs->evfd;
+			*optlen = sizeof(int);
+			break;
+		case RDMA_SINGLE_THREAD:
+			*((int *) optval) = !!(rs->opts & RS_OPT_SINGLE_THREAD);
+			*optlen = sizeof(int);
+			break;
+		case RDMA_RECORDER:
+			*((int *) optval) = rs->rec_size;
+			*optlen = sizeof(int);
+			break;
+		case RDMA_ACCEPT_POOL:
+			*((int *) optval) = rs->accept_pool_size;
+			*optlen = sizeof(int);
+			break;
+		case RDMA_ACCEPT_SHARDS:
+			*((int *) optval) = rs->accept_shard_cnt;
+			*optlen = sizeof(int);
+			break;
+		case RDMA_ACCEPT_HASH:
+			*((int *) optval) = !!(rs->opts & RS_OPT_ACCEPT_HASH);
+			*optlen = sizeof(int);
+			break;
+		case RDMA_ASYNC_CLOSE:
+			*((int *) optval) = !!(rs->opts & RS_OPT_ASYNC_CLOSE);
+			*optlen = sizeof(int);
+			break;
+		case RDMA_CONN_DATA:
+			if (*optlen < rs->conn_slen) {
+				ret = EINVAL;
+				break;
+			}
+			if (rs->conn_sdata)
+				memcpy(optval, rs->conn_sdata, rs->conn_slen);
+			*optlen = rs->conn_slen;
+			break;
+		case RDMA_LATENCY:
+			if (*optlen < sizeof(struct rsocket_latency_stats)) {
+				ret = EINVAL;
+				break;
+			}
+			if (rget_latency_stats(optval)) {
+				ret = errno;
+				break;
+			}
+			*optlen = sizeof(struct rsocket_latency_stats);
+			break;
+		case RDMA_STATS:
+			if (rs->type != SOCK_STREAM) {
+				ret = ENOTSUP;
+				break;
+			}
+			if (*optlen < sizeof(struct rsocket_stats)) {
+				ret = EINVAL;
+				break;
+			}
+			rs_get_stats(rs, optval);
+			*optlen = sizeof(struct rsocket_stats);
+			break;
+		case RDMA_SEND_STALLS:
+		case RDMA_SEND_STALLS_TOTAL:
+			if (rs->type != SOCK_STREAM) {
+				ret = ENOTSUP;
+				break;
+			}
+			if (*optlen < sizeof(struct rsocket_send_stalls)) {
+				ret = EINVAL;
+				break;
+			}
+			if (optname == RDMA_SEND_STALLS)
+				rs_read_send_counters(rs, &send);
+			else
+				rs_read_counters(&send, send_stalls, NULL,
+						 sizeof send);
+			rs_get_send_stalls(&send, optval);
+			*optlen = sizeof(struct rsocket_send_stalls);
+			break;
+		case RDMA_LOCK_STATS:
+			if (*optlen < sizeof(struct rsocket_lock_stats)) {
+				ret = EINVAL;
+				break;
+			}
+			rs_get_lock_stats(rs, optval);
+			*optlen = sizeof(struct rsocket_lock_stats);
 			break;
 		case RDMA_ROUTE:
 			if (rs->optval) {
@@ -3762,7 +7350,7 @@ off_t riomap(int socket, void *buf, size_t len, int prot, int flags, off_t offse
 		goto out;
 	}
 
-	iomr->mr = ibv_reg_mr(rs->cm_id->pd, buf, len, access);
+	iomr->mr = ucma_ibv_reg_mr(rs->cm_id->pd, buf, len, access);
 	if (!iomr->mr) {
 		if (iomr->index < 0)
 			free(iomr);
@@ -3832,7 +7420,7 @@ static struct rs_iomap *rs_find_iomap(struct rsocket *rs, off_t offset)
 	return NULL;
 }
 
-size_t riowrite(int socket, const void *buf, size_t count, off_t offset, int flags)
+static size_t rs_iowrite(int socket, const void *buf, size_t count, off_t offset, int flags)
 {
 	struct rsocket *rs;
 	struct rs_iomap *iom = NULL;
@@ -3842,7 +7430,7 @@ size_t riowrite(int socket, const void *buf, size_t count, off_t offset, int fla
 	int ret = 0;
 
 	rs = idm_at(&idm, socket);
-	fastlock_acquire(&rs->slock);
+	rs_lock(rs, &rs->slock);
 	if (rs->iomap_pending) {
 		ret = rs_send_iomaps(rs, flags);
 		if (ret)
@@ -3856,8 +7444,7 @@ size_t riowrite(int socket, const void *buf, size_t count, off_t offset, int fla
 		}
 
 		if (!rs_can_send(rs)) {
-			ret = rs_get_comp(rs, rs_nonblocking(rs, flags),
-					  rs_conn_can_send);
+			ret = rs_wait_send(rs, rs_nonblocking(rs, flags));
 			if (ret)
 				break;
 			if (!(rs->state & rs_writable)) {
@@ -3866,49 +7453,637 @@ size_t riowrite(int socket, const void *buf, size_t count, off_t offset, int fla
 			}
 		}
 
-		if (olen < left) {
-			xfer_size = olen;
-			if (olen < RS_MAX_TRANSFER)
-				olen <<= 1;
-		} else {
-			xfer_size = left;
+		if (olen < left) {
+			xfer_size = olen;
+			if (olen < RS_MAX_TRANSFER)
+				olen <<= 1;
+		} else {
+			xfer_size = left;
+		}
+
+		if (xfer_size > rs->sbuf_bytes_avail)
+			xfer_size = rs->sbuf_bytes_avail;
+		if (xfer_size > iom->offset + iom->sge.length - offset)
+			xfer_size = iom->offset + iom->sge.length - offset;
+
+		if (xfer_size <= rs->sq_inline) {
+			sge.addr = (uintptr_t) buf;
+			sge.length = xfer_size;
+			sge.lkey = 0;
+			ret = rs_write_direct(rs, iom, offset, &sge, 1,
+					      xfer_size, IBV_SEND_INLINE);
+		} else if (xfer_size <= rs_sbuf_left(rs)) {
+			memcpy((void *) (uintptr_t) rs->ssgl[0].addr, buf, xfer_size);
+			rs->ssgl[0].length = xfer_size;
+			ret = rs_write_direct(rs, iom, offset, rs->ssgl, 1, xfer_size, 0);
+			if (xfer_size < rs_sbuf_left(rs))
+				rs->ssgl[0].addr += xfer_size;
+			else
+				rs->ssgl[0].addr = (uintptr_t) rs->sbuf;
+		} else {
+			rs->ssgl[0].length = rs_sbuf_left(rs);
+			memcpy((void *) (uintptr_t) rs->ssgl[0].addr, buf,
+				rs->ssgl[0].length);
+			rs->ssgl[1].length = xfer_size - rs->ssgl[0].length;
+			memcpy(rs->sbuf, buf + rs->ssgl[0].length, rs->ssgl[1].length);
+			ret = rs_write_direct(rs, iom, offset, rs->ssgl, 2, xfer_size, 0);
+			rs->ssgl[0].addr = (uintptr_t) rs->sbuf + rs->ssgl[1].length;
+		}
+		if (ret)
+			break;
+	}
+out:
+	rs_unlock(rs, &rs->slock);
+	if (rs->evfd >= 0) {
+		rs->ev_want_send = (left != 0);
+		rs_update_evfd(rs);
+	}
+
+	return (ret && left == count) ? ret : count - left;
+}
+
+size_t riowrite(int socket, const void *buf, size_t count, off_t offset, int flags)
+{
+	uint64_t start = rs_lat_start();
+	size_t ret;
+
+	ret = rs_iowrite(socket, buf, count, offset, flags);
+	rs_lat_end(RSOCKET_LAT_IOWRITE, start);
+	return ret;
+}
+
+/****************************************************************************
+ * Connection Pools
+ ****************************************************************************/
+
+/*
+ * Connection pools keep connected rsockets that were released by the
+ * application, indexed by destination address, and hand them out again
+ * from rpool_connect.  Every connection in a pool is created with the
+ * pool's socket options, so the pool and the destination together form
+ * the key.  Idle connections are kept alive and checked by the keepalive
+ * service, unless the options disable it.
+ */
+struct rs_pool_opt {
+	int		  level;
+	int		  optname;
+	void		  *optval;
+	socklen_t	  optlen;
+};
+
+struct rs_pool_dest {
+	union socket_addr addr;
+	int		  idle_cnt;
+	int		  idle[0];
+};
+
+struct rsocket_pool {
+	pthread_mutex_t	  lock;
+	int		  domain;
+	int		  max_idle;
+	int		  keepalive;
+	void		  *dest_map;
+	int		  opt_cnt;
+	struct rs_pool_opt *opts;
+};
+
+struct rsocket_pool *rpool_create(int domain, int max_idle)
+{
+	struct rsocket_pool *pool;
+
+	if ((domain != AF_INET && domain != AF_INET6) || max_idle < 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	pool = calloc(1, sizeof *pool);
+	if (!pool)
+		return NULL;
+
+	pthread_mutex_init(&pool->lock, NULL);
+	pool->domain = domain;
+	pool->max_idle = max_idle;
+	pool->keepalive = 1;
+	return pool;
+}
+
+static void rs_pool_free_dest(void *node)
+{
+	struct rs_pool_dest *dest = node;
+
+	while (dest->idle_cnt)
+		rclose(dest->idle[--dest->idle_cnt]);
+	free(dest);
+}
+
+static void rs_pool_flush(struct rsocket_pool *pool)
+{
+	pthread_mutex_lock(&pool->lock);
+	tdestroy(pool->dest_map, rs_pool_free_dest);
+	pool->dest_map = NULL;
+	pthread_mutex_unlock(&pool->lock);
+}
+
+void rpool_destroy(struct rsocket_pool *pool)
+{
+	int i;
+
+	rs_pool_flush(pool);
+	for (i = 0; i < pool->opt_cnt; i++)
+		free(pool->opts[i].optval);
+	free(pool->opts);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool);
+}
+
+/*
+ * Options apply to connections created after the call.  Idle connections
+ * created with the previous options are closed.
+ */
+int rpool_setsockopt(struct rsocket_pool *pool, int level, int optname,
+		     const void *optval, socklen_t optlen)
+{
+	struct rs_pool_opt *opt;
+	void *val;
+	int i;
+
+	val = malloc(optlen);
+	if (!val)
+		return ERR(ENOMEM);
+	memcpy(val, optval, optlen);
+
+	pthread_mutex_lock(&pool->lock);
+	for (i = 0; i < pool->opt_cnt; i++) {
+		if (pool->opts[i].level == level && pool->opts[i].optname == optname)
+			break;
+	}
+
+	if (i == pool->opt_cnt) {
+		opt = realloc(pool->opts, sizeof(*opt) * (i + 1));
+		if (!opt) {
+			pthread_mutex_unlock(&pool->lock);
+			free(val);
+			return ERR(ENOMEM);
+		}
+		pool->opts = opt;
+		pool->opt_cnt++;
+	} else {
+		free(pool->opts[i].optval);
+	}
+
+	pool->opts[i].level = level;
+	pool->opts[i].optname = optname;
+	pool->opts[i].optval = val;
+	pool->opts[i].optlen = optlen;
+	if ((level == SOL_SOCKET && optname == SO_KEEPALIVE) ||
+	    (level == SOL_RDMA && optname == RDMA_SINGLE_THREAD))
+		pool->keepalive = 0;
+	pthread_mutex_unlock(&pool->lock);
+
+	rs_pool_flush(pool);
+	return 0;
+}
+
+/*
+ * An rsocket can be reused if it is still connected in both directions
+ * and has no unread data.  Processing completions picks up a disconnect,
+ * or the error left by a failed keepalive.
+ */
+static int rs_pool_idle(struct rsocket *rs)
+{
+	if (rs->type != SOCK_STREAM || rs->state != rs_connect_rdwr)
+		return 0;
+
+	if (rs->local) {
+		rs_lock(rs, &rs->cq_wait_lock);
+		rs_local_drain(rs->local);
+		rs_unlock(rs, &rs->cq_wait_lock);
+	}
+	return !rs_poll_rs(rs, POLLIN, 1, rs_poll_all) &&
+	       rs->state == rs_connect_rdwr;
+}
+
+static int rs_pool_get(struct rsocket_pool *pool, const struct sockaddr *addr)
+{
+	struct rs_pool_dest **dest;
+	int socket = -1;
+
+	pthread_mutex_lock(&pool->lock);
+	dest = tfind(addr, &pool->dest_map, ds_compare_addr);
+	if (dest && (*dest)->idle_cnt)
+		socket = (*dest)->idle[--(*dest)->idle_cnt];
+	pthread_mutex_unlock(&pool->lock);
+	return socket;
+}
+
+static int rs_pool_set_opts(struct rsocket_pool *pool, int socket)
+{
+	int i, ret = 0;
+
+	pthread_mutex_lock(&pool->lock);
+	for (i = 0; i < pool->opt_cnt && !ret; i++) {
+		ret = rsetsockopt(socket, pool->opts[i].level,
+				  pool->opts[i].optname, pool->opts[i].optval,
+				  pool->opts[i].optlen);
+	}
+	if (!ret && pool->keepalive) {
+		i = 1;
+		ret = rsetsockopt(socket, SOL_SOCKET, SO_KEEPALIVE, &i, sizeof i);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return ret;
+}
+
+int rpool_connect(struct rsocket_pool *pool, const struct sockaddr *addr,
+		  socklen_t addrlen)
+{
+	struct rsocket *rs;
+	int socket, ret, err;
+
+	while ((socket = rs_pool_get(pool, addr)) >= 0) {
+		rs = idm_lookup(&idm, socket);
+		if (rs && rs_pool_idle(rs))
+			return socket;
+		rclose(socket);
+	}
+
+	socket = rsocket(pool->domain, SOCK_STREAM, 0);
+	if (socket < 0)
+		return socket;
+
+	ret = rs_pool_set_opts(pool, socket);
+	if (!ret)
+		ret = rconnect(socket, addr, addrlen);
+	if (ret) {
+		err = errno;
+		rclose(socket);
+		return ERR(err);
+	}
+
+	rs = idm_lookup(&idm, socket);
+	rs->pool = pool;
+	return socket;
+}
+
+/*
+ * Return a connection to the pool.  Only connections obtained from this
+ * pool are accepted.  Per-use state (nonblocking mode, statistics and the
+ * flight recorder) is reset.  Connections that are not idle, that still
+ * have I/O mappings or unsent connection data, or that exceed the pool's
+ * limit for their destination, are closed.  The peer may still write to a
+ * mapping, and the next user could not remove it.
+ */
+int rpool_release(struct rsocket_pool *pool, int socket)
+{
+	struct rs_pool_dest **dest, *new_dest;
+	struct sockaddr *addr;
+	struct rsocket *rs;
+
+	rs = idm_lookup(&idm, socket);
+	if (!rs)
+		return ERR(EBADF);
+	if (rs->pool != pool)
+		return ERR(EINVAL);
+	if (!rs_pool_idle(rs) || !dlist_empty(&rs->iomap_list) ||
+	    !dlist_empty(&rs->iomap_queue) || rs->conn_sdata)
+		return rclose(socket);
+
+	if (rs->fd_flags & O_NONBLOCK)
+		rfcntl(socket, F_SETFL, rs->fd_flags & ~O_NONBLOCK);
+	rs_reset_stats(rs);
+	rs_rec_reset(rs);
+
+	addr = &rs->cm_id->route.addr.dst_addr;
+	pthread_mutex_lock(&pool->lock);
+	dest = tfind(addr, &pool->dest_map, ds_compare_addr);
+	if (!dest) {
+		new_dest = calloc(1, sizeof(*new_dest) +
+				     sizeof(int) * pool->max_idle);
+		if (!new_dest)
+			goto close;
+
+		memcpy(&new_dest->addr, addr, ucma_addrlen(addr));
+		dest = tsearch(&new_dest->addr, &pool->dest_map, ds_compare_addr);
+		if (!dest) {
+			free(new_dest);
+			goto close;
+		}
+	}
+
+	if ((*dest)->idle_cnt < pool->max_idle) {
+		(*dest)->idle[(*dest)->idle_cnt++] = socket;
+		pthread_mutex_unlock(&pool->lock);
+		return 0;
+	}
+close:
+	pthread_mutex_unlock(&pool->lock);
+	return rclose(socket);
+}
+
+/****************************************************************************
+ * Bulk Connects
+ ****************************************************************************/
+
+/*
+ * Bulk connects drive many rconnects through one rdma_cm event channel,
+ * instead of one channel per rsocket.  A connection's cm_id moves to its
+ * own channel once it is established, making it an ordinary rsocket.
+ * Failed attempts are retried with exponential backoff, unless the peer
+ * refused the connection.
+ */
+struct rs_bulk_conn {
+	dlist_entry	  entry;
+	struct rsocket	  *rs;
+	void		  *context;
+	uint64_t	  due;		/* retry time, in ns */
+	int		  retries;
+	int		  status;
+	struct sockaddr_storage addr;
+};
+
+struct rsocket_bulk {
+	struct rdma_event_channel *channel;
+	struct rsocket	  *tmpl;
+	int		  max_pending;
+	int		  pending;
+	dlist_entry	  queue;
+	dlist_entry	  retry;
+	dlist_entry	  active;
+	dlist_entry	  done;
+};
+
+struct rsocket_bulk *rbulk_create(int socket, int max_pending)
+{
+	struct rsocket_bulk *bulk;
+	struct rsocket *tmpl = NULL;
+
+	rs_configure();
+	if (socket >= 0) {
+		tmpl = idm_lookup(&idm, socket);
+		if (!tmpl || tmpl->type != SOCK_STREAM) {
+			errno = EBADF;
+			return NULL;
+		}
+	}
+
+	bulk = calloc(1, sizeof(*bulk));
+	if (!bulk) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	bulk->channel = rdma_create_event_channel();
+	if (!bulk->channel ||
+	    fcntl(bulk->channel->fd, F_SETFL, O_NONBLOCK)) {
+		if (bulk->channel)
+			rdma_destroy_event_channel(bulk->channel);
+		free(bulk);
+		return NULL;
+	}
+
+	bulk->tmpl = tmpl;
+	bulk->max_pending = max_pending > 0 ? max_pending : RS_BULK_PENDING;
+	dlist_init(&bulk->queue);
+	dlist_init(&bulk->retry);
+	dlist_init(&bulk->active);
+	dlist_init(&bulk->done);
+	return bulk;
+}
+
+static void rs_bulk_free_list(dlist_entry *head)
+{
+	struct rs_bulk_conn *conn;
+
+	while (!dlist_empty(head)) {
+		conn = container_of(head->next, struct rs_bulk_conn, entry);
+		dlist_remove(&conn->entry);
+		if (conn->rs && conn->rs->index >= 0)
+			rclose(conn->rs->index);
+		else if (conn->rs)
+			rs_free(conn->rs);
+		free(conn);
+	}
+}
+
+void rbulk_destroy(struct rsocket_bulk *bulk)
+{
+	rs_bulk_free_list(&bulk->queue);
+	rs_bulk_free_list(&bulk->retry);
+	rs_bulk_free_list(&bulk->active);
+	rs_bulk_free_list(&bulk->done);
+	rdma_destroy_event_channel(bulk->channel);
+	free(bulk);
+}
+
+int rbulk_connect(struct rsocket_bulk *bulk, const struct sockaddr *addr,
+		  socklen_t addrlen, void *context)
+{
+	struct rs_bulk_conn *conn;
+
+	if (addrlen > sizeof conn->addr)
+		return ERR(EINVAL);
+
+	conn = calloc(1, sizeof(*conn));
+	if (!conn)
+		return ERR(ENOMEM);
+
+	memcpy(&conn->addr, addr, addrlen);
+	conn->context = context;
+	dlist_insert_tail(&conn->entry, &bulk->queue);
+	return 0;
+}
+
+static void rs_bulk_fail(struct rsocket_bulk *bulk, struct rs_bulk_conn *conn,
+			 int err)
+{
+	dlist_remove(&conn->entry);
+	bulk->pending--;
+	if (conn->rs) {
+		rs_route_drop(conn->rs, err);
+		rs_free(conn->rs);
+		conn->rs = NULL;
+	}
+	if (err != ECONNREFUSED && ++conn->retries <= RS_CONN_RETRIES) {
+		conn->due = rs_time_ns() + (1000000ULL << conn->retries);
+		dlist_insert_tail(&conn->entry, &bulk->retry);
+	} else {
+		conn->status = err;
+		dlist_insert_tail(&conn->entry, &bulk->done);
+	}
+}
+
+static void rs_bulk_start(struct rsocket_bulk *bulk, struct rs_bulk_conn *conn)
+{
+	struct rsocket *rs;
+	int ret;
+
+	dlist_remove(&conn->entry);
+	dlist_insert_tail(&conn->entry, &bulk->active);
+	bulk->pending++;
+	conn->rs = rs = rs_alloc(bulk->tmpl, SOCK_STREAM);
+	if (!rs) {
+		rs_bulk_fail(bulk, conn, ENOMEM);
+		return;
+	}
+
+	rs->conn_start = rs_lat_start();
+	ret = rdma_create_id(bulk->channel, &rs->cm_id, conn, RDMA_PS_TCP);
+	if (!ret)
+		ret = rdma_resolve_addr(rs->cm_id, NULL,
+					(struct sockaddr *) &conn->addr,
+					1000 << conn->retries);
+	if (ret)
+		rs_bulk_fail(bulk, conn, errno);
+	else
+		rs_set_state(rs, rs_resolving_addr);
+}
+
+/* Retries go first, then new connections, up to max_pending in flight */
+static void rs_bulk_start_all(struct rsocket_bulk *bulk, uint64_t now)
+{
+	struct rs_bulk_conn *conn;
+	dlist_entry *item, *next;
+
+	for (item = bulk->retry.next; item != &bulk->retry; item = next) {
+		next = item->next;
+		conn = container_of(item, struct rs_bulk_conn, entry);
+		if (bulk->pending >= bulk->max_pending)
+			return;
+		if (conn->due <= now)
+			rs_bulk_start(bulk, conn);
+	}
+
+	while (bulk->pending < bulk->max_pending && !dlist_empty(&bulk->queue)) {
+		conn = container_of(bulk->queue.next, struct rs_bulk_conn, entry);
+		rs_bulk_start(bulk, conn);
+	}
+}
+
+/*
+ * The event must be acked before a failed cm_id is destroyed or an
+ * established one migrates to its own channel.
+ */
+static void rs_bulk_event(struct rsocket_bulk *bulk, struct rdma_cm_event *event)
+{
+	struct rs_bulk_conn *conn = event->id->context;
+	struct rsocket *rs = conn->rs;
+	struct rdma_conn_param param;
+	struct rs_conn_private_data cdata;
+	int ret, err = 0, established = 0;
+
+	switch (event->event) {
+	case RDMA_CM_EVENT_ADDR_RESOLVED:
+		rs_conn_phase(rs, RSOCKET_LAT_RESOLVE_ADDR);
+		ret = rs_route_lookup(rs) ?
+		      rdma_resolve_route(rs->cm_id, 1000 << conn->retries) : 0;
+		if (!ret) {
+			rs_set_state(rs, rs_resolving_route);
+			ret = rs_create_ep(rs);
+			if (!ret)
+				rs_conn_phase(rs, RSOCKET_LAT_CREATE_EP);
+		}
+		break;
+	case RDMA_CM_EVENT_ROUTE_RESOLVED:
+		rs_conn_phase(rs, RSOCKET_LAT_RESOLVE_ROUTE);
+		rs_route_save(rs);
+		rs_format_conn_param(rs, &param, &cdata);
+		ret = rdma_connect(rs->cm_id, &param);
+		if (!ret)
+			rs_set_state(rs, rs_connecting);
+		break;
+	case RDMA_CM_EVENT_ESTABLISHED:
+		rs_conn_phase(rs, RSOCKET_LAT_ESTABLISH);
+		ret = rs_connect_done(rs, &event->param.conn);
+		established = !ret;
+		break;
+	case RDMA_CM_EVENT_REJECTED:
+		ret = ERR(ECONNREFUSED);
+		break;
+	case RDMA_CM_EVENT_ROUTE_ERROR:
+		ret = ERR(event->status < 0 ? -event->status : EHOSTUNREACH);
+		break;
+	default:
+		ret = ERR(event->status < 0 ? -event->status : ECONNABORTED);
+		break;
+	}
+	if (ret)
+		err = errno;
+	rdma_ack_cm_event(event);
+
+	if (established) {
+		ret = rdma_migrate_id(rs->cm_id, NULL);
+		if (!ret) {
+			rs->cm_id->context = rs;
+			ret = rs_insert(rs, rs->cm_id->channel->fd);
 		}
-
-		if (xfer_size > rs->sbuf_bytes_avail)
-			xfer_size = rs->sbuf_bytes_avail;
-		if (xfer_size > iom->offset + iom->sge.length - offset)
-			xfer_size = iom->offset + iom->sge.length - offset;
-
-		if (xfer_size <= rs->sq_inline) {
-			sge.addr = (uintptr_t) buf;
-			sge.length = xfer_size;
-			sge.lkey = 0;
-			ret = rs_write_direct(rs, iom, offset, &sge, 1,
-					      xfer_size, IBV_SEND_INLINE);
-		} else if (xfer_size <= rs_sbuf_left(rs)) {
-			memcpy((void *) (uintptr_t) rs->ssgl[0].addr, buf, xfer_size);
-			rs->ssgl[0].length = xfer_size;
-			ret = rs_write_direct(rs, iom, offset, rs->ssgl, 1, xfer_size, 0);
-			if (xfer_size < rs_sbuf_left(rs))
-				rs->ssgl[0].addr += xfer_size;
-			else
-				rs->ssgl[0].addr = (uintptr_t) rs->sbuf;
-		} else {
-			rs->ssgl[0].length = rs_sbuf_left(rs);
-			memcpy((void *) (uintptr_t) rs->ssgl[0].addr, buf,
-				rs->ssgl[0].length);
-			rs->ssgl[1].length = xfer_size - rs->ssgl[0].length;
-			memcpy(rs->sbuf, buf + rs->ssgl[0].length, rs->ssgl[1].length);
-			ret = rs_write_direct(rs, iom, offset, rs->ssgl, 2, xfer_size, 0);
-			rs->ssgl[0].addr = (uintptr_t) rs->sbuf + rs->ssgl[1].length;
+		if (ret >= 0) {
+			dlist_remove(&conn->entry);
+			dlist_insert_tail(&conn->entry, &bulk->done);
+			bulk->pending--;
+			return;
 		}
-		if (ret)
+		err = errno;
+	}
+	if (err)
+		rs_bulk_fail(bulk, conn, err);
+}
+
+/*
+ * Returns up to nent completed connections, waiting up to timeout
+ * milliseconds for the first one.  Returns 0 if none completed, including
+ * when no connections are left.
+ */
+int rbulk_poll(struct rsocket_bulk *bulk, struct rsocket_bulk_comp *comp,
+	       int nent, int timeout)
+{
+	struct rdma_cm_event *event;
+	struct rs_bulk_conn *conn;
+	struct pollfd fds;
+	dlist_entry *item;
+	uint64_t now, end;
+	int i, wait;
+
+	now = rs_time_ns();
+	end = now + (uint64_t) timeout * 1000000;
+	for (;;) {
+		rs_bulk_start_all(bulk, now);
+		if (!dlist_empty(&bulk->done))
 			break;
+		if (!bulk->pending && dlist_empty(&bulk->retry) &&
+		    dlist_empty(&bulk->queue))
+			return 0;
+		if (timeout >= 0 && now >= end)
+			return 0;
+
+		wait = timeout < 0 ? -1 : (int) ((end - now) / 1000000) + 1;
+		if (bulk->pending < bulk->max_pending) {
+			for (item = bulk->retry.next; item != &bulk->retry;
+			     item = item->next) {
+				conn = container_of(item, struct rs_bulk_conn, entry);
+				i = (int) ((conn->due - min(conn->due, now)) / 1000000) + 1;
+				if (wait < 0 || i < wait)
+					wait = i;
+			}
+		}
+
+		fds.fd = bulk->channel->fd;
+		fds.events = POLLIN;
+		fds.revents = 0;
+		poll(&fds, 1, wait);
+		while (!rdma_get_cm_event(bulk->channel, &event))
+			rs_bulk_event(bulk, event);
+		now = rs_time_ns();
 	}
-out:
-	fastlock_release(&rs->slock);
 
-	return (ret && left == count) ? ret : count - left;
+	for (i = 0; i < nent && !dlist_empty(&bulk->done); i++) {
+		conn = container_of(bulk->done.next, struct rs_bulk_conn, entry);
+		dlist_remove(&conn->entry);
+		comp[i].context = conn->context;
+		comp[i].socket = conn->rs ? conn->rs->index : -1;
+		comp[i].status = conn->status;
+		free(conn);
+	}
+	return i;
 }
 
 /****************************************************************************
@@ -4018,8 +8193,8 @@ static uint8_t udp_svc_sgid_index(struct ds_dest *dest, union ibv_gid *sgid)
 	int i;
 
 	for (i = 0; i < 16; i++) {
-		ibv_query_gid(dest->qp->cm_id->verbs, dest->qp->cm_id->port_num,
-			      i, &gid);
+		ucma_ibv_query_gid(dest->qp->cm_id->verbs, dest->qp->cm_id->port_num,
+				   i, &gid);
 		if (!memcmp(sgid, &gid, sizeof gid))
 			return i;
 	}
@@ -4030,7 +8205,7 @@ static uint8_t udp_svc_path_bits(struct ds_dest *dest)
 {
 	struct ibv_port_attr attr;
 
-	if (!ibv_query_port(dest->qp->cm_id->verbs, dest->qp->cm_id->port_num, &attr))
+	if (!ucma_ibv_query_port(dest->qp->cm_id->verbs, dest->qp->cm_id->port_num, &attr))
 		return (uint8_t) ((1 << attr.lmc) - 1);
 	return 0x7f;
 }
@@ -4044,7 +8219,7 @@ static void udp_svc_create_ah(struct rsocket *rs, struct ds_dest *dest, uint32_t
 
 	if (dest->ah) {
 		fastlock_acquire(&rs->slock);
-		ibv_destroy_ah(dest->ah);
+		ucma_ibv_destroy_ah(dest->ah);
 		dest->ah = NULL;
 		fastlock_release(&rs->slock);
 	}
@@ -4084,7 +8259,7 @@ static void udp_svc_create_ah(struct rsocket *rs, struct ds_dest *dest, uint32_t
 
 	fastlock_acquire(&rs->slock);
 	dest->qpn = qpn;
-	dest->ah = ibv_create_ah(dest->qp->cm_id->pd, &attr);
+	dest->ah = ucma_ibv_create_ah(dest->qp->cm_id->pd, &attr);
 	fastlock_release(&rs->slock);
 out:
 	rdma_destroy_id(id);
@@ -4196,6 +8371,8 @@ static void *udp_svc_run(void *arg)
 			udp_svc_fds[i].revents = 0;
 
 		poll(udp_svc_fds, svc->cnt + 1, -1);
+		if (rs_shm)
+			rs_shm->udp_svc_wakeups++;
 		if (udp_svc_fds[0].revents)
 			udp_svc_process_sock(svc);
 
@@ -4203,6 +8380,8 @@ static void *udp_svc_run(void *arg)
 			if (udp_svc_fds[i].revents)
 				udp_svc_process_rs(svc->rss[i]);
 		}
+		if (rs_shm)
+			rs_shm->udp_svc_socks = svc->cnt;
 	} while (svc->cnt >= 1);
 
 	return NULL;
@@ -4210,103 +8389,498 @@ static void *udp_svc_run(void *arg)
 
 static uint32_t rs_get_time(void)
 {
-	struct timeval now;
+	return (uint32_t) (rs_time_ns() / 1000000000);
+}
+
+/*
+ * Keepalive deadlines are kept in a hierarchical timer wheel with one
+ * second ticks.  Each slot at level l covers RS_WHEEL_SLOTS^l seconds,
+ * and an rsocket is placed in the lowest level that reaches its deadline.
+ * When a slot above level 0 comes up, its rsockets move down to the level
+ * that now reaches their deadlines; a slot at level 0 expires.  A bitmap
+ * of the non-empty slots at each level gives the next tick with any work
+ * without visiting rsockets, so adding, changing or removing a deadline
+ * is O(1), and the service thread sleeps until a keepalive is due.
+ *
+ * Callers update the wheel directly under keepalive_lock.  The service
+ * thread is only messaged to start or stop, or to wake up early when a
+ * deadline comes before its next wake up.  Expired rsockets are moved to
+ * a sending list and their keepalives posted after the lock is dropped,
+ * so that a slow send does not hold up rsetsockopt or rclose.  Removing
+ * or changing the deadline of an rsocket on that list waits for the
+ * sends to finish.
+ */
+#define RS_WHEEL_BITS	6
+#define RS_WHEEL_SLOTS	(1 << RS_WHEEL_BITS)
+#define RS_WHEEL_MASK	(RS_WHEEL_SLOTS - 1)
+#define RS_WHEEL_LEVELS	4
+#define RS_WHEEL_SPAN	(1U << (RS_WHEEL_BITS * RS_WHEEL_LEVELS))
+#define RS_WHEEL_MAX_SLEEP 86400	/* seconds, bounds the poll timeout */
+#define RS_WHEEL_SENDING (RS_WHEEL_LEVELS * RS_WHEEL_SLOTS)
+
+static struct {
+	uint32_t	  now;		/* last tick processed */
+	uint32_t	  wakeup;	/* service thread's next wake up */
+	uint64_t	  map[RS_WHEEL_LEVELS];
+	dlist_entry	  slot[RS_WHEEL_LEVELS][RS_WHEEL_SLOTS];
+	dlist_entry	  sending;	/* expired, keepalive not yet sent */
+	pthread_cond_t	  sent;		/* signaled when sending empties */
+} keepalive = {
+	.sent = PTHREAD_COND_INITIALIZER
+};
+
+static void rs_wheel_init(uint32_t now)
+{
+	int level, i;
 
-	memset(&now, 0, sizeof now);
-	gettimeofday(&now, NULL);
-	return (uint32_t) now.tv_sec;
+	for (level = 0; level < RS_WHEEL_LEVELS; level++) {
+		keepalive.map[level] = 0;
+		for (i = 0; i < RS_WHEEL_SLOTS; i++)
+			dlist_init(&keepalive.slot[level][i]);
+	}
+	dlist_init(&keepalive.sending);
+	keepalive.now = now;
+	keepalive.wakeup = ~0;
 }
 
-static void tcp_svc_process_sock(struct rs_svc *svc)
+static void rs_wheel_insert(struct rsocket *rs)
+{
+	uint32_t delta;
+	int level, i;
+
+	/* a deadline moved down a level may be due on the current tick */
+	delta = rs->keepalive_due - keepalive.now;
+	if ((int32_t) delta < 0) {
+		delta = 1;
+		rs->keepalive_due = keepalive.now + 1;
+	} else if (delta >= RS_WHEEL_SPAN) {
+		delta = RS_WHEEL_SPAN - 1;
+		rs->keepalive_due = keepalive.now + delta;
+	}
+
+	for (level = 0; delta >> (RS_WHEEL_BITS * (level + 1)); level++)
+		;
+	i = (rs->keepalive_due >> (RS_WHEEL_BITS * level)) & RS_WHEEL_MASK;
+	rs->keepalive_slot = (uint16_t) (level * RS_WHEEL_SLOTS + i);
+	dlist_insert_tail(&rs->keepalive_entry, &keepalive.slot[level][i]);
+	keepalive.map[level] |= 1ULL << i;
+}
+
+static void rs_wheel_remove(struct rsocket *rs)
+{
+	int level, i;
+
+	while (rs->keepalive_slot == RS_WHEEL_SENDING)
+		pthread_cond_wait(&keepalive.sent, &keepalive_lock);
+
+	level = rs->keepalive_slot / RS_WHEEL_SLOTS;
+	i = rs->keepalive_slot & RS_WHEEL_MASK;
+	dlist_remove(&rs->keepalive_entry);
+	if (dlist_empty(&keepalive.slot[level][i]))
+		keepalive.map[level] &= ~(1ULL << i);
+}
+
+/* Moves the rsockets in a slot onto list, emptying the slot */
+static void rs_wheel_take(int level, int i, dlist_entry *list)
+{
+	dlist_entry *slot = &keepalive.slot[level][i];
+
+	dlist_init(list);
+	if (!dlist_empty(slot)) {
+		list->next = slot->next;
+		list->prev = slot->prev;
+		list->next->prev = list;
+		list->prev->next = list;
+		dlist_init(slot);
+	}
+	keepalive.map[level] &= ~(1ULL << i);
+}
+
+/* Returns the number of ticks after keepalive.now with work, or ~0 */
+static uint32_t rs_wheel_next(void)
+{
+	uint64_t map, tick, next = ~0U;
+	int level, shift, cur;
+
+	for (level = 0; level < RS_WHEEL_LEVELS; level++) {
+		if (!keepalive.map[level])
+			continue;
+
+		/* rotate the slot after the current one down to bit 0 */
+		shift = RS_WHEEL_BITS * level;
+		cur = ((keepalive.now >> shift) + 1) & RS_WHEEL_MASK;
+		map = keepalive.map[level];
+		if (cur)
+			map = (map >> cur) | (map << (RS_WHEEL_SLOTS - cur));
+
+		tick = ((uint64_t) ffsll((long long) map) << shift) -
+		       (keepalive.now & ((1U << shift) - 1));
+		if (tick < next)
+			next = tick;
+	}
+	return (uint32_t) next;
+}
+
+/*
+ * Send a 0 byte RDMA write with immediate as keep-alive message.
+ * This avoids the need for the receive side to do any acknowledgment.
+ */
+static void tcp_svc_send_keepalive(struct rsocket *rs)
+{
+	fastlock_acquire(&rs->cq_lock);
+	if (!rs->local && rs_ctrl_avail(rs) && (rs->state & rs_connected)) {
+		rs->ctrl_seqno++;
+		rs_post_write(rs, NULL, 0, rs_msg_set(RS_OP_CTRL, RS_CTRL_KEEPALIVE),
+			      0, (uint64_t) NULL, (uint64_t) NULL);
+		if (rs_shm)
+			rs_shm->tcp_svc_keepalives++;
+	}
+	fastlock_release(&rs->cq_lock);
+}	
+
+static void rs_wheel_tick(void)
+{
+	dlist_entry list;
+	struct rsocket *rs;
+	uint32_t tick;
+	int level, shift;
+
+	tick = ++keepalive.now;
+	for (level = 1; level < RS_WHEEL_LEVELS; level++) {
+		shift = RS_WHEEL_BITS * level;
+		if (tick & ((1U << shift) - 1))
+			break;
+
+		rs_wheel_take(level, (tick >> shift) & RS_WHEEL_MASK, &list);
+		while (!dlist_empty(&list)) {
+			rs = container_of(list.next, struct rsocket, keepalive_entry);
+			dlist_remove(&rs->keepalive_entry);
+			rs_wheel_insert(rs);
+		}
+	}
+
+	rs_wheel_take(0, tick & RS_WHEEL_MASK, &list);
+	while (!dlist_empty(&list)) {
+		rs = container_of(list.next, struct rsocket, keepalive_entry);
+		dlist_remove(&rs->keepalive_entry);
+		rs->keepalive_due = tick + rs->keepalive_time;
+		rs->keepalive_slot = RS_WHEEL_SENDING;
+		dlist_insert_tail(&rs->keepalive_entry, &keepalive.sending);
+	}
+}
+
+/*
+ * Called and returns with keepalive_lock held, but drops it while posting
+ * the sends.  Only the service thread adds to or empties the sending list,
+ * and other threads leave rsockets on it alone, so it can be walked
+ * without the lock.
+ */
+static void rs_wheel_send(void)
+{
+	dlist_entry *entry;
+	struct rsocket *rs;
+
+	if (dlist_empty(&keepalive.sending))
+		return;
+
+	pthread_mutex_unlock(&keepalive_lock);
+	for (entry = keepalive.sending.next; entry != &keepalive.sending;
+	     entry = entry->next) {
+		rs = container_of(entry, struct rsocket, keepalive_entry);
+		tcp_svc_send_keepalive(rs);
+	}
+	pthread_mutex_lock(&keepalive_lock);
+
+	while (!dlist_empty(&keepalive.sending)) {
+		rs = container_of(keepalive.sending.next, struct rsocket,
+				  keepalive_entry);
+		dlist_remove(&rs->keepalive_entry);
+		rs_wheel_insert(rs);
+	}
+	pthread_cond_broadcast(&keepalive.sent);
+}
+
+/* Processes the ticks up to now, skipping those without work */
+static void rs_wheel_advance(uint32_t now)
+{
+	uint32_t next;
+
+	while ((int32_t) (now - keepalive.now) > 0) {
+		next = rs_wheel_next();
+		if (next > now - keepalive.now) {
+			keepalive.now = now;
+			break;
+		}
+		keepalive.now += next - 1;
+		rs_wheel_tick();
+	}
+}
+
+static void rs_keepalive_add(struct rs_svc *svc, struct rsocket *rs)
+{
+	rs->keepalive_due = rs_get_time() + rs->keepalive_time;
+	rs_wheel_insert(rs);
+	rs->opts |= RS_OPT_SVC_ACTIVE;
+	svc->cnt++;
+}
+
+static void rs_keepalive_remove(struct rs_svc *svc, struct rsocket *rs)
+{
+	rs_wheel_remove(rs);
+	rs->opts &= ~RS_OPT_SVC_ACTIVE;
+	svc->cnt--;
+}
+
+/* Wakes the service thread if the wheel has work before it wakes up */
+static void rs_keepalive_wake(struct rs_svc *svc)
 {
 	struct rs_svc_msg msg;
-	int i;
+	uint32_t next;
 
-	read(svc->sock[1], &msg, sizeof msg);
-	switch (msg.cmd) {
+	next = keepalive.now + rs_wheel_next();
+	if (keepalive.wakeup != ~0U &&
+	    (int32_t) (next - keepalive.wakeup) >= 0)
+		return;
+
+	keepalive.wakeup = next;
+	msg.cmd = RS_SVC_WAKE_KEEPALIVE;
+	msg.rs = NULL;
+	send(svc->sock[0], &msg, sizeof msg, MSG_DONTWAIT);
+}
+
+/*
+ * The service thread only needs to handle the first rsocket added, which
+ * starts it, and the last one removed, which stops it.
+ */
+static int tcp_svc_notify(struct rs_svc *svc, struct rsocket *rs, int cmd)
+{
+	int ret = 0;
+
+	pthread_mutex_lock(&keepalive_lock);
+	switch (cmd) {
 	case RS_SVC_ADD_KEEPALIVE:
-		msg.status = rs_svc_add_rs(svc, msg.rs);
-		if (!msg.status) {
-			msg.rs->opts |= RS_OPT_SVC_ACTIVE;
-			tcp_svc_timeouts = svc->contexts;
-			tcp_svc_timeouts[svc->cnt] = rs_get_time() +
-						     msg.rs->keepalive_time;
+		if (!svc->cnt) {
+			ret = -1;
+			break;
 		}
+		rs_keepalive_add(svc, rs);
+		rs_keepalive_wake(svc);
 		break;
 	case RS_SVC_REM_KEEPALIVE:
-		msg.status = rs_svc_rm_rs(svc, msg.rs);
-		if (!msg.status)
-			msg.rs->opts &= ~RS_OPT_SVC_ACTIVE;
+		if (!(rs->opts & RS_OPT_SVC_ACTIVE))
+			ret = EBADF;
+		else if (svc->cnt == 1)
+			ret = -1;
+		else
+			rs_keepalive_remove(svc, rs);
 		break;
 	case RS_SVC_MOD_KEEPALIVE:
-		i = rs_svc_index(svc, msg.rs);
-		if (i >= 0) {
-			tcp_svc_timeouts[i] = rs_get_time() + msg.rs->keepalive_time;
+		if (!(rs->opts & RS_OPT_SVC_ACTIVE)) {
+			ret = EBADF;
+			break;
+		}
+		rs_wheel_remove(rs);
+		rs->keepalive_due = rs_get_time() + rs->keepalive_time;
+		rs_wheel_insert(rs);
+		rs_keepalive_wake(svc);
+		break;
+	default:
+		ret = -1;
+		break;
+	}
+	pthread_mutex_unlock(&keepalive_lock);
+	return ret;
+}
+
+static void tcp_svc_process_sock(struct rs_svc *svc)
+{
+	struct rs_svc_msg msg;
+
+	read(svc->sock[1], &msg, sizeof msg);
+	pthread_mutex_lock(&keepalive_lock);
+	switch (msg.cmd) {
+	case RS_SVC_ADD_KEEPALIVE:
+		rs_keepalive_add(svc, msg.rs);
+		msg.status = 0;
+		break;
+	case RS_SVC_REM_KEEPALIVE:
+		if (msg.rs->opts & RS_OPT_SVC_ACTIVE) {
+			rs_keepalive_remove(svc, msg.rs);
 			msg.status = 0;
 		} else {
 			msg.status = EBADF;
 		}
 		break;
+	case RS_SVC_WAKE_KEEPALIVE:
+		pthread_mutex_unlock(&keepalive_lock);
+		return;
+	case RS_SVC_NOOP:
+		msg.status = 0;
+		break;
+	default:
+		break;
+	}
+	pthread_mutex_unlock(&keepalive_lock);
+	write(svc->sock[1], &msg, sizeof msg);
+}
+
+static void *tcp_svc_run(void *arg)
+{
+	struct rs_svc *svc = arg;
+	struct pollfd fds;
+	uint32_t next;
+	int timeout, cnt;
+
+	pthread_mutex_lock(&keepalive_lock);
+	rs_wheel_init(rs_get_time());
+	pthread_mutex_unlock(&keepalive_lock);
+
+	fds.fd = svc->sock[1];
+	fds.events = POLLIN;
+	timeout = -1;
+	do {
+		poll(&fds, 1, timeout);
+		if (fds.revents)
+			tcp_svc_process_sock(svc);
+
+		pthread_mutex_lock(&keepalive_lock);
+		if (rs_shm) {
+			rs_shm->tcp_svc_wakeups++;
+			rs_shm->tcp_svc_socks = svc->cnt;
+		}
+
+		rs_wheel_advance(rs_get_time());
+		rs_wheel_send();
+		next = rs_wheel_next();
+		if (next == ~0U) {
+			keepalive.wakeup = ~0;
+			timeout = -1;
+		} else {
+			next = min(next, RS_WHEEL_MAX_SLEEP);
+			keepalive.wakeup = keepalive.now + next;
+			timeout = next * 1000;
+		}
+		cnt = svc->cnt;
+		pthread_mutex_unlock(&keepalive_lock);
+	} while (cnt >= 1);
+
+	return NULL;
+}
+
+static void accept_svc_process_sock(struct rs_svc *svc)
+{
+	struct rs_svc_msg msg;
+
+	read(svc->sock[1], &msg, sizeof msg);
+	switch (msg.cmd) {
+	case RS_SVC_ADD_ACCEPT:
+		msg.status = rs_svc_add_rs(svc, msg.rs);
+		if (!msg.status) {
+			accept_svc_fds = svc->contexts;
+			accept_svc_fds[svc->cnt].fd = msg.rs->accept_pool->kick;
+			accept_svc_fds[svc->cnt].events = POLLIN;
+			accept_svc_fds[svc->cnt].revents = 0;
+		}
+		break;
+	case RS_SVC_REM_ACCEPT:
+		msg.status = rs_svc_rm_rs(svc, msg.rs);
+		break;
 	case RS_SVC_NOOP:
 		msg.status = 0;
 		break;
 	default:
 		break;
 	}
+
 	write(svc->sock[1], &msg, sizeof msg);
 }
 
+static struct rsocket *accept_svc_alloc_ep(struct rsocket *rs,
+					   union socket_addr *addr)
+{
+	struct rsocket *ep;
+
+	ep = rs_alloc(rs, rs->type);
+	if (!ep)
+		return NULL;
+
+	if (rdma_create_id(NULL, &ep->cm_id, ep, RDMA_PS_TCP) ||
+	    rdma_bind_addr(ep->cm_id, &addr->sa) || rs_create_ep(ep)) {
+		rs_free(ep);
+		return NULL;
+	}
+	return ep;
+}
+
 /*
- * Send a 0 byte RDMA write with immediate as keep-alive message.
- * This avoids the need for the receive side to do any acknowledgment.
+ * Destroys the placeholder ids left by raccept, then builds at most one
+ * endpoint so that service commands are not held up behind a large pool.
+ * Returns 1 if the pool still needs work.
  */
-static void tcp_svc_send_keepalive(struct rsocket *rs)
+static int accept_svc_fill(struct rsocket *rs)
 {
-	fastlock_acquire(&rs->cq_lock);
-	if (rs_ctrl_avail(rs) && (rs->state & rs_connected)) {
-		rs->ctrl_seqno++;
-		rs_post_write(rs, NULL, 0, rs_msg_set(RS_OP_CTRL, RS_CTRL_KEEPALIVE),
-			      0, (uint64_t) NULL, (uint64_t) NULL);
+	struct rs_accept_pool *pool = rs->accept_pool;
+	union socket_addr addr;
+	struct rdma_cm_id *id;
+	struct rsocket *ep;
+
+	pthread_mutex_lock(&pool->lock);
+	while (pool->idle_cnt) {
+		id = pool->idle_ids[--pool->idle_cnt];
+		pthread_mutex_unlock(&pool->lock);
+		rdma_destroy_id(id);
+		pthread_mutex_lock(&pool->lock);
 	}
-	fastlock_release(&rs->cq_lock);
-}	
+	if (pool->cnt == pool->size || !pool->addr.sa.sa_family) {
+		pthread_mutex_unlock(&pool->lock);
+		return 0;
+	}
+	addr = pool->addr;
+	pthread_mutex_unlock(&pool->lock);
 
-static void *tcp_svc_run(void *arg)
+	ep = accept_svc_alloc_ep(rs, &addr);
+	if (!ep)
+		return 0;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->eps[pool->cnt++] = ep;
+	pthread_mutex_unlock(&pool->lock);
+	return 1;
+}
+
+static void *accept_svc_run(void *arg)
 {
 	struct rs_svc *svc = arg;
 	struct rs_svc_msg msg;
-	struct pollfd fds;
-	uint32_t now, next_timeout;
+	uint64_t cnt;
 	int i, ret, timeout;
 
-	ret = rs_svc_grow_sets(svc, 16);
+	ret = rs_svc_grow_sets(svc, 4);
 	if (ret) {
 		msg.status = ret;
 		write(svc->sock[1], &msg, sizeof msg);
 		return (void *) (uintptr_t) ret;
 	}
 
-	tcp_svc_timeouts = svc->contexts;
-	fds.fd = svc->sock[1];
-	fds.events = POLLIN;
+	accept_svc_fds = svc->contexts;
+	accept_svc_fds[0].fd = svc->sock[1];
+	accept_svc_fds[0].events = POLLIN;
 	timeout = -1;
 	do {
-		poll(&fds, 1, timeout * 1000);
-		if (fds.revents)
-			tcp_svc_process_sock(svc);
+		for (i = 0; i <= svc->cnt; i++)
+			accept_svc_fds[i].revents = 0;
 
-		now = rs_get_time();
-		next_timeout = ~0;
+		poll(accept_svc_fds, svc->cnt + 1, timeout);
+		if (accept_svc_fds[0].revents)
+			accept_svc_process_sock(svc);
+
+		timeout = -1;
 		for (i = 1; i <= svc->cnt; i++) {
-			if (tcp_svc_timeouts[i] <= now) {
-				tcp_svc_send_keepalive(svc->rss[i]);
-				tcp_svc_timeouts[i] =
-					now + svc->rss[i]->keepalive_time;
-			}
-			if (tcp_svc_timeouts[i] < next_timeout)
-				next_timeout = tcp_svc_timeouts[i];
+			if (accept_svc_fds[i].revents)
+				read(accept_svc_fds[i].fd, &cnt, sizeof cnt);
+			if (accept_svc_fill(svc->rss[i]))
+				timeout = 0;
 		}
-		timeout = (int) (next_timeout - now);
 	} while (svc->cnt >= 1);
 
 	return NULL;
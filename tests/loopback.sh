@@ -0,0 +1,46 @@
+#!/bin/sh
+#
+# Exercise rsockets over the software loopback device.  Each test runs
+# an example server in the background and its client in the foreground;
+# the test fails if either side fails or does not finish in time.
+# udpong servers run until killed, so only the client is checked.
+
+RDMA_LOOPBACK=1
+export RDMA_LOOPBACK
+
+bindir=${top_builddir:-.}/examples
+port=17471
+status=0
+
+run()
+{
+	prog=$1
+	shift
+
+	timeout 60 $bindir/$prog -p $port -b 127.0.0.1 "$@" > /dev/null &
+	server=$!
+	sleep 1
+	timeout 60 $bindir/$prog -p $port -s 127.0.0.1 "$@" > /dev/null
+	client=$?
+	wait $server
+	if [ $client -ne 0 -o $? -ne 0 ]; then
+		echo "FAIL: $prog $*"
+		status=1
+	fi
+	port=`expr $port + 1`
+}
+
+run rstream -T v -S 1000 -C 1000
+run rstream -T b -S 65536 -C 100
+run rstream -T n -S 64 -C 1000
+run riostream -S 65536 -C 100
+timeout 60 $bindir/udpong -p $port -b 127.0.0.1 > /dev/null &
+server=$!
+sleep 1
+if ! timeout 60 $bindir/udpong -p $port -s 127.0.0.1 -S 100 -C 100 > /dev/null; then
+	echo "FAIL: udpong"
+	status=1
+fi
+kill $server
+
+exit $status